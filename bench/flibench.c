@@ -0,0 +1,569 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+/* Readout benchmark
+ *
+ * Runs the library against the simulated camera (see libfli-sim.h)
+ * and writes one JSON object to stdout, so runs can be diffed:
+ *
+ *   readout                   frames/s and MB/s for FLIGrabRow(),
+ *                             FLIGrabFrame() and FLIGrabVideoFrame()
+ *   multi_camera              aggregate MB/s of 1..N cameras read out
+ *                             from one thread each, and how close that
+ *                             is to N times a single camera
+ *   descramble_ns_per_pixel   CPU time spent in the readout path per
+ *                             pixel, for each amplifier geometry
+ *   command_latency_us        round trip of single commands
+ *   alloc_ns                  xmalloc()/xfree() pair with 0..100000
+ *                             other allocations live, and from 1..N
+ *                             threads at once
+ *   enumerate_us, open_us     FLIList() and FLIOpen()/FLIClose()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libfli.h"
+#include "libfli-mem.h"
+
+static long width = 2048, height = 2048, frames = 5, iterations = 1000;
+static long quad = 4, bandwidth = 0, latency = 0, cameras = 4;
+
+/* Camera threads wait here until all of them are open */
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static long gate_waiting, gate_open;
+
+typedef struct {
+  pthread_t thread;
+  unsigned short *img;
+  double end;
+} camthread_t;
+
+/* Each allocation thread keeps this many blocks live, so a freed
+ * block is not simply handed straight back by the next allocation */
+#define ALLOC_RING (64)
+
+typedef struct {
+  pthread_t thread;
+  double ns;
+} allocthread_t;
+
+static double now_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void fail(const char *what, long err)
+{
+  fprintf(stderr, "flibench: %s failed: %ld\n", what, err);
+  exit(1);
+}
+
+static flidev_t sim_open(const char *model, long q)
+{
+  char name[256];
+  flidev_t dev;
+  long err, ul_x, ul_y, lr_x, lr_y;
+
+  snprintf(name, sizeof(name),
+    "sim:%s,width=%ld,height=%ld,quad=%ld,bw=%ld,latency=%ld",
+    model, width, height, q, bandwidth, latency);
+
+  if ((err = FLIOpen(&dev, name, FLIDOMAIN_USB | FLIDEVICE_CAMERA)))
+    fail(name, err);
+
+  if ((err = FLIGetVisibleArea(dev, &ul_x, &ul_y, &lr_x, &lr_y)) ||
+    (err = FLISetImageArea(dev, ul_x, ul_y, lr_x, lr_y)) ||
+    (err = FLISetExposureTime(dev, 1)))
+    fail("setup", err);
+
+  return dev;
+}
+
+static void expose(flidev_t dev)
+{
+  long err, timeleft;
+
+  if ((err = FLIExposeFrame(dev)))
+    fail("FLIExposeFrame", err);
+
+  do {
+    if ((err = FLIGetExposureStatus(dev, &timeleft)))
+      fail("FLIGetExposureStatus", err);
+  } while (timeleft > 0);
+}
+
+/* Time the download of one exposed frame, how selects the API */
+static double grab(flidev_t dev, unsigned short *img, int how, clockid_t clk)
+{
+  double start;
+  size_t got = 0;
+  long err = 0, y;
+
+  start = now_ns(clk);
+
+  switch (how)
+  {
+  case 0:
+    for (y = 0; (err == 0) && (y < height); y++)
+      err = FLIGrabRow(dev, img + y * width, width);
+    break;
+
+  case 1:
+    err = FLIGrabFrame(dev, img, width * height * 2, &got);
+    break;
+
+  default:
+    err = FLIGrabVideoFrame(dev, img, width * height * 2);
+    break;
+  }
+
+  if (err)
+    fail("grab", err);
+
+  return now_ns(clk) - start;
+}
+
+static void readout(unsigned short *img)
+{
+  static const char *api[] = {"grab_row", "grab_frame", "grab_video_frame"};
+  flidev_t dev;
+  double ns;
+  long err, i;
+  int how;
+
+  printf("  \"readout\": {\n");
+
+  for (how = 0; how < 3; how++)
+  {
+    dev = sim_open("proline", quad);
+
+    if ((how == 2) && (err = FLIStartVideoMode(dev)))
+      fail("FLIStartVideoMode", err);
+
+    for (i = 0, ns = 0.0; i < frames; i++)
+    {
+      if (how != 2)
+        expose(dev);
+      ns += grab(dev, img, how, CLOCK_MONOTONIC);
+    }
+
+    if ((how == 2) && (err = FLIStopVideoMode(dev)))
+      fail("FLIStopVideoMode", err);
+    FLIClose(dev);
+
+    printf("    \"%s\": {\"frames_per_s\": %.3f, \"mb_per_s\": %.3f}%s\n",
+      api[how], frames * 1e9 / ns,
+      (double) frames * width * height * 2 * 1e3 / ns, (how < 2)?",":"");
+  }
+
+  printf("  },\n");
+}
+
+static void *camera_thread(void *arg)
+{
+  camthread_t *t = arg;
+  flidev_t dev;
+  long i, err;
+
+  dev = sim_open("proline", quad);
+
+  pthread_mutex_lock(&gate_mutex);
+  gate_waiting++;
+  pthread_cond_broadcast(&gate_cond);
+  while (!gate_open)
+    pthread_cond_wait(&gate_cond, &gate_mutex);
+  pthread_mutex_unlock(&gate_mutex);
+
+  /* Video mode sends the same frame again, so rendering and exposure
+   * polling stay out of the measurement */
+  if ((err = FLIStartVideoMode(dev)))
+    fail("FLIStartVideoMode", err);
+
+  for (i = 0; i < frames; i++)
+    grab(dev, t->img, 2, CLOCK_MONOTONIC);
+  t->end = now_ns(CLOCK_MONOTONIC);
+
+  FLIStopVideoMode(dev);
+  FLIClose(dev);
+
+  return NULL;
+}
+
+/* n cameras from n threads, returns the aggregate MB/s */
+static double multi_run(long n)
+{
+  camthread_t *t;
+  double start, end = 0.0;
+  long i;
+
+  if ((t = calloc(n, sizeof(camthread_t))) == NULL)
+    fail("calloc", -1);
+
+  gate_waiting = 0;
+  gate_open = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    if ((t[i].img = malloc(width * height * sizeof(unsigned short))) == NULL)
+      fail("malloc", -1);
+    if (pthread_create(&t[i].thread, NULL, camera_thread, &t[i]) != 0)
+      fail("pthread_create", -1);
+  }
+
+  pthread_mutex_lock(&gate_mutex);
+  while (gate_waiting < n)
+    pthread_cond_wait(&gate_cond, &gate_mutex);
+  start = now_ns(CLOCK_MONOTONIC);
+  gate_open = 1;
+  pthread_cond_broadcast(&gate_cond);
+  pthread_mutex_unlock(&gate_mutex);
+
+  for (i = 0; i < n; i++)
+  {
+    pthread_join(t[i].thread, NULL);
+    if (t[i].end > end)
+      end = t[i].end;
+    free(t[i].img);
+  }
+  free(t);
+
+  return (double) n * frames * width * height * 2 * 1e3 / (end - start);
+}
+
+static void multi_camera(void)
+{
+  double one = 0.0, mbps;
+  long n;
+
+  printf("  \"multi_camera\": [\n");
+
+  /* 1, 2, 4, ... up to and including cameras */
+  for (n = 1; ; n = (2 * n < cameras)?(2 * n):cameras)
+  {
+    mbps = multi_run(n);
+    if (n == 1)
+      one = mbps;
+
+    printf("    {\"cameras\": %ld, \"mb_per_s\": %.3f, \"scaling\": %.3f}%s\n",
+      n, mbps, mbps / (n * one), (n < cameras)?",":"");
+
+    if (n == cameras)
+      break;
+  }
+
+  printf("  ],\n");
+}
+
+static void descramble(unsigned short *img)
+{
+  static const struct {
+    const char *name, *model;
+    long quad;
+  } geom[] = {
+    {"proline_quad1", "proline", 1},
+    {"proline_quad2", "proline", 2},
+    {"proline_quad4", "proline", 4},
+    {"maxcam", "maxcam", 1},
+  };
+  flidev_t dev;
+  double ns;
+  long i;
+  unsigned g;
+
+  printf("  \"descramble_ns_per_pixel\": {\n");
+
+  for (g = 0; g < sizeof(geom) / sizeof(geom[0]); g++)
+  {
+    dev = sim_open(geom[g].model, geom[g].quad);
+
+    for (i = 0, ns = 0.0; i < frames; i++)
+    {
+      expose(dev);
+      ns += grab(dev, img, 0, CLOCK_PROCESS_CPUTIME_ID);
+    }
+    FLIClose(dev);
+
+    printf("    \"%s\": %.3f%s\n", geom[g].name,
+      ns / ((double) frames * width * height),
+      (g + 1 < sizeof(geom) / sizeof(geom[0]))?",":"");
+  }
+
+  printf("  },\n");
+}
+
+static void command_latency(void)
+{
+  static const char *cmd[] = {"exposure_status", "temperature", "device_status"};
+  flidev_t dev;
+  double start, ns, sum, min, max;
+  double temperature;
+  long i, err = 0, value;
+  int c;
+
+  dev = sim_open("proline", quad);
+
+  printf("  \"command_latency_us\": {\n");
+
+  for (c = 0; c < 3; c++)
+  {
+    sum = max = 0.0;
+    min = 1e18;
+
+    for (i = 0; i < iterations; i++)
+    {
+      start = now_ns(CLOCK_MONOTONIC);
+      switch (c)
+      {
+      case 0:
+        err = FLIGetExposureStatus(dev, &value);
+        break;
+
+      case 1:
+        err = FLIGetTemperature(dev, &temperature);
+        break;
+
+      default:
+        err = FLIGetDeviceStatus(dev, &value);
+        break;
+      }
+      ns = now_ns(CLOCK_MONOTONIC) - start;
+
+      if (err)
+        fail(cmd[c], err);
+
+      sum += ns;
+      if (ns < min)
+        min = ns;
+      if (ns > max)
+        max = ns;
+    }
+
+    printf("    \"%s\": {\"mean\": %.3f, \"min\": %.3f, \"max\": %.3f}%s\n",
+      cmd[c], sum / iterations / 1e3, min / 1e3, max / 1e3,
+      (c < 2)?",":"");
+  }
+
+  printf("  },\n");
+
+  FLIClose(dev);
+}
+
+/* ns per xfree()/xmalloc() pair */
+static double alloc_pairs(long pairs)
+{
+  void *ring[ALLOC_RING];
+  double start;
+  long i;
+
+  memset(ring, 0, sizeof(ring));
+
+  start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < pairs; i++)
+  {
+    xfree(ring[i % ALLOC_RING]);
+    if ((ring[i % ALLOC_RING] = xmalloc(16 + (i % 8) * 16)) == NULL)
+      fail("xmalloc", -1);
+  }
+  for (i = 0; i < ALLOC_RING; i++)
+    xfree(ring[i]);
+
+  return (now_ns(CLOCK_MONOTONIC) - start) / pairs;
+}
+
+static void *alloc_thread(void *arg)
+{
+  allocthread_t *t = arg;
+
+  t->ns = alloc_pairs(iterations * 100);
+
+  return NULL;
+}
+
+static void alloc(void)
+{
+  static const long live[] = {0, 1000, 100000};
+  allocthread_t *t;
+  size_t before;
+  void **keep;
+  double ns;
+  long i, n;
+  unsigned l;
+
+  before = xalloc_count();
+
+  printf("  \"alloc_ns\": {\n");
+
+  for (l = 0; l < sizeof(live) / sizeof(live[0]); l++)
+  {
+    if ((keep = malloc((live[l] + 1) * sizeof(void *))) == NULL)
+      fail("malloc", -1);
+    for (i = 0; i < live[l]; i++)
+      if ((keep[i] = xmalloc(32)) == NULL)
+        fail("xmalloc", -1);
+
+    printf("    \"live_%ld\": %.3f,\n", live[l], alloc_pairs(iterations * 100));
+
+    for (i = 0; i < live[l]; i++)
+      xfree(keep[i]);
+    free(keep);
+  }
+
+  printf("    \"threads\": [\n");
+
+  for (n = 1; ; n = (2 * n < cameras)?(2 * n):cameras)
+  {
+    if ((t = calloc(n, sizeof(allocthread_t))) == NULL)
+      fail("calloc", -1);
+    for (i = 0; i < n; i++)
+      if (pthread_create(&t[i].thread, NULL, alloc_thread, &t[i]) != 0)
+        fail("pthread_create", -1);
+    for (i = 0, ns = 0.0; i < n; i++)
+    {
+      pthread_join(t[i].thread, NULL);
+      ns += t[i].ns;
+    }
+    free(t);
+
+    printf("      {\"threads\": %ld, \"ns\": %.3f}%s\n",
+      n, ns / n, (n < cameras)?",":"");
+
+    if (n == cameras)
+      break;
+  }
+
+  printf("    ],\n");
+  printf("    \"leaked\": %ld\n", (long) (xalloc_count() - before));
+  printf("  },\n");
+}
+
+static void enumerate_open(void)
+{
+  char **names;
+  double start, ns;
+  long i, err;
+
+  start = now_ns(CLOCK_MONOTONIC);
+  if ((err = FLIList(FLIDOMAIN_USB | FLIDEVICE_CAMERA, &names)) == 0)
+    FLIFreeList(names);
+  ns = now_ns(CLOCK_MONOTONIC) - start;
+  printf("  \"enumerate_us\": %.3f,\n", ns / 1e3);
+
+  start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < frames; i++)
+    FLIClose(sim_open("proline", quad));
+  ns = now_ns(CLOCK_MONOTONIC) - start;
+  printf("  \"open_us\": %.3f\n", ns / frames / 1e3);
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "usage: flibench [-w width] [-h height] [-n frames] [-i iterations]\n"
+    "                [-q quadrants] [-b bytes/s] [-l latency_us]\n"
+    "                [-c cameras]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned short *img;
+  char version[64];
+  int c;
+
+  while ((c = getopt(argc, argv, "w:h:n:i:q:b:l:c:")) != -1)
+  {
+    switch (c)
+    {
+    case 'w': width = strtol(optarg, NULL, 0); break;
+    case 'h': height = strtol(optarg, NULL, 0); break;
+    case 'n': frames = strtol(optarg, NULL, 0); break;
+    case 'i': iterations = strtol(optarg, NULL, 0); break;
+    case 'q': quad = strtol(optarg, NULL, 0); break;
+    case 'b': bandwidth = strtol(optarg, NULL, 0); break;
+    case 'l': latency = strtol(optarg, NULL, 0); break;
+    case 'c': cameras = strtol(optarg, NULL, 0); break;
+    default: usage();
+    }
+  }
+
+  if ((width < 1) || (height < 1) || (frames < 1) || (iterations < 1) ||
+    (cameras < 1))
+    usage();
+
+  if ((img = malloc(width * height * sizeof(unsigned short))) == NULL)
+    fail("malloc", -1);
+
+  FLISetDebugLevel(NULL, FLIDEBUG_NONE);
+  if (FLIGetLibVersion(version, sizeof(version)))
+    strcpy(version, "unknown");
+
+  printf("{\n");
+  printf("  \"version\": \"%s\",\n", version);
+  printf("  \"width\": %ld, \"height\": %ld, \"frames\": %ld, \"quadrants\": %ld,\n",
+    width, height, frames, quad);
+  printf("  \"bandwidth\": %ld, \"latency_us\": %ld,\n", bandwidth, latency);
+
+  readout(img);
+  multi_camera();
+  descramble(img);
+  command_latency();
+  alloc();
+  enumerate_open();
+
+  printf("}\n");
+
+  free(img);
+
+  return 0;
+}
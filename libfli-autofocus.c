@@ -0,0 +1,388 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-sequence.h"
+#include "libfli-autofocus.h"
+
+/* Sums kept while a frame is read, one row at a time */
+typedef struct {
+  long width, height;
+  long rows;
+  unsigned short *frame;	/* Kept for the star metric only */
+  uint64_t sum, sumsq;
+  uint64_t brenner;
+  unsigned short max;
+  long maxx, maxy;
+} af_stats_t;
+
+/* The loops below stay in plain integer arithmetic so the compiler
+ * can vectorize them */
+static void af_row(af_stats_t *st, const unsigned short *row)
+{
+  uint64_t sum = 0, sumsq = 0, brenner = 0;
+  long x, w = st->width;
+
+  for (x = 0; x < w; x++)
+  {
+    uint32_t v = row[x];
+
+    sum += v;
+    sumsq += (uint64_t) (v * v);
+  }
+
+  /* Brenner gradient, squared differences two pixels apart */
+  for (x = 0; x + 2 < w; x++)
+  {
+    uint32_t d = (row[x + 2] > row[x])?
+      (uint32_t) (row[x + 2] - row[x]):(uint32_t) (row[x] - row[x + 2]);
+
+    brenner += (uint64_t) (d * d);
+  }
+
+  for (x = 0; x < w; x++)
+  {
+    if (row[x] > st->max)
+    {
+      st->max = row[x];
+      st->maxx = x;
+      st->maxy = st->rows;
+    }
+  }
+
+  st->sum += sum;
+  st->sumsq += sumsq;
+  st->brenner += brenner;
+
+  if (st->frame != NULL)
+    memcpy(st->frame + st->rows * w, row, w * sizeof(unsigned short));
+  st->rows++;
+}
+
+/* Half flux diameter of the brightest star, twice the flux weighted
+ * mean radius about its centroid with the frame mean as background */
+static double af_hfd(af_stats_t *st)
+{
+  double bg, f, flux = 0.0, fx = 0.0, fy = 0.0, fr = 0.0, cx, cy;
+  long x, y, x0, x1, y0, y1;
+
+  bg = (double) st->sum / (double) (st->width * st->height);
+
+  x0 = (st->maxx > FLI_FOCUS_HFD_RADIUS)?st->maxx - FLI_FOCUS_HFD_RADIUS:0;
+  y0 = (st->maxy > FLI_FOCUS_HFD_RADIUS)?st->maxy - FLI_FOCUS_HFD_RADIUS:0;
+  x1 = (st->maxx + FLI_FOCUS_HFD_RADIUS < st->width)?
+    st->maxx + FLI_FOCUS_HFD_RADIUS:st->width - 1;
+  y1 = (st->maxy + FLI_FOCUS_HFD_RADIUS < st->height)?
+    st->maxy + FLI_FOCUS_HFD_RADIUS:st->height - 1;
+
+  for (y = y0; y <= y1; y++)
+    for (x = x0; x <= x1; x++)
+    {
+      f = (double) st->frame[y * st->width + x] - bg;
+      flux += f;
+      fx += f * x;
+      fy += f * y;
+    }
+
+  /* Nothing above the background, as bad as it gets */
+  if (flux <= 0.0)
+    return 2.0 * FLI_FOCUS_HFD_RADIUS;
+
+  cx = fx / flux;
+  cy = fy / flux;
+
+  for (y = y0; y <= y1; y++)
+    for (x = x0; x <= x1; x++)
+    {
+      f = (double) st->frame[y * st->width + x] - bg;
+      fr += f * sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+    }
+
+  return 2.0 * fr / flux;
+}
+
+static double af_metric(af_stats_t *st, long metric)
+{
+  double n = (double) (st->width * st->height), mean;
+
+  switch (metric)
+  {
+    case FLI_FOCUS_METRIC_VARIANCE:
+      mean = (double) st->sum / n;
+      return (double) st->sumsq / n - mean * mean;
+
+    case FLI_FOCUS_METRIC_HFD:
+      return af_hfd(st);
+
+    default:
+      return (double) st->brenner / n;
+  }
+}
+
+/* Sharper is larger, except for star size */
+static int af_better(long metric, double a, double b)
+{
+  return (metric == FLI_FOCUS_METRIC_HFD)?(a < b):(a > b);
+}
+
+/* The best sample b is bracketed once the last of the n samples is
+ * FLI_FOCUS_BRACKET past it, and the worst samples on either side are
+ * clearly worse than it */
+static int af_bracketed(long metric, flifocussample_t *s, long b, long n)
+{
+  double margin, left, right;
+  long i;
+
+  if ((b == 0) || (n - 1 - b < FLI_FOCUS_BRACKET))
+    return 0;
+
+  left = s[0].metric;
+  for (i = 1; i < b; i++)
+    if (af_better(metric, left, s[i].metric))
+      left = s[i].metric;
+
+  right = s[b + 1].metric;
+  for (i = b + 2; i < n; i++)
+    if (af_better(metric, right, s[i].metric))
+      right = s[i].metric;
+
+  margin = fabs(s[b].metric) * FLI_FOCUS_CONTRAST / 100.0;
+
+  return (fabs(left - s[b].metric) > margin) &&
+    (fabs(right - s[b].metric) > margin);
+}
+
+static long af_readout(flidev_t cam, af_stats_t *st)
+{
+  unsigned short *row;
+  long r = 0, y;
+
+  if ((row = xmalloc(st->width * sizeof(unsigned short))) == NULL)
+    return -ENOMEM;
+
+  if ((r = fli_tx_begin(cam)) != 0)
+  {
+    xfree(row);
+    return r;
+  }
+
+  for (y = 0; y < st->height; y++)
+  {
+    if ((r = FLIGrabRow(cam, row, st->width)) != 0)
+    {
+      debug(FLIDEBUG_WARN, "Autofocus: grabbing row %ld failed, %ld.", y, r);
+      break;
+    }
+    af_row(st, row);
+  }
+
+  fli_tx_end(cam);
+  xfree(row);
+
+  return r;
+}
+
+static long af_move(flidev_t focuser, long steps)
+{
+  long r;
+
+  if (steps == 0)
+    return 0;
+
+  if ((r = FLIStepMotorAsync(focuser, steps)) != 0)
+    return r;
+
+  return FLIWaitStepMotor(focuser, -1);
+}
+
+long fli_autofocus_run(flidev_t cam, flidev_t focuser, flifocussweep_t *sweep,
+  flifocussample_t *samples, long *nsamples, long *best)
+{
+  af_stats_t st;
+  flifocussample_t *s;
+  long width, hoffset, hbin, height, voffset, vbin;
+  long i, b, n = 0, pos, target, r, mr = 0;
+  int moving = 0;
+  double m0, m1, m2, d;
+
+  if ((sweep == NULL) || (sweep->step == 0) || (sweep->samples < 3) ||
+    !fli_dev_valid(focuser))
+    return -EINVAL;
+
+  if ((s = xcalloc(sweep->samples, sizeof(flifocussample_t))) == NULL)
+    return -ENOMEM;
+
+  memset(&st, 0, sizeof(st));
+
+  if (((r = FLISetImageArea(cam, sweep->ul_x, sweep->ul_y,
+    sweep->lr_x, sweep->lr_y)) != 0) ||
+    ((r = FLISetExposureTime(cam, sweep->exptime)) != 0) ||
+    ((r = FLIGetReadoutDimensions(cam, &width, &hoffset, &hbin,
+    &height, &voffset, &vbin)) != 0))
+    goto done;
+
+  st.width = width;
+  st.height = height;
+  if ((sweep->metric == FLI_FOCUS_METRIC_HFD) &&
+    ((st.frame = xmalloc(width * height * sizeof(unsigned short))) == NULL))
+  {
+    r = -ENOMEM;
+    goto done;
+  }
+
+  if (((r = FLIGetStepperPosition(focuser, &pos)) != 0) ||
+    ((r = af_move(focuser, sweep->start - pos)) != 0))
+    goto done;
+  pos = sweep->start;
+
+  b = 0;
+  for (i = 0; i < sweep->samples; i++)
+  {
+    if (((r = FLIExposeFrame(cam)) != 0) ||
+      ((r = fli_sequence_exposure_wait(cam)) != 0))
+      goto done;
+
+    /* Head for the next position while this one is read out, the move
+     * is wasted only on the sample that brackets the best focus */
+    if ((i + 1 < sweep->samples) &&
+      ((mr = FLIStepMotorAsync(focuser, sweep->step)) == 0))
+      moving = 1;
+
+    st.sum = st.sumsq = st.brenner = 0;
+    st.rows = st.max = st.maxx = st.maxy = 0;
+    if ((r = af_readout(cam, &st)) != 0)
+      goto done;
+
+    s[i].position = pos;
+    s[i].metric = af_metric(&st, sweep->metric);
+    n = i + 1;
+
+    debug(FLIDEBUG_INFO, "Autofocus: position %ld metric %f.",
+      s[i].position, s[i].metric);
+
+    if (af_better(sweep->metric, s[i].metric, s[b].metric))
+      b = i;
+
+    /* A failed move ends the sweep once the frame is out of the camera */
+    if (mr != 0)
+      break;
+
+    if (af_bracketed(sweep->metric, s, b, n))
+      break;
+
+    if (moving)
+    {
+      if ((r = FLIWaitStepMotor(focuser, -1)) != 0)
+        goto done;
+      moving = 0;
+      pos += sweep->step;
+    }
+  }
+
+  if (moving)
+  {
+    if ((r = FLIWaitStepMotor(focuser, -1)) != 0)
+      goto done;
+    pos += sweep->step;
+  }
+
+  if (mr != 0)
+  {
+    r = mr;
+    goto done;
+  }
+
+  /* Vertex of the parabola through the best sample and its neighbours,
+   * an edge sample is taken as it is */
+  target = s[b].position;
+  if ((b > 0) && (b + 1 < n))
+  {
+    m0 = s[b - 1].metric;
+    m1 = s[b].metric;
+    m2 = s[b + 1].metric;
+    d = m0 - 2.0 * m1 + m2;
+    if (d != 0.0)
+    {
+      d = 0.5 * (m0 - m2) / d;
+      if ((d > -1.0) && (d < 1.0))
+        target += (long) floor(d * sweep->step + 0.5);
+    }
+  }
+
+  if (b + 1 < n)
+    debug(FLIDEBUG_INFO, "Autofocus: best focus at %ld after %ld of %ld samples.",
+      target, n, sweep->samples);
+  else
+    debug(FLIDEBUG_WARN, "Autofocus: best focus at %ld is the end of the sweep.",
+      target);
+
+  /* Come back past the target and approach it the way the sweep went,
+   * so the focuser's backlash is taken up as it was during the sweep */
+  if ((r = af_move(focuser, target - sweep->step - pos)) != 0)
+    goto done;
+  if ((r = af_move(focuser, sweep->step)) != 0)
+    goto done;
+
+  if (best != NULL)
+    *best = target;
+
+done:
+  if ((samples != NULL) && (n > 0))
+    memcpy(samples, s, n * sizeof(flifocussample_t));
+  if (nsamples != NULL)
+    *nsamples = n;
+
+  if (st.frame != NULL)
+    xfree(st.frame);
+  xfree(s);
+
+  return r;
+}
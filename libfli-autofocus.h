@@ -0,0 +1,67 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+#ifndef _LIBFLI_AUTOFOCUS_H_
+#define _LIBFLI_AUTOFOCUS_H_
+
+/* Autofocus
+ *
+ * Steps the focuser through a range of positions, exposing a small
+ * region at each one. The focus metric is worked out from the rows as
+ * they are read, and the focuser is already on its way to the next
+ * position while they are. The sweep ends early once the best focus
+ * is FLI_FOCUS_BRACKET samples behind it and the samples either side
+ * are worse by FLI_FOCUS_CONTRAST percent, so that noise on a flat
+ * stretch of the curve doesn't end it. The focuser is left at the best
+ * position found, refined by a parabola through its
+ * neighbours.
+ */
+
+#define FLI_FOCUS_BRACKET (2)	/* Worse samples past the best one */
+#define FLI_FOCUS_CONTRAST (10)	/* Percent worse either side of it */
+#define FLI_FOCUS_HFD_RADIUS (24)	/* Pixels around the star measured */
+
+long fli_autofocus_run(flidev_t cam, flidev_t focuser, flifocussweep_t *sweep,
+  flifocussample_t *samples, long *nsamples, long *best);
+
+#endif /* _LIBFLI_AUTOFOCUS_H_ */
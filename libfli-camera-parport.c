@@ -113,10 +113,8 @@ long fli_camera_parport_open(flidev_t dev)
   cam->ccd.pixelwidth = knowndev[id].pixelwidth;
   cam->ccd.pixelheight = knowndev[id].pixelheight;
 
-  if ((DEVICE->devinfo.model =
-       (char *)xmalloc(strlen(knowndev[id].model) + 1)) == NULL)
+  if ((DEVICE->devinfo.model = fli_dev_strdup(dev, knowndev[id].model)) == NULL)
     return -ENOMEM;
-  strcpy(DEVICE->devinfo.model, knowndev[id].model);
 
   debug(FLIDEBUG_INFO, "     Name: %s", DEVICE->devinfo.devnam);
   debug(FLIDEBUG_INFO, "    Array: (%4d,%4d),(%4d,%4d)",
@@ -368,10 +366,10 @@ long fli_camera_parport_grab_row(flidev_t dev, void *buff, size_t width)
 {
   flicamdata_t *cam;
   long r;
-  double dTm;
   long rlen, wlen;
-  unsigned short buf;
-	long grabwidth;
+  unsigned short buf, echo;
+	long grabwidth, bpp, need, x;
+	unsigned char *rbuf;
 
   cam = DEVICE->device_data;
 
@@ -384,10 +382,9 @@ long fli_camera_parport_grab_row(flidev_t dev, void *buff, size_t width)
     cam->flushcountbeforefirstrow = 0;
   }
 
-  dTm = (25.0e-6) * cam->ccd.array_area.lr.x + 1e-3;
-  dTm = dTm / 1e-6;
-  cam->readto = (long)dTm;
-  cam->writeto = (long)dTm;
+  /* 25 usec a pixel and a msec to spare */
+  cam->readto = 25 * cam->ccd.array_area.lr.x + 1000;
+  cam->writeto = cam->readto;
 
 	if (cam->removebias)
 	{
@@ -399,111 +396,91 @@ long fli_camera_parport_grab_row(flidev_t dev, void *buff, size_t width)
 		grabwidth = cam->grabrowwidth;
 	}
 
-  rlen = 0; wlen = 2;
-  buf = htons((unsigned short) C_SEND(grabwidth));
-  IO(dev, &buf, &wlen, &rlen);
-
-  if (cam->bitdepth == FLI_MODE_8BIT)
-  {
-    unsigned char *cbuf;
-    int x;
+	/* The row and the echo that ends it are read in answer to the send
+		 command in one transfer, into a buffer kept from row to row */
+	bpp = (cam->bitdepth == FLI_MODE_8BIT)?1:2;
+	need = grabwidth * bpp + 2;
+	if ((cam->gbuf == NULL) || (cam->gbuf_siz < (size_t) need))
+	{
+		if (cam->gbuf != NULL)
+			xfree(cam->gbuf);
+		cam->gbuf_siz = 0;
+		cam->gbuf_devmem = 0;
+		if ((cam->gbuf = xmalloc(need)) == NULL)
+		{
+			debug(FLIDEBUG_FAIL, "Failed memory allocation during row grab.");
+			return -ENOMEM;
+		}
+		cam->gbuf_siz = need;
+	}
+	rbuf = (unsigned char *) cam->gbuf;
 
-    if ((cbuf = xmalloc(grabwidth)) == NULL)
-    {
-      debug(FLIDEBUG_FAIL, "Failed memory allocation during row grab.");
-      return -ENOMEM;
-    }
+	buf = htons((unsigned short) C_SEND(grabwidth));
+	memcpy(rbuf, &buf, sizeof(buf));
+	wlen = 2; rlen = need;
+	if ((r = DEVICE->fli_io(dev, rbuf, &wlen, &rlen)) != 0)
+	{
+		debug(FLIDEBUG_WARN,
+			"Couldn't grab entire row (%ld-bit), got %ld of %ld bytes.",
+			bpp * 8, rlen, need);
+		return r;
+	}
 
-    rlen = grabwidth; wlen = 0;
-    r = DEVICE->fli_io(dev, cbuf, &wlen, &rlen);
-    if (r != 0)
-    {
-      debug(FLIDEBUG_WARN,
-	    "Couldn't grab entire row (8-bit), got %d of %d bytes.",
-	    r, grabwidth);
-    }
-    for (x = 0; x < (int)width; x++)
-    {
-      ((char *)buff)[x] = (((cbuf[x]) + 128) & 0x00ff);
-    }
-    xfree(cbuf);
-  }
-  else
-  {
-    unsigned short *sbuf;
-    int x;
+	/* Plain byte loops, so the compiler can vectorize them */
+	if (bpp == 1)
+	{
+		unsigned char *cbuf = buff;
 
-    if ((sbuf = xmalloc(grabwidth * sizeof(unsigned short))) == NULL)
-    {
-      debug(FLIDEBUG_FAIL, "Failed memory allocation during row grab.");
-      return -ENOMEM;
-    }
+		for (x = 0; x < (long) width; x++)
+			cbuf[x] = (unsigned char) (rbuf[x] + 128);
+	}
+	else
+	{
+		unsigned short *sbuf = buff;
+		/* IMG cameras send signed pixels */
+		unsigned short offset = (DEVICE->devinfo.hwrev == 0x01)?32768:0;
 
-    rlen = grabwidth * sizeof(unsigned short); wlen = 0;
-    r = DEVICE->fli_io(dev, sbuf, &wlen, &rlen);
-    if (r != 0)
-    {
-      debug(FLIDEBUG_WARN,
-	    "Couldn't grab entire row (16-bit), got %d of %d bytes.",
-	    r, grabwidth);
-    }
-    for (x = 0; x < (int)width; x++)
-    {
-      if (DEVICE->devinfo.hwrev == 0x01) /* IMG camera */
-      {
-				((unsigned short *)buff)[x] = ntohs(sbuf[x]) + 32768;
-      }
-      else
-      {
-				((unsigned short *)buff)[x] = ntohs(sbuf[x]);
-      }
-    }
+		for (x = 0; x < (long) width; x++)
+			sbuf[x] = (unsigned short) (((rbuf[2 * x] << 8) | rbuf[2 * x + 1]) + offset);
 
 		if (cam->removebias)
 		{
+			unsigned short bias;
+
 			for (x = grabwidth - (64 / cam->hbin); x < grabwidth; x++)
 			{
-				unsigned short d;
-
-				if (DEVICE->devinfo.hwrev == 0x01) /* IMG camera */
-					d = ntohs(sbuf[x]) + 32768;
-				else
-					d = ntohs(sbuf[x]);
-
-				cam->pix_sum += (double) d;
+				cam->pix_sum += (double) (unsigned short)
+					(((rbuf[2 * x] << 8) | rbuf[2 * x + 1]) + offset);
 				cam->pix_cnt += 1.0;
 			}
 
-			for (x = 0; x < (int)width; x++)
-			{
-				((unsigned short *)buff)[x] = ((unsigned short *)buff)[x] - (unsigned short) ((cam->pix_sum / cam->pix_cnt) - cam->biasoffset);
-			}
+			bias = (unsigned short) ((cam->pix_sum / cam->pix_cnt) - cam->biasoffset);
+			for (x = 0; x < (long) width; x++)
+				sbuf[x] = sbuf[x] - bias;
+
 			debug(FLIDEBUG_INFO, "Overscan bias average: %g (%d)", (cam->pix_sum / cam->pix_cnt), (unsigned short) ((cam->pix_sum / cam->pix_cnt) - 200.0));
 		}
+	}
 
-    xfree(sbuf);
-  }
-
-  rlen = 2; wlen = 0;
-  IO(dev, &buf, &wlen, &rlen);
+	echo = (rbuf[grabwidth * bpp] << 8) | rbuf[grabwidth * bpp + 1];
 
 	if (cam->removebias)
 	{
-		if (ntohs(buf) != C_SEND(grabwidth))
+		if (echo != C_SEND(grabwidth))
 		{
-			debug(FLIDEBUG_WARN, "Width: %d, requested %d.",
+			debug(FLIDEBUG_WARN, "Width: %zu, requested %ld.",
 			width, grabwidth * sizeof(unsigned short));
-			debug(FLIDEBUG_WARN, "Got 0x%04x instead of 0x%04x.", ntohs(buf), C_SEND(grabwidth));
+			debug(FLIDEBUG_WARN, "Got 0x%04x instead of 0x%04lx.", echo, C_SEND(grabwidth));
 			debug(FLIDEBUG_WARN, "Didn't get command echo at end of row.");
 		}
 	}
 	else
 	{
-  if (ntohs(buf) != C_SEND(width))
+  if (echo != C_SEND(width))
   {
-    debug(FLIDEBUG_WARN, "Width: %d, requested %d.",
+    debug(FLIDEBUG_WARN, "Width: %zu, requested %ld.",
 			width, grabwidth * sizeof(unsigned short));
-    debug(FLIDEBUG_WARN, "Got 0x%04x instead of 0x%04x.", ntohs(buf), C_SEND(width));
+    debug(FLIDEBUG_WARN, "Got 0x%04x instead of 0x%04zx.", echo, C_SEND(width));
     debug(FLIDEBUG_WARN, "Didn't get command echo at end of row.");
   }
   }
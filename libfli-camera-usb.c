@@ -61,6 +61,8 @@
 #include "libfli-camera.h"
 #include "libfli-camera-usb.h"
 #include "libfli-usb.h"
+#include "libfli-trace.h"
+#include "libfli-tune.h"
 
 double dconvert(void *buf)
 {
@@ -79,11 +81,117 @@ double dconvert(void *buf)
   return result;
 }
 
+/* Image transfer buffers come from the transport when it can hand out
+ * memory the host controller reads into directly (libusb_dev_mem_alloc(),
+ * usbfs mmap), otherwise from the heap with the usual alignment. */
+void *fli_camera_usb_buf_alloc(flidev_t dev, size_t len, int *devmem)
+{
+	void *buf = NULL;
+
+	if (DEVICE->fli_dev_mem_alloc != NULL)
+		buf = DEVICE->fli_dev_mem_alloc(dev, len);
+
+	if (buf != NULL)
+	{
+		debug(FLIDEBUG_INFO, "Using %zu bytes of device memory for transfers.", len);
+		*devmem = 1;
+		return buf;
+	}
+
+	*devmem = 0;
+#ifdef __linux__
+	/* Linux needs this page aligned, hopefully this is 512 byte aligned too... */
+	return xmemalign(getpagesize(), len);
+#else
+	return xmalloc(len);
+#endif
+}
+
+void fli_camera_usb_buf_free(flidev_t dev, void *buf, size_t len, int devmem)
+{
+	if (buf == NULL)
+		return;
+
+	if ((devmem != 0) && (DEVICE->fli_dev_mem_free != NULL))
+		DEVICE->fli_dev_mem_free(dev, buf, len);
+	else
+		xfree(buf);
+}
+
+/* Read len bytes of image data. A busy bus can end a read early, and
+ * the camera answers with its three byte "no data" reply when it has
+ * nothing ready. Either way the rest is asked for again, a bounded
+ * number of times and within a time budget, so the stream stays aligned
+ * and the frame complete. A read that is still short fails with -EIO. */
+static long fli_camera_usb_read_image(flidev_t dev, void *buf, long *len)
+{
+	long want = *len, got = 0, n, r, timeout = DEVICE->io_timeout;
+	int retries = 0;
+	uint64_t now, deadline = 0;
+
+	DEVICE->stats.reads++;
+
+	for (;;)
+	{
+		n = want - got;
+		r = DEVICE->fli_bulk(dev, 0x82, (unsigned char *) buf + got, &n);
+
+		/* Three bytes where more was expected is the camera's no data reply */
+		if ((n == 3) && (want - got > 3))
+			n = 0;
+		got += n;
+
+		if (got == want)
+		{
+			r = 0;
+			break;
+		}
+
+		if ((r != 0) && (r != -ETIMEDOUT))
+			break;
+
+		now = fli_trace_now();
+		if (retries == 0)
+		{
+			DEVICE->stats.short_reads++;
+			deadline = now + FLI_RESUME_BUDGET * 1000000ull;
+		}
+
+		if ((retries >= FLI_RESUME_RETRIES) || (now >= deadline))
+			break;
+
+		debug(FLIDEBUG_WARN, "Short read, %ld of %ld bytes, resuming.", got, want);
+		retries++;
+		DEVICE->stats.retries++;
+
+		/* Don't let one read outlast the budget */
+		DEVICE->io_timeout = (long) MIN((uint64_t) timeout, (deadline - now) / 1000000 + 1);
+	}
+
+	DEVICE->io_timeout = timeout;
+
+	if (retries > 0)
+	{
+		if (got == want)
+			DEVICE->stats.resumed++;
+		else
+			DEVICE->stats.incomplete++;
+	}
+
+	/* Out of retries or time with the read still short */
+	if ((got != want) && (r == 0))
+		r = -EIO;
+
+	*len = got;
+
+	return r;
+}
+
 long fli_camera_usb_open(flidev_t dev)
 {
 	flicamdata_t *cam;
 	iobuf_t buf[IOBUF_MAX_SIZ];
-	long rlen, wlen;
+	long rlen, wlen, xfer_max;
 //	long r = 0;
 
 	memset(buf, 0x00, IOBUF_MAX_SIZ);
@@ -93,18 +201,15 @@ long fli_camera_usb_open(flidev_t dev)
 #ifdef __linux__
 	/* Linux needs this page aligned, hopefully this is 512 byte aligned too... */
 	cam->max_usb_xfer = (USB_READ_SIZ_MAX / getpagesize()) * getpagesize();
-	cam->gbuf_siz = 2 * cam->max_usb_xfer;
-
-	if ((cam->gbuf = xmemalign(getpagesize(), cam->gbuf_siz)) == NULL)
-		return -ENOMEM;
 #else
 	/* Just 512 byte align it... */
 	cam->max_usb_xfer = (USB_READ_SIZ_MAX & 0xfffffe00);
+#endif
 	cam->gbuf_siz = 2 * cam->max_usb_xfer;
 
-	if ((cam->gbuf = xmalloc(cam->gbuf_siz)) == NULL)
+	if ((cam->gbuf = fli_camera_usb_buf_alloc(dev, cam->gbuf_siz,
+		&cam->gbuf_devmem)) == NULL)
 		return -ENOMEM;
-#endif
 
 	if ((DEVICE->devinfo.devid >= 0x0100) && (DEVICE->devinfo.devid < 0x0110))
 			DEVICE->devinfo.devid = FLIUSB_PROLINE_ID;
@@ -158,7 +263,7 @@ long fli_camera_usb_open(flidev_t dev)
 				IOWRITE_U16(buf, 12, (unsigned short) knowndev[id].visible_area.ul.y);
 				IO(dev, buf, &wlen, &rlen);
 
-				DEVICE->devinfo.model = xstrndup(knowndev[id].model, 31);
+				DEVICE->devinfo.model = fli_dev_strndup(dev, knowndev[id].model, 31);
 
 				switch(DEVICE->devinfo.fwrev & 0xff00)
 				{
@@ -195,8 +300,8 @@ long fli_camera_usb_open(flidev_t dev)
 			IO(dev, buf, &wlen, &rlen);
 
 			/* Hack to make old software happy */
-			DEVICE->devinfo.devnam = xcalloc(1, 32);
-			DEVICE->devinfo.model = xcalloc(1, 32);
+			DEVICE->devinfo.devnam = fli_dev_alloc(dev, 32);
+			DEVICE->devinfo.model = fli_dev_alloc(dev, 32);
 			strncpy(DEVICE->devinfo.devnam, (char *) buf, 30);
 			strncpy(DEVICE->devinfo.model, (char *) buf, 30);
 
@@ -372,8 +477,8 @@ long fli_camera_usb_open(flidev_t dev)
 				rlen = 64; wlen = 2;
 				IOWRITE_U16(buf, 0, PROLINE_GET_DEVICESTRINGS);
 				IO(dev, buf, &wlen, &rlen);
-				DEVICE->devinfo.devnam = xstrndup((char *) &buf[0], 32);
-				DEVICE->devinfo.model = xstrndup((char *) &buf[32], 32);
+				DEVICE->devinfo.devnam = fli_dev_strndup(dev, (char *) &buf[0], 32);
+				DEVICE->devinfo.model = fli_dev_strndup(dev, (char *) &buf[32], 32);
 			}
 
 //#ifdef _WIN32_
@@ -463,10 +568,20 @@ long fli_camera_usb_open(flidev_t dev)
 			return -ENODEV;
 	}
 
-	debug(FLIDEBUG_INFO, "DeviceID %d", DEVICE->devinfo.devid);
-	debug(FLIDEBUG_INFO, "SerialNum %d", DEVICE->devinfo.serno);
-	debug(FLIDEBUG_INFO, "HWRev %04x", DEVICE->devinfo.hwrev);
-	debug(FLIDEBUG_INFO, "FWRev %04x", DEVICE->devinfo.fwrev);
+	/* Proline downloads go straight into the frame buffer and take any
+	 * transfer size, MaxCam row batches must fit the grab buffer. Sizes
+	 * the transport would split up anyway are not worth timing. */
+	xfer_max = (DEVICE->devinfo.devid == FLIUSB_PROLINE_ID)?
+		FLI_TUNE_XFER_MAX:cam->max_usb_xfer;
+	if ((DEVICE->bulk_max > 0) && (xfer_max > DEVICE->bulk_max))
+		xfer_max = MAX(DEVICE->bulk_max, cam->max_usb_xfer);
+	if (fli_tune_open(dev, cam->max_usb_xfer, FLI_TUNE_XFER_MIN, xfer_max) != 0)
+		debug(FLIDEBUG_WARN, "Could not set up transfer tuning.");
+
+	debug(FLIDEBUG_INFO, "DeviceID %ld", DEVICE->devinfo.devid);
+	debug(FLIDEBUG_INFO, "SerialNum %ld", DEVICE->devinfo.serno);
+	debug(FLIDEBUG_INFO, "HWRev %04lx", DEVICE->devinfo.hwrev);
+	debug(FLIDEBUG_INFO, "FWRev %04lx", DEVICE->devinfo.fwrev);
 
 	debug(FLIDEBUG_INFO, "     Name: %s", DEVICE->devinfo.devnam);
 	debug(FLIDEBUG_INFO, "    Array: (%4d,%4d),(%4d,%4d)",
@@ -642,7 +757,7 @@ long fli_camera_usb_set_image_area(flidev_t dev, long ul_x, long ul_y,
 				(lr_y > (cam->ccd.visible_area.lr.y * cam->vbin)) )
 		{
 			debug(FLIDEBUG_WARN,
-				"Area out of bounds: (%4d,%4d),(%4d,%4d)",
+				"Area out of bounds: (%4ld,%4ld),(%4ld,%4ld)",
 				ul_x, ul_y, lr_x, lr_y);
 			return -EINVAL;
 		}
@@ -652,13 +767,13 @@ long fli_camera_usb_set_image_area(flidev_t dev, long ul_x, long ul_y,
 			(ul_y < 0) )
 	{
 		debug(FLIDEBUG_FAIL,
-			"Area out of bounds: (%4d,%4d),(%4d,%4d)",
+			"Area out of bounds: (%4ld,%4ld),(%4ld,%4ld)",
 			ul_x, ul_y, lr_x, lr_y);
 		return -EINVAL;
 	}
 
 	debug(FLIDEBUG_INFO,
-		"Setting image area to: (%4d,%4d),(%4d,%4d)", ul_x, ul_y, lr_x, lr_y);
+		"Setting image area to: (%4ld,%4ld),(%4ld,%4ld)", ul_x, ul_y, lr_x, lr_y);
 
 	switch (DEVICE->devinfo.devid)
   {
@@ -1035,7 +1150,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 	if(width > (size_t) (cam->image_area.lr.x - cam->image_area.ul.x))
 	{
 		debug(FLIDEBUG_FAIL, "Requested row too wide, truncating.");
-		debug(FLIDEBUG_FAIL, "  Requested width: %d", width);
+		debug(FLIDEBUG_FAIL, "  Requested width: %zu", width);
 		debug(FLIDEBUG_FAIL, "  Set width: %d",
 			cam->image_area.lr.x - cam->image_area.ul.x);
 
@@ -1055,7 +1170,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 
 			if (cam->flushcountbeforefirstrow > 0)
 			{
-				debug(FLIDEBUG_INFO, "Flushing %d rows before image download.", cam->flushcountbeforefirstrow);
+				debug(FLIDEBUG_INFO, "Flushing %ld rows before image download.", cam->flushcountbeforefirstrow);
 				if ((r = fli_camera_usb_flush_rows(dev, cam->flushcountbeforefirstrow, 1)))
 					return r;
 
@@ -1076,13 +1191,21 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 						cam->grabrowbatchsize = 1;
 				}
 
-				debug(FLIDEBUG_INFO, "Grabbing %d rows of width %d.", cam->grabrowbatchsize, cam->grabrowwidth);
+				debug(FLIDEBUG_INFO, "Grabbing %ld rows of width %ld.", cam->grabrowbatchsize, cam->grabrowwidth);
 				rlen = cam->grabrowwidth * 2 * cam->grabrowbatchsize;
 				wlen = 6;
 				cam->gbuf[0] = htons(FLI_USBCAM_SENDROW);
 				cam->gbuf[1] = htons((unsigned short) cam->grabrowwidth);
 				cam->gbuf[2] = htons((unsigned short) cam->grabrowbatchsize);
-				IO(dev, cam->gbuf, &wlen, &rlen);
+				if (FLI_TUNE_SEARCHING(dev))
+				{
+					uint64_t start = fli_trace_now();
+
+					IO(dev, cam->gbuf, &wlen, &rlen);
+					fli_tune_sample(dev, cam->tune_xfer, rlen, fli_trace_now() - start);
+				}
+				else
+					IO(dev, cam->gbuf, &wlen, &rlen);
 
 				for (x = 0; x < (cam->grabrowwidth * cam->grabrowbatchsize); x++)
 				{
@@ -1114,7 +1237,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 				{
 					if (cam->flushcountafterlastrow > 0)
 					{
-						debug(FLIDEBUG_INFO, "Flushing %d rows after image download.", cam->flushcountafterlastrow);
+						debug(FLIDEBUG_INFO, "Flushing %ld rows after image download.", cam->flushcountafterlastrow);
 						if ((r = fli_camera_usb_flush_rows(dev, cam->flushcountafterlastrow, 1)))
 							return r;
 					}
@@ -1223,7 +1346,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 
 #endif
 
-				if ((usb_bulktransfer(dev, 0x82, &cam->gbuf[loadindex], &rlen)) != 0) /* Grab the buffer */
+				if ((DEVICE->fli_bulk(dev, 0x82, &cam->gbuf[loadindex], &rlen)) != 0) /* Grab the buffer */
 				{
 					debug(FLIDEBUG_FAIL, "Read failed...");
 					abort = 1;
@@ -1287,8 +1410,9 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 		/* New code */
 		case FLIUSB_PROLINE_ID:
 		{
-			long rlen = 0, rtotal = 0;
+			long rlen = 0, rtotal = 0, xfer = 0;
 			int index = 0;
+			uint64_t start = 0;
 
 			/*
 			 * cam->gbuf_siz -- size of the grab buffer (bytes)
@@ -1306,7 +1430,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 			long to, bo, lo, ro;
 			long th, bh, lw, rw;
 			long w;
-			unsigned short *left, *right, *ibuf;
+			unsigned short *left, *right, *ibuf, *rbuf;
 
 			/* Normalize the offsets */
 			to = cam->top_offset - MIN(cam->top_offset, cam->bottom_offset);
@@ -1486,7 +1610,8 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 				/* Not performing TDI */
 				if (cam->tdirate == 0)
 				{
-					rlen = (long) MIN(cam->bytesleft, (size_t) cam->max_usb_xfer);
+					xfer = FLI_TUNE_XFER(dev, cam->max_usb_xfer);
+					rlen = (long) MIN(cam->bytesleft, (size_t) xfer);
 				}
 				else
 				/* For TDI imaging we only want one row at a time, must be rounded up
@@ -1502,24 +1627,38 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 					}
 				}
 
-				memset(cam->gbuf, 0x00, rlen);
+				/* Outside of TDI the rest of the frame fits in the image buffer,
+				 * read straight into it and swap in place */
+				if (cam->tdirate == 0)
+				{
+					rbuf = cam->ibuf_wr_idx;
+				}
+				else
+				{
+					rbuf = cam->gbuf;
+					memset(rbuf, 0x00, rlen);
+				}
 				rtotal = rlen;
 
-				if ((usb_bulktransfer(dev, 0x82, cam->gbuf, &rlen)) != 0) /* Grab the buffer */
+				if (FLI_TUNE_SEARCHING(dev))
+					start = fli_trace_now();
+
+				if (fli_camera_usb_read_image(dev, rbuf, &rlen) != 0) /* Grab the buffer */
 				{
 					debug(FLIDEBUG_FAIL, "Read failed...");
 					abort = 1;
 				}
-
-				if (rlen < rtotal)
+				else if ((cam->tdirate == 0) && (rtotal == xfer) && (rlen == rtotal) &&
+					FLI_TUNE_SEARCHING(dev))
 				{
-					debug(FLIDEBUG_FAIL, "Transfer did not complete...");
+					fli_tune_sample(dev, xfer, rlen, fli_trace_now() - start);
 				}
 
-				if (rlen == 0x03) /* This is a special case, the camera is telling us there
-													 * is no more data, something went wrong */
+				if (rlen < rtotal) /* Still short after resuming, the rest isn't coming */
 				{
+					debug(FLIDEBUG_FAIL, "Transfer did not complete...");
 					cam->bytesleft = 0;
+					abort = 1;
 				}
 				else
 				{
@@ -1528,7 +1667,7 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 
 				for (index = 0; index < (rlen / (long) sizeof(unsigned short)); index ++)
 				{
-					*cam->ibuf_wr_idx = ((cam->gbuf[index] << 8) & 0xff00) | ((cam->gbuf[index] >> 8) & 0x00ff);
+					*cam->ibuf_wr_idx = ((rbuf[index] << 8) & 0xff00) | ((rbuf[index] >> 8) & 0x00ff);
 					cam->ibuf_wr_idx++;
 				}
 			}
@@ -1667,6 +1806,12 @@ long fli_camera_usb_grab_row(flidev_t dev, void *buff, size_t width)
 					}
 				}
 			}
+			else if (abort == 0)
+			{
+				/* An earlier read of this frame came up short */
+				debug(FLIDEBUG_FAIL, "Row %ld is not in memory, frame is incomplete.", cam->grabrowindex);
+				abort = 1;
+			}
 			cam->grabrowindex ++;
 		}
 
@@ -1976,7 +2121,7 @@ long fli_camera_usb_expose_frame(flidev_t dev)
 			flags |= (cam->exttriggerpol != 0) ? 0x08 : 0x00;
 
 			debug(FLIDEBUG_INFO, "Exposure flags: %04x", flags);
-			debug(FLIDEBUG_INFO, "Flushing %d times.", cam->flushes);
+			debug(FLIDEBUG_INFO, "Flushing %ld times.", cam->flushes);
 
 			if (cam->flushes > 0)
 			{
@@ -1999,7 +2144,10 @@ long fli_camera_usb_expose_frame(flidev_t dev)
 			cam->grabrowwidth = cam->image_area.lr.x - cam->image_area.ul.x;
 			cam->grabrowindex = 0;
 			if (cam->grabrowwidth > 0){
-				cam->grabrowbatchsize = USB_READ_SIZ_MAX / (cam->grabrowwidth * 2);
+				cam->tune_xfer = FLI_TUNE_XFER(dev, USB_READ_SIZ_MAX);
+				cam->grabrowbatchsize = cam->tune_xfer / (cam->grabrowwidth * 2);
+				if (cam->grabrowbatchsize < 1)
+					cam->grabrowbatchsize = 1;
 			}
 			else
 			{
@@ -2136,14 +2284,14 @@ long fli_camera_usb_expose_frame(flidev_t dev)
 				cam->right_offset =cam->grabrowwidth;
 			}
 
-			debug(FLIDEBUG_INFO, "         Grab Height: %d", cam->top_height);
-			debug(FLIDEBUG_INFO, "           Top Flush: %d", cam->top_offset);
-			debug(FLIDEBUG_INFO, "       Bottom Height: %d", cam->bottom_height);
-			debug(FLIDEBUG_INFO, "        Bottom Flush: %d", cam->bottom_offset);
-			debug(FLIDEBUG_INFO, "          Left Width: %d", cam->left_width);
-			debug(FLIDEBUG_INFO, "         Left Offset: %d", cam->left_offset);
-			debug(FLIDEBUG_INFO, "         Right Width: %d", cam->right_width);
-			debug(FLIDEBUG_INFO, "        Right Offset: %d", cam->right_offset);
+			debug(FLIDEBUG_INFO, "         Grab Height: %ld", cam->top_height);
+			debug(FLIDEBUG_INFO, "           Top Flush: %ld", cam->top_offset);
+			debug(FLIDEBUG_INFO, "       Bottom Height: %ld", cam->bottom_height);
+			debug(FLIDEBUG_INFO, "        Bottom Flush: %ld", cam->bottom_offset);
+			debug(FLIDEBUG_INFO, "          Left Width: %ld", cam->left_width);
+			debug(FLIDEBUG_INFO, "         Left Offset: %ld", cam->left_offset);
+			debug(FLIDEBUG_INFO, "         Right Width: %ld", cam->right_width);
+			debug(FLIDEBUG_INFO, "        Right Offset: %ld", cam->right_offset);
 
 			numpix = (cam->top_height + cam->bottom_height) *
 				(cam->left_width + cam->right_width);
@@ -2157,22 +2305,17 @@ long fli_camera_usb_expose_frame(flidev_t dev)
 
 			if (cam->ibuf_siz < (numpix * sizeof(unsigned short)))
 			{
-				if (cam->ibuf != NULL)
-					xfree(cam->ibuf);
+				fli_camera_usb_buf_free(dev, cam->ibuf, cam->ibuf_siz, cam->ibuf_devmem);
 
 				cam->ibuf = NULL;
 				cam->ibuf_siz = numpix * sizeof(unsigned short);
 
 #ifdef __linux__
-				/* Linux needs this page aligned, hopefully this is 512 byte aligned too... */
 				cam->ibuf_siz = ((cam->ibuf_siz / getpagesize()) + 1) * getpagesize();
-				if ((cam->ibuf = xmemalign(getpagesize(), cam->ibuf_siz)) == NULL)
-					r = -ENOMEM;
-#else
-				/* Just 512 byte align it... */
-				if ((cam->ibuf = xmalloc(cam->ibuf_siz)) == NULL)
-					r = -ENOMEM;
 #endif
+				if ((cam->ibuf = fli_camera_usb_buf_alloc(dev, cam->ibuf_siz,
+					&cam->ibuf_devmem)) == NULL)
+					r = -ENOMEM;
 				if (r != 0)
 					cam->ibuf_siz = 0;
 			}
@@ -2218,7 +2361,7 @@ long fli_camera_usb_flush_rows(flidev_t dev, long rows, long repeat)
 
 			while (repeat > 0)
 			{
-				debug(FLIDEBUG_INFO, "Flushing %d rows.", rows);
+				debug(FLIDEBUG_INFO, "Flushing %ld rows.", rows);
 				rlen = 0; wlen = 4;
 				IOWRITE_U16(buf, 0, FLI_USBCAM_FLUSHROWS);
 				IOWRITE_U16(buf, 2, rows);
@@ -2679,7 +2822,7 @@ long fli_camera_usb_set_camera_mode(flidev_t dev, flimode_t camera_mode)
 
 				if (mode != camera_mode)
 				{
-					debug(FLIDEBUG_FAIL, "Error setting camera mode, tried %d, performed %d.", camera_mode, mode);
+					debug(FLIDEBUG_FAIL, "Error setting camera mode, tried %ld, performed %ld.", camera_mode, mode);
 					r = -EINVAL;
 				}
 			}
@@ -2977,7 +3120,7 @@ long fli_camera_usb_read_eeprom(flidev_t dev, long loc, long address, long lengt
 				IOWRITE_U8(buf, 4, loc);
 				IOWRITE_U8(buf, 5, eelen);
 
-				debug(FLIDEBUG_INFO, "Reading %d bytes starting at %#04x", (int) eelen, address + addr);
+				debug(FLIDEBUG_INFO, "Reading %d bytes starting at %#04lx", (int) eelen, address + addr);
 
 				IO(dev, buf, &wlen, &rlen);
 
@@ -3046,7 +3189,7 @@ long fli_camera_usb_write_eeprom(flidev_t dev, long loc, long address, long leng
 
 				memcpy(&buf[6], &((unsigned char *) wbuf)[addr], eelen);
 
-				debug(FLIDEBUG_INFO, "Writing %d bytes starting at %#04x", (int) eelen, address + addr);
+				debug(FLIDEBUG_INFO, "Writing %d bytes starting at %#04lx", (int) eelen, address + addr);
 
 				IO(dev, buf, &wlen, &rlen);
 			}
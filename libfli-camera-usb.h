@@ -99,6 +99,12 @@
 #define PROLINE_COMMAND_READ_USER_EEPROM			(0x0020)
 #define PROLINE_COMMAND_WRITE_USER_EEPROM			(0x0021)
 
+/* Resuming short image reads */
+#define FLI_RESUME_RETRIES (8)
+#define FLI_RESUME_BUDGET (2000) /* msec, for all retries of one read */
+
+void *fli_camera_usb_buf_alloc(flidev_t dev, size_t len, int *devmem);
+void fli_camera_usb_buf_free(flidev_t dev, void *buf, size_t len, int devmem);
 long fli_camera_usb_open(flidev_t dev);
 long fli_camera_usb_get_array_area(flidev_t dev, long *ul_x, long *ul_y,
 				   long *lr_x, long *lr_y);
@@ -96,7 +96,7 @@ long fli_camera_open(flidev_t dev)
 
   CHKDEVICE(dev);
 
-  if ((DEVICE->device_data = xcalloc(1, sizeof(flicamdata_t))) == NULL)
+  if ((DEVICE->device_data = fli_dev_alloc(dev, sizeof(flicamdata_t))) == NULL)
     return -ENOMEM;
 
 //	load_camera_defaults();
@@ -117,7 +117,7 @@ long fli_camera_open(flidev_t dev)
 
   if (r)
   {
-    xfree(DEVICE->device_data);
+    fli_dev_free(dev, DEVICE->device_data);
     DEVICE->device_data = NULL;
   }
 
@@ -134,31 +134,31 @@ long fli_camera_close(flidev_t dev)
 
   if (cam->gbuf != NULL)
   {
-    xfree(cam->gbuf);
+    fli_camera_usb_buf_free(dev, cam->gbuf, cam->gbuf_siz, cam->gbuf_devmem);
     cam->gbuf = NULL;
   }
 
 	 if (cam->ibuf != NULL)
   {
-    xfree(cam->ibuf);
+    fli_camera_usb_buf_free(dev, cam->ibuf, cam->ibuf_siz, cam->ibuf_devmem);
     cam->ibuf = NULL;
   }
 
   if (DEVICE->devinfo.model != NULL)
   {
-    xfree(DEVICE->devinfo.model);
+    fli_dev_free(dev, DEVICE->devinfo.model);
     DEVICE->devinfo.model = NULL;
   }
 
   if (DEVICE->devinfo.devnam != NULL)
   {
-    xfree(DEVICE->devinfo.devnam);
+    fli_dev_free(dev, DEVICE->devinfo.devnam);
     DEVICE->devinfo.devnam = NULL;
   }
 
   if (DEVICE->device_data != NULL)
   {
-    xfree(DEVICE->device_data);
+    fli_dev_free(dev, DEVICE->device_data);
     DEVICE->device_data = NULL;
   }
 
@@ -168,11 +168,21 @@ long fli_camera_close(flidev_t dev)
 long fli_camera_command(flidev_t dev, int cmd, int argc, ...)
 {
   long r = 0;
+  int tx;
   va_list ap;
 
   va_start(ap, argc);
   CHKDEVICE(dev);
 
+  /* Each command runs under a single lock, however many transfers it
+   * takes. A video frame can wait a whole exposure for its data, which
+   * would keep other threads from reading the temperature. */
+  if ((tx = (cmd != FLI_GRAB_VIDEO_FRAME)) && (r = fli_tx_begin(dev)) != 0)
+  {
+    va_end(ap);
+    return r;
+  }
+
   switch (cmd)
   {
 		case FLI_GET_PIXEL_SIZE:
@@ -952,7 +962,7 @@ long fli_camera_command(flidev_t dev, int cmd, int argc, ...)
 					  (shutter & FLI_SHUTTER_EXTERNAL_TRIGGER_HIGH) ||
 						((shutter & FLI_SHUTTER_EXTERNAL_EXPOSURE_CONTROL)) )
 				{
-					debug(FLIDEBUG_INFO, "External trigger: %02x", shutter);
+					debug(FLIDEBUG_INFO, "External trigger: %02lx", shutter);
 					cam->exttrigger = 1;
 					cam->exttriggerpol = (shutter & FLI_SHUTTER_EXTERNAL_TRIGGER_LOW)?0:1;
 					cam->extexposurectrl = (shutter & FLI_SHUTTER_EXTERNAL_EXPOSURE_CONTROL)?1:0; 
@@ -1262,6 +1272,14 @@ long fli_camera_command(flidev_t dev, int cmd, int argc, ...)
 
   va_end(ap);
 
+  if (tx)
+  {
+    long u = fli_tx_end(dev);
+
+    if (r == 0)
+      r = u;
+  }
+
   return r;
 }
 
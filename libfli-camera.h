@@ -158,6 +158,9 @@ typedef struct {
   unsigned short *ibuf;
   size_t gbuf_siz;
   size_t ibuf_siz;
+  int gbuf_devmem;		/* Buffer came from fli_dev_mem_alloc() */
+  int ibuf_devmem;
+  long tune_xfer;		/* Transfer size the row batches were sized for */
   long max_usb_xfer;
   
 } flicamdata_t;
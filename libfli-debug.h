@@ -51,10 +51,30 @@
 
 #define _DEBUG_IO
 
+/* Levels compiled in; anything else is removed by the compiler */
+#ifndef FLIDEBUG_COMPILED
+#define FLIDEBUG_COMPILED (FLIDEBUG_ALL | FLIDEBUG_IO)
+#endif
+
+/* Levels currently logged, kept by setdebuglevel() */
+extern volatile int fli_debug_levels;
+
+/* The level is tested before the arguments are evaluated, so disabled
+   messages cost one load and branch */
+#define debug(level, ...) \
+  do { \
+    if (((level) & FLIDEBUG_COMPILED) && ((level) & fli_debug_levels)) \
+      fli_debug((level), __VA_ARGS__); \
+  } while (0)
+
 /* Debug functions */
 int debugclose(void);
 int debugopen(char *host);
-void debug(int level, char *format, ...);
+void fli_debug(int level, char *format, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 2, 3)))
+#endif
+  ;
 void setdebuglevel(char *host, long level);
 
 #endif /* _LIBFLI_DEBUG_H_ */
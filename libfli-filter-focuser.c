@@ -60,6 +60,8 @@
 #include "libfli-mem.h"
 #include "libfli-debug.h"
 #include "libfli-filter-focuser.h"
+#include "libfli-trace.h"
+#include "libfli-flashcache.h"
 
 //#define SHOWFUNCTIONS
 
@@ -92,26 +94,63 @@ static const wheeldata_t wheeldata[] =
 #define FLI_BLOCK (1)
 #define FLI_NON_BLOCK (0)
 
+/* Moves tracked until they are waited for, see fli_move_begin() */
+#define FLI_MOVE_NONE (0)
+#define FLI_MOVE_SLOT (1)
+#define FLI_MOVE_STEPS (2)
+#define FLI_MOVE_HOME (3)
+
+#define FLI_FILTER_MSPERSLOT (250) /* Until a move has been timed */
+
+/* Steps of slack taken up when an older wheel turns backwards. No
+	 wheel has had its slack measured, so by default they only turn
+	 forward as they always have; setting the FLI_FILTER_BACKLASH
+	 environment variable to the measured slack allows reverse moves. */
+#define FLI_FILTER_BACKLASH (-1)
+#define FLI_MOVE_POLL_MIN (5)
+#define FLI_MOVE_POLL_MAX (50)
+
+/* Bytes per flash read command, the length is sent in a byte */
+#define FLI_FLASH_CHUNK_MAX (128)
+#define FLI_FLASH_CHUNK_MIN (16)
+
 static long fli_stepmotor(flidev_t dev, long steps, long block);
 static long fli_getsteppos(flidev_t dev, long *pos);
 static long fli_setfilterpos(flidev_t dev, long pos);
+static long fli_filter_move_start(flidev_t dev, long pos);
+static long fli_filter_step_to(flidev_t dev, long pos);
+static long fli_filter_move_wheels(flidev_t dev, long *pos, long n);
+static long fli_move_wait(flidev_t dev, long timeout);
+static long fli_move_timeleft(flidev_t dev, long *ms);
 static long fli_getstepsremaining(flidev_t dev, long *pos);
 static long fli_focuser_getfocuserextent(flidev_t dev, long *extent);
 static long fli_focuser_readtemperature(flidev_t dev, flichannel_t channel, double *temperature);
 static long fli_getfilterpos(flidev_t dev, long *cslot);
 static long fli_getfiltername(flidev_t dev, long filter, char *name, size_t len);
 
+/* Reads flash in commands of up to FLI_FLASH_CHUNK_MAX bytes. Firmware
+	 that answers such a read short or not at all is read FLI_FLASH_CHUNK_MIN
+	 bytes at a time from then on. */
 static long fli_filter_focuser_read_flash(flidev_t dev,
 																					long address, long length, void *buf)
 {
+  flifilterfocuserdata_t *fdata;
 	long ret = 0;
 	long addr;
-	long len;
-	unsigned char b[64];
+	long len, chunk;
+	unsigned char b[8];
+	unsigned char eelen;
 
-	for (addr = 0; (addr < length); addr += 16)
+  fdata = DEVICE->device_data;
+	chunk = (fdata->flashchunk > 0)?fdata->flashchunk:FLI_FLASH_CHUNK_MAX;
+
+	/* Nothing else may get between a command and its reply */
+	if ((ret = fli_tx_begin(dev)) != 0)
+		return ret;
+
+	for (addr = 0; (addr < length); addr += eelen)
 	{
-		unsigned char eelen = (unsigned char) (((length - addr) > 16)?16:(length - addr));
+		eelen = (unsigned char) (((length - addr) > chunk)?chunk:(length - addr));
 
 		b[0] = 0x00;
 		b[1] = 0x00;
@@ -132,16 +171,27 @@ static long fli_filter_focuser_read_flash(flidev_t dev,
 
 		len = eelen;
 		/* Receive the reply */
-		if (((ret = FLIUsbBulkIO(dev, 0x82, b, &len)) != 0) || (len != eelen) )
+		if (((ret = FLIUsbBulkIO(dev, 0x82, &((unsigned char *) buf)[addr], &len)) != 0) || (len != eelen) )
 		{
+			if (chunk > FLI_FLASH_CHUNK_MIN)
+			{
+				debug(FLIDEBUG_INFO, "Flash reads of %ld bytes failed, reading %d at a time.",
+					chunk, FLI_FLASH_CHUNK_MIN);
+				chunk = FLI_FLASH_CHUNK_MIN;
+				eelen = 0;
+				ret = 0;
+				continue;
+			}
+
 //			debug(FLIDEBUG_WARN, "  error %d!", GetLastError());
 			ret = 1;
 			break;
 		}
-
-		memcpy(&((unsigned char *) buf)[addr], b, eelen);
 	}
 
+	fdata->flashchunk = chunk;
+	fli_tx_end(dev);
+
 	return ret;
 }
 
@@ -174,6 +224,7 @@ long fli_filter_focuser_open(flidev_t dev)
   long rlen, wlen;
   unsigned short buf[16];
   flifilterfocuserdata_t *fdata = NULL;
+  char *env;
 
   CHKDEVICE(dev);
 
@@ -202,18 +253,20 @@ long fli_filter_focuser_open(flidev_t dev)
     goto done;
   }
 
-  if ((DEVICE->device_data = xmalloc(sizeof(flifilterfocuserdata_t))) == NULL)
+  if ((DEVICE->device_data = fli_dev_alloc(dev, sizeof(flifilterfocuserdata_t))) == NULL)
   {
     err = -ENOMEM;
     goto done;
   }
-	memset(DEVICE->device_data, 0, sizeof(flifilterfocuserdata_t));
 
 	fdata = DEVICE->device_data;
 	fdata->nameinfobuf = NULL;
   fdata->tableindex = -1;
   fdata->stepspersec = 100;
   fdata->currentslot = -1;
+	fdata->backlash = FLI_FILTER_BACKLASH;
+	if ((env = getenv("FLI_FILTER_BACKLASH")) != NULL)
+		fdata->backlash = strtol(env, NULL, 0);
 //	fdata->numslots = 0;
 //	fdata->numslotswheel[0] = 0;
 //	fdata->numslotswheel[1] = 0;
@@ -235,7 +288,7 @@ long fli_filter_focuser_open(flidev_t dev)
   }
 
   debug(FLIDEBUG_INFO, "New version of hardware found.");
-	debug(FLIDEBUG_INFO, "Internal FW Rev: 0x%04x", DEVICE->devinfo.fwrev);
+	debug(FLIDEBUG_INFO, "Internal FW Rev: 0x%04lx", DEVICE->devinfo.fwrev);
 
 	wlen = 2;
   rlen = 2;
@@ -348,7 +401,7 @@ long fli_filter_focuser_open(flidev_t dev)
 				fdata->numtempsensors = 2;
 			}
 
-			debug(FLIDEBUG_INFO, "Extent: %d Steps/sec: %d Temp Sensors: %d", fdata->extent, fdata->stepspersec, fdata->numtempsensors);
+			debug(FLIDEBUG_INFO, "Extent: %ld Steps/sec: %ld Temp Sensors: %ld", fdata->extent, fdata->stepspersec, fdata->numtempsensors);
 			break;
 
 		case 0x08:
@@ -477,13 +530,13 @@ long fli_filter_focuser_open(flidev_t dev)
 			IO(dev, buf, &wlen, &rlen);
 			fdata->stepspersec = ntohs(buf[0]) & 0x7fff;
 
-			debug(FLIDEBUG_INFO, "Extent: %d Steps/sec: %d Temp Sensors: %d", fdata->extent, fdata->stepspersec, fdata->numtempsensors);
+			debug(FLIDEBUG_INFO, "Extent: %ld Steps/sec: %ld Temp Sensors: %ld", fdata->extent, fdata->stepspersec, fdata->numtempsensors);
 
 			fdata->tableindex = (-1);
 			break;
 
 		default:
-		  debug(FLIDEBUG_FAIL, "Unknown device %d attached.", fdata->hwtype);
+		  debug(FLIDEBUG_FAIL, "Unknown device %ld attached.", fdata->hwtype);
 			err = -ENODEV;
 			goto done;
   }
@@ -497,22 +550,23 @@ long fli_filter_focuser_open(flidev_t dev)
 			{
 				if ((DEVICE->devinfo.fwrev & 0x00ff) <= 0x30)
 				{
-					if (xasprintf(&DEVICE->devinfo.model, "Filter Wheel (%ld position)",
-							fdata->numslots) < 0)
+					if ((DEVICE->devinfo.model = (char *) fli_dev_alloc(dev, 33)) == NULL)
 					{
 						debug(FLIDEBUG_WARN, "Could not allocate memory for model information.");
 					}
+					else
+						snprintf(DEVICE->devinfo.model, 33, "Filter Wheel (%ld position)",
+							fdata->numslots);
 				}
 
 				if ((DEVICE->devinfo.fwrev & 0x00ff) >= 0x31)
 				{
-					if ((DEVICE->devinfo.model = (char *) xmalloc(33)) == NULL)
+					if ((DEVICE->devinfo.model = (char *) fli_dev_alloc(dev, 33)) == NULL)
 					{
 						debug(FLIDEBUG_WARN, "Could not allocate memory for model information.");
 					}
 					else
 					{
-						memset(DEVICE->devinfo.model, '\0', 33);
 						wlen = 2; rlen = 32;
 						DEVICE->devinfo.model[0] = 0x80;
 						DEVICE->devinfo.model[1] = 0x03;
@@ -523,7 +577,7 @@ long fli_filter_focuser_open(flidev_t dev)
 
 			if (DEVICE->devinfo.type == FLIDEVICE_FOCUSER)
 			{
-				if (xasprintf(&DEVICE->devinfo.model, "FLI Focuser") < 0)
+				if ((DEVICE->devinfo.model = fli_dev_strdup(dev, "FLI Focuser")) == NULL)
 				{
 					debug(FLIDEBUG_WARN, "Could not allocate memory for model information.");
 				}
@@ -531,13 +585,12 @@ long fli_filter_focuser_open(flidev_t dev)
 		}
 		else /* Newer style hardware */
 		{
-			if ((DEVICE->devinfo.model = (char *) xmalloc(33)) == NULL)
+			if ((DEVICE->devinfo.model = (char *) fli_dev_alloc(dev, 33)) == NULL)
 			{
 				debug(FLIDEBUG_WARN, "Could not allocate memory for model information.");
 			}
 			else
 			{
-				memset(DEVICE->devinfo.model, '\0', 33);
 				wlen = 2; rlen = 32;
 				DEVICE->devinfo.model[0] = 0x80;
 				DEVICE->devinfo.model[1] = 0x03;
@@ -551,13 +604,13 @@ long fli_filter_focuser_open(flidev_t dev)
   {
     if (DEVICE->devinfo.model != NULL)
     {
-      xfree(DEVICE->devinfo.model);
+      fli_dev_free(dev, DEVICE->devinfo.model);
       DEVICE->devinfo.model = NULL;
     }
 
     if (DEVICE->device_data != NULL)
     {
-      xfree(DEVICE->device_data);
+      fli_dev_free(dev, DEVICE->device_data);
       DEVICE->device_data = NULL;
     }
 
@@ -574,7 +627,7 @@ long fli_filter_focuser_close(flidev_t dev)
 
   if (DEVICE->devinfo.model != NULL)
   {
-    xfree(DEVICE->devinfo.model);
+    fli_dev_free(dev, DEVICE->devinfo.model);
     DEVICE->devinfo.model = NULL;
   }
 
@@ -589,7 +642,7 @@ long fli_filter_focuser_close(flidev_t dev)
 			fdata->nameinfobuf = NULL;
 		}
 
-		xfree(DEVICE->device_data);
+		fli_dev_free(dev, DEVICE->device_data);
     DEVICE->device_data = NULL;
   }
 
@@ -620,6 +673,67 @@ long fli_filter_command(flidev_t dev, int cmd, int argc, ...)
 			}
 			break;
 
+		case FLI_SET_FILTER_POS_ASYNC:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long pos;
+
+				pos = *va_arg(ap, long *);
+				r = fli_filter_move_start(dev, pos);
+			}
+			break;
+
+		case FLI_SET_WHEEL_POSITIONS_ASYNC:
+			if (argc != 2)
+				r = -EINVAL;
+			else
+			{
+				long *pos, n;
+
+				pos = va_arg(ap, long *);
+				n = *va_arg(ap, long *);
+				r = fli_filter_move_wheels(dev, pos, n);
+			}
+			break;
+
+		case FLI_WAIT_FILTER_MOVE:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long timeout;
+
+				timeout = *va_arg(ap, long *);
+				r = fli_move_wait(dev, timeout);
+			}
+			break;
+
+		case FLI_WAIT_STEP_MOTOR:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long timeout;
+
+				timeout = *va_arg(ap, long *);
+				r = fli_move_wait(dev, timeout);
+			}
+			break;
+
+		case FLI_GET_MOVE_TIME_REMAINING:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long *ms;
+
+				ms = va_arg(ap, long *);
+				r = fli_move_timeleft(dev, ms);
+			}
+			break;
+
 		case FLI_GET_FILTER_POS:
 			if (argc != 1)
 				r = -EINVAL;
@@ -673,6 +787,7 @@ long fli_filter_command(flidev_t dev, int cmd, int argc, ...)
 
 				steps = va_arg(ap, long *);
 				r = fli_stepmotor(dev, *steps, FLI_BLOCK);
+				fdata->slotunsure = 1;
 			}
 			break;
 
@@ -685,6 +800,7 @@ long fli_filter_command(flidev_t dev, int cmd, int argc, ...)
 
 				steps = va_arg(ap, long *);
 				r = fli_stepmotor(dev, *steps, FLI_NON_BLOCK);
+				fdata->slotunsure = 1;
 			}
 			break;
 
@@ -722,6 +838,10 @@ long fli_filter_command(flidev_t dev, int cmd, int argc, ...)
 
 				wheel = *va_arg(ap, long *);
 
+				/* The slot last reached belongs to the previous wheel */
+				if (wheel != fdata->activewheel)
+					fdata->slotunsure = 1;
+
 				r = 0;
 				if (wheel & FLI_FILTER_WHEEL_PHYSICAL)
 				{
@@ -862,6 +982,30 @@ long fli_focuser_command(flidev_t dev, int cmd, int argc, ...)
     }
     break;
 
+		case FLI_WAIT_STEP_MOTOR:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long timeout;
+
+				timeout = *va_arg(ap, long *);
+				r = fli_move_wait(dev, timeout);
+			}
+			break;
+
+		case FLI_GET_MOVE_TIME_REMAINING:
+			if (argc != 1)
+				r = -EINVAL;
+			else
+			{
+				long *ms;
+
+				ms = va_arg(ap, long *);
+				r = fli_move_timeleft(dev, ms);
+			}
+			break;
+
   case FLI_GET_FOCUSER_EXTENT:
     if (argc != 1)
       r = -EINVAL;
@@ -923,14 +1067,186 @@ long fli_focuser_command(flidev_t dev, int cmd, int argc, ...)
   return r;
 }
 
+static void fli_msleep(long ms)
+{
+	while (ms > 0)
+	{
+		long t = (ms > 500)?500:ms;
+
+#ifdef _WIN32
+		Sleep(t);
+#else
+		usleep(t * 1000);
+#endif
+		ms -= t;
+	}
+}
+
+/* Steps take the motor 1/stepspersec each */
+static long fli_steps_msec(flifilterfocuserdata_t *fdata, long steps)
+{
+	if (fdata->stepspersec <= 0)
+		return 0;
+
+	return (long) (((double) labs(steps) * 1000.0) / fdata->stepspersec);
+}
+
+/* Records a move the device has accepted, expected to take expect msec */
+static void fli_move_begin(flidev_t dev, long kind, long expect)
+{
+  flifilterfocuserdata_t *fdata;
+
+  fdata = DEVICE->device_data;
+
+	fdata->movekind = kind;
+	fdata->moveexpect = expect;
+	fdata->movestart = fli_trace_now();
+}
+
+/* Asks the device whether the move being tracked has ended */
+static long fli_move_done(flidev_t dev, long *done)
+{
+  flifilterfocuserdata_t *fdata;
+	iobuf_t _buf[IOBUF_MAX_SIZ];
+	long rlen, wlen, stepsleft;
+
+  fdata = DEVICE->device_data;
+
+	CLEARIO;
+	switch (fdata->movekind)
+	{
+		case FLI_MOVE_HOME:
+			wlen = 2; rlen = 2;
+			IOWRITE_U16(_buf, 0, 0xb000);
+			IO(dev, _buf, &wlen, &rlen);
+			*done = ((_buf[1] & FLI_FOCUSER_STATUS_HOMING) == 0);
+			break;
+
+		case FLI_MOVE_STEPS:
+			if ((fdata->hwtype >= 0xfe) && ((DEVICE->devinfo.fwrev & 0x00ff) >= 0x43))
+			{
+				wlen = 12; rlen = 12;
+				IOWRITE_U16(_buf, 0, 0x7000);
+				IO(dev, _buf, &wlen, &rlen);
+				IOREAD_U32(_buf, 0, stepsleft);
+				*done = ((stepsleft & 0x00ffffff) == 0);
+				break;
+			}
+			/* Older firmware answers like a filter wheel */
+
+		case FLI_MOVE_SLOT:
+			wlen = 2; rlen = 2;
+			IOWRITE_U16(_buf, 0, 0x7000);
+			IO(dev, _buf, &wlen, &rlen);
+			IOREAD_U16(_buf, 0, stepsleft);
+			*done = (stepsleft == 0x7000);
+			break;
+
+		default:
+			*done = 1;
+			break;
+	}
+
+	return 0;
+}
+
+/* Waits up to timeout msec, or for as long as it takes if negative, for
+	 the move being tracked to end. Nothing is asked of the device until
+	 three quarters of the expected time have passed, after that it is
+	 polled more often the closer the move should be to its end. */
+static long fli_move_wait(flidev_t dev, long timeout)
+{
+  flifilterfocuserdata_t *fdata;
+	long elapsed = 0, waited, left, ms, done, r;
+	uint64_t begin;
+
+  fdata = DEVICE->device_data;
+
+	if (fdata->movekind == FLI_MOVE_NONE)
+		return 0;
+
+	begin = fli_trace_now();
+	while (1)
+	{
+		elapsed = (long) ((fli_trace_now() - fdata->movestart) / 1000000);
+		left = fdata->moveexpect - elapsed;
+
+		if (left > fdata->moveexpect / 4)
+			ms = left - fdata->moveexpect / 4;
+		else
+		{
+			if ((r = fli_move_done(dev, &done)) != 0)
+				return r;
+			if (done)
+				break;
+
+			ms = labs(left) / 4;
+			if (ms < FLI_MOVE_POLL_MIN)
+				ms = FLI_MOVE_POLL_MIN;
+			if (ms > FLI_MOVE_POLL_MAX)
+				ms = FLI_MOVE_POLL_MAX;
+		}
+
+		if (timeout >= 0)
+		{
+			waited = (long) ((fli_trace_now() - begin) / 1000000);
+			if (waited >= timeout)
+				return -ETIMEDOUT;
+			ms = MIN(ms, timeout - waited);
+		}
+
+		fli_msleep(ms);
+	}
+
+	debug(FLIDEBUG_INFO, "Move ended after %ld msec, %ld expected.",
+		elapsed, fdata->moveexpect);
+
+	if (fdata->movekind == FLI_MOVE_SLOT)
+	{
+		/* Learn how long a slot takes for the next estimate */
+		if (fdata->moveslots > 0)
+		{
+			ms = elapsed / fdata->moveslots;
+			fdata->msperslot = (fdata->msperslot > 0)?
+				(3 * fdata->msperslot + ms) / 4:ms;
+		}
+		if (fdata->movetarget >= 0)
+		{
+			fdata->currentslot = fdata->movetarget;
+			fdata->slotunsure = 0;
+		}
+	}
+	fdata->movekind = FLI_MOVE_NONE;
+
+	return 0;
+}
+
+/* What is left of the expected time of the move being tracked */
+static long fli_move_timeleft(flidev_t dev, long *ms)
+{
+  flifilterfocuserdata_t *fdata;
+	long elapsed;
+
+  fdata = DEVICE->device_data;
+
+	*ms = 0;
+	if (fdata->movekind == FLI_MOVE_NONE)
+		return 0;
+
+	elapsed = (long) ((fli_trace_now() - fdata->movestart) / 1000000);
+	if (elapsed < fdata->moveexpect)
+		*ms = fdata->moveexpect - elapsed;
+
+	return 0;
+}
+
 static long fli_stepmotor(flidev_t dev, long steps, long block)
 {
   flifilterfocuserdata_t *fdata;
-  long dir, timeout, move, stepsleft;
+  long dir, move, r;
   long rlen, wlen;
   unsigned short buf[16];
 	iobuf_t _buf[IOBUF_MAX_SIZ];
-	clock_t begin;
 
   fdata = DEVICE->device_data;
 
@@ -949,6 +1265,7 @@ static long fli_stepmotor(flidev_t dev, long steps, long block)
 				debug(FLIDEBUG_WARN, "Invalid echo.");
 				return -EIO;
 			}
+			fdata->movekind = FLI_MOVE_NONE;
 			return 0;
 		}
 
@@ -962,7 +1279,6 @@ static long fli_stepmotor(flidev_t dev, long steps, long block)
 				move = steps;
 
 			steps -= move;
-			timeout = (move / fdata->stepspersec) + 2;
 
 			rlen = 2;
 			wlen = 2;
@@ -1032,25 +1348,9 @@ static long fli_stepmotor(flidev_t dev, long steps, long block)
 				}
 			}
 
-			begin = clock();
-			stepsleft = 0;
-			while ( (stepsleft != 0x7000) && (block != 0) )
-			{
-	#ifdef _WIN32
-				Sleep(100);
-	#else
-				usleep(100000);
-	#endif
-				buf[0] = htons(0x7000);
-				IO(dev, buf, &wlen, &rlen);
-				stepsleft = ntohs(buf[0]);
-
-				if (((clock() - begin) / CLOCKS_PER_SEC) > (clock_t)timeout)
-				{
-					debug(FLIDEBUG_WARN, "A device timeout has occurred.");
-					return -EIO;
-				}
-			}
+			fli_move_begin(dev, FLI_MOVE_STEPS, fli_steps_msec(fdata, move));
+			if ((block != 0) && ((r = fli_move_wait(dev, -1)) != 0))
+				return r;
 		}
 	}
 	else /* Newer firmware */
@@ -1090,27 +1390,9 @@ static long fli_stepmotor(flidev_t dev, long steps, long block)
 			return -EIO;
 		}
 
-		stepsleft = -1;
-		while ( (stepsleft != 0) && (block != 0) )
-		{
-#ifdef _WIN32
-			Sleep(100);
-#else
-			usleep(100000);
-#endif
-			CLEARIO;
-			wlen = 12; rlen = 12;
-			IOWRITE_U16(_buf, 0, 0x7000);
-			IO(dev, _buf, &wlen, &rlen);
-			IOREAD_U32(_buf, 0, stepsleft);
-			stepsleft &= 0x00ffffff;
-
-//			if (((clock() - begin) / CLOCKS_PER_SEC) > timeout)
-//			{
-//				debug(FLIDEBUG_WARN, "A device timeout has occurred.");
-//				return -EIO;
-//			}
-		}
+		fli_move_begin(dev, FLI_MOVE_STEPS, fli_steps_msec(fdata, steps));
+		if ((block != 0) && ((r = fli_move_wait(dev, -1)) != 0))
+			return r;
 	}
   return 0;
 }
@@ -1124,16 +1406,19 @@ static long fli_getsteppos(flidev_t dev, long *pos)
 	/* Pre-Atlas */
 	if ((DEVICE->devinfo.fwrev & 0x00ff) < 0x40)
 	{
-		rlen = 2; wlen = 2;
+		long r;
+
+		/* Both halves in one round trip where the port allows */
 		buf[0] = htons(0x6000);
-		IO(dev, buf, &wlen, &rlen);
-		poslow = ntohs(buf[0]);
+		buf[1] = htons(0x6001);
+		if ((r = fli_io_batch(dev, buf, 2, buf + 2, 2, 2)) != 0)
+			return r;
+
+		poslow = ntohs(buf[2]);
 		if ((poslow & 0xf000) != 0x6000)
 			return -EIO;
 
-		buf[0] = htons(0x6001);
-		IO(dev, buf, &wlen, &rlen);
-		poshigh = ntohs(buf[0]);
+		poshigh = ntohs(buf[3]);
 		if ((poshigh & 0xf000) != 0x6000)
 			return -EIO;
 
@@ -1245,13 +1530,12 @@ static long fli_homedevice(flidev_t dev, long block)
 
 			COMMAND(fli_stepmotor(dev, - (wheeldata[fdata->tableindex].n_offset), FLI_BLOCK));
 			fdata->currentslot = 0;
+			fdata->slotunsure = 0;
 		}
 	}
 	else /* New HW */
 	{
-		clock_t begin;
-		FLI_UNUSED(begin);
-		unsigned short stepsleft;
+		long r;
 
 		rlen = 2; wlen = 2;
 		buf[0] = htons((unsigned short) 0xf000);
@@ -1261,20 +1545,13 @@ static long fli_homedevice(flidev_t dev, long block)
 			debug(FLIDEBUG_WARN, "Invalid echo.");
 			return -EIO;
 		}
-		begin = clock();
-		stepsleft = 0x04;
-		while ( ((stepsleft & 0x04) != 0) && (block != 0) )
-		{
-#ifdef _WIN32
-			Sleep(100);
-#else
-			usleep(100000);
-#endif
-		buf[0] = htons(0xb000);
-    IO(dev, buf, &wlen, &rlen);
-    stepsleft = ntohs(buf[0]);
-	  }
+
+		/* How far it is from home is not known */
+		fli_move_begin(dev, FLI_MOVE_HOME, 0);
+		if ((block != 0) && ((r = fli_move_wait(dev, -1)) != 0))
+			return r;
 		fdata->currentslot = 0;
+		fdata->slotunsure = 0;
 	}
 
 	return 0;
@@ -1323,11 +1600,24 @@ static long fli_getstepperstatus(flidev_t dev, flistatus_t *status)
 }
 
 static long fli_setfilterpos(flidev_t dev, long pos)
+{
+	long r;
+
+	if ((r = fli_filter_move_start(dev, pos)) != 0)
+		return r;
+
+	return fli_move_wait(dev, -1);
+}
+
+/* Sends the wheel on its way to pos and returns, fli_move_wait()
+	 completes the move. Older hardware is stepped there before this
+	 returns, as is a wheel that has to be homed first. */
+static long fli_filter_move_start(flidev_t dev, long pos)
 {
   flifilterfocuserdata_t *fdata;
   long rlen, wlen;
 //  unsigned short buf[16];
-  long move, i, steps;
+  long r;
 
   fdata = DEVICE->device_data;
 
@@ -1335,6 +1625,10 @@ static long fli_setfilterpos(flidev_t dev, long pos)
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
 #endif
 
+	/* One move at a time */
+	if ((r = fli_move_wait(dev, -1)) != 0)
+		return r;
+
 	if (pos == FLI_FILTERPOSITION_HOME)
 	  fdata->currentslot = FLI_FILTERPOSITION_HOME;
 
@@ -1346,39 +1640,29 @@ static long fli_setfilterpos(flidev_t dev, long pos)
   if (pos == FLI_FILTERPOSITION_HOME)
     return 0;
 
+	/* Nothing to do unless the wheel was stepped or switched since */
+	if ((pos == fdata->currentslot) && (fdata->slotunsure == 0))
+		return 0;
+
 	/* This is for very old hardware, let's not tread here too much */
 	if (fdata->hwtype < 0xfe)
 	{
 		if (pos >= fdata->numslots)
 		{
-			debug(FLIDEBUG_WARN, "Requested slot (%d) exceeds number of slots.", pos);
+			debug(FLIDEBUG_WARN, "Requested slot (%ld) exceeds number of slots.", pos);
 			return -EINVAL;
 		}
 
-		if (pos == fdata->currentslot)
-			return 0;
-
-		move = pos - fdata->currentslot;
-
-		if (move < 0)
-			move += fdata->numslots;
-
-		steps = 0;
-		if (fdata->numslots != 0)
-			for (i=0; i < move; i++)
-				steps += wheeldata[fdata->tableindex].n_steps[i % fdata->numslots];
-
-		debug(FLIDEBUG_INFO, "Move filter wheel %d steps.", steps);
-
-		if (steps != 0)
-			COMMAND(fli_stepmotor(dev, - (steps), FLI_BLOCK));
+		COMMAND(fli_filter_step_to(dev, pos));
 		fdata->currentslot = pos;
+		fdata->slotunsure = 0;
 	}
 	else /* This is for newer hardware. The newer hardware is in general asynchronous
 			 which is a good thing, this allows this function to also be asyncronous... */
 	{
 		unsigned short stepsleft;
 		iobuf_t _buf[IOBUF_MAX_SIZ];
+		long nslots = fdata->numslots;
 		CLEARIO;
 
 		if ( ((DEVICE->devinfo.fwrev & 0x00ff) < 0x43) || /* Older style CFW */
@@ -1386,14 +1670,10 @@ static long fli_setfilterpos(flidev_t dev, long pos)
 		{
 			if (pos >= fdata->numslots)
 			{
-				debug(FLIDEBUG_WARN, "Requested slot (%d) exceeds number of slots.", pos);
+				debug(FLIDEBUG_WARN, "Requested slot (%ld) exceeds number of slots.", pos);
 				return -EINVAL;
 			}
 
-			/* We shouldn't need to double check that we are at that slot. */
-//			if (pos == fdata->currentslot)
-//				return 0;
-
 			wlen = 2; rlen = 2;
 			IOWRITE_U16(_buf, 0, (0xc000 | (unsigned short) pos));
 			IO(dev, _buf, &wlen, &rlen);
@@ -1414,7 +1694,7 @@ static long fli_setfilterpos(flidev_t dev, long pos)
 			{
 				if (pos >= fdata->numslotswheel[0])
 				{
-					debug(FLIDEBUG_WARN, "Requested slot (%d) exceeds number of slots.", pos);
+					debug(FLIDEBUG_WARN, "Requested slot (%ld) exceeds number of slots.", pos);
 				}
 
 				IOWRITE_U8(_buf, 2, pos);
@@ -1424,33 +1704,179 @@ static long fli_setfilterpos(flidev_t dev, long pos)
 			{
 				if (pos >= fdata->numslotswheel[1])
 				{
-					debug(FLIDEBUG_WARN, "Requested slot (%d) exceeds number of slots.", pos);
+					debug(FLIDEBUG_WARN, "Requested slot (%ld) exceeds number of slots.", pos);
 				}
 
 				IOWRITE_U8(_buf, 2, FLI_FILTER_POSITION_UNKNOWN);
 				IOWRITE_U8(_buf, 3, pos);
 			}
 
+			nslots = fdata->numslotswheel[fdata->activewheel & 0x01];
 			IO(dev, _buf, &wlen, &rlen);
 		}
 
-		stepsleft = 0;
+		/* The wheel turns one way, count the slots it passes */
+		if ((nslots > 0) && (fdata->currentslot >= 0))
+			fdata->moveslots = (pos - fdata->currentslot + nslots) % nslots;
+		else
+			fdata->moveslots = nslots / 2;
+
+		fdata->movetarget = pos;
+		fli_move_begin(dev, FLI_MOVE_SLOT, fdata->moveslots *
+			((fdata->msperslot > 0)?fdata->msperslot:FLI_FILTER_MSPERSLOT));
+	}
+  return 0;
+}
+
+/* Steps an older wheel from the current slot to pos. These wheels have
+	 no notion of direction of their own, so the table of steps between
+	 slots is walked both ways and, when a backlash has been configured,
+	 the shorter way is taken. Turning backwards overshoots by the backlash and comes forward again so the
+	 wheel always settles from the same side. */
+static long fli_filter_step_to(flidev_t dev, long pos)
+{
+  flifilterfocuserdata_t *fdata;
+	long n, k, i, fwd, back;
+	const int *table;
+
+  fdata = DEVICE->device_data;
+	n = fdata->numslots;
+	table = wheeldata[fdata->tableindex].n_steps;
+
+	if (n <= 0)
+		return 0;
+
+	/* Slot i is table[i] steps from slot i + 1 */
+	k = (pos - fdata->currentslot + n) % n;
+	fwd = 0;
+	for (i = 0; i < k; i++)
+		fwd += table[(fdata->currentslot + i) % n];
+
+	back = 0;
+	for (i = 0; i < n - k; i++)
+		back += table[(fdata->currentslot - 1 - i + 2 * n) % n];
+
+	if ((k == 0) || (fdata->backlash < 0) ||
+		(back + 2 * fdata->backlash >= fwd))
+	{
+		debug(FLIDEBUG_INFO, "Move filter wheel %ld steps.", fwd);
+
+		if (fwd != 0)
+			COMMAND(fli_stepmotor(dev, - (fwd), FLI_BLOCK));
+		return 0;
+	}
+
+	debug(FLIDEBUG_INFO, "Move filter wheel %ld steps back instead of %ld forward.",
+		back, fwd);
+
+	COMMAND(fli_stepmotor(dev, back + fdata->backlash, FLI_BLOCK));
+	if (fdata->backlash > 0)
+		COMMAND(fli_stepmotor(dev, - (fdata->backlash), FLI_BLOCK));
+
+	return 0;
+}
+
+/* Starts both wheels of a multi-wheel unit with one command so their
+	 moves overlap, pos holds a slot per physical wheel. Wheels given a
+	 negative slot or already in place are left alone. fli_move_wait()
+	 completes the move, which lasts as long as the longest of them. */
+static long fli_filter_move_wheels(flidev_t dev, long *pos, long n)
+{
+  flifilterfocuserdata_t *fdata;
+	iobuf_t _buf[IOBUF_MAX_SIZ];
+	long rlen, wlen, r, w, at[2], slots;
+	unsigned char target[2];
+	int moving = 0;
+
+  fdata = DEVICE->device_data;
+
+	/* Only units with individual wheel control */
+	if ((fdata->hwtype < 0xfe) || ((DEVICE->devinfo.fwrev & 0x00ff) < 0x43))
+		return -EINVAL;
+
+	if ((pos == NULL) || (n < 1) || (n > fdata->numwheels) || (n > 2))
+		return -EINVAL;
+
+	for (w = 0; w < n; w++)
+	{
+		if (pos[w] >= fdata->numslotswheel[w])
+		{
+			debug(FLIDEBUG_WARN, "Requested slot (%ld) exceeds number of slots.", pos[w]);
+			return -EINVAL;
+		}
+	}
+
+	/* One move at a time */
+	if ((r = fli_move_wait(dev, -1)) != 0)
+		return r;
+
+  if (fdata->currentslot < 0)
+  {
+		fli_homedevice(dev, FLI_BLOCK);
+	}
+
+	/* Where each wheel stands now */
+	CLEARIO;
+	wlen = 12; rlen = 12;
+	IOWRITE_U16(_buf, 0, 0x6000);
+	IO(dev, _buf, &wlen, &rlen);
+	IOREAD_U8(_buf, 10, at[0]);
+	IOREAD_U8(_buf, 11, at[1]);
+
+	fdata->moveslots = 0;
+	for (w = 0; w < 2; w++)
+	{
+		target[w] = FLI_FILTER_POSITION_UNKNOWN;
+		if ((w >= n) || (pos[w] < 0) || (pos[w] == at[w]))
+			continue;
+
+		target[w] = (unsigned char) pos[w];
+		moving = 1;
+
+		/* Each wheel turns one way, count the slots it passes */
+		if (at[w] < fdata->numslotswheel[w])
+			slots = (pos[w] - at[w] + fdata->numslotswheel[w]) % fdata->numslotswheel[w];
+		else
+			slots = fdata->numslotswheel[w] / 2;
+
+		if (slots > fdata->moveslots)
+			fdata->moveslots = slots;
+	}
 
-		while (stepsleft != 0x7000)
+	/* The active wheel is known once the move ends, a table indexed
+		 wheel has to be read back */
+	fdata->movetarget = -1;
+	fdata->slotunsure = 1;
+	if (fdata->activewheel & FLI_FILTER_WHEEL_PHYSICAL)
+	{
+		w = fdata->activewheel & 0x01;
+		fdata->movetarget = ((w < n) && (pos[w] >= 0))? pos[w]: at[w];
+	}
+
+	if (moving == 0)
+	{
+		if (fdata->movetarget >= 0)
 		{
-#ifdef _WIN32
-			Sleep(100);
-#else
-			usleep(100000);
-#endif
-			CLEARIO;
-			wlen = 2; rlen = 2;
-			IOWRITE_U16(_buf, 0, 0x7000);
-			IO(dev, _buf, &wlen, &rlen);
-			IOREAD_U16(_buf, 0, stepsleft);
+			fdata->currentslot = fdata->movetarget;
+			fdata->slotunsure = 0;
 		}
-		fdata->currentslot = pos;
+		return 0;
 	}
+
+	debug(FLIDEBUG_INFO, "Move wheels to %d and %d.",
+		(target[0] == FLI_FILTER_POSITION_UNKNOWN)? -1: target[0],
+		(target[1] == FLI_FILTER_POSITION_UNKNOWN)? -1: target[1]);
+
+	CLEARIO;
+	wlen = 4; rlen = 2;
+	IOWRITE_U16(_buf, 0, 0xc000);
+	IOWRITE_U8(_buf, 2, target[0]);
+	IOWRITE_U8(_buf, 3, target[1]);
+	IO(dev, _buf, &wlen, &rlen);
+
+	fli_move_begin(dev, FLI_MOVE_SLOT, fdata->moveslots *
+		((fdata->msperslot > 0)?fdata->msperslot:FLI_FILTER_MSPERSLOT));
+
   return 0;
 }
 
@@ -1489,7 +1915,7 @@ long fli_focuser_readtemperature(flidev_t dev, flichannel_t channel, double *tem
 
 	if (channel > fdata->numtempsensors)
 	{
-		debug(FLIDEBUG_WARN, "Device has %d channels, %d channel requested.", fdata->numtempsensors, channel);
+		debug(FLIDEBUG_WARN, "Device has %ld channels, %ld channel requested.", fdata->numtempsensors, channel);
 			return -EINVAL;
 	}
 
@@ -1585,19 +2011,29 @@ static long fli_getfiltername(flidev_t dev, long filter, char *name, size_t len)
 		/* Ok, we need to download information from the filter wheel */
 		if (fdata->nameinfobuf == NULL)
 		{
+			char tag[64];
+
 			/* Allocate the storage */
 		  if ((fdata->nameinfobuf = xmalloc(1024)) == NULL)
 			{
 				r = -ENOMEM;
 				goto done;
 			}
-			
-			debug(FLIDEBUG_INFO, "Downloading name table from filter wheel.");
-			if ((r = fli_filter_focuser_read_flash(dev, 0x3000, 1024, fdata->nameinfobuf)) != 0)
+
+			/* The table is laid out by the slot counts */
+			snprintf(tag, sizeof(tag), "slots=%ld/%ld/%ld", fdata->numslots,
+				fdata->numslotswheel[0], fdata->numslotswheel[1]);
+
+			if (fli_flash_cache_load(dev, 0x3000, 1024, tag, fdata->nameinfobuf) != 0)
 			{
-				xfree(fdata->nameinfobuf);
-				fdata->nameinfobuf = NULL;
-				goto done;
+				debug(FLIDEBUG_INFO, "Downloading name table from filter wheel.");
+				if ((r = fli_filter_focuser_read_flash(dev, 0x3000, 1024, fdata->nameinfobuf)) != 0)
+				{
+					xfree(fdata->nameinfobuf);
+					fdata->nameinfobuf = NULL;
+					goto done;
+				}
+				fli_flash_cache_save(dev, 0x3000, 1024, tag, fdata->nameinfobuf);
 			}
 		}
 
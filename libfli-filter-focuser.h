@@ -62,6 +62,17 @@ typedef struct _flifilterfocuserdata_t {
 	long numwheels;
 	long numslotswheel[2];
 	char *nameinfobuf;
+	long flashchunk;		/* Bytes per flash read, zero until one is made */
+	long backlash;		/* Steps, older wheels turning backwards; negative for forward only */
+	long slotunsure;		/* Stepped or switched since currentslot was reached */
+
+	/* Move in progress, see fli_move_begin() */
+	long movekind;
+	long movetarget;		/* Filter slot */
+	long moveslots;
+	long moveexpect;		/* msec */
+	uint64_t movestart;		/* nsec */
+	long msperslot;		/* Timed from past moves, zero until one ends */
 } flifilterfocuserdata_t;
 
 typedef struct {
@@ -0,0 +1,175 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+#include "libfli-flashcache.h"
+#include "libfli-keyfile.h"
+
+/* Longest line: key, tag and the table in hex */
+#define FLASH_LINE_MAX (512 + 2 * FLI_FLASH_CACHE_MAX)
+
+/* <serial>@<fwrev>:<address>, or nothing for devices that can't be told
+ * apart or whose transfers are being replayed */
+static long flash_key(flidev_t dev, long address, char *key, size_t len)
+{
+  char *p;
+
+  if ((DEVICE->devinfo.serial == NULL) || (DEVICE->devinfo.serial[0] == '\0') ||
+    ((DEVICE->trace != NULL) && (DEVICE->trace->replay != NULL)))
+    return -ENOENT;
+
+  snprintf(key, len, "%s@%04lx:%04lx", DEVICE->devinfo.serial,
+    DEVICE->devinfo.fwrev, address);
+  for (p = key; *p != '\0'; p++)
+    if (isspace((unsigned char) *p))
+      *p = '_';
+
+  return 0;
+}
+
+static int flash_enabled(int load)
+{
+  char *env;
+
+  if ((env = getenv("FLI_FLASH_CACHE")) == NULL)
+    return 1;
+  if (strcmp(env, "off") == 0)
+    return 0;
+  if (strcmp(env, "refresh") == 0)
+    return !load;
+
+  debug(FLIDEBUG_WARN, "Ignoring FLI_FLASH_CACHE=%s", env);
+  return 1;
+}
+
+/* One line per table: <key> <tag> <length> <hex> */
+long fli_flash_cache_load(flidev_t dev, long address, long length,
+  const char *tag, void *buf)
+{
+  char path[1024], key[128], lkey[128], ltag[128], *line, *hex;
+  unsigned char *b = buf;
+  FILE *f;
+  long llen, i, r = -ENOENT;
+  int n;
+
+  if ((length <= 0) || (length > FLI_FLASH_CACHE_MAX) || !flash_enabled(1) ||
+    (flash_key(dev, address, key, sizeof(key)) != 0) ||
+    (fli_keyfile_path("FLI_FLASH_CACHE_FILE", FLI_FLASH_CACHE_FILE_DEFAULT,
+    path, sizeof(path)) == NULL))
+    return -ENOENT;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return -ENOENT;
+
+  if ((line = xmalloc(FLASH_LINE_MAX)) == NULL)
+  {
+    fclose(f);
+    return -ENOMEM;
+  }
+
+  while ((r != 0) && (fgets(line, FLASH_LINE_MAX, f) != NULL))
+  {
+    if ((sscanf(line, "%127s %127s %ld %n", lkey, ltag, &llen, &n) != 3) ||
+      (strcmp(lkey, key) != 0) || (strcmp(ltag, tag) != 0) ||
+      (llen != length))
+      continue;
+
+    hex = line + n;
+    for (i = 0; i < length; i++)
+    {
+      unsigned int v;
+
+      if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+        break;
+      b[i] = (unsigned char) v;
+    }
+    if (i == length)
+      r = 0;
+  }
+
+  xfree(line);
+  fclose(f);
+
+  if (r == 0)
+    debug(FLIDEBUG_INFO, "Flash %s read from %s", key, path);
+
+  return r;
+}
+
+long fli_flash_cache_save(flidev_t dev, long address, long length,
+  const char *tag, const void *buf)
+{
+  char path[1024], key[128], *line;
+  const unsigned char *b = buf;
+  long i, r;
+  int n;
+
+  if ((length <= 0) || (length > FLI_FLASH_CACHE_MAX) || !flash_enabled(0) ||
+    (flash_key(dev, address, key, sizeof(key)) != 0) ||
+    (fli_keyfile_path("FLI_FLASH_CACHE_FILE", FLI_FLASH_CACHE_FILE_DEFAULT,
+    path, sizeof(path)) == NULL))
+    return -ENOENT;
+
+  if ((line = xmalloc(FLASH_LINE_MAX)) == NULL)
+    return -ENOMEM;
+
+  n = snprintf(line, FLASH_LINE_MAX, "%s %s %ld ", key, tag, length);
+  for (i = 0; i < length; i++)
+    n += snprintf(line + n, FLASH_LINE_MAX - n, "%02x", b[i]);
+  snprintf(line + n, FLASH_LINE_MAX - n, "\n");
+
+  r = fli_keyfile_put(path, key, line, FLASH_LINE_MAX);
+  xfree(line);
+
+  return r;
+}
@@ -0,0 +1,71 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifndef _LIBFLI_FLASHCACHE_H_
+#define _LIBFLI_FLASHCACHE_H_
+
+/* Device flash cache
+ *
+ * Tables a device keeps in flash, such as the filter names of a CFW,
+ * take many small reads to download but only change when the device
+ * is reprogrammed. Each table read is stored in a file keyed by serial
+ * number, firmware revision and address, together with a tag naming
+ * what the table was read against (for a filter wheel, its slot
+ * counts), so reopening the device reads it from disk. A stored table
+ * is only used while its tag matches.
+ *
+ * FLI_FLASH_CACHE=off disables this, FLI_FLASH_CACHE=refresh reads
+ * every table from the device again, as is needed after renaming
+ * filters. FLI_FLASH_CACHE_FILE names the file, by default ~/.fliflash.
+ */
+
+#define FLI_FLASH_CACHE_FILE_DEFAULT ".fliflash"
+#define FLI_FLASH_CACHE_MAX (4096)	/* Largest table stored */
+
+long fli_flash_cache_load(flidev_t dev, long address, long length,
+  const char *tag, void *buf);
+long fli_flash_cache_save(flidev_t dev, long address, long length,
+  const char *tag, const void *buf);
+
+#endif /* _LIBFLI_FLASHCACHE_H_ */
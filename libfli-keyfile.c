@@ -0,0 +1,151 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-keyfile.h"
+
+#ifdef _WIN32
+#define KEYFILE_NEXT(p) InterlockedIncrement(p)
+#else
+#define KEYFILE_NEXT(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+static volatile long keyfile_seq;
+
+/* The file named by the environment variable env, else name in the
+ * home directory */
+char *fli_keyfile_path(const char *env, const char *name, char *path,
+  size_t len)
+{
+  char *home;
+
+  if ((home = getenv(env)) != NULL)
+  {
+    snprintf(path, len, "%s", home);
+    return path;
+  }
+
+  if (((home = getenv("HOME")) == NULL) &&
+    ((home = getenv("USERPROFILE")) == NULL))
+    return NULL;
+
+  snprintf(path, len, "%s/%s", home, name);
+
+  return path;
+}
+
+/* Replace the line of key with line, which must start with the key and
+ * end in a newline. Lines are at most linemax bytes. */
+long fli_keyfile_put(const char *path, const char *key, const char *line,
+  size_t linemax)
+{
+  char tmp[1100], *buf;
+  size_t klen = strlen(key);
+  FILE *in, *out;
+  int err;
+
+  /* Unique to this process and call */
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld.%ld.tmp", path, (long) getpid(),
+    (long) KEYFILE_NEXT(&keyfile_seq)) >= (int) sizeof(tmp))
+    return -EOVERFLOW;
+
+  if ((buf = xmalloc(linemax)) == NULL)
+    return -ENOMEM;
+
+  if ((out = fopen(tmp, "w")) == NULL)
+  {
+    err = errno;
+    debug(FLIDEBUG_WARN, "Could not write %s", tmp);
+    xfree(buf);
+    return -err;
+  }
+
+  /* Keep every other key's line */
+  if ((in = fopen(path, "r")) != NULL)
+  {
+    while (fgets(buf, linemax, in) != NULL)
+    {
+      if ((strncmp(buf, key, klen) == 0) &&
+        ((buf[klen] == ' ') || (buf[klen] == '\t') || (buf[klen] == '\n')))
+        continue;
+      fputs(buf, out);
+    }
+    fclose(in);
+  }
+  xfree(buf);
+
+  fputs(line, out);
+  if (fclose(out) != 0)
+  {
+    remove(tmp);
+    return -EIO;
+  }
+
+#ifdef _WIN32
+  remove(path);
+#endif
+  if (rename(tmp, path) != 0)
+  {
+    err = errno;
+    remove(tmp);
+    return -err;
+  }
+
+  return 0;
+}
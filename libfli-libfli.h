@@ -48,6 +48,7 @@
 //#define BADCOLUMN
 
 #include <string.h>
+#include <stdint.h>
 
 #ifdef DEFINELONG
 #define LIBFLIAPI long __stdcall
@@ -58,6 +59,7 @@
 //#define LIBFLIAPI __declspec(dllexport) long __stdcall
 #endif
 #define stricmp _stricmp
+#define strcasecmp _stricmp
 #endif
 
 #include "libfli.h"
@@ -77,20 +79,30 @@
 
 #define CHKDEVICE(xdev)				\
   do {								\
-    if((xdev < 0) || (xdev >= MAX_OPEN_DEVICES))		\
+    if(!fli_dev_valid(xdev))					\
     {								\
       debug(FLIDEBUG_WARN,					\
-	    "[%s] Attempt to use a device out of range (%d)", __FUNCTION__, xdev);	\
+	    "[%s] Attempt to use an invalid or closed device (%ld)",	\
+	    __FUNCTION__, (long) (xdev));				\
       return -EINVAL;						\
     }								\
-    if(devices[xdev] == NULL)					\
+  } while(0)
+
+/* As CHKDEVICE, for API entry points: also holds off a close of the
+   device until the call returns through LEAVEDEVICE() */
+#define ENTERDEVICE(xdev)					\
+  do {								\
+    if(!fli_dev_get(xdev))					\
     {								\
       debug(FLIDEBUG_WARN,					\
-	    "[%s] Attempt to use a NULL device (%d)", __FUNCTION__, xdev);		\
+	    "[%s] Attempt to use an invalid or closed device (%ld)",	\
+	    __FUNCTION__, (long) (xdev));				\
       return -EINVAL;						\
     }								\
   } while(0)
 
+#define LEAVEDEVICE(xdev, r) fli_dev_put((xdev), (r))
+
 #define CHKFUNCTION(func)					\
   do {								\
     if(func == NULL)						\
@@ -104,7 +116,7 @@
 #define IO(dev, buf, wlen, rlen)				\
   do {								\
     int err;							\
-    if((err = devices[dev]->fli_io(dev, buf, wlen, rlen)))	\
+    if((err = FLI_DEVICE(dev)->fli_io(dev, buf, wlen, rlen)))	\
     {								\
       debug(FLIDEBUG_WARN, "Communication error: %d [%s]",	\
 	    err, strerror(-err));				\
@@ -155,7 +167,17 @@ typedef unsigned char iobuf_t;
 #define FLIUSB_PDF2_ID 0x0c
 #define FLIUSB_GUIDER_ID 0x0d
 
-#define MAX_OPEN_DEVICES (32)
+/* A device handle holds the index of the device's slot in its low
+ * bits and the slot's generation above them, so the handle of a
+ * closed device stays invalid when the slot is reused. Slots are kept
+ * in pages that are added as devices are opened and never move or go
+ * away, so a handle is looked up without taking a lock. */
+#define FLI_HANDLE_INDEX_BITS (16)
+#define FLI_HANDLE_PAGE_BITS (6)
+#define FLI_HANDLE_PAGE_SIZE (1 << FLI_HANDLE_PAGE_BITS)
+#define FLI_HANDLE_PAGES (1 << (FLI_HANDLE_INDEX_BITS - FLI_HANDLE_PAGE_BITS))
+#define FLI_HANDLE_GEN_MAX (0x7fff)
+#define FLI_HANDLE_INDEX(h) ((h) & ((1L << FLI_HANDLE_INDEX_BITS) - 1))
 #define MAX_SEARCH_LIST (16)
 
 #ifndef MIN
@@ -172,10 +194,16 @@ typedef struct _flidevinfo_t {
   char *model;
   char *devnam;
 	char *serial;
+  char *buspath;		/* Physical port, e.g. "1-2.4", may be NULL */
 } flidevinfo_t;
 
 /* A specific device instance */
 typedef struct _flidevdesc_t {
+  volatile long handle;		/* Handle of the open device, 0 if free */
+  long gen;			/* Generation of the last handle */
+  volatile long closing;	/* Set once a close has started */
+  volatile long inflight;	/* API calls under way, see fli_dev_get() */
+
   char *name;			/* The device name */
   long domain;			/* The device's domain */
   flidevinfo_t devinfo;		/* Device information */
@@ -183,6 +211,13 @@ typedef struct _flidevdesc_t {
   void *io_data;		/* For holding I/O specific data */
   void *device_data;		/* For holding device specific data */
   void *sys_data;		/* For holding system specific data */
+  struct _fli_trace_t *trace;	/* USB transaction trace, may be NULL */
+  struct _fli_sim_t *sim;	/* Simulated camera, may be NULL */
+  struct _fli_tune_t *tune;	/* Transfer tuning, may be NULL */
+  struct _fli_arena_t *arena;	/* Metadata, released on close */
+  flidevstats_t stats;		/* See FLIGetDeviceStats() */
+  long tx_depth;		/* Nesting of fli_tx_begin(), under the lock */
+  uint64_t tx_start;		/* When the outermost transaction began */
 
   /* System-specific functions */
   long (*fli_lock)(flidev_t dev);
@@ -191,6 +226,13 @@ typedef struct _flidevdesc_t {
 
   /* Domain-specific functions */
   long (*fli_io)(flidev_t dev, void *buf, long *wlen, long *rlen);
+  long (*fli_io_batch)(flidev_t dev, void *wbuf, long wlen,
+    void *rbuf, long rlen, long n); /* May be NULL */
+  long (*fli_bulk)(flidev_t dev, int ep, void *buf, long *len);
+  void *(*fli_dev_mem_alloc)(flidev_t dev, size_t len); /* May be NULL */
+  void (*fli_dev_mem_free)(flidev_t dev, void *buf, size_t len);
+  long (*fli_queue_depth)(flidev_t dev, long depth); /* Sets it if > 0, may be NULL */
+  long bulk_max;		/* Largest transfer fli_bulk makes in one piece, 0 if any */
 
   /* Device-specific functions */
   long (*fli_open)(flidev_t dev);
@@ -198,10 +240,28 @@ typedef struct _flidevdesc_t {
   long (*fli_command)(flidev_t dev, int cmd, int argc, ...);
 } flidevdesc_t;
 
+int fli_devinfo_match(fli_devinfo_t *info, char *serial, char *model);
+long fli_tx_begin(flidev_t dev);
+long fli_tx_end(flidev_t dev);
+long fli_io_batch(flidev_t dev, void *wbuf, long wlen, void *rbuf, long rlen,
+  long n);
+void *fli_dev_alloc(flidev_t dev, size_t size);
+char *fli_dev_strndup(flidev_t dev, const char *s, size_t siz);
+char *fli_dev_strdup(flidev_t dev, const char *s);
+void fli_dev_free(flidev_t dev, void *ptr);
+
 extern const char* version;
 
-extern flidevdesc_t *devices[MAX_OPEN_DEVICES];
-#define DEVICE devices[dev]
+extern flidevdesc_t *fli_devpages[FLI_HANDLE_PAGES];
+int fli_dev_valid(flidev_t dev);
+int fli_dev_get(flidev_t dev);
+long fli_dev_put(flidev_t dev, long r);
+
+/* Only for handles that passed CHKDEVICE */
+#define FLI_DEVICE(d) \
+  (&fli_devpages[FLI_HANDLE_INDEX(d) >> FLI_HANDLE_PAGE_BITS] \
+   [FLI_HANDLE_INDEX(d) & (FLI_HANDLE_PAGE_SIZE - 1)])
+#define DEVICE FLI_DEVICE(dev)
 
 /* Device commands, the format is FLI_COMMAND(<command name>, <number of args>) */
 #define FLI_COMMANDS				\
@@ -265,6 +325,11 @@ extern flidevdesc_t *devices[MAX_OPEN_DEVICES];
 	FLI_COMMAND(FLI_READ_EEPROM, 4) \
 	FLI_COMMAND(FLI_WRITE_EEPROM, 4) \
 	FLI_COMMAND(FLI_GET_FILTER_NAME, 3) \
+	FLI_COMMAND(FLI_SET_FILTER_POS_ASYNC, 1) \
+	FLI_COMMAND(FLI_WAIT_FILTER_MOVE, 1) \
+	FLI_COMMAND(FLI_WAIT_STEP_MOTOR, 1) \
+	FLI_COMMAND(FLI_GET_MOVE_TIME_REMAINING, 1) \
+	FLI_COMMAND(FLI_SET_WHEEL_POSITIONS_ASYNC, 2) \
 
 /* Enumerate the commands */
 enum _commands {
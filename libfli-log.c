@@ -0,0 +1,530 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+#include "libfli-log.h"
+
+/* Records are published as in the transaction trace: a record is valid
+ * once its sequence number is stored, and a reader discards any record
+ * whose sequence number changed while it was copied. Only the owning
+ * thread writes a ring, so claiming a slot needs no atomic add. */
+#ifdef _WIN32
+#define LOG_THREAD __declspec(thread)
+#define LOG_LOAD(p) ((uint64_t) InterlockedCompareExchange64((volatile LONG64 *) (p), 0, 0))
+#define LOG_STORE(p, v) InterlockedExchange64((volatile LONG64 *) (p), (LONG64) (v))
+#define LOG_FENCE() MemoryBarrier()
+#define LOG_NEXT(p) InterlockedIncrement((volatile LONG *) (p))
+#define LOG_HEAD(p) ((fli_log_ring_t *) InterlockedCompareExchangePointer((PVOID volatile *) (p), NULL, NULL))
+#define LOG_PUSH(p, old, new) \
+  (InterlockedCompareExchangePointer((PVOID volatile *) (p), (new), (old)) == (old))
+#define LOG_CLAIM(p) (InterlockedCompareExchange((p), 1, 0) == 0)
+#define LOG_RELEASE(p) InterlockedExchange((p), 0)
+#else
+#define LOG_THREAD __thread
+#define LOG_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOG_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOG_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define LOG_NEXT(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define LOG_HEAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOG_PUSH(p, old, new) \
+  __atomic_compare_exchange_n((p), &(old), (new), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#define LOG_CLAIM(p) __sync_bool_compare_and_swap((p), 0, 1)
+#define LOG_RELEASE(p) __atomic_store_n((p), 0, __ATOMIC_RELEASE)
+#endif
+
+#define LOG_FLAGS "-+ #0123456789."
+
+typedef struct {
+  fli_log_rec_t rec;
+  int32_t thread;
+} log_entry_t;
+
+static fli_log_ring_t *log_rings = NULL;
+static volatile long log_depth = 0;	/* Nonzero while enabled */
+static volatile long log_threads = 0;
+static LOG_THREAD fli_log_ring_t *log_ring = NULL;
+
+#ifdef _WIN32
+static DWORD log_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE log_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_keyed = 0;
+#endif
+
+int fli_log_active(void)
+{
+  return (log_depth > 0);
+}
+
+/* Runs as a thread exits: its ring is left for the next new thread to
+ * claim, with the records in it kept until they are overwritten */
+static void fli_log_release(void *data)
+{
+  fli_log_ring_t *ring = data;
+
+  log_ring = NULL;
+  LOG_RELEASE(&ring->owned);
+}
+
+#ifdef _WIN32
+static VOID WINAPI fli_log_fls(PVOID data)
+{
+  if (data != NULL)
+    fli_log_release(data);
+}
+
+static BOOL CALLBACK fli_log_key_init(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+  log_key = FlsAlloc(fli_log_fls);
+
+  return TRUE;
+}
+#else
+static void fli_log_key_init(void)
+{
+  log_keyed = (pthread_key_create(&log_key, fli_log_release) == 0);
+}
+#endif
+
+/* Rings come from calloc() rather than xcalloc(): the allocator logs,
+ * and xfree_all() must not take a ring from under a running thread.
+ * A ring left by a thread that exited is reused before allocating. */
+static fli_log_ring_t *fli_log_ring(void)
+{
+  fli_log_ring_t *ring;
+  uint32_t n = 16;
+
+  if (log_ring != NULL)
+    return log_ring;
+
+  for (ring = LOG_HEAD(&log_rings); ring != NULL; ring = ring->next)
+    if (LOG_CLAIM(&ring->owned))
+      break;
+
+  if (ring == NULL)
+  {
+    while ((n < (uint32_t) log_depth) && (n < (1u << 20)))
+      n <<= 1;
+
+    if ((ring = calloc(1, sizeof(fli_log_ring_t))) == NULL)
+      return NULL;
+
+    if ((ring->rec = calloc(n, sizeof(fli_log_rec_t))) == NULL)
+    {
+      free(ring);
+      return NULL;
+    }
+
+    ring->mask = n - 1;
+    ring->thread = LOG_NEXT(&log_threads);
+    ring->owned = 1;
+
+    do {
+      ring->next = LOG_HEAD(&log_rings);
+    } while (!LOG_PUSH(&log_rings, ring->next, ring));
+  }
+
+  /* Without a key the ring stays with this thread for good */
+#ifdef _WIN32
+  InitOnceExecuteOnce(&log_once, fli_log_key_init, NULL, NULL);
+  if (log_key != FLS_OUT_OF_INDEXES)
+    FlsSetValue(log_key, ring);
+#else
+  pthread_once(&log_once, fli_log_key_init);
+  if (log_keyed)
+    pthread_setspecific(log_key, ring);
+#endif
+
+  log_ring = ring;
+
+  return ring;
+}
+
+/* Skip flags, width and precision of the conversion after a '%' and
+ * return its conversion character; length is set to the modifier, with
+ * 'H' for hh and 'q' for ll */
+static const char *fli_log_spec(const char *f, char *length)
+{
+  while ((*f != '\0') && (strchr(LOG_FLAGS, *f) != NULL))
+    f++;
+
+  *length = '\0';
+  if ((f[0] == 'h') && (f[1] == 'h'))
+  {
+    *length = 'H';
+    f += 2;
+  }
+  else if ((f[0] == 'l') && (f[1] == 'l'))
+  {
+    *length = 'q';
+    f += 2;
+  }
+  else if ((*f != '\0') && (strchr("hlLjzt", *f) != NULL))
+    *length = *f++;
+
+  return f;
+}
+
+void fli_log_vrecord(int level, const char *format, va_list ap)
+{
+  fli_log_ring_t *ring;
+  fli_log_rec_t *rec;
+  const char *f, *s;
+  uint64_t seq;
+  size_t used = 0, len;
+  char length;
+  int n = 0;
+
+  if ((ring = fli_log_ring()) == NULL)
+    return;
+
+  seq = ring->head;
+  rec = &ring->rec[seq & ring->mask];
+
+  LOG_STORE(&rec->seq, 0);
+  LOG_FENCE();
+
+  rec->ts = fli_trace_now();
+  rec->format = format;
+  rec->level = level;
+
+  /* Take the arguments off the list as printf() would; anything after
+   * a conversion we cannot capture is printed verbatim */
+  for (f = format; (*f != '\0') && (n < FLI_LOG_ARGS); f++)
+  {
+    if (*f != '%')
+      continue;
+    if (*++f == '%')
+      continue;
+
+    f = fli_log_spec(f, &length);
+
+    switch (*f)
+    {
+    case 'd':
+    case 'i':
+      switch (length)
+      {
+      case 'H': rec->arg[n].i = (signed char) va_arg(ap, int); break;
+      case 'h': rec->arg[n].i = (short) va_arg(ap, int); break;
+      case 'l': rec->arg[n].i = va_arg(ap, long); break;
+      case 'q': rec->arg[n].i = va_arg(ap, long long); break;
+      case 'j': rec->arg[n].i = va_arg(ap, intmax_t); break;
+      case 'z':
+      case 't': rec->arg[n].i = va_arg(ap, ptrdiff_t); break;
+      default: rec->arg[n].i = va_arg(ap, int); break;
+      }
+      break;
+
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      switch (length)
+      {
+      case 'H': rec->arg[n].i = (unsigned char) va_arg(ap, unsigned int); break;
+      case 'h': rec->arg[n].i = (unsigned short) va_arg(ap, unsigned int); break;
+      case 'l': rec->arg[n].i = va_arg(ap, unsigned long); break;
+      case 'q': rec->arg[n].i = va_arg(ap, unsigned long long); break;
+      case 'j': rec->arg[n].i = va_arg(ap, uintmax_t); break;
+      case 'z':
+      case 't': rec->arg[n].i = va_arg(ap, size_t); break;
+      default: rec->arg[n].i = va_arg(ap, unsigned int); break;
+      }
+      break;
+
+    case 'c':
+      rec->arg[n].i = va_arg(ap, int);
+      break;
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (length == 'L')
+        rec->arg[n].d = (double) va_arg(ap, long double);
+      else
+        rec->arg[n].d = va_arg(ap, double);
+      break;
+
+    case 's':
+      if ((s = va_arg(ap, const char *)) == NULL)
+        s = "(null)";
+      if (used > FLI_LOG_STRBUF - 1)
+        used = FLI_LOG_STRBUF - 1;
+      len = MIN(strlen(s), FLI_LOG_STRBUF - 1 - used);
+      memcpy(&rec->str[used], s, len);
+      rec->str[used + len] = '\0';
+      rec->arg[n].i = used;
+      used += len + 1;
+      break;
+
+    case 'p':
+      rec->arg[n].p = va_arg(ap, void *);
+      break;
+
+    default:
+      goto done;
+    }
+
+    n++;
+  }
+
+ done:
+  rec->nargs = n;
+
+  LOG_STORE(&rec->seq, seq + 1);
+  LOG_STORE(&ring->head, seq + 1);
+}
+
+long fli_log_enable(long depth)
+{
+  if (depth < 0)
+    return -EINVAL;
+
+  log_depth = depth;
+
+  return 0;
+}
+
+static void fli_log_format(const fli_log_rec_t *rec, char *out, size_t size)
+{
+  const char *f = rec->format, *p;
+  char spec[32], length;
+  size_t o = 0;
+  int n = 0, k, ret;
+
+  while ((*f != '\0') && (o < size - 1))
+  {
+    if ((f[0] == '%') && (f[1] == '%'))
+    {
+      out[o++] = '%';
+      f += 2;
+      continue;
+    }
+
+    if ((*f != '%') || (n >= rec->nargs))
+    {
+      out[o++] = *f++;
+      continue;
+    }
+
+    /* Rebuild the conversion around the widened stored value */
+    k = 0;
+    spec[k++] = '%';
+    for (p = f + 1; (*p != '\0') && (strchr(LOG_FLAGS, *p) != NULL) &&
+      (k < (int) sizeof(spec) - 4); p++)
+      spec[k++] = *p;
+
+    f = fli_log_spec(f + 1, &length);
+
+    switch (*f)
+    {
+    case 'd':
+    case 'i':
+      strcpy(&spec[k], "lld");
+      ret = snprintf(&out[o], size - o, spec, (long long) rec->arg[n].i);
+      break;
+
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      spec[k++] = 'l';
+      spec[k++] = 'l';
+      spec[k++] = *f;
+      spec[k] = '\0';
+      ret = snprintf(&out[o], size - o, spec, (unsigned long long) rec->arg[n].i);
+      break;
+
+    case 'c':
+      strcpy(&spec[k], "c");
+      ret = snprintf(&out[o], size - o, spec, (int) rec->arg[n].i);
+      break;
+
+    case 's':
+      strcpy(&spec[k], "s");
+      ret = snprintf(&out[o], size - o, spec, &rec->str[rec->arg[n].i]);
+      break;
+
+    case 'p':
+      strcpy(&spec[k], "p");
+      ret = snprintf(&out[o], size - o, spec, rec->arg[n].p);
+      break;
+
+    default:
+      spec[k++] = *f;
+      spec[k] = '\0';
+      ret = snprintf(&out[o], size - o, spec, rec->arg[n].d);
+      break;
+    }
+
+    if (ret > 0)
+      o = MIN(o + ret, size - 1);
+    f++;
+    n++;
+  }
+
+  out[o] = '\0';
+}
+
+static int fli_log_cmp(const void *a, const void *b)
+{
+  const log_entry_t *x = a, *y = b;
+
+  if (x->rec.ts != y->rec.ts)
+    return (x->rec.ts < y->rec.ts)?-1:1;
+  if (x->thread != y->thread)
+    return (x->thread < y->thread)?-1:1;
+
+  return (x->rec.seq < y->rec.seq)?-1:(x->rec.seq > y->rec.seq);
+}
+
+static const char *fli_log_level(int level)
+{
+  switch (level)
+  {
+  case FLIDEBUG_INFO:
+    return "INFO";
+  case FLIDEBUG_WARN:
+    return "WARN";
+  case FLIDEBUG_FAIL:
+    return "FAIL";
+  case FLIDEBUG_IO:
+    return "IO";
+  }
+
+  return "ALL";
+}
+
+long fli_log_dump(char *filename)
+{
+  fli_log_ring_t *ring;
+  log_entry_t *entry;
+  char line[1024];
+  size_t total = 0, count = 0, i;
+  uint64_t head, seq;
+  FILE *f;
+  long err = 0;
+
+  for (ring = LOG_HEAD(&log_rings); ring != NULL; ring = ring->next)
+    total += ring->mask + 1;
+
+  if (total == 0)
+    return -EINVAL;
+
+  if ((entry = xmalloc(total * sizeof(log_entry_t))) == NULL)
+    return -ENOMEM;
+
+  /* Rings only grow at the head of the list, so the walk above saw at
+   * least as many slots as this one will */
+  for (ring = LOG_HEAD(&log_rings); (ring != NULL) && (count < total);
+    ring = ring->next)
+  {
+    head = LOG_LOAD(&ring->head);
+    seq = (head > (uint64_t) ring->mask + 1)?head - ring->mask - 1:0;
+
+    for (; (seq < head) && (count < total); seq++)
+    {
+      fli_log_rec_t *rec = &ring->rec[seq & ring->mask];
+
+      if (LOG_LOAD(&rec->seq) != seq + 1)
+        continue;
+
+      memcpy(&entry[count].rec, rec, sizeof(fli_log_rec_t));
+      LOG_FENCE();
+
+      if (LOG_LOAD(&rec->seq) != seq + 1)
+        continue;
+
+      entry[count++].thread = ring->thread;
+    }
+  }
+
+  qsort(entry, count, sizeof(log_entry_t), fli_log_cmp);
+
+  if ((f = fopen(filename, "w")) == NULL)
+  {
+    xfree(entry);
+    return -errno;
+  }
+
+  for (i = 0; (err == 0) && (i < count); i++)
+  {
+    fli_log_format(&entry[i].rec, line, sizeof(line));
+    if (fprintf(f, "%12.6f [%d] %s: %s\n",
+      (double) (entry[i].rec.ts - entry[0].rec.ts) / 1e9, entry[i].thread,
+      fli_log_level(entry[i].rec.level), line) < 0)
+      err = -EIO;
+  }
+
+  if ((fclose(f) != 0) && (err == 0))
+    err = -errno;
+
+  xfree(entry);
+
+  debug(FLIDEBUG_INFO, "Log: wrote %d messages to %s", (int) count, filename);
+
+  return err;
+}
@@ -0,0 +1,99 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifndef _LIBFLI_LOG_H_
+#define _LIBFLI_LOG_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+/* Binary debug log
+ *
+ * While enabled, debug() messages are not formatted. Each thread
+ * appends fixed size records to a ring of its own: the format string
+ * pointer, which identifies the message, and the raw arguments it
+ * consumes. Formatting happens only when the rings are dumped, so
+ * verbose logging costs little more than a few stores per message.
+ * Format strings must outlive the dump, which holds for literals.
+ */
+
+#define FLI_LOG_ARGS (8)		/* Arguments kept per message */
+#define FLI_LOG_STRBUF (64)		/* Bytes kept for all %s arguments */
+#define FLI_LOG_DEPTH_DEFAULT (1024)	/* Records, rounded to a power of two */
+
+typedef union {
+  int64_t i;			/* Integers, or the offset of a %s in str */
+  double d;
+  const void *p;
+} fli_log_arg_t;
+
+typedef struct {
+  uint64_t seq;			/* Sequence number + 1, 0 while being written */
+  uint64_t ts;			/* nsec, monotonic */
+  const char *format;
+  int32_t level;
+  int32_t nargs;		/* Arguments captured */
+  fli_log_arg_t arg[FLI_LOG_ARGS];
+  char str[FLI_LOG_STRBUF];
+} fli_log_rec_t;
+
+/* One per thread that is logging. A ring is never freed: when its
+ * thread exits it is claimed by the next new thread, and until then the
+ * records of the finished thread can still be dumped. Threads that
+ * share a ring share its number in the dump. */
+typedef struct _fli_log_ring_t {
+  struct _fli_log_ring_t *next;
+  uint64_t head;		/* Next sequence number, owner writes only */
+  uint32_t mask;
+  int32_t thread;		/* Order of first message, for the dump */
+  volatile long owned;		/* Nonzero while a live thread writes it */
+  fli_log_rec_t *rec;
+} fli_log_ring_t;
+
+int fli_log_active(void);
+void fli_log_vrecord(int level, const char *format, va_list ap);
+long fli_log_enable(long depth);
+long fli_log_dump(char *filename);
+
+#endif /* _LIBFLI_LOG_H_ */
@@ -46,67 +46,166 @@
 #define _GNU_SOURCE
 #endif /* __linux__ */
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include "libfli-libfli.h"
 #include "libfli-mem.h"
 
-#define DEFAULT_NUM_POINTERS (1024)
+/* Every pointer handed out is remembered, so xfree() can reject strays
+ * and xfree_all() can clean up. The table is split into shards by
+ * pointer hash, each behind its own lock, so threads driving different
+ * cameras rarely meet. A shard is an open addressed hash table with
+ * linear probing. */
+
+#define MEM_SHARD_BITS (6)
+#define MEM_SHARDS (1 << MEM_SHARD_BITS)
+#define MEM_SHARD_MIN (64)		/* Slots, a power of two */
+
+#ifdef _WIN32
+#define MEM_TRYLOCK(l) (InterlockedExchange((l), 1) == 0)
+#define MEM_UNLOCK(l) InterlockedExchange((l), 0)
+#define MEM_YIELD() SwitchToThread()
+#else
+#define MEM_TRYLOCK(l) (__atomic_exchange_n((l), 1, __ATOMIC_ACQUIRE) == 0)
+#define MEM_UNLOCK(l) __atomic_store_n((l), 0, __ATOMIC_RELEASE)
+#define MEM_YIELD() sched_yield()
+#endif
 
-static struct _mem_ptrs {
+typedef struct {
+  volatile long lock;
   void **pointers;
-  int total;
-  int used;
-} allocated = {NULL, 0, 0};
+  size_t total;
+  size_t used;
+} mem_shard_t;
 
-static void *saveptr(void *ptr)
+static mem_shard_t allocated[MEM_SHARDS];
+
+static size_t mem_hash(void *ptr)
 {
-  int i, err = 0;
+  /* Fibonacci hashing, the low bits of a pointer are alignment */
+  return (size_t) ((((uintptr_t) ptr) >> 4) * (uintptr_t) 0x9e3779b97f4a7c15ull);
+}
 
-  if (allocated.used + 1 > allocated.total)
-  {
-    void **tmp;
-    int newtotal;
+static mem_shard_t *mem_lock(size_t hash)
+{
+  mem_shard_t *shard;
 
-    if (allocated.total == 0)
-      newtotal = DEFAULT_NUM_POINTERS;
-    else
-      newtotal = 2 * allocated.total;
+  shard = &allocated[hash >> (8 * sizeof(size_t) - MEM_SHARD_BITS)];
+  while (!MEM_TRYLOCK(&shard->lock))
+    MEM_YIELD();
+
+  return shard;
+}
+
+static void **mem_find(mem_shard_t *shard, size_t hash, void *ptr)
+{
+  size_t i, mask = shard->total - 1;
 
-    if ((tmp = realloc(allocated.pointers,
-		       newtotal * sizeof(void **))) == NULL)
+  if (shard->total == 0)
+    return NULL;
+
+  for (i = hash & mask; shard->pointers[i] != NULL; i = (i + 1) & mask)
+    if (shard->pointers[i] == ptr)
+      return &shard->pointers[i];
+
+  return NULL;
+}
+
+static int mem_insert(mem_shard_t *shard, size_t hash, void *ptr)
+{
+  size_t i, mask;
+
+  /* Keep the load under 3/4 */
+  if ((shard->used + 1) * 4 > shard->total * 3)
+  {
+    void **old = shard->pointers;
+    size_t j, oldtotal = shard->total, newtotal;
+
+    newtotal = (oldtotal == 0)?MEM_SHARD_MIN:(2 * oldtotal);
+    if ((shard->pointers = calloc(newtotal, sizeof(void *))) == NULL)
     {
-      err = 1;
-      goto done;
+      shard->pointers = old;
+      return -1;
     }
+    shard->total = newtotal;
 
-    allocated.pointers = tmp;
-    memset(allocated.pointers + allocated.total, 0,
-	   (newtotal - allocated.total) * sizeof(void **));
-    allocated.total = newtotal;
+    mask = newtotal - 1;
+    for (j = 0; j < oldtotal; j++)
+    {
+      if (old[j] == NULL)
+        continue;
+      for (i = mem_hash(old[j]) & mask; shard->pointers[i] != NULL;
+        i = (i + 1) & mask)
+        ;
+      shard->pointers[i] = old[j];
+    }
+    free(old);
   }
 
-  for (i = 0; i < allocated.total; i++)
-    if (allocated.pointers[i] == NULL)
-      break;
+  mask = shard->total - 1;
+  for (i = hash & mask; shard->pointers[i] != NULL; i = (i + 1) & mask)
+    ;
+  shard->pointers[i] = ptr;
+  shard->used++;
+
+  return 0;
+}
+
+/* Backward shift deletion, which leaves no tombstones behind */
+static void mem_remove(mem_shard_t *shard, void **slot)
+{
+  size_t i, j, home, mask = shard->total - 1;
 
-  if (i == allocated.total)
+  i = j = slot - shard->pointers;
+  for (;;)
   {
-    /* This shouldn't happen */
-    debug(FLIDEBUG_WARN, "Internal memory allocation error");
-    err = 1;
-    goto done;
+    j = (j + 1) & mask;
+    if (shard->pointers[j] == NULL)
+      break;
+
+    /* Move it back unless its home lies cyclically in (i, j] */
+    home = mem_hash(shard->pointers[j]) & mask;
+    if ((i <= j)?((home <= i) || (home > j)):((home <= i) && (home > j)))
+    {
+      shard->pointers[i] = shard->pointers[j];
+      i = j;
+    }
   }
 
-  allocated.pointers[i] = ptr;
-  allocated.used++;
+  shard->pointers[i] = NULL;
+  shard->used--;
+}
+
+static int trackptr(void *ptr)
+{
+  mem_shard_t *shard;
+  size_t hash;
+  int err;
 
- done:
+  hash = mem_hash(ptr);
+  shard = mem_lock(hash);
+  err = mem_insert(shard, hash, ptr);
+  MEM_UNLOCK(&shard->lock);
 
   if (err)
+    debug(FLIDEBUG_WARN, "Internal memory allocation error");
+
+  return err;
+}
+
+static void *saveptr(void *ptr)
+{
+  if (trackptr(ptr))
   {
     free(ptr);
     return NULL;
@@ -115,28 +214,23 @@ static void *saveptr(void *ptr)
   return ptr;
 }
 
-static void **findptr(void *ptr)
-{
-  int i;
-
-  for (i = 0; i < allocated.total; i++)
-    if (allocated.pointers[i] == ptr)
-      return &allocated.pointers[i];
-
-  debug(FLIDEBUG_WARN, "Invalid pointer not found: %p", ptr);
-
-  return NULL;
-}
-
 static int deleteptr(void *ptr)
 {
-  void **allocatedptr;
+  mem_shard_t *shard;
+  void **slot;
+  size_t hash;
 
-  if ((allocatedptr = findptr(ptr)) == NULL)
-    return -1;
+  hash = mem_hash(ptr);
+  shard = mem_lock(hash);
+  if ((slot = mem_find(shard, hash, ptr)) != NULL)
+    mem_remove(shard, slot);
+  MEM_UNLOCK(&shard->lock);
 
-  *allocatedptr = NULL;
-  allocated.used--;
+  if (slot == NULL)
+  {
+    debug(FLIDEBUG_WARN, "Invalid pointer not found: %p", ptr);
+    return -1;
+  }
 
   return 0;
 }
@@ -181,6 +275,9 @@ void *xmemalign(size_t alignment, size_t size)
 
 void xfree(void *ptr)
 {
+  if (ptr == NULL)
+    return;
+
   if (deleteptr(ptr))
     return;
 
@@ -189,50 +286,94 @@ void xfree(void *ptr)
   return;
 }
 
+/* The block is taken out of the table for the realloc(), so no shard
+ * is locked while libc works. Whatever block the caller ends up with is
+ * put back; should that fail it is returned untracked, since freeing it
+ * would lose the caller's data. */
 void *xrealloc(void *ptr, size_t size)
 {
-  void **allocatedptr, *tmp;
+  void *tmp;
 
-  if ((allocatedptr = findptr(ptr)) == NULL)
+  if (ptr == NULL)
+    return xmalloc(size);
+
+  if (deleteptr(ptr))
     return NULL;
 
   if ((tmp = realloc(ptr, size)) == NULL)
+  {
+    /* The original block is still the caller's */
+    trackptr(ptr);
     return NULL;
+  }
 
-  *allocatedptr = tmp;
+  trackptr(tmp);
 
   return tmp;
 }
 
 int xfree_all(void)
 {
-  int i;
-  int freed = 0;
+  mem_shard_t *shard;
+  size_t i;
+  int s, freed = 0;
 
-  for (i = 0; i < allocated.total; i++)
+  for (s = 0; s < MEM_SHARDS; s++)
   {
-    if (allocated.pointers[i] != NULL)
+    shard = &allocated[s];
+    while (!MEM_TRYLOCK(&shard->lock))
+      MEM_YIELD();
+
+    for (i = 0; i < shard->total; i++)
     {
-      free(allocated.pointers[i]);
-      allocated.pointers[i] = NULL;
-      allocated.used--;
-      freed++;
+      if (shard->pointers[i] != NULL)
+      {
+        debug(FLIDEBUG_INFO, "Freeing leaked pointer %p", shard->pointers[i]);
+        free(shard->pointers[i]);
+        shard->pointers[i] = NULL;
+        shard->used--;
+        freed++;
+      }
     }
-  }
 
-  if (allocated.used != 0)
-    debug(FLIDEBUG_WARN, "Internal memory handling error");
+    if (shard->used != 0)
+      debug(FLIDEBUG_WARN, "Internal memory handling error");
+
+    if (shard->pointers != NULL)
+      free(shard->pointers);
 
-  if (allocated.pointers != NULL)
-    free(allocated.pointers);
+    shard->pointers = NULL;
+    shard->used = 0;
+    shard->total = 0;
+
+    MEM_UNLOCK(&shard->lock);
+  }
 
-  allocated.pointers = NULL;
-  allocated.used = 0;
-  allocated.total = 0;
+  if (freed)
+    debug(FLIDEBUG_WARN, "Freed %d leaked pointers", freed);
 
   return freed;
 }
 
+/* Number of pointers currently handed out, for leak checks */
+size_t xalloc_count(void)
+{
+  mem_shard_t *shard;
+  size_t used = 0;
+  int s;
+
+  for (s = 0; s < MEM_SHARDS; s++)
+  {
+    shard = &allocated[s];
+    while (!MEM_TRYLOCK(&shard->lock))
+      MEM_YIELD();
+    used += shard->used;
+    MEM_UNLOCK(&shard->lock);
+  }
+
+  return used;
+}
+
 char *xstrdup(const char *s)
 {
   char *tmp;
@@ -275,14 +416,13 @@ int xasprintf(char **strp, const char *fmt, ...)
   va_list ap;
   char *tmp;
   int err;
-  FLI_UNUSED(strp);
 
   va_start(ap, fmt);
 
   if ((err = vasprintf(&tmp, fmt, ap)) < 0)
     goto done;
 
-  if (saveptr(tmp) == NULL)
+  if ((*strp = saveptr(tmp)) == NULL)
     err = -1;
 
 	done:
@@ -331,3 +471,125 @@ int xasprintf(char **strp, const char *fmt, ...)
 }
 
 #endif
+
+/* Arenas hand out small blocks from a few large chunks and release
+ * them all at once, for data that lives exactly as long as something
+ * else does, such as an open device. Blocks are zeroed and cannot be
+ * freed or resized individually. An arena is not locked; its owner
+ * serialises access to it. */
+
+#define MEM_ARENA_CHUNK (2048)
+#define MEM_ARENA_ALIGN (2 * sizeof(void *))
+#define MEM_ARENA_ROUND(n) (((n) + MEM_ARENA_ALIGN - 1) & ~(MEM_ARENA_ALIGN - 1))
+
+typedef struct _fli_arena_chunk_t {
+  struct _fli_arena_chunk_t *next;
+  size_t size;			/* Usable bytes after the header */
+  size_t used;
+} fli_arena_chunk_t;
+
+struct _fli_arena_t {
+  fli_arena_chunk_t *head;	/* Allocations come from here */
+  unsigned long allocs;
+  size_t bytes;
+};
+
+#define MEM_ARENA_HDR MEM_ARENA_ROUND(sizeof(fli_arena_chunk_t))
+#define MEM_ARENA_DATA(c) ((char *) (c) + MEM_ARENA_HDR)
+
+static fli_arena_chunk_t *xarena_chunk(size_t size)
+{
+  fli_arena_chunk_t *chunk;
+
+  if ((chunk = xcalloc(1, MEM_ARENA_HDR + size)) == NULL)
+    return NULL;
+  chunk->size = size;
+
+  return chunk;
+}
+
+fli_arena_t *xarena_create(void)
+{
+  fli_arena_t *arena;
+
+  if ((arena = xcalloc(1, sizeof(fli_arena_t))) == NULL)
+    return NULL;
+
+  if ((arena->head = xarena_chunk(MEM_ARENA_CHUNK)) == NULL)
+  {
+    xfree(arena);
+    return NULL;
+  }
+
+  return arena;
+}
+
+void *xarena_alloc(fli_arena_t *arena, size_t size)
+{
+  fli_arena_chunk_t *chunk = arena->head;
+  void *ptr;
+
+  size = MEM_ARENA_ROUND(size ? size : 1);
+  if (chunk->size - chunk->used < size)
+  {
+    if ((chunk = xarena_chunk((size > MEM_ARENA_CHUNK)?size:MEM_ARENA_CHUNK)) == NULL)
+      return NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+  }
+
+  ptr = MEM_ARENA_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  arena->allocs++;
+  arena->bytes += size;
+
+  return ptr;
+}
+
+char *xarena_strndup(fli_arena_t *arena, const char *s, size_t siz)
+{
+  size_t len;
+  char *tmp;
+
+  for (len = 0; len < siz && s[len] != '\0'; len++)
+    ;
+
+  if ((tmp = xarena_alloc(arena, len + 1)) == NULL)
+    return NULL;
+  memcpy(tmp, s, len);
+
+  return tmp;
+}
+
+int xarena_owns(fli_arena_t *arena, const void *ptr)
+{
+  fli_arena_chunk_t *chunk;
+
+  for (chunk = arena->head; chunk != NULL; chunk = chunk->next)
+    if (((const char *) ptr >= MEM_ARENA_DATA(chunk)) &&
+      ((const char *) ptr < MEM_ARENA_DATA(chunk) + chunk->size))
+      return 1;
+
+  return 0;
+}
+
+void xarena_usage(fli_arena_t *arena, unsigned long *allocs, size_t *bytes)
+{
+  *allocs = arena->allocs;
+  *bytes = arena->bytes;
+}
+
+void xarena_destroy(fli_arena_t *arena)
+{
+  fli_arena_chunk_t *chunk, *next;
+
+  if (arena == NULL)
+    return;
+
+  for (chunk = arena->head; chunk != NULL; chunk = next)
+  {
+    next = chunk->next;
+    xfree(chunk);
+  }
+  xfree(arena);
+}
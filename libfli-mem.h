@@ -52,8 +52,18 @@ void *xmemalign(size_t alignment, size_t size);
 void xfree(void *ptr);
 void *xrealloc(void *ptr, size_t size);
 int  xfree_all(void);
+size_t xalloc_count(void);
 char *xstrdup(const char *s);
 int  xasprintf(char **strp, const char *fmt, ...);
 char *xstrndup(const char *s, size_t siz);
 
+typedef struct _fli_arena_t fli_arena_t;
+
+fli_arena_t *xarena_create(void);
+void *xarena_alloc(fli_arena_t *arena, size_t size);
+char *xarena_strndup(fli_arena_t *arena, const char *s, size_t siz);
+int  xarena_owns(fli_arena_t *arena, const void *ptr);
+void xarena_usage(fli_arena_t *arena, unsigned long *allocs, size_t *bytes);
+void xarena_destroy(fli_arena_t *arena);
+
 #endif /* _LIBFLI_MEM_H_ */
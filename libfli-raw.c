@@ -60,19 +60,19 @@ long fli_raw_close(flidev_t dev)
 {
   if (DEVICE->devinfo.model != NULL)
   {
-    xfree(DEVICE->devinfo.model);
+    fli_dev_free(dev, DEVICE->devinfo.model);
     DEVICE->devinfo.model = NULL;
   }
 
   if (DEVICE->devinfo.devnam != NULL)
   {
-    xfree(DEVICE->devinfo.devnam);
+    fli_dev_free(dev, DEVICE->devinfo.devnam);
     DEVICE->devinfo.devnam = NULL;
   }
 
   if (DEVICE->device_data != NULL)
   {
-    xfree(DEVICE->device_data);
+    fli_dev_free(dev, DEVICE->device_data);
     DEVICE->device_data = NULL;
   }
 
@@ -0,0 +1,286 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+#include "libfli-sequence.h"
+
+static void seq_msleep(long ms)
+{
+  while (ms > 0)
+  {
+    long t = (ms > 500)?500:ms;
+
+#ifdef _WIN32
+    Sleep(t);
+#else
+    usleep(t * 1000);
+#endif
+    ms -= t;
+  }
+}
+
+static double seq_seconds(uint64_t from, uint64_t to)
+{
+  return (to > from)?(double) (to - from) / 1e9:0.0;
+}
+
+/* Starts the moves a step needs, neither waits for the other */
+static long seq_move_start(flidev_t wheel, flidev_t focuser,
+  flisequencestep_t *step)
+{
+  long r;
+
+  if ((wheel != FLI_INVALID_DEVICE) && (step->filter >= 0))
+  {
+    if ((r = FLISetFilterPosAsync(wheel, step->filter)) != 0)
+    {
+      debug(FLIDEBUG_WARN, "Sequence: filter move to %ld failed, %ld.",
+        step->filter, r);
+      return r;
+    }
+  }
+
+  if ((focuser != FLI_INVALID_DEVICE) && (step->focus != 0))
+  {
+    if ((r = FLIStepMotorAsync(focuser, step->focus)) != 0)
+    {
+      debug(FLIDEBUG_WARN, "Sequence: focus move of %ld steps failed, %ld.",
+        step->focus, r);
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+/* Waits for the moves started by seq_move_start(). A move still going
+ * held the next exposure up; how long is recorded from the time it
+ * could otherwise have started, and the move that ended last is the
+ * critical one. */
+static long seq_move_wait(flidev_t wheel, flidev_t focuser,
+  flisequencestep_t *step, uint64_t from, flisequencetiming_t *t)
+{
+  long r;
+
+  if ((wheel != FLI_INVALID_DEVICE) && (step->filter >= 0))
+  {
+    if ((r = FLIWaitFilterMove(wheel, 0)) == -ETIMEDOUT)
+    {
+      if ((r = FLIWaitFilterMove(wheel, -1)) != 0)
+        return r;
+      t->filter = seq_seconds(from, fli_trace_now());
+      t->critical = FLI_SEQUENCE_CRITICAL_FILTER;
+    }
+    else if (r != 0)
+      return r;
+  }
+
+  if ((focuser != FLI_INVALID_DEVICE) && (step->focus != 0))
+  {
+    if ((r = FLIWaitStepMotor(focuser, 0)) == -ETIMEDOUT)
+    {
+      if ((r = FLIWaitStepMotor(focuser, -1)) != 0)
+        return r;
+      t->focus = seq_seconds(from, fli_trace_now());
+      if (t->focus > t->filter)
+        t->critical = FLI_SEQUENCE_CRITICAL_FOCUS;
+    }
+    else if (r != 0)
+      return r;
+  }
+
+  return 0;
+}
+
+/* Returns once the exposure in progress has ended */
+long fli_sequence_exposure_wait(flidev_t cam)
+{
+  long left, r;
+
+  for (;;)
+  {
+    if ((r = FLIGetExposureStatus(cam, &left)) != 0)
+      return r;
+
+    if (left <= 0)
+      return 0;
+
+    seq_msleep((left < FLI_SEQUENCE_POLL_MAX)?left:FLI_SEQUENCE_POLL_MAX);
+  }
+}
+
+/* Reads the frame into buff, or drops it when buff is NULL */
+static long seq_readout(flidev_t cam, void *buff, size_t buffsize)
+{
+  long width, hoffset, hbin, height, voffset, vbin, row;
+  char *rowbuf = NULL;
+  long r;
+
+  if ((r = FLIGetReadoutDimensions(cam, &width, &hoffset, &hbin,
+    &height, &voffset, &vbin)) != 0)
+    return r;
+
+  if (buff == NULL)
+  {
+    if ((rowbuf = xmalloc(width * 2)) == NULL)
+      return -ENOMEM;
+  }
+  else if ((long) buffsize < width * height * 2)
+  {
+    debug(FLIDEBUG_WARN, "Sequence: frame buffer too small, %zu bytes for %ld.",
+      buffsize, width * height * 2);
+    return -ENOMEM;
+  }
+
+  if ((r = fli_tx_begin(cam)) != 0)
+  {
+    xfree(rowbuf);
+    return r;
+  }
+
+  for (row = 0; row < height; row++)
+  {
+    if ((r = FLIGrabRow(cam, (rowbuf != NULL)?rowbuf:
+      (char *) buff + row * width * 2, width)) != 0)
+    {
+      debug(FLIDEBUG_WARN, "Sequence: grabbing row %ld failed, %ld.", row, r);
+      break;
+    }
+  }
+
+  fli_tx_end(cam);
+  xfree(rowbuf);
+
+  return r;
+}
+
+long fli_sequence_run(flidev_t cam, flidev_t wheel, flidev_t focuser,
+  flisequencestep_t *steps, long nsteps, flisequencetiming_t *timing)
+{
+  flisequencetiming_t t, next;
+  uint64_t begin, start, end, ready;
+  long i, r, mr;
+
+  if ((steps == NULL) || (nsteps < 1))
+    return -EINVAL;
+
+  if (((wheel != FLI_INVALID_DEVICE) && !fli_dev_valid(wheel)) ||
+    ((focuser != FLI_INVALID_DEVICE) && !fli_dev_valid(focuser)))
+    return -EINVAL;
+
+  memset(&next, 0, sizeof(next));
+  next.critical = FLI_SEQUENCE_CRITICAL_NONE;
+
+  begin = fli_trace_now();
+  if ((r = seq_move_start(wheel, focuser, &steps[0])) != 0)
+    return r;
+  if ((r = seq_move_wait(wheel, focuser, &steps[0], begin, &next)) != 0)
+    return r;
+
+  for (i = 0; i < nsteps; i++)
+  {
+    t = next;
+
+    if ((r = FLISetExposureTime(cam, steps[i].exptime)) != 0)
+      return r;
+
+    start = fli_trace_now();
+    if ((r = FLIExposeFrame(cam)) != 0)
+      return r;
+
+    if ((r = fli_sequence_exposure_wait(cam)) != 0)
+      return r;
+    end = fli_trace_now();
+
+    /* The shutter is closed, the next step can get ready while this
+     * frame is read out. A move that fails to start is reported once
+     * the frame has been read, so it isn't left in the camera. */
+    mr = 0;
+    if (i + 1 < nsteps)
+      mr = seq_move_start(wheel, focuser, &steps[i + 1]);
+
+    r = seq_readout(cam, steps[i].buff, steps[i].buffsize);
+    ready = fli_trace_now();
+
+    t.start = seq_seconds(begin, start);
+    t.exposure = seq_seconds(start, end);
+    t.readout = seq_seconds(end, ready);
+
+    debug(FLIDEBUG_INFO, "Sequence: step %ld exposure %ld msec, readout %ld msec, "
+      "held %ld msec for the filter and %ld for focus.", i,
+      (long) (t.exposure * 1000), (long) (t.readout * 1000),
+      (long) (t.filter * 1000), (long) (t.focus * 1000));
+
+    if (timing != NULL)
+      timing[i] = t;
+
+    if (r != 0)
+      return r;
+    if (mr != 0)
+      return mr;
+
+    if (i + 1 < nsteps)
+    {
+      memset(&next, 0, sizeof(next));
+      next.critical = FLI_SEQUENCE_CRITICAL_READOUT;
+      if ((r = seq_move_wait(wheel, focuser, &steps[i + 1], ready, &next)) != 0)
+        return r;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,1249 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sched.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-camera.h"
+#include "libfli-camera-usb.h"
+#include "libfli-trace.h"
+#include "libfli-sim.h"
+
+/* Fixed properties of the simulated sensors */
+#define SIM_PIXEL_SIZE (9.0e-6)
+#define SIM_TEMPSLOPE (0.5)		/* MaxCam, degrees per AD count */
+#define SIM_TEMPINTERCEPT (-60.0)
+#define SIM_BASE_TEMPERATURE (20.0)
+
+static long fli_sim_bulk(flidev_t dev, int ep, void *buf, long *len);
+static long fli_sim_io(flidev_t dev, void *buf, long *wlen, long *rlen);
+
+/* The open focuser that camera star images follow, if any. Cameras
+ * read its motor from their own threads while rendering, so the
+ * pointer and motor moves are guarded by a spin lock. */
+static fli_sim_t *sim_focuser = NULL;
+static volatile long sim_focuser_lock;
+
+#ifdef _WIN32
+#define SIM_LOCK() \
+  while (InterlockedExchange(&sim_focuser_lock, 1) != 0) SwitchToThread()
+#define SIM_UNLOCK() InterlockedExchange(&sim_focuser_lock, 0)
+#else
+#define SIM_LOCK() \
+  while (__atomic_exchange_n(&sim_focuser_lock, 1, __ATOMIC_ACQUIRE) != 0) \
+    sched_yield()
+#define SIM_UNLOCK() __atomic_store_n(&sim_focuser_lock, 0, __ATOMIC_RELEASE)
+#endif
+
+static uint32_t sim_rand(fli_sim_t *sim)
+{
+  uint32_t x = sim->rng;
+
+  /* xorshift32, the state must never be zero */
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  return (sim->rng = x);
+}
+
+static double sim_uniform(fli_sim_t *sim)
+{
+  return (double) sim_rand(sim) / 4294967296.0;
+}
+
+static void sim_sleep(long usec)
+{
+  if (usec <= 0)
+    return;
+
+#ifdef _WIN32
+  Sleep((usec + 999) / 1000);
+#else
+  {
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+      ;
+  }
+#endif
+}
+
+/* Time the wire would have taken for a transfer of len bytes */
+static void sim_stall(fli_sim_t *sim, long len)
+{
+  long usec = sim->latency;
+
+  if ((sim->bandwidth > 0) && (len > 0))
+    usec += (long) (((double) len * 1e6) / (double) sim->bandwidth);
+
+  sim_sleep(usec);
+}
+
+static long sim_timeleft(fli_sim_t *sim)
+{
+  uint64_t elapsed;
+
+  if (sim->expstart == 0)
+    return 0;
+
+  elapsed = (fli_trace_now() - sim->expstart) / 1000000;
+  if (elapsed >= (uint64_t) sim->exposure)
+    return 0;
+
+  return sim->exposure - (long) elapsed;
+}
+
+static void sim_start_exposure(fli_sim_t *sim)
+{
+  sim->expstart = fli_trace_now();
+  if (sim->expstart == 0)
+    sim->expstart = 1;
+}
+
+/* Position of motor m in steps, it runs at steprate from stepfrom to
+ * stepto */
+static long sim_step_pos(fli_sim_t *sim, int m)
+{
+  uint64_t elapsed;
+  long dist, moved;
+
+  dist = labs(sim->stepto[m] - sim->stepfrom[m]);
+  elapsed = (fli_trace_now() - sim->stepstart[m]) / 1000;
+  if (elapsed >= ((uint64_t) dist * 1000000) / sim->steprate)
+    moved = dist;
+  else
+    moved = (long) ((elapsed * sim->steprate) / 1000000);
+
+  return (sim->stepto[m] >= sim->stepfrom[m])?
+    sim->stepfrom[m] + moved:sim->stepfrom[m] - moved;
+}
+
+/* Steps left on the motor with the furthest to go */
+static long sim_step_left(fli_sim_t *sim)
+{
+  long left = 0, l;
+  int m;
+
+  for (m = 0; m < sim->wheels; m++)
+    if ((l = labs(sim->stepto[m] - sim_step_pos(sim, m))) > left)
+      left = l;
+
+  return left;
+}
+
+static void sim_step_to(fli_sim_t *sim, int m, long to)
+{
+  SIM_LOCK();
+  sim->stepfrom[m] = sim_step_pos(sim, m);
+  sim->stepto[m] = to;
+  sim->stepstart[m] = fli_trace_now();
+  SIM_UNLOCK();
+}
+
+/* Slot a filter wheel is at, or last passed */
+static long sim_slot(fli_sim_t *sim, int m)
+{
+  long turn = sim->slots * sim->slotsteps;
+
+  return ((sim_step_pos(sim, m) % turn + turn) % turn) / sim->slotsteps;
+}
+
+/* Forward to the slot, filter wheels only turn one way */
+static void sim_slot_to(fli_sim_t *sim, int m, long slot)
+{
+  long turn = sim->slots * sim->slotsteps, at;
+
+  if ((slot < 0) || (slot >= sim->slots))
+    return;
+
+  at = sim_step_pos(sim, m);
+  sim_step_to(sim, m, at + (slot * sim->slotsteps - at % turn + 2 * turn) % turn);
+}
+
+static unsigned char *sim_reply(fli_sim_t *sim, long len)
+{
+  if (len > sim->replysiz)
+  {
+    unsigned char *p;
+
+    if ((p = xrealloc(sim->reply, len)) == NULL)
+      return NULL;
+    sim->reply = p;
+    sim->replysiz = len;
+  }
+
+  memset(sim->reply, 0, len);
+  sim->replylen = len;
+  sim->replyidx = 0;
+  sim->replyexact = 0;
+
+  return sim->reply;
+}
+
+static void sim_put16(unsigned char *b, long i, unsigned short v)
+{
+  b[i] = (v >> 8) & 0xff;
+  b[i + 1] = v & 0xff;
+}
+
+static void sim_put16l(unsigned char *b, long i, unsigned short v)
+{
+  b[i] = v & 0xff;
+  b[i + 1] = (v >> 8) & 0xff;
+}
+
+static void sim_put32(unsigned char *b, long i, unsigned long v)
+{
+  b[i] = (v >> 24) & 0xff;
+  b[i + 1] = (v >> 16) & 0xff;
+  b[i + 2] = (v >> 8) & 0xff;
+  b[i + 3] = v & 0xff;
+}
+
+/* Little endian IEEE single, as read back by dconvert() */
+static void sim_putfloat(unsigned char *b, long i, double v)
+{
+  union {
+    float f;
+    uint32_t u;
+  } c;
+
+  c.f = (float) v;
+  b[i] = c.u & 0xff;
+  b[i + 1] = (c.u >> 8) & 0xff;
+  b[i + 2] = (c.u >> 16) & 0xff;
+  b[i + 3] = (c.u >> 24) & 0xff;
+}
+
+/* A pixel on the wire, in the configured byte order */
+static void sim_putpixel(fli_sim_t *sim, unsigned char *b, long n,
+  unsigned short v)
+{
+  if (sim->little_endian)
+    sim_put16l(b, n * 2, v);
+  else
+    sim_put16(b, n * 2, v);
+}
+
+/* Render n binned pixels of one row, the first binned pixel starting at
+ * array column ax and the row at array row ay. */
+static void sim_render_row(fli_sim_t *sim, unsigned short *row, long n,
+  long ax, long ay, long hbin, long vbin)
+{
+  double t = (double) sim->exposure / 1000.0;
+  double area = (double) (hbin * vbin);
+  double cy = (double) ay + (double) vbin / 2.0;
+  double blur = 0.0;
+  long i, x;
+
+  for (x = 0; x < n; x++)
+    row[x] = (unsigned short) (sim->bias +
+      (long) ((sim_uniform(sim) * 2.0 - 1.0) * (double) sim->noise));
+
+  if (sim->dark)
+    return;
+
+  if (sim->focusset)
+  {
+    SIM_LOCK();
+    if (sim_focuser != NULL)
+      blur = (double) (sim_step_pos(sim_focuser, 0) - sim->focus) /
+        (double) sim->defocus;
+    SIM_UNLOCK();
+  }
+
+  for (i = 0; i < sim->nstars; i++)
+  {
+    fli_sim_star_t *s = &sim->stars[i];
+    /* Defocus spreads the same flux over a wider star */
+    double var = s->sigma * s->sigma + blur * blur;
+    double peak = s->peak * s->sigma * s->sigma / var;
+    double reach = 5.0 * sqrt(var);
+    double dy = cy - s->y;
+    long x0, x1;
+
+    if (fabs(dy) > reach + vbin)
+      continue;
+
+    x0 = (long) floor((s->x - reach - ax) / hbin);
+    x1 = (long) ceil((s->x + reach - ax) / hbin);
+    if (x0 < 0)
+      x0 = 0;
+    if (x1 > n)
+      x1 = n;
+
+    for (x = x0; x < x1; x++)
+    {
+      double dx = (double) ax + ((double) x + 0.5) * hbin - s->x;
+      double v = row[x] + area * t * peak *
+        exp(-(dx * dx + dy * dy) / (2.0 * var));
+
+      row[x] = (v > 65535.0)?65535:(unsigned short) v;
+    }
+  }
+}
+
+/* Build the readout stream of a Proline frame. This is the inverse of
+ * the descramble in fli_camera_usb_grab_row(): with two row amplifiers
+ * the top and bottom halves are read together, word interleaved, the
+ * bottom half from its last row up; with two column amplifiers each
+ * row is read from both ends towards the middle. */
+static void sim_proline_geometry(flidev_t dev, fli_sim_t *sim,
+  long *lw, long *rw, long *th, long *bh)
+{
+  /* Older firmware is read out through a single amplifier */
+  *lw = sim->cols; *rw = 0;
+  *th = sim->rows; *bh = 0;
+  if (DEVICE->devinfo.fwrev >= 0x0200)
+  {
+    if (sim->quadrants >= 2)
+    {
+      *rw = sim->cols / 2;
+      *lw = sim->cols - *rw;
+    }
+    if ((sim->quadrants >= 4) && ((sim->rows & 1) == 0))
+    {
+      *bh = sim->rows / 2;
+      *th = sim->rows - *bh;
+    }
+  }
+}
+
+static long sim_proline_frame(flidev_t dev, fli_sim_t *sim)
+{
+  unsigned short *img;
+  long w = sim->cols, h = sim->rows;
+  long lw, rw, th, bh;
+  long k, m, n;
+
+  sim_proline_geometry(dev, sim, &lw, &rw, &th, &bh);
+
+  if (w * h * 2 > sim->streamsiz)
+  {
+    unsigned char *p;
+
+    if ((p = xrealloc(sim->stream, w * h * 2)) == NULL)
+      return -ENOMEM;
+    sim->stream = p;
+    sim->streamsiz = w * h * 2;
+  }
+
+  if ((img = xmalloc(w * h * sizeof(unsigned short))) == NULL)
+    return -ENOMEM;
+
+  for (k = 0; k < h; k++)
+    sim_render_row(sim, img + k * w, w, sim->ulx, sim->uly + k * sim->vbin,
+      sim->hbin, sim->vbin);
+
+  n = 0;
+  for (k = 0; k < th; k++)
+  {
+    unsigned short *top = img + k * w;
+    unsigned short *bottom = (k < bh)?img + (th + bh - 1 - k) * w:NULL;
+
+    for (m = 0; m < w; m++)
+    {
+      long x;
+
+      if (m < 2 * rw)
+        x = (m & 1)?w - 1 - m / 2:m / 2;
+      else
+        x = rw + (m - 2 * rw);
+
+      sim_putpixel(sim, sim->stream, n++, top[x]);
+      if (bottom != NULL)
+        sim_putpixel(sim, sim->stream, n++, bottom[x]);
+    }
+  }
+  xfree(img);
+
+  sim->streamlen = n * 2;
+  sim->streamidx = 0;
+  sim_start_exposure(sim);
+
+  return 0;
+}
+
+static long sim_proline_expose(flidev_t dev, fli_sim_t *sim, unsigned char *cmd)
+{
+  unsigned char *r;
+  long lw, rw, th, bh;
+  long err;
+
+  sim->cols = (cmd[2] << 8) | cmd[3];
+  sim->ulx = (cmd[4] << 8) | cmd[5];
+  sim->rows = (cmd[6] << 8) | cmd[7];
+  sim->uly = (cmd[8] << 8) | cmd[9];
+  sim->hbin = cmd[10];
+  sim->vbin = cmd[11] | (cmd[18] << 8);
+  sim->exposure = ((long) cmd[12] << 24) | (cmd[13] << 16) |
+    (cmd[14] << 8) | cmd[15];
+  sim->dark = (cmd[16] & 0x01) != 0;
+  sim->video = (cmd[16] & 0x10) != 0;
+
+  if (sim->hbin < 1)
+    sim->hbin = 1;
+  if (sim->vbin < 1)
+    sim->vbin = 1;
+
+  debug(FLIDEBUG_INFO, "Sim: expose %ldx%ld at (%ld,%ld) bin %ldx%ld, %ld msec%s",
+    sim->cols, sim->rows, sim->ulx, sim->uly, sim->hbin, sim->vbin,
+    sim->exposure, sim->video?", video":"");
+
+  if ((err = sim_proline_frame(dev, sim)) != 0)
+    return err;
+
+  if (DEVICE->devinfo.fwrev < 0x0200)
+    return 0;
+
+  if ((r = sim_reply(sim, 64)) == NULL)
+    return -ENOMEM;
+  sim_proline_geometry(dev, sim, &lw, &rw, &th, &bh);
+  sim_put16l(r, 0, th);
+  sim_put16l(r, 2, 0);
+  sim_put16l(r, 4, 0);
+  sim_put16l(r, 11, lw);
+  sim_put16l(r, 13, 0);
+  sim_put16l(r, 15, rw);
+  sim_put16l(r, 17, 0);
+  sim_put16l(r, 44, bh);
+
+  return 0;
+}
+
+static long sim_proline_command(flidev_t dev, fli_sim_t *sim,
+  unsigned char *cmd, long len)
+{
+  unsigned char *r = NULL;
+  long status;
+
+  switch ((cmd[0] << 8) | cmd[1])
+  {
+  case PROLINE_GET_HARDWAREINFO:
+    if ((r = sim_reply(sim, 6)) == NULL)
+      break;
+    sim_put16(r, 0, DEVICE->devinfo.hwrev);
+    sim_put16(r, 2, DEVICE->devinfo.serno);
+    sim_put16(r, 4, 32);
+    return 0;
+
+  case PROLINE_GET_CAMERAINFO:
+    if ((r = sim_reply(sim, 32)) == NULL)
+      break;
+    sim_put16l(r, 0, sim->width);
+    sim_put16l(r, 2, sim->height);
+    sim_put16l(r, 4, sim->width);
+    sim_put16l(r, 6, sim->height);
+    sim_putfloat(r, 12, SIM_PIXEL_SIZE);
+    sim_putfloat(r, 16, SIM_PIXEL_SIZE);
+    r[23] = (CAPABILITY_VIDEO >> 16) & 0xff;	/* Capabilities from 21, LE */
+    return 0;
+
+  case PROLINE_GET_DEVICESTRINGS:
+    if ((r = sim_reply(sim, 64)) == NULL)
+      break;
+    strcpy((char *) r, "FLI Simulated ProLine");
+    strcpy((char *) r + 32, "ProLine Simulator");
+    return 0;
+
+  case PROLINE_COMMAND_EXPOSE:
+    return sim_proline_expose(dev, sim, cmd);
+
+  case PROLINE_COMMAND_GET_EXPOSURE_STATUS:
+    if ((r = sim_reply(sim, 4)) == NULL)
+      break;
+    sim_put32(r, 0, sim_timeleft(sim));
+    return 0;
+
+  case PROLINE_COMMAND_CANCEL_EXPOSURE:
+    sim->expstart = 0;
+    sim->video = 0;
+    sim->streamlen = 0;
+    sim->streamidx = 0;
+    r = sim_reply(sim, 2);
+    break;
+
+  case PROLINE_COMMAND_GET_TEMPERATURE:
+    if ((r = sim_reply(sim, 14)) == NULL)
+      break;
+    sim_put16(r, 0, (unsigned short) (short) (sim->setpoint * 256.0));
+    sim_put16(r, 2, (unsigned short) (short) (SIM_BASE_TEMPERATURE * 256.0));
+    return 0;
+
+  case PROLINE_COMMAND_SET_TEMPERATURE:
+    if (len >= 4)
+      sim->setpoint = (double) (short) ((cmd[2] << 8) | cmd[3]) / 256.0;
+    r = sim_reply(sim, 2);
+    break;
+
+  case PROLINE_COMMAND_GET_STATUS:
+    if ((r = sim_reply(sim, 4)) == NULL)
+      break;
+    if (sim_timeleft(sim) > 0)
+      status = FLI_CAMERA_STATUS_EXPOSING;
+    else if (sim->streamidx < sim->streamlen)
+      status = FLI_CAMERA_STATUS_READING_CCD | FLI_CAMERA_DATA_READY;
+    else
+      status = FLI_CAMERA_STATUS_IDLE;
+    sim_put32(r, 0, status);
+    return 0;
+
+  default:
+    /* Accepted, replies read back as zeros */
+    r = sim_reply(sim, 0);
+    break;
+  }
+
+  return (r == NULL)?-ENOMEM:0;
+}
+
+static long sim_maxcam_command(flidev_t dev, fli_sim_t *sim,
+  unsigned char *cmd, long len)
+{
+  unsigned char *r = NULL;
+  long ad;
+
+  switch ((cmd[0] << 8) | cmd[1])
+  {
+  case FLI_USBCAM_DEVICENAME:
+    if ((r = sim_reply(sim, 32)) == NULL)
+      break;
+    strcpy((char *) r, "MaxCam Simulator");
+    return 0;
+
+  case FLI_USBCAM_HARDWAREREV:
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, DEVICE->devinfo.hwrev);
+    return 0;
+
+  case FLI_USBCAM_DEVICEID:
+    r = sim_reply(sim, 2);
+    break;
+
+  case FLI_USBCAM_SERIALNUM:
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, DEVICE->devinfo.serno);
+    return 0;
+
+  case FLI_USBCAM_READPARAMBLOCK:
+    if ((r = sim_reply(sim, 64)) == NULL)
+      break;
+    sim_putfloat(r, 23, SIM_TEMPSLOPE);
+    sim_putfloat(r, 27, SIM_TEMPINTERCEPT);
+    sim_putfloat(r, 31, SIM_PIXEL_SIZE);
+    sim_putfloat(r, 35, SIM_PIXEL_SIZE);
+    return 0;
+
+  case FLI_USBCAM_ARRAYSIZE:
+  case FLI_USBCAM_IMAGESIZE:
+    if ((r = sim_reply(sim, 4)) == NULL)
+      break;
+    sim_put16(r, 0, sim->width);
+    sim_put16(r, 2, sim->height);
+    return 0;
+
+  case FLI_USBCAM_IMAGEOFFSET:
+    r = sim_reply(sim, 4);
+    break;
+
+  case FLI_USBCAM_TEMPERATURE:
+    if (len >= 4)
+    {
+      ad = (cmd[2] << 8) | cmd[3];
+      sim->setpoint = SIM_TEMPSLOPE * ad + SIM_TEMPINTERCEPT;
+      r = sim_reply(sim, 0);
+      break;
+    }
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    ad = (long) ((sim->setpoint - SIM_TEMPINTERCEPT) / SIM_TEMPSLOPE);
+    r[1] = (ad < 0)?0:((ad > 255)?255:ad);
+    return 0;
+
+  case FLI_USBCAM_SETFRAMEOFFSET:
+    sim->ulx = (cmd[2] << 8) | cmd[3];
+    sim->uly = (cmd[4] << 8) | cmd[5];
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_SETBINFACTORS:
+    sim->hbin = (cmd[2] << 8) | cmd[3];
+    sim->vbin = (cmd[4] << 8) | cmd[5];
+    if (sim->hbin < 1)
+      sim->hbin = 1;
+    if (sim->vbin < 1)
+      sim->vbin = 1;
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_SETEXPOSURE:
+    sim->exposure = ((long) cmd[4] << 24) | (cmd[5] << 16) |
+      (cmd[6] << 8) | cmd[7];
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_STARTEXPOSURE:
+    sim->dark = (cmd[3] & 0x01) != 0;
+    sim->row = 0;
+    sim_start_exposure(sim);
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_ABORTEXPOSURE:
+    sim->expstart = 0;
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_EXPOSURESTATUS:
+    if ((r = sim_reply(sim, 4)) == NULL)
+      break;
+    sim_put32(r, 0, sim_timeleft(sim));
+    return 0;
+
+  case FLI_USBCAM_FLUSHROWS:
+    /* The rows above the frame are flushed before the first row is sent */
+    sim->row += (cmd[2] << 8) | cmd[3];
+    r = sim_reply(sim, 0);
+    break;
+
+  case FLI_USBCAM_SENDROW:
+    {
+      long width = (cmd[2] << 8) | cmd[3];
+      long batch = (cmd[4] << 8) | cmd[5];
+      unsigned short *row;
+      long i, x;
+
+      /* The camera holds the request until the exposure is over */
+      sim_sleep(sim_timeleft(sim) * 1000);
+
+      if ((r = sim_reply(sim, width * 2 * batch)) == NULL)
+        break;
+      if ((row = xmalloc(width * sizeof(unsigned short))) == NULL)
+        return -ENOMEM;
+
+      for (i = 0; i < batch; i++)
+      {
+        sim_render_row(sim, row, width, sim->ulx, sim->row, sim->hbin, sim->vbin);
+        for (x = 0; x < width; x++)
+          sim_putpixel(sim, r, i * width + x, row[x]);
+        sim->row += sim->vbin;
+      }
+      xfree(row);
+    }
+    return 0;
+
+  default:
+    r = sim_reply(sim, 0);
+    break;
+  }
+
+  return (r == NULL)?-ENOMEM:0;
+}
+
+/* Slot 0 of a filter wheel is at every full turn, a CFW4 has two
+ * wheels that move at once. A focuser moves between 0, its home, and
+ * the extent. */
+static long sim_stepper_command(flidev_t dev, fli_sim_t *sim,
+  unsigned char *cmd, long len)
+{
+  unsigned char *r = NULL;
+  long pos, turn, status;
+  int cfw = (sim->model == FLI_SIM_CFW);
+  unsigned short c;
+
+  c = (cmd[0] << 8) | cmd[1];
+  turn = sim->slots * sim->slotsteps;
+
+  switch (c & 0xf000)
+  {
+  case 0x0000:
+    /* Flash read, longer than the firmware takes is answered short */
+    if ((len >= 8) && (cmd[2] == 0x02))
+    {
+      long addr = ((cmd[4] << 8) | cmd[5]) - FLI_SIM_FLASH_BASE, n = cmd[7];
+
+      if (n > sim->flashmax)
+        n = sim->flashmax;
+      if ((r = sim_reply(sim, n)) == NULL)
+        break;
+      for (pos = 0; pos < n; pos++)
+        if ((addr + pos >= 0) && (addr + pos < FLI_SIM_FLASH_SIZE))
+          r[pos] = sim->flash[addr + pos];
+      sim->replyexact = 1;
+      return 0;
+    }
+    r = sim_reply(sim, 0);
+    break;
+
+  case 0x8000:
+    if ((r = sim_reply(sim, 32)) == NULL)
+      break;
+    switch (c)
+    {
+    case 0x8001:
+      sim_put16(r, 0, DEVICE->devinfo.fwrev);
+      break;
+
+    case 0x8002:
+      sim_put16(r, 0, 0x8000 | sim->hwtype);
+      break;
+
+    case 0x8003:
+      strcpy((char *) r, cfw?"FLI Simulated CFW":"FLI Simulated Focuser");
+      break;
+
+    case 0x8006:
+      if (len >= 4)
+        sim_put32(r, 0, sim->extent);
+      else
+        sim_put16(r, 0, sim->extent);
+      break;
+
+    case 0x8008:
+      r[0] = 0x80;
+      r[1] = r[2] = (unsigned char) sim->slots;
+      if (sim->wheels > 1)
+        r[3] = (unsigned char) sim->slots;
+      break;
+
+    case 0x8009:
+      sim_put16(r, 0, 0x8000 | (sim->steprate & 0x7fff));
+      break;
+
+    case 0x800a:
+      sim_put16(r, 0, 0x8001);	/* One temperature sensor */
+      break;
+
+    default:
+      sim_put16(r, 0, c);
+      break;
+    }
+    return 0;
+
+  case 0xc000:
+    if (!cfw)
+      ;
+    else if (len >= 4)
+    {
+      /* Each wheel on its own, 0xff leaves one where it is */
+      sim_slot_to(sim, 0, cmd[2]);
+      if (sim->wheels > 1)
+        sim_slot_to(sim, 1, cmd[3]);
+    }
+    else if ((pos = c & 0x0fff) < sim->slots)
+    {
+      /* A position names a slot of each wheel */
+      sim_slot_to(sim, 0, sim->flash[512 + pos * 2]);
+      if (sim->wheels > 1)
+        sim_slot_to(sim, 1, sim->flash[512 + pos * 2 + 1]);
+    }
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, c);
+    return 0;
+
+  case 0x9000:
+  case 0xa000:
+    /* Longer moves carry the high bits in the command word */
+    if (len >= 4)
+      pos = ((c & 0x00ff) << 16) | (cmd[2] << 8) | cmd[3];
+    else
+      pos = c & 0x0fff;
+    if ((c & 0xf000) == 0xa000)
+      pos = -pos;
+    pos += sim_step_pos(sim, 0);
+    if (!cfw)
+      pos = (pos < 0)?0:MIN(pos, sim->extent);
+    sim_step_to(sim, 0, pos);
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, c & 0xf000);
+    return 0;
+
+  case 0x7000:
+    pos = sim_step_left(sim);
+    if ((r = sim_reply(sim, 4)) == NULL)
+      break;
+    if (len >= 4)
+      sim_put32(r, 0, pos);
+    else
+      sim_put16(r, 0, 0x7000 | ((pos > 0x0fff)?0x0fff:pos));
+    return 0;
+
+  case 0xf000:
+    for (pos = 0; pos < sim->wheels; pos++)
+      sim_step_to(sim, (int) pos,
+        cfw?((sim_step_pos(sim, (int) pos) + turn - 1) / turn) * turn:0);
+    sim->homing = 1;
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, c);
+    return 0;
+
+  case 0xb000:
+    pos = sim_step_left(sim);
+    if ((pos == 0) && sim->homing)
+    {
+      sim->homing = 0;
+      sim->homed = 1;
+    }
+    status = 0;
+    if (pos > 0)
+      status |= (sim->stepto[0] > sim->stepfrom[0])?
+        FLI_FOCUSER_STATUS_MOVING_OUT:FLI_FOCUSER_STATUS_MOVING_IN;
+    if (sim->homing)
+      status |= FLI_FILTER_STATUS_HOMING;
+    if (cfw && sim->homed)
+      status |= FLI_FILTER_STATUS_HOME_SUCCEEDED;
+    if ((pos == 0) && ((sim_step_pos(sim, 0) % turn) == 0))
+      status |= FLI_FILTER_STATUS_HOME;
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    r[0] = 0xb0;
+    r[1] = (unsigned char) status;
+    return 0;
+
+  case 0x6000:
+    pos = sim_step_pos(sim, 0);
+    if ((r = sim_reply(sim, 12)) == NULL)
+      break;
+    if (cfw)
+    {
+      r[9] = r[10] = (unsigned char) sim_slot(sim, 0);
+      r[11] = (sim->wheels > 1)?
+        (unsigned char) sim_slot(sim, 1):FLI_FILTER_POSITION_UNKNOWN;
+    }
+    else if (len >= 4)
+      sim_put32(r, 0, pos);
+    else
+      sim_put16(r, 0, 0x6000 | ((pos >> ((c & 0x01) * 8)) & 0xff));
+    return 0;
+
+  case 0x1000:
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    r[0] = (unsigned char) (signed char) SIM_BASE_TEMPERATURE;	/* Degrees, then 1/256ths */
+    return 0;
+
+  default:
+    if ((r = sim_reply(sim, 2)) == NULL)
+      break;
+    sim_put16(r, 0, c);
+    return 0;
+  }
+
+  return (r == NULL)?-ENOMEM:0;
+}
+
+/* Outgoing transfers are commands; incoming transfers drain the reply
+ * to the last command, or on the Proline data endpoint the image. */
+static long fli_sim_bulk(flidev_t dev, int ep, void *buf, long *len)
+{
+  fli_sim_t *sim;
+  uint64_t start;
+  long org = *len, n, err = 0;
+
+  CHKDEVICE(dev);
+
+  if ((sim = DEVICE->sim) == NULL)
+    return -ENODEV;
+
+  start = fli_trace_now();
+
+  if ((ep & 0x80) == 0)
+  {
+    unsigned char cmd[IOBUF_MAX_SIZ];
+
+    memset(cmd, 0, sizeof(cmd));
+    memcpy(cmd, buf, MIN(*len, (long) sizeof(cmd)));
+
+    if (*len < 2)
+      err = -EINVAL;
+    else if (sim->model == FLI_SIM_PROLINE)
+      err = sim_proline_command(dev, sim, cmd, *len);
+    else if ((sim->model == FLI_SIM_CFW) || (sim->model == FLI_SIM_FOCUSER))
+      err = sim_stepper_command(dev, sim, cmd, *len);
+    else
+      err = sim_maxcam_command(dev, sim, cmd, *len);
+
+    sim_stall(sim, 0);
+  }
+  else if ((sim->model == FLI_SIM_PROLINE) && (ep == 0x82))
+  {
+    /* In video mode the camera starts over once a frame is read, the
+     * same frame is sent again so rendering stays out of the readout */
+    if (sim->video && (sim->streamlen > 0) &&
+      (sim->streamidx >= sim->streamlen))
+    {
+      sim->streamidx = 0;
+      sim_start_exposure(sim);
+    }
+
+    sim_sleep(sim_timeleft(sim) * 1000);
+
+    sim->reads++;
+    n = MIN(*len, sim->streamlen - sim->streamidx);
+    if ((sim->nodataevery > 0) && ((sim->reads % sim->nodataevery) == 0))
+      n = 0;
+    else if ((sim->shortevery > 0) && ((sim->reads % sim->shortevery) == 0) &&
+      (n > 1))
+      n = (n / 2) | 1;
+
+    if (n > 0)
+    {
+      memcpy(buf, sim->stream + sim->streamidx, n);
+      sim->streamidx += n;
+    }
+    else
+    {
+      /* Nothing to send, the camera ends the transfer short */
+      n = MIN(*len, 3);
+      memset(buf, 0, n);
+    }
+    *len = n;
+
+    sim_stall(sim, n);
+  }
+  else
+  {
+    memset(buf, 0, *len);
+    n = MIN(*len, sim->replylen - sim->replyidx);
+    if (n > 0)
+    {
+      memcpy(buf, sim->reply + sim->replyidx, n);
+      sim->replyidx += n;
+    }
+    if (sim->replyexact)
+      *len = (n > 0)?n:0;
+
+    sim_stall(sim, *len);
+  }
+
+  if (FLI_TRACE_ACTIVE(DEVICE->trace))
+    fli_trace_record(DEVICE->trace, ep, buf, org, *len, err, start);
+
+  return err;
+}
+
+static long fli_sim_io(flidev_t dev, void *buf, long *wlen, long *rlen)
+{
+  long err;
+  int ep;
+
+  ep = (DEVICE->devinfo.devid == FLIUSB_PROLINE_ID)?0x01:0x02;
+
+  if ((*wlen > 0) && ((err = fli_sim_bulk(dev, ep, buf, wlen)) != 0))
+    return err;
+
+  if ((*rlen > 0) && ((err = fli_sim_bulk(dev, ep | 0x80, buf, rlen)) != 0))
+    return err;
+
+  return 0;
+}
+
+static long sim_option(fli_sim_t *sim, char *key, char *val, long *fwrev,
+  char **serial)
+{
+  if (val == NULL)
+    return -EINVAL;
+
+  if (strcmp(key, "width") == 0)
+    sim->width = strtol(val, NULL, 0);
+  else if (strcmp(key, "height") == 0)
+    sim->height = strtol(val, NULL, 0);
+  else if (strcmp(key, "quad") == 0)
+    sim->quadrants = strtol(val, NULL, 0);
+  else if (strcmp(key, "order") == 0)
+  {
+    if (strcmp(val, "le") == 0)
+      sim->little_endian = 1;
+    else if (strcmp(val, "be") == 0)
+      sim->little_endian = 0;
+    else
+      return -EINVAL;
+  }
+  else if (strcmp(key, "bw") == 0)
+    sim->bandwidth = strtol(val, NULL, 0);
+  else if (strcmp(key, "latency") == 0)
+    sim->latency = strtol(val, NULL, 0);
+  else if (strcmp(key, "short") == 0)
+    sim->shortevery = strtol(val, NULL, 0);
+  else if (strcmp(key, "nodata") == 0)
+    sim->nodataevery = strtol(val, NULL, 0);
+  else if (strcmp(key, "stars") == 0)
+    sim->nstars = strtol(val, NULL, 0);
+  else if (strcmp(key, "seed") == 0)
+    sim->rng = (uint32_t) strtoul(val, NULL, 0);
+  else if (strcmp(key, "bias") == 0)
+    sim->bias = strtol(val, NULL, 0);
+  else if (strcmp(key, "noise") == 0)
+    sim->noise = strtol(val, NULL, 0);
+  else if (strcmp(key, "focus") == 0)
+  {
+    sim->focus = strtol(val, NULL, 0);
+    sim->focusset = 1;
+  }
+  else if (strcmp(key, "defocus") == 0)
+    sim->defocus = strtol(val, NULL, 0);
+  else if (strcmp(key, "slots") == 0)
+    sim->slots = strtol(val, NULL, 0);
+  else if (strcmp(key, "slotsteps") == 0)
+    sim->slotsteps = strtol(val, NULL, 0);
+  else if (strcmp(key, "wheels") == 0)
+    sim->wheels = strtol(val, NULL, 0);
+  else if (strcmp(key, "hwtype") == 0)
+    sim->hwtype = strtol(val, NULL, 0);
+  else if (strcmp(key, "flashmax") == 0)
+    sim->flashmax = strtol(val, NULL, 0);
+  else if (strcmp(key, "extent") == 0)
+    sim->extent = strtol(val, NULL, 0);
+  else if (strcmp(key, "rate") == 0)
+    sim->steprate = strtol(val, NULL, 0);
+  else if (strcmp(key, "fwrev") == 0)
+    *fwrev = strtol(val, NULL, 0);
+  else if (strcmp(key, "serial") == 0)
+    *serial = val;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
+long fli_sim_connect(flidev_t dev, char *options)
+{
+  fli_sim_t *sim;
+  char *copy, *opt, *next, *val;
+  char *serial = "SIM0001";
+  long fwrev = -1, err = 0, i;
+
+  CHKDEVICE(dev);
+
+  if ((sim = xcalloc(1, sizeof(fli_sim_t))) == NULL)
+    return -ENOMEM;
+  DEVICE->sim = sim;
+
+  sim->width = 1024;
+  sim->height = 1024;
+  sim->quadrants = 4;
+  sim->nstars = 50;
+  sim->rng = 1;
+  sim->bias = 1000;
+  sim->noise = 10;
+  sim->hbin = 1;
+  sim->vbin = 1;
+  sim->setpoint = SIM_BASE_TEMPERATURE;
+  sim->defocus = 20;
+  sim->slots = 7;
+  sim->slotsteps = 120;
+  sim->steprate = 600;
+  sim->extent = 7000;
+  sim->flashmax = 128;
+  sim->wheels = 1;
+  sim->hwtype = 0xff;
+
+  if ((copy = xstrdup(options)) == NULL)
+    return -ENOMEM;
+
+  for (opt = copy, i = 0; (opt != NULL) && (err == 0); opt = next, i++)
+  {
+    if ((next = strchr(opt, ',')) != NULL)
+      *next++ = '\0';
+    if ((val = strchr(opt, '=')) != NULL)
+      *val++ = '\0';
+
+    if (i == 0)
+    {
+      if (strcmp(opt, "proline") == 0)
+        sim->model = FLI_SIM_PROLINE;
+      else if (strcmp(opt, "maxcam") == 0)
+        sim->model = FLI_SIM_MAXCAM;
+      else if (strcmp(opt, "cfw") == 0)
+        sim->model = FLI_SIM_CFW;
+      else if (strcmp(opt, "focuser") == 0)
+        sim->model = FLI_SIM_FOCUSER;
+      else
+        err = -EINVAL;
+    }
+    else
+      err = sim_option(sim, opt, val, &fwrev, &serial);
+
+    if (err)
+      debug(FLIDEBUG_FAIL, "Sim: bad option \"%s\"", opt);
+  }
+
+  if ((err == 0) && ((sim->width < 1) || (sim->width > 0xffff) ||
+    (sim->height < 1) || (sim->height > 0xffff) ||
+    (sim->slots < 1) || (sim->slots > 0xff) || (sim->slotsteps < 1) || (sim->extent < 1) ||
+    (sim->wheels < 1) || (sim->wheels > FLI_SIM_WHEELS) ||
+    (sim->hwtype < 0) || (sim->hwtype > 0xff) || (sim->defocus < 1) ||
+    (sim->steprate < 1) || (sim->steprate > 0x7fff)))
+    err = -EINVAL;
+
+  if (err == 0)
+    DEVICE->devinfo.serial = fli_dev_strdup(dev, serial);
+  xfree(copy);
+
+  if (err)
+    return err;
+
+  if (sim->rng == 0)
+    sim->rng = 1;
+
+  if ((sim->nstars > 0) &&
+    ((sim->stars = xcalloc(sim->nstars, sizeof(fli_sim_star_t))) == NULL))
+    return -ENOMEM;
+
+  /* Mostly faint stars, a few bright ones */
+  for (i = 0; i < sim->nstars; i++)
+  {
+    double u = sim_uniform(sim);
+
+    sim->stars[i].x = (float) (sim_uniform(sim) * sim->width);
+    sim->stars[i].y = (float) (sim_uniform(sim) * sim->height);
+    sim->stars[i].peak = (float) (200.0 + 20000.0 * u * u * u);
+    sim->stars[i].sigma = (float) (1.0 + 1.5 * sim_uniform(sim));
+  }
+
+  /* Filter names, 8 characters a slot, then the slots of each wheel
+   * that make up a position */
+  if (sim->model == FLI_SIM_CFW)
+  {
+    if ((sim->flash = xcalloc(1, FLI_SIM_FLASH_SIZE)) == NULL)
+      return -ENOMEM;
+    for (i = 0; i < sim->slots; i++)
+    {
+      snprintf((char *) sim->flash + i * 8, 8, "Filt%02x", (unsigned char) i);
+      sim->flash[512 + i * 2] = (unsigned char) i;
+      sim->flash[512 + i * 2 + 1] = FLI_FILTER_POSITION_UNKNOWN;
+    }
+  }
+
+  if (sim->model == FLI_SIM_PROLINE)
+  {
+    DEVICE->devinfo.devid = FLIUSB_PROLINE_ID;
+    DEVICE->devinfo.fwrev = (fwrev < 0)?0x0200:fwrev;
+    DEVICE->devinfo.hwrev = 0x0100;
+  }
+  else if (sim->model == FLI_SIM_CFW)
+  {
+    DEVICE->devinfo.devid = FLIUSB_FILTER_ID;
+    DEVICE->devinfo.fwrev = (fwrev < 0)?0x8042:fwrev;
+    DEVICE->devinfo.hwrev = 0x0100;
+  }
+  else if (sim->model == FLI_SIM_FOCUSER)
+  {
+    DEVICE->devinfo.devid = FLIUSB_FOCUSER_ID;
+    DEVICE->devinfo.fwrev = (fwrev < 0)?0x8043:fwrev;
+    DEVICE->devinfo.hwrev = 0x0100;
+  }
+  else
+  {
+    DEVICE->devinfo.devid = FLIUSB_CAM_ID;
+    /* Older MaxCam firmware needs a parameter download we don't model */
+    DEVICE->devinfo.fwrev = (fwrev < 0x0201)?0x0201:fwrev;
+    DEVICE->devinfo.hwrev = 0x0200;
+  }
+  DEVICE->devinfo.serno = 1;
+
+  DEVICE->fli_io = fli_sim_io;
+  DEVICE->fli_bulk = fli_sim_bulk;
+
+  if (sim->model == FLI_SIM_FOCUSER)
+  {
+    SIM_LOCK();
+    sim_focuser = sim;
+    SIM_UNLOCK();
+  }
+
+  if (sim->model == FLI_SIM_CFW)
+    debug(FLIDEBUG_INFO, "Sim: cfw %ld slots, %ld steps/slot at %ld steps/s",
+      sim->slots, sim->slotsteps, sim->steprate);
+  else if (sim->model == FLI_SIM_FOCUSER)
+    debug(FLIDEBUG_INFO, "Sim: focuser extent %ld at %ld steps/s",
+      sim->extent, sim->steprate);
+  else
+    debug(FLIDEBUG_INFO, "Sim: %s %ldx%ld, %ld quadrants, %ld stars",
+      (sim->model == FLI_SIM_PROLINE)?"proline":"maxcam",
+      sim->width, sim->height, sim->quadrants, sim->nstars);
+
+  return 0;
+}
+
+void fli_sim_free(fli_sim_t *sim)
+{
+  if (sim == NULL)
+    return;
+
+  SIM_LOCK();
+  if (sim == sim_focuser)
+    sim_focuser = NULL;
+  SIM_UNLOCK();
+  if (sim->stars != NULL)
+    xfree(sim->stars);
+  if (sim->reply != NULL)
+    xfree(sim->reply);
+  if (sim->stream != NULL)
+    xfree(sim->stream);
+  if (sim->flash != NULL)
+    xfree(sim->flash);
+  xfree(sim);
+}
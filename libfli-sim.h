@@ -0,0 +1,157 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+
+#ifndef _LIBFLI_SIM_H_
+#define _LIBFLI_SIM_H_
+
+#include <stdint.h>
+
+/* Simulated USB camera
+ *
+ * Opening a camera named "sim:<model>[,option=value...]" in the USB
+ * domain connects it to an in-process transport that answers the
+ * Proline or MaxCam command set instead of a real device, so the
+ * readout path can be exercised and timed without hardware. The
+ * Proline simulator also supports video mode. "sim:cfw" and
+ * "sim:focuser" are a filter wheel and a focuser whose moves take as
+ * long as the motor would.
+ *
+ *   model      proline, maxcam, cfw or focuser
+ *   width      visible columns (default 1024)
+ *   height     visible rows (default 1024)
+ *   quad       Proline readout amplifiers, 1, 2 or 4 (default 4)
+ *   order      pixel byte order on the wire, be or le (default be)
+ *   bw         readout bandwidth in bytes/s, 0 for unlimited
+ *   latency    usec added to every transfer
+ *   short      end every nth image read early, at an odd length
+ *   nodata     answer every nth image read with the "no data" reply
+ *   stars      stars in the synthetic field (default 50)
+ *   seed       field and noise seed
+ *   bias       bias level in ADU (default 1000)
+ *   focus      focuser position the stars are sharpest at; away from
+ *              it they blur with the position of an open sim focuser
+ *   defocus    focuser steps per pixel of blur (default 20)
+ *   noise      peak read noise in ADU (default 10)
+ *   slots      filter wheel positions (default 7)
+ *   slotsteps  motor steps between slots (default 120)
+ *   extent     focuser travel in steps (default 7000)
+ *   wheels     filter wheels moved together, 1 or 2 (default 1)
+ *   hwtype     filter wheel hardware type, below 0xfe for the older
+ *              step table driven wheels (default 0xff)
+ *   flashmax   longest flash read the filter wheel answers (default 128)
+ *   rate       motor steps/s (default 600)
+ *   serial     serial number string
+ *   fwrev      firmware revision reported to the library
+ */
+
+#define FLI_SIM_PREFIX "sim:"
+
+#define FLI_SIM_PROLINE (0)
+#define FLI_SIM_MAXCAM (1)
+#define FLI_SIM_CFW (2)
+#define FLI_SIM_FOCUSER (3)
+
+#define FLI_SIM_WHEELS (2)
+#define FLI_SIM_FLASH_BASE (0x3000)	/* Filter name table */
+#define FLI_SIM_FLASH_SIZE (1024)
+
+typedef struct {
+  float x, y;			/* Array coordinates */
+  float peak;			/* ADU/s at the center */
+  float sigma;			/* Pixels */
+} fli_sim_star_t;
+
+typedef struct _fli_sim_t {
+  int model;
+  long width, height;
+  long quadrants;
+  int little_endian;
+  long bandwidth;
+  long latency;
+  long shortevery, nodataevery;	/* Fault injection, every nth image read */
+  long reads;
+  long bias, noise;
+  uint32_t rng;
+
+  long nstars;
+  fli_sim_star_t *stars;
+
+  /* Camera state */
+  long exposure;		/* msec */
+  uint64_t expstart;		/* nsec, zero when idle */
+  int dark;
+  int video;			/* Proline, restart the frame once read */
+  double setpoint;
+  long focus, defocus;		/* Blur follows the sim focuser, see focus */
+  int focusset;
+  long ulx, uly, hbin, vbin;	/* Frame setup */
+  long cols, rows;		/* Proline frame size, binned */
+  long row;			/* MaxCam readout row, array coordinates */
+
+  /* Filter wheel and focuser state */
+  long slots, slotsteps, steprate;
+  long extent;
+  long wheels, hwtype;
+  long stepfrom[FLI_SIM_WHEELS];	/* Motor position in steps */
+  long stepto[FLI_SIM_WHEELS];
+  uint64_t stepstart[FLI_SIM_WHEELS];	/* nsec, when the last move began */
+  int homing, homed;
+  unsigned char *flash;		/* Name table */
+  long flashmax;
+
+  /* Reply to the last command */
+  unsigned char *reply;
+  long replysiz, replylen, replyidx;
+  int replyexact;		/* Reads end with the reply, not padded */
+
+  /* Proline image stream */
+  unsigned char *stream;
+  long streamsiz, streamlen, streamidx;
+} fli_sim_t;
+
+long fli_sim_connect(flidev_t dev, char *options);
+void fli_sim_free(fli_sim_t *sim);
+
+#endif /* _LIBFLI_SIM_H_ */
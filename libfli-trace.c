@@ -0,0 +1,368 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+
+/* Writers claim a slot by bumping the head and publish it by storing
+ * its sequence number last; readers treat a record whose sequence
+ * number changed while it was copied as torn and skip it. */
+#ifdef _WIN32
+#define TRACE_CLAIM(p) ((uint64_t) InterlockedExchangeAdd64((volatile LONG64 *) (p), 1))
+#define TRACE_LOAD(p) ((uint64_t) InterlockedCompareExchange64((volatile LONG64 *) (p), 0, 0))
+#define TRACE_STORE(p, v) InterlockedExchange64((volatile LONG64 *) (p), (LONG64) (v))
+#define TRACE_FENCE() MemoryBarrier()
+#else
+#define TRACE_CLAIM(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define TRACE_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define TRACE_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+static long fli_trace_replay_bulk(flidev_t dev, int ep, void *buf, long *len);
+static long fli_trace_replay_io(flidev_t dev, void *buf, long *wlen, long *rlen);
+
+uint64_t fli_trace_now(void)
+{
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+
+  return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000ull +
+    (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void fli_trace_record(fli_trace_t *trace, int ep, const void *buf, long len,
+  long actual, long status, uint64_t start)
+{
+  fli_trace_rec_t *rec;
+  uint64_t seq;
+  long n;
+
+  seq = TRACE_CLAIM(&trace->head);
+  rec = &trace->rec[seq & trace->mask];
+
+  TRACE_STORE(&rec->seq, 0);
+  TRACE_FENCE();
+
+  rec->ts = start;
+  rec->duration = fli_trace_now() - start;
+  rec->status = status;
+  rec->ep = ep;
+  rec->len = len;
+  rec->actual = actual;
+
+  /* Outgoing data is what we asked to send, incoming what arrived */
+  n = (ep & 0x80)?actual:len;
+  n = (n < 0)?0:MIN(n, FLI_TRACE_PREFIX);
+  if ((n > 0) && (buf != NULL))
+    memcpy(rec->data, buf, n);
+
+  TRACE_STORE(&rec->seq, seq + 1);
+}
+
+fli_trace_t *fli_trace_alloc(long depth)
+{
+  fli_trace_t *trace;
+  uint32_t n = 16;
+
+  while ((n < (uint32_t) depth) && (n < (1u << 24)))
+    n <<= 1;
+
+  if ((trace = xcalloc(1, sizeof(fli_trace_t))) == NULL)
+    return NULL;
+
+  if ((trace->rec = xcalloc(n, sizeof(fli_trace_rec_t))) == NULL)
+  {
+    xfree(trace);
+    return NULL;
+  }
+
+  trace->mask = n - 1;
+
+  return trace;
+}
+
+void fli_trace_free(fli_trace_t *trace)
+{
+  if (trace == NULL)
+    return;
+
+  if (trace->rec != NULL)
+    xfree(trace->rec);
+  if (trace->replay != NULL)
+    xfree(trace->replay);
+  xfree(trace);
+}
+
+long fli_trace_dump(flidev_t dev, char *filename)
+{
+  fli_trace_t *trace;
+  fli_trace_hdr_t hdr;
+  uint64_t head, seq;
+  FILE *f;
+  long err = 0;
+
+  CHKDEVICE(dev);
+
+  if ((trace = DEVICE->trace) == NULL)
+    return -EINVAL;
+
+  if ((f = fopen(filename, "wb")) == NULL)
+    return -errno;
+
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, FLI_TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = FLI_TRACE_VERSION;
+  hdr.reclen = sizeof(fli_trace_rec_t);
+  hdr.devid = DEVICE->devinfo.devid;
+  hdr.fwrev = DEVICE->devinfo.fwrev;
+  hdr.hwrev = DEVICE->devinfo.hwrev;
+  if (DEVICE->devinfo.serial != NULL)
+    strncpy(hdr.serial, DEVICE->devinfo.serial, sizeof(hdr.serial) - 1);
+  if (DEVICE->devinfo.model != NULL)
+    strncpy(hdr.model, DEVICE->devinfo.model, sizeof(hdr.model) - 1);
+  if (DEVICE->name != NULL)
+    strncpy(hdr.name, DEVICE->name, sizeof(hdr.name) - 1);
+
+  /* Count is filled in once we know how many records survived */
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+    err = -EIO;
+
+  head = TRACE_LOAD(&trace->head);
+  seq = (head > (uint64_t) trace->mask + 1)?head - trace->mask - 1:0;
+
+  for (; (err == 0) && (seq < head); seq++)
+  {
+    fli_trace_rec_t *rec = &trace->rec[seq & trace->mask];
+    fli_trace_rec_t copy;
+
+    if (TRACE_LOAD(&rec->seq) != seq + 1)
+      continue;
+
+    memcpy(&copy, rec, sizeof(copy));
+    TRACE_FENCE();
+
+    if (TRACE_LOAD(&rec->seq) != seq + 1)
+      continue;
+
+    if (fwrite(&copy, sizeof(copy), 1, f) != 1)
+      err = -EIO;
+    else
+      hdr.count++;
+  }
+
+  if ((err == 0) && ((fseek(f, 0, SEEK_SET) != 0) ||
+    (fwrite(&hdr, sizeof(hdr), 1, f) != 1)))
+    err = -EIO;
+
+  if ((fclose(f) != 0) && (err == 0))
+    err = -errno;
+
+  debug(FLIDEBUG_INFO, "Trace: wrote %d records to %s", hdr.count, filename);
+
+  return err;
+}
+
+long fli_trace_replay_connect(flidev_t dev, char *filename)
+{
+  fli_trace_t *trace;
+  fli_trace_hdr_t hdr;
+  FILE *f;
+
+  CHKDEVICE(dev);
+
+  if ((f = fopen(filename, "rb")) == NULL)
+    return -errno;
+
+  if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+    (memcmp(hdr.magic, FLI_TRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+    (hdr.version != FLI_TRACE_VERSION) ||
+    (hdr.reclen != sizeof(fli_trace_rec_t)))
+  {
+    debug(FLIDEBUG_FAIL, "Trace: %s is not a trace file", filename);
+    fclose(f);
+    return -EINVAL;
+  }
+
+  if ((trace = DEVICE->trace) == NULL)
+  {
+    if ((trace = fli_trace_alloc(FLI_TRACE_DEPTH_DEFAULT)) == NULL)
+    {
+      fclose(f);
+      return -ENOMEM;
+    }
+    DEVICE->trace = trace;
+  }
+
+  if ((hdr.count > 0) &&
+    ((trace->replay = xcalloc(hdr.count, sizeof(fli_trace_rec_t))) == NULL))
+  {
+    fclose(f);
+    return -ENOMEM;
+  }
+
+  trace->nreplay = fread(trace->replay, sizeof(fli_trace_rec_t), hdr.count, f);
+  trace->cursor = 0;
+  trace->hdr = hdr;
+  fclose(f);
+
+  if (trace->nreplay != hdr.count)
+    debug(FLIDEBUG_WARN, "Trace: %s truncated, %d of %d records",
+      filename, trace->nreplay, hdr.count);
+
+  DEVICE->devinfo.devid = hdr.devid;
+  DEVICE->devinfo.fwrev = hdr.fwrev;
+  if (hdr.serial[0] != '\0')
+    DEVICE->devinfo.serial = fli_dev_strndup(dev, hdr.serial, sizeof(hdr.serial));
+
+  DEVICE->fli_io = fli_trace_replay_io;
+  DEVICE->fli_bulk = fli_trace_replay_bulk;
+
+  debug(FLIDEBUG_INFO, "Trace: replaying %d records from %s (%s)",
+    trace->nreplay, filename, hdr.name);
+
+  return 0;
+}
+
+/* Serve the next recorded transfer on ep. Only the recorded prefix of
+ * each payload is known, the rest of an incoming buffer is zeroed. */
+static long fli_trace_replay_bulk(flidev_t dev, int ep, void *buf, long *len)
+{
+  fli_trace_t *trace;
+  fli_trace_rec_t *rec = NULL;
+  long n;
+
+  CHKDEVICE(dev);
+
+  if ((trace = DEVICE->trace) == NULL)
+    return -ENODEV;
+
+  while (trace->cursor < trace->nreplay)
+  {
+    rec = &trace->replay[trace->cursor++];
+    if (rec->ep == ep)
+      break;
+
+    debug(FLIDEBUG_WARN, "Trace: skipping record on ep 0x%02x, want 0x%02x",
+      rec->ep, ep);
+    rec = NULL;
+  }
+
+  if (rec == NULL)
+  {
+    debug(FLIDEBUG_WARN, "Trace: replay exhausted");
+    *len = 0;
+    return -EIO;
+  }
+
+  if (ep & 0x80)
+  {
+    n = MIN(*len, rec->actual);
+    memset(buf, 0, n);
+    memcpy(buf, rec->data, MIN(n, FLI_TRACE_PREFIX));
+    *len = n;
+  }
+  else
+  {
+    n = MIN(MIN(*len, rec->len), FLI_TRACE_PREFIX);
+    if (memcmp(buf, rec->data, n) != 0)
+      debug(FLIDEBUG_WARN, "Trace: outgoing data differs from record %d",
+        trace->cursor - 1);
+    *len = MIN(*len, rec->actual);
+  }
+
+  if (FLI_TRACE_ACTIVE(trace))
+    fli_trace_record(trace, ep, buf, rec->len, *len, rec->status,
+      fli_trace_now());
+
+  return rec->status;
+}
+
+static long fli_trace_replay_io(flidev_t dev, void *buf, long *wlen, long *rlen)
+{
+  long err;
+  int ep;
+
+  switch (DEVICE->devinfo.devid)
+  {
+  case FLIUSB_PROLINE_ID:
+    ep = 0x01;
+    break;
+
+  default:
+    ep = 0x02;
+    break;
+  }
+
+  if ((*wlen > 0) && ((err = fli_trace_replay_bulk(dev, ep, buf, wlen)) != 0))
+    return err;
+
+  if ((*rlen > 0) && ((err = fli_trace_replay_bulk(dev, ep | 0x80, buf, rlen)) != 0))
+    return err;
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifndef _LIBFLI_TRACE_H_
+#define _LIBFLI_TRACE_H_
+
+#include <stdint.h>
+
+/* USB transaction trace
+ *
+ * Each device may carry a ring of fixed size binary records, one per
+ * bulk transfer, written without locks or formatting so tracing can
+ * stay enabled in production. The ring can be dumped to a file and a
+ * dump can be opened as a device ("replay:<file>"), which serves the
+ * recorded transfers back through a fake transport.
+ */
+
+#define FLI_TRACE_PREFIX (64)		/* Payload bytes kept per transfer */
+#define FLI_TRACE_DEPTH_DEFAULT (1024)	/* Records, rounded to a power of two */
+#define FLI_TRACE_MAGIC "FLITRACE"
+#define FLI_TRACE_VERSION (1)
+#define FLI_TRACE_REPLAY_PREFIX "replay:"
+
+typedef struct {
+  uint64_t seq;			/* Sequence number + 1, 0 while being written */
+  uint64_t ts;			/* Start of transfer, nsec, monotonic */
+  uint64_t duration;		/* nsec */
+  int32_t status;		/* Zero or -errno */
+  int32_t ep;
+  int32_t len;			/* Requested */
+  int32_t actual;		/* Transferred */
+  uint8_t data[FLI_TRACE_PREFIX];
+} fli_trace_rec_t;
+
+/* Dump file header, followed by count records. Host byte order. */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reclen;
+  uint32_t count;
+  int32_t devid;
+  int32_t fwrev;
+  int32_t hwrev;
+  char serial[32];
+  char model[32];
+  char name[64];
+} fli_trace_hdr_t;
+
+typedef struct _fli_trace_t {
+  volatile int enabled;
+  uint64_t head;		/* Next sequence number */
+  uint32_t mask;
+  fli_trace_rec_t *rec;
+
+  /* Replay source */
+  fli_trace_hdr_t hdr;
+  fli_trace_rec_t *replay;
+  uint32_t nreplay;
+  uint32_t cursor;
+} fli_trace_t;
+
+uint64_t fli_trace_now(void);
+void fli_trace_record(fli_trace_t *trace, int ep, const void *buf, long len,
+  long actual, long status, uint64_t start);
+fli_trace_t *fli_trace_alloc(long depth);
+void fli_trace_free(fli_trace_t *trace);
+long fli_trace_dump(flidev_t dev, char *filename);
+long fli_trace_replay_connect(flidev_t dev, char *filename);
+
+/* Cheap enough to leave in every transfer path */
+#define FLI_TRACE_ACTIVE(t) (((t) != NULL) && (t)->enabled)
+
+#endif /* _LIBFLI_TRACE_H_ */
@@ -0,0 +1,291 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+#include "libfli-tune.h"
+#include "libfli-keyfile.h"
+
+static void tune_apply(flidev_t dev, fli_tune_t *tune, long xfer, long depth)
+{
+  tune->xfer = xfer;
+  tune->depth = 0;
+
+  if ((depth > 0) && (DEVICE->fli_queue_depth != NULL))
+    tune->depth = DEVICE->fli_queue_depth(dev, depth);
+}
+
+/* Every size from xfer_min up to xfer_max in powers of two, crossed with
+ * every queue depth the transport takes. The starting setting goes
+ * first, so a search that never finishes behaves as an untuned device. */
+static void tune_candidates(flidev_t dev, fli_tune_t *tune)
+{
+  long xfer, depth;
+  int n = 0;
+
+  memset(tune->cand, 0, sizeof(tune->cand));
+  tune->cand[n].xfer = tune->xfer;
+  tune->cand[n].depth = tune->depth;
+  n++;
+
+  for (xfer = tune->xfer_min; xfer <= tune->xfer_max; xfer *= 2)
+  {
+    depth = (DEVICE->fli_queue_depth != NULL)?1:0;
+    do
+    {
+      if (((xfer != tune->cand[0].xfer) || (depth != tune->cand[0].depth)) &&
+        (n < FLI_TUNE_CAND_MAX))
+      {
+        tune->cand[n].xfer = xfer;
+        tune->cand[n].depth = depth;
+        n++;
+      }
+      depth *= 2;
+    } while ((depth > 0) && (depth <= FLI_TUNE_DEPTH_MAX));
+  }
+
+  tune->ncand = n;
+  tune->cur = 0;
+}
+
+/* One line per device: <key> <xfer> <depth> */
+static long tune_load(fli_tune_t *tune, long *xfer, long *depth)
+{
+  char path[1024], line[256], key[128];
+  FILE *f;
+  long x, d, r = -ENOENT;
+
+  if ((fli_keyfile_path("FLI_TUNE_FILE", FLI_TUNE_FILE_DEFAULT, path,
+    sizeof(path)) == NULL) ||
+    ((f = fopen(path, "r")) == NULL))
+    return -ENOENT;
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if ((sscanf(line, "%127s %ld %ld", key, &x, &d) == 3) &&
+      (strcmp(key, tune->key) == 0))
+    {
+      *xfer = x;
+      *depth = d;
+      r = 0;
+    }
+  }
+  fclose(f);
+
+  return r;
+}
+
+static long tune_save(fli_tune_t *tune)
+{
+  char path[1024], line[256];
+
+  if (fli_keyfile_path("FLI_TUNE_FILE", FLI_TUNE_FILE_DEFAULT, path,
+    sizeof(path)) == NULL)
+    return -ENOENT;
+
+  snprintf(line, sizeof(line), "%s %ld %ld\n", tune->key, tune->xfer,
+    tune->depth);
+
+  return fli_keyfile_put(path, tune->key, line, sizeof(line));
+}
+
+long fli_tune_open(flidev_t dev, long xfer, long xfer_min, long xfer_max)
+{
+  fli_tune_t *tune;
+  char *env, *p;
+  long fxfer = 0, fdepth = 0, x, d;
+  int retune = 0;
+
+  if (DEVICE->tune != NULL)
+  {
+    fli_tune_free(DEVICE->tune);
+    DEVICE->tune = NULL;
+  }
+
+  if ((tune = xcalloc(1, sizeof(fli_tune_t))) == NULL)
+    return -ENOMEM;
+
+  tune->xfer_def = xfer;
+  tune->xfer_min = xfer_min;
+  tune->xfer_max = xfer_max;
+
+  /* Nothing to learn from a simulated or replayed transport */
+  tune->persist = (DEVICE->sim == NULL) &&
+    ((DEVICE->trace == NULL) || (DEVICE->trace->replay == NULL));
+
+  snprintf(tune->key, sizeof(tune->key), "%s@%s",
+    ((DEVICE->devinfo.serial != NULL) && (DEVICE->devinfo.serial[0] != '\0'))?
+    DEVICE->devinfo.serial:"-",
+    (DEVICE->devinfo.buspath != NULL)?DEVICE->devinfo.buspath:DEVICE->name);
+  for (p = tune->key; *p != '\0'; p++)
+    if (isspace((unsigned char) *p))
+      *p = '_';
+
+  tune_apply(dev, tune, xfer, (DEVICE->fli_queue_depth != NULL)?
+    DEVICE->fli_queue_depth(dev, 0):0);
+  DEVICE->tune = tune;
+
+  if ((env = getenv("FLI_TUNE")) != NULL)
+  {
+    if (strcmp(env, "retune") == 0)
+      retune = 1;
+    else
+    {
+      if ((strcmp(env, "off") != 0) &&
+        ((sscanf(env, "%ld,%ld", &fxfer, &fdepth) < 1) ||
+          (fli_tune_set(dev, fxfer, fdepth) != 0)))
+        debug(FLIDEBUG_WARN, "Ignoring FLI_TUNE=%s", env);
+      tune->state = FLI_TUNE_FIXED;
+      return 0;
+    }
+  }
+  else if (tune->persist == 0)
+  {
+    tune->state = FLI_TUNE_FIXED;
+    return 0;
+  }
+
+  if ((retune == 0) && tune->persist && (tune_load(tune, &x, &d) == 0) &&
+    (x >= xfer_min) && (x <= xfer_max))
+  {
+    debug(FLIDEBUG_INFO, "Tuning for %s: %ld bytes, depth %ld",
+      tune->key, x, d);
+    tune_apply(dev, tune, x, d);
+    tune->state = FLI_TUNE_DONE;
+    return 0;
+  }
+
+  tune_candidates(dev, tune);
+  tune->state = FLI_TUNE_SEARCH;
+  debug(FLIDEBUG_INFO, "Tuning %s over %d candidates", tune->key, tune->ncand);
+
+  return 0;
+}
+
+void fli_tune_sample(flidev_t dev, long xfer, long len, uint64_t ns)
+{
+  fli_tune_t *tune = DEVICE->tune;
+  fli_tune_cand_t *c;
+  int i, best;
+
+  if ((tune == NULL) || (tune->state != FLI_TUNE_SEARCH))
+    return;
+
+  c = &tune->cand[tune->cur];
+  if ((xfer != c->xfer) || (len <= 0))
+    return;
+
+  c->bytes += len;
+  c->ns += ns;
+  if (c->bytes < FLI_TUNE_SAMPLE_BYTES)
+    return;
+
+  debug(FLIDEBUG_INFO, "Tuning: %ld bytes, depth %ld: %.1f MB/s", c->xfer,
+    c->depth, (c->ns > 0)?((double) c->bytes * 1000.0 / (double) c->ns):0.0);
+
+  if (++tune->cur < tune->ncand)
+  {
+    tune_apply(dev, tune, tune->cand[tune->cur].xfer,
+      tune->cand[tune->cur].depth);
+    return;
+  }
+
+  best = 0;
+  for (i = 1; i < tune->ncand; i++)
+    if ((double) tune->cand[i].bytes * (double) tune->cand[best].ns >
+      (double) tune->cand[best].bytes * (double) tune->cand[i].ns)
+      best = i;
+
+  tune_apply(dev, tune, tune->cand[best].xfer, tune->cand[best].depth);
+  tune->state = FLI_TUNE_DONE;
+  debug(FLIDEBUG_INFO, "Tuned %s: %ld bytes, depth %ld", tune->key,
+    tune->xfer, tune->depth);
+
+  if (tune->persist)
+    tune_save(tune);
+}
+
+/* A fixed setting, or with xfer zero a new search */
+long fli_tune_set(flidev_t dev, long xfer, long depth)
+{
+  fli_tune_t *tune = DEVICE->tune;
+
+  if (tune == NULL)
+    return -EINVAL;
+
+  if (xfer == 0)
+  {
+    tune_apply(dev, tune, tune->xfer_def, tune->depth);
+    tune_candidates(dev, tune);
+    tune->state = FLI_TUNE_SEARCH;
+    return 0;
+  }
+
+  /* Whole USB packets, within what the driver's buffers allow */
+  if ((xfer < 512) || (xfer > tune->xfer_max) || (xfer & 0x1ff) ||
+    (depth < 0) || (depth > FLI_TUNE_DEPTH_MAX))
+    return -EINVAL;
+
+  tune_apply(dev, tune, xfer, (depth > 0)?depth:tune->depth);
+  tune->state = FLI_TUNE_FIXED;
+
+  return 0;
+}
+
+void fli_tune_free(fli_tune_t *tune)
+{
+  xfree(tune);
+}
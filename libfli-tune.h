@@ -0,0 +1,108 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifndef _LIBFLI_TUNE_H_
+#define _LIBFLI_TUNE_H_
+
+#include <stdint.h>
+
+/* Transfer size tuning
+ *
+ * The best bulk transfer size, and the queue depth on transports that
+ * keep several transfers in flight, depends on the camera and on the
+ * hubs and host controller between it and us. Until a device has a
+ * setting the tuner steps through candidate combinations during the
+ * first readouts, timing full sized transfers, then keeps the fastest
+ * and stores it in a file keyed by serial number and bus path.
+ *
+ * FLI_TUNE=off|retune|<bytes>[,<depth>] overrides this, as does
+ * FLISetTransferTuning(). FLI_TUNE_FILE names the file, by default
+ * ~/.flitune.
+ */
+
+#define FLI_TUNE_XFER_MIN (16 * 1024)
+#define FLI_TUNE_XFER_MAX (512 * 1024)
+#define FLI_TUNE_CAND_MAX (32)
+#define FLI_TUNE_SAMPLE_BYTES (4 * 1024 * 1024) /* Timed per candidate */
+#define FLI_TUNE_DEPTH_MAX (16)
+#define FLI_TUNE_FILE_DEFAULT ".flitune"
+
+#define FLI_TUNE_SEARCH (0)
+#define FLI_TUNE_DONE (1)
+#define FLI_TUNE_FIXED (2)		/* Set by the user, not stored */
+
+typedef struct {
+  long xfer;
+  long depth;
+  uint64_t bytes;
+  uint64_t ns;
+} fli_tune_cand_t;
+
+typedef struct _fli_tune_t {
+  int state;
+  long xfer;			/* Bytes per bulk request */
+  long depth;			/* Transfers kept queued, 0 if not tunable */
+  long xfer_def, xfer_min, xfer_max;
+  int persist;
+  int ncand;
+  int cur;
+  fli_tune_cand_t cand[FLI_TUNE_CAND_MAX];
+  char key[128];
+} fli_tune_t;
+
+long fli_tune_open(flidev_t dev, long xfer, long xfer_min, long xfer_max);
+void fli_tune_sample(flidev_t dev, long xfer, long len, uint64_t ns);
+long fli_tune_set(flidev_t dev, long xfer, long depth);
+void fli_tune_free(fli_tune_t *tune);
+
+/* Transfer size to use, def when the device isn't tuned */
+#define FLI_TUNE_XFER(dev, def) \
+  ((FLI_DEVICE(dev)->tune != NULL) ? FLI_DEVICE(dev)->tune->xfer : (def))
+
+/* Only time transfers while there is something to learn */
+#define FLI_TUNE_SEARCHING(dev) \
+  ((FLI_DEVICE(dev)->tune != NULL) && \
+   (FLI_DEVICE(dev)->tune->state == FLI_TUNE_SEARCH))
+
+#endif /* _LIBFLI_TUNE_H_ */
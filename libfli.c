@@ -42,45 +42,205 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 #include "libfli-libfli.h"
 #include "libfli-mem.h"
 #include "libfli-debug.h"
+#include "libfli-trace.h"
+#include "libfli-sim.h"
+#include "libfli-tune.h"
+#include "libfli-sequence.h"
+#include "libfli-autofocus.h"
+#include "libfli-log.h"
 
 static long devalloc(flidev_t *dev);
 static long devfree(flidev_t dev);
 static long fli_open(flidev_t *dev, char *name, long domain);
 static long fli_close(flidev_t dev);
 static long fli_freelist(char **names);
+static void fli_enum_refresh(flidev_t dev);
+
+flidevdesc_t *fli_devpages[FLI_HANDLE_PAGES] = {NULL,};
+
+/* Free slot indices, taken from the top. Opening and closing take a
+ * short spin lock to use it; looking a handle up takes none. */
+static long *freeslots, nfreeslots, npages;
+static volatile long devlock;
+
+/* fli_close() sleeps here until the calls under way have finished; the
+ * last of them on a closing device wakes it */
+#ifdef _WIN32
+static SRWLOCK devidle_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE devidle = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t devidle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t devidle = PTHREAD_COND_INITIALIZER;
+#endif
 
-flidevdesc_t *devices[MAX_OPEN_DEVICES] = {NULL,};
+#ifdef _WIN32
+#define DEV_TRYLOCK() (InterlockedExchange(&devlock, 1) == 0)
+#define DEV_UNLOCK() InterlockedExchange(&devlock, 0)
+#define DEV_YIELD() SwitchToThread()
+#define DEV_LOAD_PAGE(p) \
+  ((flidevdesc_t *) InterlockedCompareExchangePointer((PVOID volatile *) (p), NULL, NULL))
+#define DEV_STORE_PAGE(p, v) InterlockedExchangePointer((PVOID volatile *) (p), (v))
+#define DEV_LOAD_HANDLE(p) InterlockedCompareExchange((p), 0, 0)
+#define DEV_STORE_HANDLE(p, h) InterlockedExchange((p), (h))
+#define DEV_LOAD(p) InterlockedCompareExchange((p), 0, 0)
+#define DEV_INC(p) InterlockedIncrement(p)
+#define DEV_DEC(p) InterlockedDecrement(p)
+#define DEV_CLOSE(p) (InterlockedCompareExchange((p), 1, 0) == 0)
+#define DEV_IDLE_LOCK() AcquireSRWLockExclusive(&devidle_lock)
+#define DEV_IDLE_UNLOCK() ReleaseSRWLockExclusive(&devidle_lock)
+#define DEV_IDLE_WAIT() SleepConditionVariableSRW(&devidle, &devidle_lock, INFINITE, 0)
+#define DEV_IDLE_WAKE() WakeAllConditionVariable(&devidle)
+#else
+#define DEV_TRYLOCK() (__atomic_exchange_n(&devlock, 1, __ATOMIC_ACQUIRE) == 0)
+#define DEV_UNLOCK() __atomic_store_n(&devlock, 0, __ATOMIC_RELEASE)
+#define DEV_YIELD() sched_yield()
+#define DEV_LOAD_PAGE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DEV_STORE_PAGE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define DEV_LOAD_HANDLE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DEV_STORE_HANDLE(p, h) __atomic_store_n((p), (h), __ATOMIC_RELEASE)
+#define DEV_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define DEV_INC(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define DEV_DEC(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define DEV_CLOSE(p) __sync_bool_compare_and_swap((p), 0, 1)
+#define DEV_IDLE_LOCK() pthread_mutex_lock(&devidle_lock)
+#define DEV_IDLE_UNLOCK() pthread_mutex_unlock(&devidle_lock)
+#define DEV_IDLE_WAIT() pthread_cond_wait(&devidle, &devidle_lock)
+#define DEV_IDLE_WAKE() pthread_cond_broadcast(&devidle)
+#endif
 
 //#define SHOWFUNCTIONS
 
 const char* version = \
 "Software Development Library for " __SYSNAME__ " " __LIBFLIVER__;
 
+/* Is dev the handle of an open device? Descriptors are never freed,
+ * so this is safe to call at any time, but a close may free what the
+ * descriptor points to; API calls hold it off with fli_dev_get(). */
+int fli_dev_valid(flidev_t dev)
+{
+  flidevdesc_t *page;
+  long idx;
+
+  if ((dev <= 0) || ((dev >> FLI_HANDLE_INDEX_BITS) > FLI_HANDLE_GEN_MAX))
+    return 0;
+
+  idx = FLI_HANDLE_INDEX(dev);
+  if ((page = DEV_LOAD_PAGE(&fli_devpages[idx >> FLI_HANDLE_PAGE_BITS])) == NULL)
+    return 0;
+
+  return DEV_LOAD_HANDLE(&page[idx & (FLI_HANDLE_PAGE_SIZE - 1)].handle) == dev;
+}
+
+/* Take a reference on an open device for the length of an API call.
+ * Refused once a close has started, and fli_close() frees nothing until
+ * every reference has been dropped with fli_dev_put(). */
+int fli_dev_get(flidev_t dev)
+{
+  flidevdesc_t *desc;
+
+  if (!fli_dev_valid(dev))
+    return 0;
+
+  desc = FLI_DEVICE(dev);
+  DEV_INC(&desc->inflight);
+
+  /* Either fli_close() sees this reference or we see it closing; the
+   * handle check catches a slot reused since fli_dev_valid() */
+  if (DEV_LOAD(&desc->closing) || (DEV_LOAD(&desc->handle) != dev))
+    return fli_dev_put(dev, 0);
+
+  return 1;
+}
+
+long fli_dev_put(flidev_t dev, long r)
+{
+  flidevdesc_t *desc = FLI_DEVICE(dev);
+
+  /* Taking the lock orders the wake after fli_close() starts waiting */
+  if ((DEV_DEC(&desc->inflight) == 0) && DEV_LOAD(&desc->closing))
+  {
+    DEV_IDLE_LOCK();
+    DEV_IDLE_WAKE();
+    DEV_IDLE_UNLOCK();
+  }
+
+  return r;
+}
+
+/* Add a page of slots, with the devlock held */
+static long devgrow(void)
+{
+  flidevdesc_t *page;
+  long *slots, i;
+
+  if (npages == FLI_HANDLE_PAGES)
+    return -ENODEV;
+
+  /* Pages and the free list live as long as the process, they are
+   * deliberately not tracked by xmalloc() */
+  if ((slots = realloc(freeslots, (npages + 1) * FLI_HANDLE_PAGE_SIZE *
+    sizeof(long))) == NULL)
+    return -ENOMEM;
+  freeslots = slots;
+
+  if ((page = calloc(FLI_HANDLE_PAGE_SIZE, sizeof(flidevdesc_t))) == NULL)
+    return -ENOMEM;
+
+  /* Lowest index on top */
+  for (i = FLI_HANDLE_PAGE_SIZE - 1; i >= 0; i--)
+    freeslots[nfreeslots++] = npages * FLI_HANDLE_PAGE_SIZE + i;
+
+  DEV_STORE_PAGE(&fli_devpages[npages], page);
+  npages++;
+
+  return 0;
+}
+
 static long devalloc(flidev_t *dev)
 {
-  int i;
+  flidevdesc_t *desc;
+  fli_arena_t *arena;
+  long idx, err = 0;
 
   if (dev == NULL)
     return -EINVAL;
 
-  for (i = 0; i < MAX_OPEN_DEVICES; i++)
-    if (devices[i] == NULL)
-      break;
+  if ((arena = xarena_create()) == NULL)
+    return -ENOMEM;
 
-  if (i == MAX_OPEN_DEVICES)
-    return -ENODEV;
+  while (!DEV_TRYLOCK())
+    DEV_YIELD();
 
-  if ((devices[i] =
-       (flidevdesc_t *)xcalloc(1, sizeof(flidevdesc_t))) == NULL)
-    return -ENOMEM;
+  if ((nfreeslots == 0) && ((err = devgrow()) != 0))
+  {
+    DEV_UNLOCK();
+    xarena_destroy(arena);
+    return err;
+  }
+
+  idx = freeslots[--nfreeslots];
+  desc = FLI_DEVICE(idx);
 
-  *dev = i;
+  memset(&desc->name, 0, sizeof(flidevdesc_t) - offsetof(flidevdesc_t, name));
+  desc->arena = arena;
+  desc->closing = 0;
+  desc->gen = (desc->gen % FLI_HANDLE_GEN_MAX) + 1;
+  *dev = (desc->gen << FLI_HANDLE_INDEX_BITS) | idx;
+  DEV_STORE_HANDLE(&desc->handle, *dev);
+
+  DEV_UNLOCK();
 
   return 0;
 }
@@ -92,30 +252,52 @@ static long devfree(flidev_t dev)
   if (DEVICE->io_data != NULL)
   {
     debug(FLIDEBUG_WARN, "close didn't free io_data (not NULL)");
-    xfree(DEVICE->io_data);
+    fli_dev_free(dev, DEVICE->io_data);
     DEVICE->io_data = NULL;
   }
   if (DEVICE->device_data != NULL)
   {
     debug(FLIDEBUG_WARN, "close didn't free device_data (not NULL)");
-    xfree(DEVICE->device_data);
+    fli_dev_free(dev, DEVICE->device_data);
     DEVICE->device_data = NULL;
   }
   if (DEVICE->sys_data != NULL)
   {
     debug(FLIDEBUG_WARN, "close didn't free sys_data (not NULL)");
-    xfree(DEVICE->sys_data);
+    fli_dev_free(dev, DEVICE->sys_data);
     DEVICE->sys_data = NULL;
   }
+  if (DEVICE->trace != NULL)
+  {
+    fli_trace_free(DEVICE->trace);
+    DEVICE->trace = NULL;
+  }
+  if (DEVICE->sim != NULL)
+  {
+    fli_sim_free(DEVICE->sim);
+    DEVICE->sim = NULL;
+  }
+  if (DEVICE->tune != NULL)
+  {
+    fli_tune_free(DEVICE->tune);
+    DEVICE->tune = NULL;
+  }
 
   if (DEVICE->name != NULL)
   {
-    xfree(DEVICE->name);
+    fli_dev_free(dev, DEVICE->name);
     DEVICE->name = NULL;
   }
 
-  xfree(DEVICE);
-  DEVICE = NULL;
+  /* Everything else allocated for the device goes in one step */
+  xarena_destroy(DEVICE->arena);
+  DEVICE->arena = NULL;
+
+  while (!DEV_TRYLOCK())
+    DEV_YIELD();
+  DEV_STORE_HANDLE(&DEVICE->handle, 0);
+  freeslots[nfreeslots++] = FLI_HANDLE_INDEX(dev);
+  DEV_UNLOCK();
 
   return 0;
 }
@@ -124,7 +306,7 @@ static long fli_open(flidev_t *dev, char *name, long domain)
 {
   int retval;
 
-  debug(FLIDEBUG_INFO, "Trying to open file <%s> in domain %d.",
+  debug(FLIDEBUG_INFO, "Trying to open file <%s> in domain %ld.",
 	name, domain);
 
   if ((retval = devalloc(dev)) != 0)
@@ -134,7 +316,7 @@ static long fli_open(flidev_t *dev, char *name, long domain)
     return retval;
   }
 
-  debug(FLIDEBUG_INFO, "Got device index %d", *dev);
+  debug(FLIDEBUG_INFO, "Got device handle 0x%lx", (unsigned long) *dev);
 
   if ((retval = fli_connect(*dev, name, domain)) != 0)
   {
@@ -144,7 +326,7 @@ static long fli_open(flidev_t *dev, char *name, long domain)
     return retval;
   }
 
-  if ((retval = devices[*dev]->fli_open(*dev)) != 0)
+  if ((retval = FLI_DEVICE(*dev)->fli_open(*dev)) != 0)
   {
     debug(FLIDEBUG_WARN, "open() error %d [%s]",
 	  retval, strerror(-retval));
@@ -153,6 +335,17 @@ static long fli_open(flidev_t *dev, char *name, long domain)
     return retval;
   }
 
+  {
+    unsigned long allocs;
+    size_t bytes;
+
+    xarena_usage(FLI_DEVICE(*dev)->arena, &allocs, &bytes);
+    FLI_DEVICE(*dev)->stats.open_allocs = allocs;
+    FLI_DEVICE(*dev)->stats.open_bytes = (unsigned long) bytes;
+    debug(FLIDEBUG_INFO, "Open made %lu allocations, %lu bytes",
+      allocs, (unsigned long) bytes);
+  }
+
   return retval;
 }
 
@@ -161,8 +354,19 @@ static long fli_close(flidev_t dev)
   CHKDEVICE(dev);
   CHKFUNCTION(DEVICE->fli_close);
 
-	debug(FLIDEBUG_INFO, "Closing device index: %d ", dev);
+  /* Refuse new calls, then let the ones under way finish before
+   * anything they use is torn down. A thread still holding the device
+   * lock can release it meanwhile, FLIUnlockDevice() is not refused. */
+  if (!DEV_CLOSE(&DEVICE->closing))
+    return -EINVAL;
+  DEV_IDLE_LOCK();
+  while (DEV_LOAD(&DEVICE->inflight) > 0)
+    DEV_IDLE_WAIT();
+  DEV_IDLE_UNLOCK();
+
+	debug(FLIDEBUG_INFO, "Closing device index: %ld ", dev);
 
+  fli_enum_refresh(dev);
 	DEVICE->fli_close(dev);
   fli_disconnect(dev);
   devfree(dev);
@@ -185,49 +389,194 @@ static long fli_freelist(char **names)
 }
 
 /* This is for FLI INTERNAL USE ONLY */
-#ifdef _WIN32
-long usb_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
-#elif defined(__APPLE__) && !defined(__LIBUSB__)
-long mac_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
-#define usb_bulktransfer mac_bulktransfer
-#elif defined(__LINUX__)
-long linux_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
-#define usb_bulktransfer linux_bulktransfer
-#else 
-long libusb_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
-#define usb_bulktransfer libusb_bulktransfer
-#endif
 
 LIBFLIAPI FLIStartVideoMode(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_START_VIDEO_MODE, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_START_VIDEO_MODE, 0));
 }
 
 LIBFLIAPI FLIStopVideoMode(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_STOP_VIDEO_MODE, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_STOP_VIDEO_MODE, 0));
 }
 
 LIBFLIAPI FLIGrabVideoFrame(flidev_t dev, void *buff, size_t size)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GRAB_VIDEO_FRAME, 2, buff, &size);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GRAB_VIDEO_FRAME, 2, buff, &size));
 }
 
 LIBFLIAPI FLIUsbBulkIO(flidev_t dev, int ep, void *buf, long *len)
 {
-	return usb_bulktransfer(dev, ep, buf, len);
+  ENTERDEVICE(dev);
+
+  if (DEVICE->fli_bulk == NULL)
+    return LEAVEDEVICE(dev, -EINVAL);
+
+	return LEAVEDEVICE(dev, DEVICE->fli_bulk(dev, ep, buf, len));
+}
+
+/**
+   Enable or disable the USB transaction trace of a device.  While
+   enabled, every bulk transfer is recorded (endpoint, length, time,
+   duration, status and the first bytes of the payload) in a ring of
+   \texttt{depth} records.  Recording is lock free and does no
+   formatting.  The ring is kept when tracing is disabled, so it can
+   still be dumped with \texttt{FLITraceDump()}.
+
+   @param dev Device handle.
+
+   @param depth Number of records to keep, rounded up to a power of
+   two; only used when the ring is first created.  Zero disables
+   tracing.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLITraceDump
+*/
+LIBFLIAPI FLITraceEnable(flidev_t dev, long depth)
+{
+  ENTERDEVICE(dev);
+
+  if (depth < 0)
+    return LEAVEDEVICE(dev, -EINVAL);
+
+  if (depth == 0)
+  {
+    if (DEVICE->trace != NULL)
+      DEVICE->trace->enabled = 0;
+    return LEAVEDEVICE(dev, 0);
+  }
+
+  if (DEVICE->trace == NULL)
+  {
+    if ((DEVICE->trace = fli_trace_alloc(depth)) == NULL)
+      return LEAVEDEVICE(dev, -ENOMEM);
+  }
+
+  DEVICE->trace->enabled = 1;
+
+  return LEAVEDEVICE(dev, 0);
+}
+
+/**
+   Write the USB transaction trace of a device to a file.  The file
+   holds the device identity followed by the recorded transfers, oldest
+   first.  Opening \texttt{"replay:<filename>"} in the USB domain plays
+   the transfers back in place of the device.
+
+   @param dev Device handle.
+
+   @param filename File to write.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLITraceEnable
+*/
+LIBFLIAPI FLITraceDump(flidev_t dev, char *filename)
+{
+  if (filename == NULL)
+    return -EINVAL;
+
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, fli_trace_dump(dev, filename));
+}
+
+/**
+   Override the bulk transfer size and queue depth used for image
+   downloads.  Without an override these are tuned automatically during
+   the first readouts and remembered for the device; the environment
+   variable \texttt{FLI\_TUNE} gives the same control without code
+   changes.
+
+   @param dev Device handle.
+
+   @param xfer Bytes per transfer, a multiple of 512.  Zero starts a new
+   automatic search.
+
+   @param depth Transfers kept queued, on transports that queue them.
+   Zero leaves the depth as it is.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIGetTransferTuning
+*/
+LIBFLIAPI FLISetTransferTuning(flidev_t dev, long xfer, long depth)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, fli_tune_set(dev, xfer, depth));
+}
+
+/**
+   Get the bulk transfer size and queue depth in use for image
+   downloads.
+
+   @param dev Device handle.
+
+   @param xfer Pointer to where the transfer size in bytes is placed.
+
+   @param depth Pointer to where the queue depth is placed, zero when
+   the transport doesn't queue transfers.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLISetTransferTuning
+*/
+LIBFLIAPI FLIGetTransferTuning(flidev_t dev, long *xfer, long *depth)
+{
+  ENTERDEVICE(dev);
+
+  if ((xfer == NULL) || (depth == NULL))
+    return LEAVEDEVICE(dev, -EINVAL);
+
+  if (DEVICE->tune == NULL)
+    return LEAVEDEVICE(dev, -EINVAL);
+
+  *xfer = DEVICE->tune->xfer;
+  *depth = DEVICE->tune->depth;
+
+  return LEAVEDEVICE(dev, 0);
+}
+
+/**
+   Get the transfer statistics of a device.  These count image data
+   reads, reads that came back short, and how those were resumed, since
+   the device was opened.
+
+   @param dev Device handle.
+
+   @param stats Pointer to where the statistics are placed.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+*/
+LIBFLIAPI FLIGetDeviceStats(flidev_t dev, flidevstats_t *stats)
+{
+  ENTERDEVICE(dev);
+
+  if (stats == NULL)
+    return LEAVEDEVICE(dev, -EINVAL);
+
+  *stats = DEVICE->stats;
+
+  return LEAVEDEVICE(dev, 0);
 }
 
 LIBFLIAPI FLIGrabFrame(flidev_t dev, void* buff,
 		       size_t buffsize, size_t* bytesgrabbed)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
   long width, hoffset, binx, height, voffset, biny;
   int res;
   res = FLIGetReadoutDimensions(dev, &width, &hoffset, &binx,
@@ -235,16 +584,19 @@ LIBFLIAPI FLIGrabFrame(flidev_t dev, void* buff,
   if (res != 0)
   {
       printf("FLIGrabFrame: FLIGetReadoutDimensions failed\n");
-      return res;
+      return LEAVEDEVICE(dev, res);
   }
 
   if ((long) buffsize < width * height * 2)
   {
     printf("FLIGrabFrame: buffer too small: expected %ld, got %lu\n", width * height * 2, buffsize);
-      return -ENOMEM;
+      return LEAVEDEVICE(dev, -ENOMEM);
   }
 
-  res = 0;
+  /* One lock for the whole frame rather than one per transfer */
+  if ((res = fli_tx_begin(dev)) != 0)
+    return LEAVEDEVICE(dev, res);
+
   for (long row = 0; row < height; row++)
   {
     res |= FLIGrabRow(dev, (char*)buff + row * width * 2, width);
@@ -255,7 +607,10 @@ LIBFLIAPI FLIGrabFrame(flidev_t dev, void* buff,
     }
     *bytesgrabbed += width * 2;
   }
-  return res;
+
+  fli_tx_end(dev);
+
+  return LEAVEDEVICE(dev, res);
 }
 
 /**
@@ -274,9 +629,9 @@ LIBFLIAPI FLIGrabFrame(flidev_t dev, void* buff,
 */
 LIBFLIAPI FLICancelExposure(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_CANCEL_EXPOSURE, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_CANCEL_EXPOSURE, 0));
 }
 
 /**
@@ -295,9 +650,9 @@ LIBFLIAPI FLICancelExposure(flidev_t dev)
 */
 LIBFLIAPI FLIEndExposure(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_END_EXPOSURE, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_END_EXPOSURE, 0));
 }
 
 /**
@@ -317,13 +672,15 @@ LIBFLIAPI FLIEndExposure(flidev_t dev)
 */
 LIBFLIAPI FLITriggerExposure(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_TRIGGER_EXPOSURE, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_TRIGGER_EXPOSURE, 0));
 }
 
 /**
-   Close a handle to a FLI device.
+   Close a handle to a FLI device.  Calls on the device already under
+   way in other threads are allowed to finish first; calls made once
+   the close has started fail.
 
    @param dev The device handle to be closed.
 
@@ -381,10 +738,10 @@ LIBFLIAPI FLIClose(flidev_t dev)
 LIBFLIAPI FLIGetArrayArea(flidev_t dev, long* ul_x, long* ul_y,
 			  long* lr_x, long* lr_y)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_ARRAY_AREA, 4,
-			     ul_x, ul_y, lr_x, lr_y);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_ARRAY_AREA, 4,
+			     ul_x, ul_y, lr_x, lr_y));
 }
 
 /**
@@ -404,9 +761,9 @@ LIBFLIAPI FLIGetArrayArea(flidev_t dev, long* ul_x, long* ul_y,
 */
 LIBFLIAPI FLIFlushRow(flidev_t dev, long rows, long repeat)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_FLUSH_ROWS, 2, &rows, &repeat);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_FLUSH_ROWS, 2, &rows, &repeat));
 }
 
 /**
@@ -426,10 +783,10 @@ LIBFLIAPI FLIFlushRow(flidev_t dev, long rows, long repeat)
 */
 LIBFLIAPI FLIGetFWRevision(flidev_t dev, long *fwrev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
   *fwrev = DEVICE->devinfo.fwrev;
-  return 0;
+  return LEAVEDEVICE(dev, 0);
 }
 
 /**
@@ -449,10 +806,10 @@ LIBFLIAPI FLIGetFWRevision(flidev_t dev, long *fwrev)
 */
 LIBFLIAPI FLIGetHWRevision(flidev_t dev, long *hwrev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
   *hwrev = DEVICE->devinfo.hwrev;
-  return 0;
+  return LEAVEDEVICE(dev, 0);
 }
 
 /**
@@ -507,18 +864,18 @@ LIBFLIAPI FLIGetSerialString(flidev_t dev, char* serial, size_t len)
   if (serial == NULL)
     return -EINVAL;
 
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
   if (DEVICE->devinfo.serial == NULL)
   {
     serial[0] = '\0';
-    return 0;
+    return LEAVEDEVICE(dev, 0);
   }
 
   if ((size_t) snprintf(serial, len, "%s", DEVICE->devinfo.serial) >= len)
-    return -EOVERFLOW;
+    return LEAVEDEVICE(dev, -EOVERFLOW);
   else
-    return 0;
+    return LEAVEDEVICE(dev, 0);
 }
 
 /**
@@ -547,18 +904,18 @@ LIBFLIAPI FLIGetModel(flidev_t dev, char* model, size_t len)
   if (model == NULL)
     return -EINVAL;
 
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
   if (DEVICE->devinfo.model == NULL)
   {
     model[0] = '\0';
-    return 0;
+    return LEAVEDEVICE(dev, 0);
   }
 
   if ((size_t) snprintf(model, len, "%s", DEVICE->devinfo.model) >= len)
-    return -EOVERFLOW;
+    return LEAVEDEVICE(dev, -EOVERFLOW);
   else
-    return 0;
+    return LEAVEDEVICE(dev, 0);
 }
 
 /**
@@ -580,10 +937,10 @@ LIBFLIAPI FLIGetModel(flidev_t dev, char* model, size_t len)
 */
 LIBFLIAPI FLIGetPixelSize(flidev_t dev, double *pixel_x, double *pixel_y)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_PIXEL_SIZE, 2,
-				   pixel_x, pixel_y);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_PIXEL_SIZE, 2,
+				   pixel_x, pixel_y));
 }
 
 
@@ -620,10 +977,10 @@ LIBFLIAPI FLIGetPixelSize(flidev_t dev, double *pixel_x, double *pixel_y)
 LIBFLIAPI FLIGetVisibleArea(flidev_t dev, long* ul_x, long* ul_y,
 			    long* lr_x, long* lr_y)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_VISIBLE_AREA, 4,
-			     ul_x, ul_y, lr_x, lr_y);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_VISIBLE_AREA, 4,
+			     ul_x, ul_y, lr_x, lr_y));
 }
 
 /**
@@ -702,6 +1059,49 @@ LIBFLIAPI FLISetDebugLevel(char *host, flidebug_t level)
   return 0;
 }
 
+/**
+   Keep debug messages in memory instead of writing them out.  While
+   enabled, each message selected by \texttt{FLISetDebugLevel()} is
+   stored unformatted, as its format string and arguments, in a ring of
+   \texttt{depth} records belonging to the calling thread.  Recording
+   takes no locks and does no formatting; messages are formatted when
+   written with \texttt{FLIDebugLogDump()}.
+
+   @param depth Number of messages to keep per thread, rounded up to a
+   power of two; only used when a thread's ring is first created.  Zero
+   returns to writing messages out as they happen.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIDebugLogDump
+   @see FLISetDebugLevel
+*/
+LIBFLIAPI FLIDebugLogEnable(long depth)
+{
+  return fli_log_enable(depth);
+}
+
+/**
+   Write the debug messages kept by \texttt{FLIDebugLogEnable()} to a
+   text file, one line per message in time order, with the time since
+   the first message and the thread that logged it.
+
+   @param filename File to write.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIDebugLogEnable
+*/
+LIBFLIAPI FLIDebugLogDump(char *filename)
+{
+  if (filename == NULL)
+    return -EINVAL;
+
+  return fli_log_dump(filename);
+}
+
 /**
    Set the exposure time for a camera.  This function sets the
    exposure time for the camera \texttt{dev} to \texttt{exptime} msec.
@@ -719,9 +1119,9 @@ LIBFLIAPI FLISetDebugLevel(char *host, flidebug_t level)
 */
 LIBFLIAPI FLISetExposureTime(flidev_t dev, long exptime)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_EXPOSURE_TIME, 1, &exptime);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_EXPOSURE_TIME, 1, &exptime));
 }
 
 /**
@@ -742,9 +1142,9 @@ LIBFLIAPI FLISetExposureTime(flidev_t dev, long exptime)
 */
 LIBFLIAPI FLISetHBin(flidev_t dev, long hbin)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_HBIN, 1, &hbin);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_HBIN, 1, &hbin));
 }
 
 /**
@@ -766,16 +1166,16 @@ LIBFLIAPI FLISetHBin(flidev_t dev, long hbin)
 */
 LIBFLIAPI FLISetFrameType(flidev_t dev, fliframe_t frametype)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_FRAME_TYPE, 1, &frametype);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_FRAME_TYPE, 1, &frametype));
 }
 
 LIBFLIAPI FLISetTDI(flidev_t dev, flitdirate_t tdi_rate, flitdiflags_t flags) 
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-	return DEVICE->fli_command(dev, FLI_SET_TDI, 2, &tdi_rate, &flags);
+	return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_TDI, 2, &tdi_rate, &flags));
 }
 
 /**
@@ -795,46 +1195,46 @@ LIBFLIAPI FLISetTDI(flidev_t dev, flitdirate_t tdi_rate, flitdiflags_t flags)
 */
 LIBFLIAPI FLIGetCoolerPower(flidev_t dev, double *power)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_COOLER_POWER, 1, power);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_COOLER_POWER, 1, power));
 }
 
 LIBFLIAPI FLIGetCameraModeString(flidev_t dev, flimode_t mode_index, char *mode_string, size_t siz)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_CAMERA_MODE_STRING, 3, mode_index, mode_string, siz);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_CAMERA_MODE_STRING, 3, mode_index, mode_string, siz));
 }
 
 LIBFLIAPI FLIGetCameraMode(flidev_t dev, flimode_t *mode_index)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_CAMERA_MODE, 1, mode_index);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_CAMERA_MODE, 1, mode_index));
 }
 
 LIBFLIAPI FLIGetFilterName(flidev_t dev, long filter, char *name, size_t len)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_FILTER_NAME, 3, filter, name, len);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_FILTER_NAME, 3, filter, name, len));
 }
 
 
 LIBFLIAPI FLISetCameraMode(flidev_t dev, flimode_t mode_index)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_CAMERA_MODE, 1, mode_index);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_CAMERA_MODE, 1, mode_index));
 }
 
 LIBFLIAPI FLIGetDeviceStatus(flidev_t dev, long *status)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
 	*status = 0xffffffff;
-  return DEVICE->fli_command(dev, FLI_GET_STATUS, 1, status);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_STATUS, 1, status));
 }
 
 /**
@@ -879,10 +1279,10 @@ LIBFLIAPI FLIGetDeviceStatus(flidev_t dev, long *status)
 LIBFLIAPI FLISetImageArea(flidev_t dev, long ul_x, long ul_y,
 			  long lr_x, long lr_y)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_IMAGE_AREA, 4,
-				   &ul_x, &ul_y, &lr_x, &lr_y);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_IMAGE_AREA, 4,
+				   &ul_x, &ul_y, &lr_x, &lr_y));
 }
 
 /**
@@ -903,9 +1303,9 @@ LIBFLIAPI FLISetImageArea(flidev_t dev, long ul_x, long ul_y,
 */
 LIBFLIAPI FLISetVBin(flidev_t dev, long vbin)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_VBIN, 1, &vbin);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_VBIN, 1, &vbin));
 }
 
 /**
@@ -926,9 +1326,9 @@ LIBFLIAPI FLISetVBin(flidev_t dev, long vbin)
 */
 LIBFLIAPI FLIGetExposureStatus(flidev_t dev, long *timeleft)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_EXPOSURE_STATUS, 1, timeleft);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_EXPOSURE_STATUS, 1, timeleft));
 }
 
 /**
@@ -948,10 +1348,10 @@ LIBFLIAPI FLIGetExposureStatus(flidev_t dev, long *timeleft)
 */
 LIBFLIAPI FLISetTemperature(flidev_t dev, double temperature)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_TEMPERATURE, 1,
-				   &temperature);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_TEMPERATURE, 1,
+				   &temperature));
 }
 
 /**
@@ -970,9 +1370,9 @@ LIBFLIAPI FLISetTemperature(flidev_t dev, double temperature)
 */
 LIBFLIAPI FLIGetTemperature(flidev_t dev, double *temperature)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_TEMPERATURE, 1, temperature);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_TEMPERATURE, 1, temperature));
 }
 
 /**
@@ -997,9 +1397,9 @@ LIBFLIAPI FLIGetTemperature(flidev_t dev, double *temperature)
 */
 LIBFLIAPI FLIGrabRow(flidev_t dev, void *buff, size_t width)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GRAB_ROW, 2, buff, &width);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GRAB_ROW, 2, buff, &width));
 }
 
 /**
@@ -1028,9 +1428,9 @@ LIBFLIAPI FLIGrabRow(flidev_t dev, void *buff, size_t width)
 */
 LIBFLIAPI FLIExposeFrame(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_EXPOSE_FRAME, 0);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_EXPOSE_FRAME, 0));
 }
 
 /**
@@ -1053,9 +1453,9 @@ LIBFLIAPI FLIExposeFrame(flidev_t dev)
 */
 LIBFLIAPI FLISetBitDepth(flidev_t dev, flibitdepth_t bitdepth)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_BIT_DEPTH, 1, &bitdepth);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_BIT_DEPTH, 1, &bitdepth));
 }
 
 /**
@@ -1081,9 +1481,9 @@ LIBFLIAPI FLISetBitDepth(flidev_t dev, flibitdepth_t bitdepth)
 */
 LIBFLIAPI FLISetNFlushes(flidev_t dev, long nflushes)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_SET_FLUSHES, 1, &nflushes);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_FLUSHES, 1, &nflushes));
 }
 
 /**
@@ -1103,9 +1503,9 @@ LIBFLIAPI FLISetNFlushes(flidev_t dev, long nflushes)
 */
 LIBFLIAPI FLIReadIOPort(flidev_t dev, long *ioportset)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_READ_IOPORT, 1, ioportset);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_READ_IOPORT, 1, ioportset));
 }
 
 /**
@@ -1124,9 +1524,9 @@ LIBFLIAPI FLIReadIOPort(flidev_t dev, long *ioportset)
 */
 LIBFLIAPI FLIWriteIOPort(flidev_t dev, long ioportset)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_WRITE_IOPORT, 1, &ioportset);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_WRITE_IOPORT, 1, &ioportset));
 }
 
 /**
@@ -1151,16 +1551,19 @@ LIBFLIAPI FLIWriteIOPort(flidev_t dev, long ioportset)
 */
 LIBFLIAPI FLIConfigureIOPort(flidev_t dev, long ioportset)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_CONFIGURE_IOPORT, 1,
-				   &ioportset);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_CONFIGURE_IOPORT, 1,
+				   &ioportset));
 }
 
 /**
    Lock a specified device.  This function establishes an exclusive
    lock (mutex) on the given device to prevent access to the device by
-   any other function or process.
+   any other function or process.  The lock may be taken again by the
+   thread holding it.  On Unix it covers the calling process only;
+   set FLI_LOCK=session in the environment to also hold an exclusive
+   cross-process lock on the device for as long as it is open.
 
    @param dev Device to lock.
 
@@ -1171,9 +1574,9 @@ LIBFLIAPI FLIConfigureIOPort(flidev_t dev, long ioportset)
 */
 LIBFLIAPI FLILockDevice(flidev_t dev)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_lock(dev);
+  return LEAVEDEVICE(dev, DEVICE->fli_lock(dev));
 }
 
 /**
@@ -1190,6 +1593,7 @@ LIBFLIAPI FLILockDevice(flidev_t dev)
 */
 LIBFLIAPI FLIUnlockDevice(flidev_t dev)
 {
+  /* Not refused during a close, which may be waiting for this lock */
   CHKDEVICE(dev);
 
   return DEVICE->fli_unlock(dev);
@@ -1219,9 +1623,9 @@ LIBFLIAPI FLIUnlockDevice(flidev_t dev)
 */
 LIBFLIAPI FLIControlShutter(flidev_t dev, flishutter_t shutter)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_CONTROL_SHUTTER, 1, &shutter);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_CONTROL_SHUTTER, 1, &shutter));
 }
 
 /* The following function is for internal use only, improper
@@ -1230,9 +1634,9 @@ device. */
 
 LIBFLIAPI FLISetDAC(flidev_t dev, unsigned long dacset)
 {
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
-	return DEVICE->fli_command(dev, FLI_SET_DAC, 1, &dacset);
+	return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_DAC, 1, &dacset));
 }
 
 /**
@@ -1256,9 +1660,9 @@ LIBFLIAPI FLISetDAC(flidev_t dev, unsigned long dacset)
 */
 LIBFLIAPI FLIControlBackgroundFlush(flidev_t dev, flibgflush_t bgflush)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_CONTROL_BGFLUSH, 1, &bgflush);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_CONTROL_BGFLUSH, 1, &bgflush));
 }
 
 /**
@@ -1287,7 +1691,7 @@ LIBFLIAPI FLIControlBackgroundFlush(flidev_t dev, flibgflush_t bgflush)
 */
 LIBFLIAPI FLIList(flidomain_t domain, char ***names)
 {
-  debug(FLIDEBUG_INFO, "List() domain %04x", domain);
+  debug(FLIDEBUG_INFO, "List() domain %04lx", domain);
   return fli_list(domain, names);
 }
 
@@ -1308,64 +1712,720 @@ LIBFLIAPI FLIFreeList(char **names)
 }
 
 /**
-   Set the filter wheel position of a given device.  Use this function
-   to set the filter wheel position of \texttt{dev} to
-   \texttt{filter}.
+   Register a hotplug callback.  The callback is invoked with
+   \texttt{FLI_HOTPLUG_ARRIVED} or \texttt{FLI_HOTPLUG_LEFT} whenever
+   an FLI device is connected to or removed from the USB bus.  The
+   library keeps its device registry current from the same events, so
+   \texttt{FLIList()} does not need to rescan the bus.
 
-   @param dev Filter wheel device handle.
+   @param cb Callback function.
 
-   @param filter Desired filter wheel position.
+   @param user Opaque pointer passed back to \texttt{cb}.
 
    @return Zero on success.
    @return Non-zero on failure.
 
-   @see FLIGetFilterPos
+   @see FLIDeregisterHotplugCallback
+   @see FLIList
 */
-LIBFLIAPI FLISetFilterPos(flidev_t dev, long filter)
-{
-  CHKDEVICE(dev);
-
-  return DEVICE->fli_command(dev, FLI_SET_FILTER_POS, 1, &filter);
-}
-
-LIBFLIAPI FLISetActiveWheel(flidev_t dev, long wheel)
-{
-  CHKDEVICE(dev);
-
-  return DEVICE->fli_command(dev, FLI_SET_ACTIVE_WHEEL, 1, &wheel);
-}
-
-LIBFLIAPI FLIGetActiveWheel(flidev_t dev, long *wheel)
+LIBFLIAPI FLIRegisterHotplugCallback(flihotplugcb_t cb, void *user)
 {
-  CHKDEVICE(dev);
+  if (cb == NULL)
+    return -EINVAL;
 
-  return DEVICE->fli_command(dev, FLI_GET_ACTIVE_WHEEL, 1, wheel);
+  return fli_hotplug_register(cb, user);
 }
 
 /**
-   Get the filter wheel position of a given device.  Use this function
-   to get the filter wheel position of \texttt{dev}.
+   Remove a hotplug callback previously registered with
+   \texttt{FLIRegisterHotplugCallback()}.
 
-   @param dev Filter wheel device handle.
+   @param cb Callback function.
 
-   @param filter Pointer to where the filter wheel position will be
-   placed.
+   @param user Opaque pointer the callback was registered with.
 
    @return Zero on success.
    @return Non-zero on failure.
 
-   @see FLISetFilterPos
+   @see FLIRegisterHotplugCallback
 */
-LIBFLIAPI FLIGetFilterPos(flidev_t dev, long *filter)
+LIBFLIAPI FLIDeregisterHotplugCallback(flihotplugcb_t cb, void *user)
 {
-  CHKDEVICE(dev);
+  if (cb == NULL)
+    return -EINVAL;
 
-  return DEVICE->fli_command(dev, FLI_GET_FILTER_POS, 1, filter);
+  return fli_hotplug_deregister(cb, user);
 }
 
-/**
-   Get the number of motor steps remaining. Use this function
-   to determine if the stepper motor of \texttt{dev} is still moving.
+/* Does info pass the serial/model filter? NULL matches anything */
+int fli_devinfo_match(fli_devinfo_t *info, char *serial, char *model)
+{
+  if ((serial != NULL) && (strcasecmp(info->serial, serial) != 0))
+    return 0;
+
+  if ((model != NULL) && (strcasecmp(info->model, model) != 0))
+    return 0;
+
+  return 1;
+}
+
+/* Transaction scope: holds the device lock across a sequence of
+ * transfers, such as the commands of an exposure setup or the reads of
+ * a frame, so that they are not interleaved with another thread's.
+ * Scopes nest; the outermost one is counted and timed in the device
+ * statistics. */
+long fli_tx_begin(flidev_t dev)
+{
+  uint64_t start, now;
+  long r;
+
+  if (DEVICE->fli_lock == NULL)
+    return 0;
+
+  start = fli_trace_now();
+  if ((r = DEVICE->fli_lock(dev)) != 0)
+    return r;
+
+  if (DEVICE->tx_depth++ == 0)
+  {
+    now = fli_trace_now();
+    DEVICE->tx_start = now;
+    DEVICE->stats.transactions++;
+    DEVICE->stats.lock_wait += (double) (now - start) / 1e9;
+  }
+
+  return 0;
+}
+
+long fli_tx_end(flidev_t dev)
+{
+  double held;
+
+  if (DEVICE->fli_unlock == NULL)
+    return 0;
+
+  if (--DEVICE->tx_depth == 0)
+  {
+    held = (double) (fli_trace_now() - DEVICE->tx_start) / 1e9;
+    DEVICE->stats.lock_hold += held;
+    if (held > DEVICE->stats.lock_hold_max)
+      DEVICE->stats.lock_hold_max = held;
+  }
+
+  return DEVICE->fli_unlock(dev);
+}
+
+/* Sends n commands of wlen bytes from wbuf and places their n replies
+ * of rlen bytes in rbuf. Transports that can pipeline commands send
+ * them all before reading the first reply; others go one command at
+ * a time, under one transaction. */
+long fli_io_batch(flidev_t dev, void *wbuf, long wlen, void *rbuf, long rlen,
+  long n)
+{
+  unsigned char buf[64];
+  long i, w, r, err = 0;
+
+  if ((n < 1) || (wlen < 1) || (rlen < 0))
+    return -EINVAL;
+
+  if (DEVICE->fli_io_batch != NULL)
+    return DEVICE->fli_io_batch(dev, wbuf, wlen, rbuf, rlen, n);
+
+  if ((wlen > (long) sizeof(buf)) || (rlen > (long) sizeof(buf)))
+    return -EINVAL;
+
+  if ((err = fli_tx_begin(dev)) != 0)
+    return err;
+
+  for (i = 0; i < n; i++)
+  {
+    memcpy(buf, (unsigned char *) wbuf + i * wlen, wlen);
+    w = wlen;
+    r = rlen;
+    if ((err = DEVICE->fli_io(dev, buf, &w, &r)) != 0)
+      break;
+    memcpy((unsigned char *) rbuf + i * rlen, buf, rlen);
+  }
+
+  fli_tx_end(dev);
+
+  return err;
+}
+
+/* Allocations for the lifetime of an open device: names, device
+ * information and the transport, system and device data. They come
+ * from the device's arena and are all released by devfree(), so
+ * fli_dev_free() only has to deal with memory from elsewhere. Frame
+ * buffers are allocated separately. */
+void *fli_dev_alloc(flidev_t dev, size_t size)
+{
+  if (DEVICE->arena == NULL)
+    return xcalloc(1, size);
+
+  return xarena_alloc(DEVICE->arena, size);
+}
+
+char *fli_dev_strndup(flidev_t dev, const char *s, size_t siz)
+{
+  if (DEVICE->arena == NULL)
+    return xstrndup(s, siz);
+
+  return xarena_strndup(DEVICE->arena, s, siz);
+}
+
+char *fli_dev_strdup(flidev_t dev, const char *s)
+{
+  return fli_dev_strndup(dev, s, strlen(s));
+}
+
+void fli_dev_free(flidev_t dev, void *ptr)
+{
+  if (ptr == NULL)
+    return;
+
+  if ((DEVICE->arena == NULL) || !xarena_owns(DEVICE->arena, ptr))
+    xfree(ptr);
+}
+
+/* What opening a serial or parallel port found, so that enumeration
+ * opens a port once per FLI_ENUM_TTL rather than on every call. Ports
+ * without a device are remembered as well. Guarded by the devlock. */
+#define FLI_ENUM_PORTS (64)
+#define FLI_ENUM_TTL (30) /* sec */
+
+typedef struct {
+  uint64_t checked;		/* When the port was opened, 0 if unused */
+  int present;
+  fli_devinfo_t info;		/* domain is the one the port was opened in */
+} fli_enumport_t;
+
+static fli_enumport_t enumports[FLI_ENUM_PORTS];
+
+/* Devlock must be held */
+static fli_enumport_t *fli_enum_find(flidomain_t domain, const char *filename)
+{
+  int i;
+
+  for (i = 0; i < FLI_ENUM_PORTS; i++)
+    if ((enumports[i].checked != 0) && (enumports[i].info.domain == domain) &&
+      (strcmp(enumports[i].info.filename, filename) == 0))
+      return &enumports[i];
+
+  return NULL;
+}
+
+/* Fill in info for its port from the cache; 1 if a device is there, 0
+ * if not and -1 if the port has not been opened lately */
+static int fli_enum_cached(fli_devinfo_t *info)
+{
+  fli_enumport_t *ent;
+  uint64_t now = fli_trace_now();
+  int r = -1;
+
+  while (!DEV_TRYLOCK())
+    DEV_YIELD();
+  if (((ent = fli_enum_find(info->domain, info->filename)) != NULL) &&
+    (now - ent->checked < FLI_ENUM_TTL * 1000000000ull))
+  {
+    r = ent->present;
+    if (r)
+      *info = ent->info;
+  }
+  DEV_UNLOCK();
+
+  return r;
+}
+
+static void fli_enum_remember(fli_devinfo_t *info, int present)
+{
+  fli_enumport_t *ent;
+  int i;
+
+  while (!DEV_TRYLOCK())
+    DEV_YIELD();
+  if ((ent = fli_enum_find(info->domain, info->filename)) == NULL)
+  {
+    /* A free entry, else the one checked longest ago */
+    ent = &enumports[0];
+    for (i = 1; (i < FLI_ENUM_PORTS) && (ent->checked != 0); i++)
+      if (enumports[i].checked < ent->checked)
+        ent = &enumports[i];
+  }
+  ent->checked = fli_trace_now();
+  ent->present = present;
+  ent->info = *info;
+  DEV_UNLOCK();
+}
+
+/* A port device being closed updates its cache entry, if it has one */
+static void fli_enum_refresh(flidev_t dev)
+{
+  fli_enumport_t *ent;
+
+  while (!DEV_TRYLOCK())
+    DEV_YIELD();
+  if ((DEVICE->name != NULL) &&
+    ((ent = fli_enum_find(DEVICE->domain, DEVICE->name)) != NULL))
+  {
+    ent->checked = fli_trace_now();
+    ent->present = 1;
+    if (DEVICE->devinfo.model != NULL)
+      strncpy(ent->info.model, DEVICE->devinfo.model, sizeof(ent->info.model) - 1);
+    if (DEVICE->devinfo.serial != NULL)
+      strncpy(ent->info.serial, DEVICE->devinfo.serial, sizeof(ent->info.serial) - 1);
+    ent->info.fwrev = DEVICE->devinfo.fwrev;
+    ent->info.hwrev = DEVICE->devinfo.hwrev;
+  }
+  DEV_UNLOCK();
+}
+
+/* Open the port to see what is there; 1 if a device answered, 0 if
+ * none did and -1 if it is in use and can't tell */
+static int fli_enum_probe(fli_devinfo_t *info)
+{
+  flidev_t dev;
+  long r;
+
+  if ((r = FLIOpen(&dev, info->filename, info->domain)) != 0)
+    return (r == -EBUSY)?-1:0;
+
+  FLIGetModel(dev, info->model, sizeof(info->model));
+  FLIGetSerialString(dev, info->serial, sizeof(info->serial));
+  FLIGetFWRevision(dev, &info->fwrev);
+  FLIGetHWRevision(dev, &info->hwrev);
+  FLIClose(dev);
+
+  return 1;
+}
+
+/* Enumeration for serial and parallel ports. The ports are listed
+ * without being opened, and only those not in the cache are opened. */
+static long fli_enumerate_ports(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
+{
+  fli_devinfo_t port[FLI_ENUM_PORTS];
+  size_t nports = 0, i;
+  long r;
+  int present;
+
+  *n = 0;
+
+  if ((r = fli_list_ports(domain, port, FLI_ENUM_PORTS, &nports)) != 0)
+    return r;
+
+  for (i = 0; (i < nports) && (i < FLI_ENUM_PORTS); i++)
+  {
+    if ((present = fli_enum_cached(&port[i])) < 0)
+    {
+      if ((present = fli_enum_probe(&port[i])) < 0)
+        continue;
+      fli_enum_remember(&port[i], present);
+    }
+
+    if (!present || !fli_devinfo_match(&port[i], serial, model))
+      continue;
+
+    if (*n < cap)
+      out[*n] = port[i];
+    (*n)++;
+  }
+
+  return 0;
+}
+
+/* Enumeration for domains without native support or a port list,
+ * built from the "name;model" strings returned by FLIList(). Only a
+ * serial number filter needs the devices opened, since FLIList() has
+ * no serials. */
+static long fli_enumerate_list(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
+{
+  char **list = NULL;
+  long r;
+  int i;
+
+  *n = 0;
+
+  if ((r = FLIList(domain, &list)) != 0)
+    return r;
+
+  if (list == NULL)
+    return 0;
+
+  for (i = 0; list[i] != NULL; i++)
+  {
+    fli_devinfo_t info;
+    char *sep;
+
+    memset(&info, '\0', sizeof(info));
+    info.domain = domain;
+    info.vid = -1;
+    info.pid = -1;
+    info.fwrev = -1;
+    info.hwrev = -1;
+
+    if ((sep = strchr(list[i], ';')) != NULL)
+    {
+      strncpy(info.model, sep + 1, sizeof(info.model) - 1);
+      *sep = '\0';
+    }
+    strncpy(info.filename, list[i], sizeof(info.filename) - 1);
+
+    if ((serial != NULL) && fli_devinfo_match(&info, NULL, model))
+    {
+      flidev_t dev;
+
+      if (FLIOpen(&dev, info.filename, domain) == 0)
+      {
+        FLIGetSerialString(dev, info.serial, sizeof(info.serial));
+        FLIGetFWRevision(dev, &info.fwrev);
+        FLIGetHWRevision(dev, &info.hwrev);
+        FLIClose(dev);
+      }
+    }
+
+    if (!fli_devinfo_match(&info, serial, model))
+      continue;
+
+    if (*n < cap)
+      out[*n] = info;
+    (*n)++;
+  }
+
+  FLIFreeList(list);
+
+  return 0;
+}
+
+/**
+   Enumerate devices into a caller supplied array of
+   \texttt{fli_devinfo_t}.  Unlike \texttt{FLIList()} no strings are
+   returned for parsing.  USB devices are described from the device
+   registry without being opened or anything allocated per device;
+   serial numbers, models and hardware revisions that have not been
+   read yet are left empty (or -1).  Serial and parallel ports are
+   opened when first seen to find out what is attached, and what was
+   found is reused for 30 seconds, or until the device is closed.
+
+   @param domain Domain to search for devices, set the interface to
+   zero to search all interfaces.
+
+   @param out Array of \texttt{cap} entries to fill.
+
+   @param cap Number of entries in \texttt{out}.
+
+   @param n Pointer to where the number of devices found will be
+   placed.  This may be larger than \texttt{cap}, in which case only
+   the first \texttt{cap} devices are written.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIEnumerateFilter
+   @see FLIOpen
+*/
+LIBFLIAPI FLIEnumerate(flidomain_t domain, fli_devinfo_t *out, size_t cap, size_t *n)
+{
+  return FLIEnumerateFilter(domain, NULL, NULL, out, cap, n);
+}
+
+/**
+   Enumerate devices matching a serial number and/or model name.  As
+   \texttt{FLIEnumerate()}, but only devices whose serial number and
+   model match (case insensitive) are counted and returned.  Filtering
+   on a field the registry has not cached yet reads it from the device
+   once.
+
+   @param domain Domain to search for devices.
+
+   @param serial Serial number to match, or \texttt{NULL} for any.
+
+   @param model Model name to match, or \texttt{NULL} for any.
+
+   @param out Array of \texttt{cap} entries to fill.
+
+   @param cap Number of entries in \texttt{out}.
+
+   @param n Pointer to where the number of matching devices will be
+   placed.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIEnumerate
+*/
+LIBFLIAPI FLIEnumerateFilter(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
+{
+  flidomain_t domord[4];
+  size_t found = 0;
+  int i;
+
+  if ((n == NULL) || ((out == NULL) && (cap != 0)))
+    return -EINVAL;
+
+  memset(domord, 0, sizeof(domord));
+  if ((domain & 0x00ff) != 0)
+  {
+    domord[0] = domain;
+  }
+  else
+  {
+    domord[0] = domain | FLIDOMAIN_PARALLEL_PORT;
+    domord[1] = domain | FLIDOMAIN_USB;
+    domord[2] = domain | FLIDOMAIN_SERIAL;
+  }
+
+  for (i = 0; domord[i] != 0; i++)
+  {
+    size_t dn = 0;
+    size_t dcap = (found < cap)?cap - found:0;
+    fli_devinfo_t *dout = (found < cap)?out + found:NULL;
+    long r;
+
+    r = fli_enumerate(domord[i], serial, model, dout, dcap, &dn);
+    if (r == -ENOSYS)
+      r = fli_enumerate_ports(domord[i], serial, model, dout, dcap, &dn);
+    if (r == -ENOSYS)
+      r = fli_enumerate_list(domord[i], serial, model, dout, dcap, &dn);
+
+    /* A missing interface is not an error when searching them all */
+    if (r != 0)
+    {
+      if ((domain & 0x00ff) != 0)
+        return r;
+      dn = 0;
+    }
+
+    found += dn;
+  }
+
+  *n = found;
+
+  return 0;
+}
+
+/**
+   Set the filter wheel position of a given device.  Use this function
+   to set the filter wheel position of \texttt{dev} to
+   \texttt{filter}. Nothing is sent when the wheel is already there.
+   Older filter wheels take the shorter way around, overshooting by
+   the backlash when turning backwards; set FLI_FILTER_BACKLASH in the
+   environment to the backlash in steps, or to -1 to always turn
+   forward.
+
+   @param dev Filter wheel device handle.
+
+   @param filter Desired filter wheel position.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIGetFilterPos
+*/
+LIBFLIAPI FLISetFilterPos(flidev_t dev, long filter)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_FILTER_POS, 1, &filter));
+}
+
+/**
+   Start moving the filter wheel of a given device to a position and
+   return without waiting for it to get there. Use this function to
+   overlap a filter change with other work, such as a camera readout,
+   then call FLIWaitFilterMove() before relying on the new filter. A
+   move still in progress is completed first. Older filter wheels are
+   stepped to the position before this returns, as is a wheel that has
+   not been homed yet.
+
+   @param dev Filter wheel device handle.
+
+   @param filter Desired filter wheel position.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIWaitFilterMove
+   @see FLISetFilterPos
+*/
+LIBFLIAPI FLISetFilterPosAsync(flidev_t dev, long filter)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_FILTER_POS_ASYNC, 1, &filter));
+}
+
+/**
+   Wait for a move started by FLISetFilterPosAsync() to end. The wheel
+   is not queried until most of the expected move time has passed, the
+   estimate improves as moves are timed. Returns at once when no move is
+   in progress.
+
+   @param dev Filter wheel device handle.
+
+   @param timeout Longest time to wait in milliseconds, zero to only
+   check, negative to wait for as long as the move takes.
+
+   @return Zero when the wheel is at the requested position.
+   @return -ETIMEDOUT if it is still moving when the timeout expires.
+   @return Other non-zero values on failure.
+
+   @see FLISetFilterPosAsync
+*/
+LIBFLIAPI FLIWaitFilterMove(flidev_t dev, long timeout)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_WAIT_FILTER_MOVE, 1, &timeout));
+}
+
+/**
+   Start moving several wheels of a multi-wheel filter unit at once and
+   return without waiting for them. The wheels turn together, so the
+   whole change takes as long as the longest of the moves instead of
+   their sum. Wheels already at the requested position are not moved.
+   Call FLIWaitFilterMove() before relying on the new filters.
+
+   @param dev Filter wheel device handle.
+
+   @param pos Array of desired positions, one for each physical wheel
+   starting with wheel 0. A negative position leaves that wheel alone.
+
+   @param n Number of entries in pos.
+
+   @return Zero on success.
+   @return Non-zero on failure, including units without individually
+   controlled wheels.
+
+   @see FLIWaitFilterMove
+   @see FLISetActiveWheel
+*/
+LIBFLIAPI FLISetWheelPositionsAsync(flidev_t dev, long *pos, long n)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_WHEEL_POSITIONS_ASYNC, 2, pos, &n));
+}
+
+/**
+   Take a sequence of exposures through a filter wheel and focuser.
+   Each step names a filter, a focus offset and an exposure time. The
+   moves for a step are started as soon as the previous exposure has
+   ended and run while that frame is read out, and the step is exposed
+   once the readout and both moves are over. The camera's other
+   settings, such as the image area and frame type, are used as they
+   are.
+
+   @param dev Camera device handle.
+
+   @param wheel Filter wheel device handle, or FLI_INVALID_DEVICE to
+   take the sequence without one.
+
+   @param focuser Focuser device handle, or FLI_INVALID_DEVICE to take
+   the sequence without one.
+
+   @param steps Array of exposures to take, in order.
+
+   @param nsteps Number of entries in steps.
+
+   @param timing Array of nsteps entries where the timing of each
+   exposure is placed, including which device held it up, or NULL.
+
+   @return Zero on success.
+   @return Non-zero on failure, the sequence stops at the step that
+   failed.
+
+   @see FLISetFilterPosAsync
+   @see FLIStepMotorAsync
+*/
+LIBFLIAPI FLIRunSequence(flidev_t dev, flidev_t wheel, flidev_t focuser,
+  flisequencestep_t *steps, long nsteps, flisequencetiming_t *timing)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, fli_sequence_run(dev, wheel, focuser, steps, nsteps, timing));
+}
+
+/**
+   Focus a camera by sweeping its focuser. The focuser is stepped from
+   a start position a fixed number of steps at a time, and a region of
+   the image is exposed at each position and scored with a focus
+   metric as it is read out, while the focuser moves on to the next
+   position. The sweep stops once the best score is followed by two
+   worse ones, or after the given number of samples. The focuser is
+   then left at the best position, interpolated between the samples
+   around it and approached from the direction of the sweep. The
+   camera's image area and exposure time are left set for the sweep.
+
+   @param dev Camera device handle.
+
+   @param focuser Focuser device handle.
+
+   @param sweep Start position, step, number of samples, exposure time,
+   image region and FLI_FOCUS_METRIC_* of the sweep.
+
+   @param samples Array of sweep->samples entries where the position
+   and score of each sample are placed, or NULL.
+
+   @param nsamples Pointer to where the number of samples taken is
+   placed, or NULL.
+
+   @param best Pointer to where the position of best focus is placed,
+   or NULL.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIStepMotorAsync
+   @see FLISetImageArea
+*/
+LIBFLIAPI FLIAutoFocus(flidev_t dev, flidev_t focuser, flifocussweep_t *sweep,
+  flifocussample_t *samples, long *nsamples, long *best)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, fli_autofocus_run(dev, focuser, sweep, samples, nsamples, best));
+}
+
+LIBFLIAPI FLISetActiveWheel(flidev_t dev, long wheel)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_SET_ACTIVE_WHEEL, 1, &wheel));
+}
+
+LIBFLIAPI FLIGetActiveWheel(flidev_t dev, long *wheel)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_ACTIVE_WHEEL, 1, wheel));
+}
+
+/**
+   Get the filter wheel position of a given device.  Use this function
+   to get the filter wheel position of \texttt{dev}.
+
+   @param dev Filter wheel device handle.
+
+   @param filter Pointer to where the filter wheel position will be
+   placed.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLISetFilterPos
+*/
+LIBFLIAPI FLIGetFilterPos(flidev_t dev, long *filter)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_FILTER_POS, 1, filter));
+}
+
+/**
+   Get the number of motor steps remaining. Use this function
+   to determine if the stepper motor of \texttt{dev} is still moving.
 
    @param dev Filter wheel device handle.
 
@@ -1381,7 +2441,7 @@ LIBFLIAPI FLIGetStepsRemaining(flidev_t dev, long *steps)
 {
 	long r;
 
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1393,7 +2453,7 @@ LIBFLIAPI FLIGetStepsRemaining(flidev_t dev, long *steps)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /**
@@ -1410,15 +2470,17 @@ LIBFLIAPI FLIGetStepsRemaining(flidev_t dev, long *steps)
 */
 LIBFLIAPI FLIGetFilterCount(flidev_t dev, long *filter)
 {
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
-  return DEVICE->fli_command(dev, FLI_GET_FILTER_COUNT, 1, filter);
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_FILTER_COUNT, 1, filter));
 }
 
 /**
    Step the filter wheel or focuser motor of a given device.  Use this
    function to move the focuser or filter wheel \texttt{dev} by an
-   amount \texttt{steps}. This function is non-blocking.
+   amount \texttt{steps}. This function is non-blocking, use
+   FLIWaitStepMotor() to wait for the move to end and
+   FLIGetMoveTimeRemaining() for when it should.
 
    @param dev Filter wheel or focuser device handle.
 
@@ -1428,12 +2490,13 @@ LIBFLIAPI FLIGetFilterCount(flidev_t dev, long *filter)
    @return Non-zero on failure.
 
    @see FLIGetStepperPosition
+   @see FLIWaitStepMotor
 */
 LIBFLIAPI FLIStepMotorAsync(flidev_t dev, long steps)
 {
 	long r;
 
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1445,7 +2508,7 @@ LIBFLIAPI FLIStepMotorAsync(flidev_t dev, long steps)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 
@@ -1467,7 +2530,7 @@ LIBFLIAPI FLIStepMotor(flidev_t dev, long steps)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1479,7 +2542,55 @@ LIBFLIAPI FLIStepMotor(flidev_t dev, long steps)
 	debug(FLIDEBUG_INFO, "Exiting  " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
+}
+
+/**
+   Wait for a move started by FLIStepMotorAsync() or FLIHomeDevice() to
+   end. The device is not queried until most of the time the move should
+   take, from its step count and the motor step rate, has passed, then
+   it is polled more often as that time approaches.
+
+   @param dev Filter wheel or focuser device handle.
+
+   @param timeout Longest time to wait in milliseconds, zero to only
+   check, negative to wait for as long as the move takes.
+
+   @return Zero when the motor has stopped.
+   @return -ETIMEDOUT if it is still moving when the timeout expires.
+   @return Other non-zero values on failure.
+
+   @see FLIStepMotorAsync
+   @see FLIGetMoveTimeRemaining
+*/
+LIBFLIAPI FLIWaitStepMotor(flidev_t dev, long timeout)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_WAIT_STEP_MOTOR, 1, &timeout));
+}
+
+/**
+   Get the time until the move in progress on a given device should
+   end. The estimate comes from the step count and step rate of the
+   motor, or for filter wheels from the time past moves took per slot,
+   the device is not queried.
+
+   @param dev Filter wheel or focuser device handle.
+
+   @param ms Pointer to where the time left in milliseconds will be
+   placed, zero when no move is in progress or it is overdue.
+
+   @return Zero on success.
+   @return Non-zero on failure.
+
+   @see FLIWaitStepMotor
+*/
+LIBFLIAPI FLIGetMoveTimeRemaining(flidev_t dev, long *ms)
+{
+  ENTERDEVICE(dev);
+
+  return LEAVEDEVICE(dev, DEVICE->fli_command(dev, FLI_GET_MOVE_TIME_REMAINING, 1, ms));
 }
 
 /**
@@ -1501,7 +2612,7 @@ LIBFLIAPI FLIGetStepperPosition(flidev_t dev, long *position)
 {
 	long r;
 
-  CHKDEVICE(dev);
+  ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1513,7 +2624,7 @@ LIBFLIAPI FLIGetStepperPosition(flidev_t dev, long *position)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 	
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /**
@@ -1538,7 +2649,7 @@ LIBFLIAPI FLIHomeDevice(flidev_t dev)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1550,7 +2661,7 @@ LIBFLIAPI FLIHomeDevice(flidev_t dev)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /**
@@ -1565,7 +2676,7 @@ LIBFLIAPI FLIHomeFocuser(flidev_t dev)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1577,7 +2688,7 @@ LIBFLIAPI FLIHomeFocuser(flidev_t dev)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /**
@@ -1593,7 +2704,7 @@ LIBFLIAPI FLIGetFocuserExtent(flidev_t dev, long *extent)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1605,7 +2716,7 @@ LIBFLIAPI FLIGetFocuserExtent(flidev_t dev, long *extent)
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /**
@@ -1623,7 +2734,7 @@ LIBFLIAPI FLIReadTemperature(flidev_t dev, flichannel_t channel, double *tempera
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 #ifdef SHOWFUNCTIONS
 	debug(FLIDEBUG_INFO, "Entering " __FUNCTION__);
@@ -1635,7 +2746,7 @@ LIBFLIAPI FLIReadTemperature(flidev_t dev, flichannel_t channel, double *tempera
 	debug(FLIDEBUG_INFO, "Exiting " __FUNCTION__);
 #endif
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 /* This stuff is used by the next four functions */
@@ -1646,14 +2757,22 @@ typedef struct list {
   struct list *next;
 } list_t;
 
-static list_t *firstdevice = NULL;
-static list_t *currentdevice = NULL;
+/* Each thread builds and walks its own list */
+#ifdef _WIN32
+#define FLI_THREAD_LOCAL __declspec(thread)
+#else
+#define FLI_THREAD_LOCAL __thread
+#endif
+
+static FLI_THREAD_LOCAL list_t *firstdevice = NULL;
+static FLI_THREAD_LOCAL list_t *currentdevice = NULL;
 
 /**
    Creates a list of all devices within a specified
 	 \texttt{domain}. Use \texttt{FLIDeleteList()} to delete the list
 	 created with this function. This function is the first called begin
 	 the iteration through the list of current FLI devices attached.
+	 Each thread has its own list.
 
    @param domain Domain to search for devices, set to zero to search all domains.
 	 This parameter must contain the device type.
@@ -1696,7 +2815,7 @@ LIBFLIAPI FLICreateList(flidomain_t domain)
   i = 0;
   while (domord[i] != 0)
   {
-    debug(FLIDEBUG_INFO, "Searching for domain 0x%04x.", domord[i]);
+    debug(FLIDEBUG_INFO, "Searching for domain 0x%04lx.", domord[i]);
     FLIList(domord[i], &list);
     if (list != NULL)
     {
@@ -1865,75 +2984,75 @@ LIBFLIAPI FLISetFanSpeed(flidev_t dev, long fan_speed)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_SET_FAN_SPEED, 1, &fan_speed);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLISetVerticalTableEntry(flidev_t dev, long index, long height, long bin, long mode)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_SET_VERTICAL_TABLE_ENTRY, 4, &index, &height, &bin, &mode);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLIGetVerticalTableEntry(flidev_t dev, long index, long *height, long *bin, long *mode)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_GET_VERTICAL_TABLE_ENTRY, 4, &index, height, bin, mode);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLIGetReadoutDimensions(flidev_t dev, long *width, long *hoffset, long *hbin, long *height, long *voffset, long *vbin)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_GET_READOUT_DIMENSIONS, 6, width, hoffset, hbin, height, voffset, vbin);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLIEnableVerticalTable(flidev_t dev, long width, long offset, long flags)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_ENABLE_VERTICAL_TABLE, 3, &width, &offset, &flags);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLIReadUserEEPROM(flidev_t dev, long loc, long address, long length, void *rbuf)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_READ_EEPROM, 4, &loc, &address, &length, rbuf);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
 
 LIBFLIAPI FLIWriteUserEEPROM(flidev_t dev, long loc, long address, long length, void *wbuf)
 {
 	long r;
 
-	CHKDEVICE(dev);
+	ENTERDEVICE(dev);
 
 	r = DEVICE->fli_command(dev, FLI_WRITE_EEPROM, 4, &loc, &address, &length, wbuf);
 
-	return r;
+	return LEAVEDEVICE(dev, r);
 }
\ No newline at end of file
@@ -300,6 +300,130 @@ typedef long flitdiflags_t;
 #define FLI_PIXEL_DEFECT_POINT_BRIGHT (0x20)
 #define FLI_PIXEL_DEFECT_POINT_DARK (0x30)
 
+#define FLI_HOTPLUG_ARRIVED (0x01)
+#define FLI_HOTPLUG_LEFT (0x02)
+
+/**
+ * @brief Hotplug notification callback.  Invoked with the domain and
+ * \texttt{FLIOpen()} filename of a device together with
+ * \texttt{FLI_HOTPLUG_ARRIVED} or \texttt{FLI_HOTPLUG_LEFT}.
+ * 
+ * @see FLIRegisterHotplugCallback
+ * 
+ */
+typedef void (*flihotplugcb_t)(flidomain_t domain, char *filename,
+			       long event, void *user);
+
+#define FLI_DEVINFO_CLAIMED (0x01)
+#define FLI_DEVINFO_STRLEN (32)
+
+/**
+ * @brief Description of an attached device as returned by
+ * \texttt{FLIEnumerate()}.  Fields that are not known without opening
+ * the device are set to -1 (numeric) or the empty string.
+ * 
+ * @see FLIEnumerate
+ * 
+ */
+typedef struct {
+  flidomain_t domain;		/* Interface and device type */
+  long vid;			/* USB vendor id */
+  long pid;			/* USB product id */
+  long fwrev;			/* Firmware revision */
+  long hwrev;			/* Hardware revision */
+  long flags;			/* FLI_DEVINFO_* */
+  char filename[64];		/* Name to pass to FLIOpen() */
+  char buspath[FLI_DEVINFO_STRLEN];	/* e.g. "1-2.4" */
+  char serial[FLI_DEVINFO_STRLEN];
+  char model[FLI_DEVINFO_STRLEN];
+} fli_devinfo_t;
+
+/**
+ * @brief Transfer statistics kept for each open device.
+ * 
+ * @see FLIGetDeviceStats
+ * 
+ */
+typedef struct {
+  unsigned long reads;		/* Image data reads */
+  unsigned long short_reads;	/* Reads that came back short */
+  unsigned long retries;	/* Extra reads issued to resume them */
+  unsigned long resumed;	/* Short reads completed by resuming */
+  unsigned long incomplete;	/* Short reads given up on */
+  unsigned long open_allocs;	/* Allocations made by FLIOpen() */
+  unsigned long open_bytes;	/* Bytes they took up */
+  unsigned long transactions;	/* Times the device lock was taken */
+  double lock_wait;		/* Seconds spent waiting for the lock */
+  double lock_hold;		/* Seconds the lock was held in total */
+  double lock_hold_max;		/* Longest single hold, in seconds */
+} flidevstats_t;
+
+/**
+ * @brief One exposure of a sequence run by `FLIRunSequence()`.
+ * 
+ */
+typedef struct {
+  long filter;			/* Filter slot, negative to leave the wheel */
+  long focus;			/* Focuser steps to move first, zero for none */
+  long exptime;			/* Exposure time in milliseconds */
+  void *buff;			/* Where the 16-bit frame is placed, NULL to drop it */
+  size_t buffsize;		/* Size of buff in bytes */
+} flisequencestep_t;
+
+/**
+ * @brief What held up an exposure of a sequence.
+ * 
+ */
+#define FLI_SEQUENCE_CRITICAL_NONE (0)	/* Nothing, the first exposure */
+#define FLI_SEQUENCE_CRITICAL_READOUT (1)	/* Readout of the previous frame */
+#define FLI_SEQUENCE_CRITICAL_FILTER (2)	/* Filter wheel move */
+#define FLI_SEQUENCE_CRITICAL_FOCUS (3)	/* Focuser move */
+
+/**
+ * @brief Timing of one exposure of a sequence, in seconds.
+ * 
+ * @see FLIRunSequence
+ * 
+ */
+typedef struct {
+  double start;			/* From the start of the sequence to the exposure */
+  double exposure;		/* From starting the exposure to its end */
+  double readout;		/* Reading out the frame */
+  double filter;		/* Exposure held up for the filter wheel */
+  double focus;			/* Exposure held up for the focuser */
+  long critical;		/* FLI_SEQUENCE_CRITICAL_* */
+} flisequencetiming_t;
+
+/**
+ * @brief Focus metrics for `FLIAutoFocus()`.
+ * 
+ */
+#define FLI_FOCUS_METRIC_BRENNER (0)	/* Squared gradient, larger is sharper */
+#define FLI_FOCUS_METRIC_VARIANCE (1)	/* Pixel variance, larger is sharper */
+#define FLI_FOCUS_METRIC_HFD (2)	/* Half flux diameter of the brightest star, smaller is sharper */
+
+/**
+ * @brief A focus sweep run by `FLIAutoFocus()`.
+ * 
+ */
+typedef struct {
+  long start;			/* Focuser position of the first sample */
+  long step;			/* Steps between samples, negative to sweep back */
+  long samples;			/* Most samples to take, at least 3 */
+  long exptime;			/* Exposure time in milliseconds */
+  long ul_x, ul_y, lr_x, lr_y;	/* Region exposed, as for FLISetImageArea() */
+  long metric;			/* FLI_FOCUS_METRIC_* */
+} flifocussweep_t;
+
+/**
+ * @brief One sample of a focus sweep.
+ * 
+ */
+typedef struct {
+  long position;		/* Focuser position */
+  double metric;		/* Focus metric there */
+} flifocussample_t;
+
 #ifndef LIBFLIAPI
 #  ifdef _WIN32
 #    ifdef _LIB
@@ -360,6 +484,25 @@ LIBFLIAPI FLIOpen(flidev_t *dev, char *name, flidomain_t domain);
  */
 LIBFLIAPI FLISetDebugLevel(char *host, flidebug_t level);
 
+/**
+ * @brief Keep debug messages in per-thread memory rings instead of writing
+ * them out. Messages are stored unformatted and formatted by FLIDebugLogDump.
+ * 
+ * @param depth Number of messages to keep per thread (rounded up to a power
+ * of two), or zero to write messages out again as they happen.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIDebugLogEnable(long depth);
+
+/**
+ * @brief Write the kept debug messages of all threads to a text file in
+ * time order.
+ * 
+ * @param filename File to write.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIDebugLogDump(char *filename);
+
 /**
  * @brief Close a handle to an FLI device. This function releases the handle to the device and frees any resources associated with it.
  * 
@@ -670,16 +813,146 @@ LIBFLIAPI FLIList(flidomain_t domain, char ***names);
  */
 LIBFLIAPI FLIFreeList(char **names);
 
+/**
+ * @brief Register a callback invoked when an FLI device arrives on or
+ * leaves the USB bus. Callbacks run on the library's event thread and
+ * may call `FLIOpen()`. Where the USB stack has no hotplug support,
+ * events are raised from within `FLIList()` instead.
+ * 
+ * @param cb Callback function.
+ * @param user Opaque pointer passed back to the callback.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIRegisterHotplugCallback(flihotplugcb_t cb, void *user);
+
+/**
+ * @brief Remove a callback registered with `FLIRegisterHotplugCallback()`.
+ * 
+ * @param cb Callback function.
+ * @param user Opaque pointer the callback was registered with.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIDeregisterHotplugCallback(flihotplugcb_t cb, void *user);
+
+/**
+ * @brief Enumerate devices into a caller supplied array. For USB no memory
+ * is allocated per device and devices are not opened; serial and parallel
+ * ports are opened when first seen, and what was found is reused for 30
+ * seconds or until the device is closed. At most
+ * `cap` entries are written to `out`; `n` receives the number of devices
+ * found, which may be larger than `cap`.
+ * 
+ * @param domain Domain to search, as for `FLICreateList()`. Supply an
+ * interface of `0` to search all interfaces.
+ * @param out Array of `cap` device descriptions.
+ * @param cap Number of entries in `out`.
+ * @param n Pointer to where the number of devices found will be stored.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIEnumerate(flidomain_t domain, fli_devinfo_t *out, size_t cap, size_t *n);
+
+/**
+ * @brief Enumerate devices matching a serial number and/or model. As
+ * `FLIEnumerate()`, with `NULL` matching any serial number or model.
+ * 
+ * @param domain Domain to search.
+ * @param serial Serial number to match (case insensitive), or `NULL`.
+ * @param model Model name to match (case insensitive), or `NULL`.
+ * @param out Array of `cap` device descriptions.
+ * @param cap Number of entries in `out`.
+ * @param n Pointer to where the number of matching devices will be stored.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIEnumerateFilter(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n);
+
 LIBFLIAPI FLIGetFilterName(flidev_t dev, long filter, char *name, size_t len);
 LIBFLIAPI FLISetActiveWheel(flidev_t dev, long wheel);
 LIBFLIAPI FLIGetActiveWheel(flidev_t dev, long *wheel);
 
 LIBFLIAPI FLISetFilterPos(flidev_t dev, long filter);
+
+/**
+ * @brief Start a filter wheel move without waiting for it to finish.
+ * A move still in progress is completed first.
+ * 
+ * @param dev Filter wheel handle.
+ * @param filter Desired filter wheel position.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ * @see FLIWaitFilterMove
+ */
+LIBFLIAPI FLISetFilterPosAsync(flidev_t dev, long filter);
+
+/**
+ * @brief Wait for a move started by `FLISetFilterPosAsync()` to end.
+ * 
+ * @param dev Filter wheel handle.
+ * @param timeout Milliseconds to wait, zero to only check, negative to wait until the move ends.
+ * @return LIBFLIAPI Zero once the move has ended, `-ETIMEDOUT` if it has not, other non-zero error codes on failure.
+ */
+LIBFLIAPI FLIWaitFilterMove(flidev_t dev, long timeout);
+
+/**
+ * @brief Start moving the wheels of a multi-wheel unit together without waiting for them.
+ * 
+ * @param dev Filter wheel handle.
+ * @param pos Desired position of each physical wheel, negative to leave a wheel alone.
+ * @param n Number of entries in `pos`.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ * @see FLIWaitFilterMove
+ */
+LIBFLIAPI FLISetWheelPositionsAsync(flidev_t dev, long *pos, long n);
+
+/**
+ * @brief Run a sequence of exposures, moving the filter wheel and focuser for each one while the previous frame is read out.
+ * 
+ * @param cam Camera handle.
+ * @param wheel Filter wheel handle, or `FLI_INVALID_DEVICE` for none.
+ * @param focuser Focuser handle, or `FLI_INVALID_DEVICE` for none.
+ * @param steps The exposures to take, in order.
+ * @param nsteps Number of entries in `steps`.
+ * @param timing Receives the timing of each exposure, `nsteps` entries, may be NULL.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIRunSequence(flidev_t cam, flidev_t wheel, flidev_t focuser,
+  flisequencestep_t *steps, long nsteps, flisequencetiming_t *timing);
+
+/**
+ * @brief Find the best focus by sweeping the focuser and measuring a region of the image at each position.
+ * 
+ * @param cam Camera handle.
+ * @param focuser Focuser handle.
+ * @param sweep Positions, exposure, region and metric of the sweep.
+ * @param samples Receives the samples taken, `sweep->samples` entries, may be NULL.
+ * @param nsamples Receives the number of samples taken, may be NULL.
+ * @param best Receives the position of best focus the focuser is left at, may be NULL.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIAutoFocus(flidev_t cam, flidev_t focuser, flifocussweep_t *sweep,
+  flifocussample_t *samples, long *nsamples, long *best);
 LIBFLIAPI FLIGetFilterPos(flidev_t dev, long *filter);
 LIBFLIAPI FLIGetFilterCount(flidev_t dev, long *filter);
 
 LIBFLIAPI FLIStepMotor(flidev_t dev, long steps);
 LIBFLIAPI FLIStepMotorAsync(flidev_t dev, long steps);
+
+/**
+ * @brief Wait for a move started by `FLIStepMotorAsync()` or `FLIHomeDevice()` to end.
+ * 
+ * @param dev Filter wheel or focuser handle.
+ * @param timeout Milliseconds to wait, zero to only check, negative to wait until the move ends.
+ * @return LIBFLIAPI Zero once the move has ended, `-ETIMEDOUT` if it has not, other non-zero error codes on failure.
+ */
+LIBFLIAPI FLIWaitStepMotor(flidev_t dev, long timeout);
+
+/**
+ * @brief Get the time until the move in progress should end, predicted from the step count and step rate.
+ * 
+ * @param dev Filter wheel or focuser handle.
+ * @param ms Receives the milliseconds left, zero when no move is in progress.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIGetMoveTimeRemaining(flidev_t dev, long *ms);
 LIBFLIAPI FLIGetStepperPosition(flidev_t dev, long *position);
 LIBFLIAPI FLIGetStepsRemaining(flidev_t dev, long *steps);
 LIBFLIAPI FLIHomeFocuser(flidev_t dev);
@@ -743,6 +1016,56 @@ LIBFLIAPI FLIListNext(flidomain_t *domain, char *filename, size_t fnlen, char *n
 LIBFLIAPI FLIReadTemperature(flidev_t dev, flichannel_t channel, double *temperature);
 LIBFLIAPI FLIGetFocuserExtent(flidev_t dev, long *extent);
 LIBFLIAPI FLIUsbBulkIO(flidev_t dev, int ep, void *buf, long *len);
+
+/**
+ * @brief Enable or disable recording of USB transfers for a device.
+ * 
+ * @param dev Device handle.
+ * @param depth Number of transfers to keep (rounded up to a power of two),
+ * or zero to stop recording.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLITraceEnable(flidev_t dev, long depth);
+
+/**
+ * @brief Write the recorded USB transfers of a device to a file. The file
+ * can be opened as the device `"replay:<filename>"` to play them back.
+ * 
+ * @param dev Device handle.
+ * @param filename File to write.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLITraceDump(flidev_t dev, char *filename);
+
+/**
+ * @brief Override the bulk transfer size and queue depth for image
+ * downloads, which are otherwise tuned during the first readouts.
+ * 
+ * @param dev Device handle.
+ * @param xfer Bytes per transfer (a multiple of 512), or zero to tune again.
+ * @param depth Transfers kept queued, or zero to leave it unchanged.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLISetTransferTuning(flidev_t dev, long xfer, long depth);
+
+/**
+ * @brief Get the bulk transfer size and queue depth used for image downloads.
+ * 
+ * @param dev Device handle.
+ * @param xfer Receives the transfer size in bytes.
+ * @param depth Receives the queue depth, zero if the transport has none.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIGetTransferTuning(flidev_t dev, long *xfer, long *depth);
+
+/**
+ * @brief Get the transfer statistics of a device since it was opened.
+ * 
+ * @param dev Device handle.
+ * @param stats Receives the statistics.
+ * @return LIBFLIAPI Zero on success, non-zero error code on failure.
+ */
+LIBFLIAPI FLIGetDeviceStats(flidev_t dev, flidevstats_t *stats);
 LIBFLIAPI FLIGetDeviceStatus(flidev_t dev, long *status);
 LIBFLIAPI FLIGetCameraModeString(flidev_t dev, flimode_t mode_index, char *mode_string, size_t siz);
 LIBFLIAPI FLIGetCameraMode(flidev_t dev, flimode_t *mode_index);
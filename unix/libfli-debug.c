@@ -46,6 +46,7 @@
 #include <stdio.h>
 
 #include "libfli-libfli.h"
+#include "libfli-log.h"
 
 #define LOGPREFIX "libfli"
 
@@ -53,6 +54,8 @@ static char *_loghost = NULL;
 static flidebug_t _loglevel = FLIDEBUG_NONE;
 static int _logopen = 0;
 
+volatile int fli_debug_levels = FLIDEBUG_NONE;
+
 int sysloglevel(int level)
 {
   switch (level)
@@ -94,19 +97,26 @@ int debugclose(void)
   return 0;
 }
 
-void debug(int level, char *format, ...)
+void fli_debug(int level, char *format, ...)
 {
+  char buf[1024];
   va_list ap;
+  int n, len;
 
   va_start(ap, format);
 
-  if (_loghost != NULL)
+  if (fli_log_active())
+    fli_log_vrecord(level, format, ap);
+  else if (_loghost != NULL)
     vsyslog(sysloglevel(level), format, ap);
   else if (level > FLIDEBUG_NONE && level <= _loglevel)
   {
-    fprintf(stderr, LOGPREFIX ": ");
-    vfprintf(stderr, format, ap);
-    fprintf(stderr, "\n");
+    /* One write per line, so lines from different threads stay whole */
+    n = snprintf(buf, sizeof(buf), LOGPREFIX ": ");
+    if ((len = vsnprintf(&buf[n], sizeof(buf) - n, format, ap)) > 0)
+      n = MIN(n + len, (int) sizeof(buf) - 2);
+    buf[n++] = '\n';
+    fwrite(buf, 1, n, stderr);
   }
 
   va_end(ap);
@@ -116,9 +126,18 @@ void debug(int level, char *format, ...)
 
 void setdebuglevel(char *host, long level)
 {
+  int bit;
+
   _loghost = host;
   _loglevel = level;
 
+  /* Levels are ordered here: a level logs everything at or below it */
+  fli_debug_levels = FLIDEBUG_NONE;
+  for (bit = 1; (bit > 0) && (bit <= level); bit <<= 1)
+    fli_debug_levels |= bit;
+  if ((host != NULL) && (level != FLIDEBUG_NONE))
+    fli_debug_levels = ~0;
+
   if (level == FLIDEBUG_NONE)
   {
     debugclose();
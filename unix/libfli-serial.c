@@ -40,7 +40,6 @@
   email: support@fli-cam.com
 
 */
-
 #include <sys/types.h>
 #include <sys/time.h>
 
@@ -48,35 +47,44 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include "libfli-libfli.h"
 #include "libfli-debug.h"
+#include "libfli-trace.h"
 #include "libfli-sys.h"
 #include "libfli-serial.h"
 
-long unix_serialio(flidev_t dev, void *buf, long *wlen, long *rlen)
+/* The port is set up once when it is opened and put back as it was
+ * when it is closed, rather than around every command */
+long unix_serial_connect(flidev_t dev, fli_unixio_t *io, char *name)
 {
-  int err = 0, locked = 0, gotattr = 0;
-  long org_wlen = *wlen, org_rlen = *rlen;
-  struct termios old_termios, new_termios;
-  fli_unixio_t *io;
+  fli_unixserial_t *ser;
+  struct termios new_termios;
+  int err;
 
-  io = DEVICE->io_data;
+  if ((ser = fli_dev_alloc(dev, sizeof(fli_unixserial_t))) == NULL)
+    return -ENOMEM;
+  ser->epfd = -1;
 
-  if ((err = unix_fli_lock(dev)))
+  if ((io->fd = open(name, O_RDWR | O_NOCTTY)) == -1)
   {
-    debug(FLIDEBUG_WARN, "Lock failed");
-    goto done;
+    err = -errno;
+    fli_dev_free(dev, ser);
+    return err;
   }
-  locked = 1;
 
-  if (tcgetattr(io->fd, &old_termios))
+  if (tcgetattr(io->fd, &ser->saved))
   {
     err = -errno;
     debug(FLIDEBUG_WARN, "tcgetattr() failed: %s", strerror(errno));
-    goto done;
+    goto fail;
   }
-  gotattr = 1;
 
   bzero(&new_termios, sizeof(struct termios));
   new_termios.c_cflag = CS8 | CREAD | CLOCAL;
@@ -88,93 +96,194 @@ long unix_serialio(flidev_t dev, void *buf, long *wlen, long *rlen)
   {
     err = -errno;
     debug(FLIDEBUG_WARN, "cfsetispeed() failed: %s", strerror(errno));
-    goto done;
+    goto fail;
   }
   /* Set the output baud rate */
   if (cfsetospeed(&new_termios, BAUDRATE))
   {
     err = -errno;
     debug(FLIDEBUG_WARN, "cfsetospeed() failed: %s", strerror(errno));
-    goto done;
+    goto fail;
   }
 
   if (tcsetattr(io->fd, TCSANOW, &new_termios))
   {
     err = -errno;
-    // FIX: Should this be FLIDEBUG_FAIL
-    debug(FLIDEBUG_WARN, "tcsetattr() failed: %s", strerror(errno));
-    goto done;
+    debug(FLIDEBUG_FAIL, "tcsetattr() failed: %s", strerror(errno));
+    goto fail;
   }
 
-  if ((*wlen = write(io->fd, buf, org_wlen)) != org_wlen)
+  /* Nothing left over from whoever had the port before */
+  tcflush(io->fd, TCIOFLUSH);
+
+#if defined(__linux__)
   {
-    err = -errno;
-    debug(FLIDEBUG_WARN, "write() failed, only %d of %d bytes written",
-	  *wlen, org_wlen);
-    goto done;
+    struct epoll_event ev;
+
+    if ((ser->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+      err = -errno;
+      debug(FLIDEBUG_WARN, "epoll_create1() failed: %s", strerror(errno));
+      goto restore;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = io->fd;
+    if (epoll_ctl(ser->epfd, EPOLL_CTL_ADD, io->fd, &ev))
+    {
+      err = -errno;
+      debug(FLIDEBUG_WARN, "epoll_ctl() failed: %s", strerror(errno));
+      close(ser->epfd);
+      goto restore;
+    }
   }
+#endif
+
+  io->serial = ser;
+
+  return 0;
+
+#if defined(__linux__)
+ restore:
+  tcsetattr(io->fd, TCSANOW, &ser->saved);
+#endif
+ fail:
+  close(io->fd);
+  io->fd = -1;
+  fli_dev_free(dev, ser);
+
+  return err;
+}
+
+long unix_serial_disconnect(flidev_t dev, fli_unixio_t *io)
+{
+  fli_unixserial_t *ser = io->serial;
+  int err = 0;
 
-  if (tcdrain(io->fd))
+  if (ser != NULL)
   {
+    if (tcsetattr(io->fd, TCSANOW, &ser->saved))
+    {
+      err = -errno;
+      debug(FLIDEBUG_WARN,
+	    "tcsetattr() failed, could not restore terminal settings: %s",
+	    strerror(errno));
+    }
+
+    if (ser->epfd != -1)
+      close(ser->epfd);
+    fli_dev_free(dev, ser);
+    io->serial = NULL;
+  }
+
+  if ((close(io->fd) != 0) && (err == 0))
     err = -errno;
-    debug(FLIDEBUG_WARN, "tcdrain() failed: %s", strerror(errno));
+  io->fd = -1;
+
+  return err;
+}
+
+/* Waits up to ms for the port to have data; -EINTR asks the caller to
+ * wait again for whatever time it has left */
+static long serial_wait(fli_unixio_t *io, long ms)
+{
+  int r;
+
+#if defined(__linux__)
+  fli_unixserial_t *ser = io->serial;
+  struct epoll_event ev;
+
+  r = epoll_wait(ser->epfd, &ev, 1, (int) ms);
+#else
+  struct pollfd pfd;
+
+  pfd.fd = io->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  r = poll(&pfd, 1, (int) ms);
+#endif
+
+  if (r < 0)
+    return -errno;
+  if (r == 0)
+    return -ETIMEDOUT;
+
+  return 0;
+}
+
+/* Writes n commands of wlen bytes back to back and reads their n
+ * replies of rlen bytes, all within one io_timeout. The device
+ * answers commands in order, so they needn't wait on each other. */
+long unix_serialio_batch(flidev_t dev, void *wbuf, long wlen,
+  void *rbuf, long rlen, long n)
+{
+  int err = 0, locked = 0;
+  long total = wlen * n, want = rlen * n, got, left;
+  uint64_t deadline;
+  ssize_t r;
+  fli_unixio_t *io;
+
+  io = DEVICE->io_data;
+
+  if ((err = unix_fli_lock(dev)))
+  {
+    debug(FLIDEBUG_WARN, "Lock failed");
     goto done;
   }
+  locked = 1;
 
-  for (*rlen = 0; *rlen < org_rlen; )
+  if ((r = write(io->fd, wbuf, total)) != total)
   {
-    ssize_t r;
-    fd_set readfds;
-    struct timeval timeout;
+    err = (r < 0)?-errno:-EIO;
+    debug(FLIDEBUG_WARN, "write() failed, only %ld of %ld bytes written",
+	  (long) r, total);
+    goto done;
+  }
 
-    timeout.tv_sec = DEVICE->io_timeout / 1000;
-    timeout.tv_usec = (DEVICE->io_timeout % 1000) * 1000;
+  deadline = fli_trace_now() + (uint64_t) DEVICE->io_timeout * 1000000;
 
-    FD_ZERO(&readfds);
-    FD_SET(io->fd, &readfds);
+  for (got = 0; got < want; )
+  {
+    uint64_t now = fli_trace_now();
 
-    switch (select(io->fd + 1, &readfds, NULL, NULL, &timeout))
+    left = (now < deadline)?(long) ((deadline - now + 999999) / 1000000):0;
+    if ((err = serial_wait(io, left)) != 0)
     {
-    case -1:			/* An error occurred */
-      err = -errno;
-      debug(FLIDEBUG_WARN, "select() failed: %s", strerror(errno));
-      break;
-
-    case 0:			/* A timeout occurred */
-      err = -ETIMEDOUT;
-      debug(FLIDEBUG_WARN, "A serial communication timeout occurred");
-      break;
-
-    default:			/* There's some data to read */
-      if ((r = read(io->fd, buf + *rlen, org_rlen - *rlen)) <= 0)
+      if (err == -EINTR)
       {
-	err = -errno;
-	debug(FLIDEBUG_WARN, "read() failed, only %d of %d bytes read",
-	      r, org_rlen - *rlen);
+	err = 0;
+	continue;
       }
+      if (err == -ETIMEDOUT)
+	debug(FLIDEBUG_WARN, "A serial communication timeout occurred");
       else
-	*rlen += r;
+	debug(FLIDEBUG_WARN, "Waiting for the port failed: %s", strerror(-err));
       break;
     }
 
-    if (err)
+    if ((r = read(io->fd, (char *) rbuf + got, want - got)) < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+	continue;
+      err = -errno;
+      debug(FLIDEBUG_WARN, "read() failed, only %ld of %ld bytes read",
+	    got, want);
       break;
-  }
-
- done:
-
-  if (gotattr)
-  {
-    if (tcsetattr(io->fd, TCSANOW, &old_termios))
+    }
+    if (r == 0)
     {
-      if (err == 0)
-	err = -errno;
-      debug(FLIDEBUG_WARN,
-	    "tcsetattr() failed, could not restore terminal settings: %s",
-	    strerror(errno));
+      err = -EIO;
+      debug(FLIDEBUG_WARN, "read() failed, only %ld of %ld bytes read",
+	    got, want);
+      break;
     }
+
+    got += r;
   }
 
+ done:
+
   if (locked)
   {
     int r;
@@ -187,3 +296,14 @@ long unix_serialio(flidev_t dev, void *buf, long *wlen, long *rlen)
 
   return err;
 }
+
+long unix_serialio(flidev_t dev, void *buf, long *wlen, long *rlen)
+{
+  long err;
+
+  /* Replies are read into the command buffer, as over USB */
+  if ((err = unix_serialio_batch(dev, buf, *wlen, buf, *rlen, 1)) != 0)
+    *rlen = 0;
+
+  return err;
+}
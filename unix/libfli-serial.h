@@ -44,8 +44,19 @@
 #ifndef _LIBFLI_SERIAL_H_
 #define _LIBFLI_SERIAL_H_
 
+#include <termios.h>
+
 #define BAUDRATE B1200
 
+typedef struct {
+  struct termios saved;		/* Port settings before it was opened */
+  int epfd;			/* Watches the port for replies, Linux only */
+} fli_unixserial_t;
+
+long unix_serial_connect(flidev_t dev, fli_unixio_t *io, char *name);
+long unix_serial_disconnect(flidev_t dev, fli_unixio_t *io);
 long unix_serialio(flidev_t dev, void *buf, long *wlen, long *rlen);
+long unix_serialio_batch(flidev_t dev, void *wbuf, long wlen,
+  void *rbuf, long rlen, long n);
 
 #endif /* _LIBFLI_SERIAL_H_ */
@@ -64,17 +64,183 @@
 #include "libfli-parport.h"
 #include "libfli-usb.h"
 #include "libfli-serial.h"
+#include "libfli-trace.h"
+#include "libfli-sim.h"
+#if defined(__linux__)
+#include "linux/libfli-usbfs.h"
+#endif
 
 static long unix_fli_list_parport(flidomain_t domain, char ***names);
 static long unix_fli_list_usb(flidomain_t domain, char ***names);
 static long unix_fli_list_serial(flidomain_t domain, char ***names);
 
+#if defined(__linux__)
+/* Devices named by their usbfs node are opened through usbfs, as is
+ * every device when FLI_USB_BACKEND=usbfs or when built for usbfs
+ * only. Registry names are translated to their node. */
+static int unix_fli_usbfs_name(char *name, char *path, size_t len)
+{
+  if (strncmp(name, FLI_USBFS_PREFIX, strlen(FLI_USBFS_PREFIX)) == 0)
+  {
+    snprintf(path, len, "%s", name);
+    return 1;
+  }
+
+#if !defined(__USBFS__)
+  {
+    char *backend = getenv("FLI_USB_BACKEND");
+
+    if ((backend == NULL) || (strcmp(backend, "usbfs") != 0))
+      return 0;
+  }
+#endif
+
+#if defined(__LIBUSB__)
+  return (libusb_fli_usbfs_path(name, path, len) == 0);
+#else
+  return 0;
+#endif
+}
+#endif
+
+static long unix_fli_usb_disconnect(flidev_t dev, fli_unixio_t *io)
+{
+#if defined(__linux__)
+  if (io->usbfs != NULL)
+    return usbfs_usb_disconnect(dev, io);
+#endif
+
+  return unix_usb_disconnect(dev, io);
+}
+
+/* Lock files live in PUBLIC_DIR and are named after the device, with
+ * path separators flattened. */
+//#define PUBLIC_DIR "/var/spool/lock"
+#define PUBLIC_DIR "/tmp"
+
+static long unix_fli_lockfile(const char *devname, char *lockf, size_t len)
+{
+  char name[PATH_MAX];
+  int i;
+
+  for (i = 0; devname[i] != '\0' && i < PATH_MAX; i++)
+    name[i] = (devname[i] == '/') ? '-' : devname[i];
+
+  name[MIN(i, PATH_MAX - 1)] = '\0';
+
+  if (snprintf(lockf, len, PUBLIC_DIR "/libfli%s.lock", name) >= (int) len)
+    return -EOVERFLOW;
+
+  return 0;
+}
+
+/* With FLI_LOCK=session the device is also locked against other
+ * processes for as long as it is open. flock() is dropped by the
+ * kernel when the holder exits, so a crashed process cannot leave a
+ * stale lock behind, and individual transactions never touch the
+ * file system. The lock is named after what the device is rather than
+ * how it was opened, so opening it by serial number and by path meet
+ * on the same file; it is only taken once the transport is up and the
+ * device has identified itself. */
+static long unix_fli_session_lock(flidev_t dev, const char *name,
+  fli_unixsysinfo_t *sys)
+{
+  char lockf[PATH_MAX], id[PATH_MAX], *mode;
+  long err;
+
+  if ((mode = getenv("FLI_LOCK")) == NULL || strcmp(mode, "session") != 0)
+    return 0;
+
+  if ((DEVICE->devinfo.serial != NULL) && (DEVICE->devinfo.serial[0] != '\0'))
+    snprintf(id, sizeof(id), "usb-%04x-%s", (unsigned int) DEVICE->devinfo.devid,
+      DEVICE->devinfo.serial);
+  else if (DEVICE->devinfo.buspath != NULL)
+    snprintf(id, sizeof(id), "usb-%s", DEVICE->devinfo.buspath);
+  else if (realpath(name, id) == NULL)
+    snprintf(id, sizeof(id), "%s", name);
+
+  if ((err = unix_fli_lockfile(id, lockf, sizeof(lockf))))
+    return err;
+
+  if ((sys->lockfd = open(lockf, O_RDWR | O_CREAT, 0666)) == -1)
+  {
+    err = -errno;
+    debug(FLIDEBUG_WARN, "Could not open lock file `%s': %s", lockf,
+      strerror(errno));
+    return err;
+  }
+  fcntl(sys->lockfd, F_SETFD, FD_CLOEXEC);
+  /* Let other users open the device after us despite the umask */
+  fchmod(sys->lockfd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
+    S_IROTH | S_IWOTH);
+
+  if (flock(sys->lockfd, LOCK_EX | LOCK_NB) == -1)
+  {
+    err = (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+    debug(FLIDEBUG_WARN, "`%s' is in use by another process", name);
+    close(sys->lockfd);
+    sys->lockfd = -1;
+    return err;
+  }
+
+  debug(FLIDEBUG_INFO, "Holding session lock `%s'", lockf);
+
+  return 0;
+}
+
+static long unix_fli_sys_init(flidev_t dev)
+{
+  fli_unixsysinfo_t *sys;
+  int err;
+
+  if ((sys = fli_dev_alloc(dev, sizeof(fli_unixsysinfo_t))) == NULL)
+    return -ENOMEM;
+
+  /* Recursive, so that FLILockDevice() can be held around commands
+   * which take the lock again for every transaction. */
+  if ((err = pthread_mutexattr_init(&sys->attr)) != 0)
+  {
+    fli_dev_free(dev, sys);
+    return -err;
+  }
+  pthread_mutexattr_settype(&sys->attr, PTHREAD_MUTEX_RECURSIVE);
+
+  if ((err = pthread_mutex_init(&sys->mutex, &sys->attr)) != 0)
+  {
+    pthread_mutexattr_destroy(&sys->attr);
+    fli_dev_free(dev, sys);
+    return -err;
+  }
+
+  sys->lockfd = -1;
+  DEVICE->sys_data = sys;
+
+  return 0;
+}
+
+static void unix_fli_sys_free(flidev_t dev)
+{
+  fli_unixsysinfo_t *sys;
+
+  if ((sys = DEVICE->sys_data) == NULL)
+    return;
+
+  if (sys->lockfd != -1)
+  {
+    flock(sys->lockfd, LOCK_UN);
+    close(sys->lockfd);
+  }
+
+  pthread_mutex_destroy(&sys->mutex);
+  pthread_mutexattr_destroy(&sys->attr);
+
+  fli_dev_free(dev, sys);
+  DEVICE->sys_data = NULL;
+}
+
 long unix_fli_connect(flidev_t dev, char *name, long domain)
 {
   fli_unixio_t *io = NULL;
-  pthread_mutex_t mutex;
-  pthread_mutexattr_t fliattr;
-  fli_unixsysinfo_t *sys;
   int err;
 
   CHKDEVICE(dev);
@@ -90,8 +256,8 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
   DEVICE->domain = domain & 0x00ff;
   DEVICE->devinfo.type = domain & 0xff00;
 
-  debug(FLIDEBUG_INFO, "Domain: 0x%04x", DEVICE->domain);
-  debug(FLIDEBUG_INFO, "  Type: 0x%04x", DEVICE->devinfo.type);
+  debug(FLIDEBUG_INFO, "Domain: 0x%04lx", DEVICE->domain);
+  debug(FLIDEBUG_INFO, "  Type: 0x%04lx", DEVICE->devinfo.type);
   
   /* Check for valid device type */  
   switch (DEVICE->devinfo.type)
@@ -118,11 +284,19 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
     return -EINVAL;
   }
 
-  if ((io = xcalloc(1, sizeof(fli_unixio_t))) == NULL)
+  /* The device lock has to work before the first transaction */
+  if ((err = unix_fli_sys_init(dev)))
+    return err;
+
+  if ((io = fli_dev_alloc(dev, sizeof(fli_unixio_t))) == NULL)
+  {
+    unix_fli_sys_free(dev);
     return -ENOMEM;
+  }
     
   io->fd = (-1); /* No device open at this time */
   io->han = NULL;
+  io->serial = NULL;
 
   switch (DEVICE->domain)
   {
@@ -130,7 +304,8 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
   case FLIDOMAIN_PARALLEL_PORT:
 	  if ((io->fd = open(name, O_RDWR)) == -1)
 	  {
-	    xfree(io);
+	    unix_fli_sys_free(dev);
+	    fli_dev_free(dev, io);
 	    return -errno;
 	  }
 
@@ -139,12 +314,28 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
   */
   case FLIDOMAIN_USB:
     {
+#if defined(__linux__)
+      char path[PATH_MAX];
+#endif
       int r;
 
-      if ((r = unix_usb_connect(dev, io, name)))
+      if (strncmp(name, FLI_TRACE_REPLAY_PREFIX,
+        strlen(FLI_TRACE_REPLAY_PREFIX)) == 0)
+        r = fli_trace_replay_connect(dev, name + strlen(FLI_TRACE_REPLAY_PREFIX));
+      else if (strncmp(name, FLI_SIM_PREFIX, strlen(FLI_SIM_PREFIX)) == 0)
+        r = fli_sim_connect(dev, name + strlen(FLI_SIM_PREFIX));
+#if defined(__linux__)
+      else if (unix_fli_usbfs_name(name, path, sizeof(path)))
+        r = usbfs_usb_connect(dev, io, path);
+#endif
+      else
+        r = unix_usb_connect(dev, io, name);
+
+      if (r)
       {
-				unix_usb_disconnect(dev,io);
-        xfree(io);
+				unix_fli_usb_disconnect(dev, io);
+        unix_fli_sys_free(dev);
+        fli_dev_free(dev, io);
         return r;
       }
       
@@ -154,8 +345,9 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
           if (!((DEVICE->devinfo.devid == FLIUSB_CAM_ID) ||
           	(DEVICE->devinfo.devid == FLIUSB_PROLINE_ID)))
           {
-						unix_usb_disconnect(dev,io);
-            xfree(io);
+						unix_fli_usb_disconnect(dev, io);
+            unix_fli_sys_free(dev);
+            fli_dev_free(dev, io);
             return -ENODEV;
           }
           break;
@@ -163,8 +355,9 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
         case FLIDEVICE_FOCUSER:
           if (DEVICE->devinfo.devid != FLIUSB_FOCUSER_ID)
           {
-						unix_usb_disconnect(dev,io);
-            xfree(io);
+						unix_fli_usb_disconnect(dev, io);
+            unix_fli_sys_free(dev);
+            fli_dev_free(dev, io);
             return -ENODEV;
           }
           break;
@@ -174,63 +367,75 @@ long unix_fli_connect(flidev_t dev, char *name, long domain)
           	(DEVICE->devinfo.devid == FLIUSB_CFW4_ID)))
           {
             debug(FLIDEBUG_INFO, "FW Not Recognized");
-						unix_usb_disconnect(dev,io);
-            xfree(io);
+						unix_fli_usb_disconnect(dev, io);
+            unix_fli_sys_free(dev);
+            fli_dev_free(dev, io);
             return -ENODEV;
           }
           break;
 
         default:
           debug(FLIDEBUG_INFO, "Device Not Recognized");
-					unix_usb_disconnect(dev,io);
-          xfree(io);
+					unix_fli_usb_disconnect(dev, io);
+          unix_fli_sys_free(dev);
+          fli_dev_free(dev, io);
           return -ENODEV;
       }
       
-      DEVICE->fli_io = unix_usbio;
+      /* A replay, simulation or usbfs supplies its own transport */
+      if (DEVICE->fli_io == NULL)
+        DEVICE->fli_io = unix_usbio;
+      if (DEVICE->fli_bulk == NULL)
+      {
+        /* Reads are split into USB_READ_SIZ_MAX pieces, one after the other */
+        DEVICE->fli_bulk = usb_bulktransfer;
+        DEVICE->bulk_max = USB_READ_SIZ_MAX;
+      }
+#if defined(unix_usb_dev_mem_alloc)
+      if (DEVICE->fli_dev_mem_alloc == NULL)
+      {
+        DEVICE->fli_dev_mem_alloc = unix_usb_dev_mem_alloc;
+        DEVICE->fli_dev_mem_free = unix_usb_dev_mem_free;
+      }
+#endif
+#if defined(__LIBUSB__)
+      {
+        char port[32];
+
+        if (libusb_fli_port_path(name, port, sizeof(port)) == 0)
+          DEVICE->devinfo.buspath = fli_dev_strdup(dev, port);
+      }
+#endif
     }
     break;
 
   case FLIDOMAIN_SERIAL:
-	  if ((io->fd = open(name, O_RDWR)) == -1)
+	  if ((err = unix_serial_connect(dev, io, name)))
 	  {
-	    xfree(io);
-	    return -errno;
+	    unix_fli_sys_free(dev);
+	    fli_dev_free(dev, io);
+	    return err;
 	  }
 
     DEVICE->fli_io = unix_serialio;
+    DEVICE->fli_io_batch = unix_serialio_batch;
     break;
 
   default:
-    xfree(io);
+    unix_fli_sys_free(dev);
+    fli_dev_free(dev, io);
     return -EINVAL;
   }
 
-  if((sys = xcalloc(1, sizeof(fli_unixsysinfo_t))) == NULL)
+  DEVICE->io_data = io;
+
+  if ((err = unix_fli_session_lock(dev, name, DEVICE->sys_data)))
   {
     unix_fli_disconnect(dev);
-    return -ENOMEM;
-  }
-  DEVICE->sys_data = sys;
-
-  /* Create synchronization object */
-  if((err = pthread_mutexattr_init(&fliattr)) != 0)
-    return err;
-  
-  if((err = pthread_mutexattr_settype(&fliattr, PTHREAD_MUTEX_NORMAL)) != 0)
-    return err;
-  
-  if((err = pthread_mutexattr_setpshared(&fliattr, PTHREAD_PROCESS_SHARED)) != 0)
-    return err;
-  
-  if((err = pthread_mutex_init(&mutex,&fliattr)) != 0)
     return err;
+  }
 
-  ((fli_unixsysinfo_t *) (DEVICE->sys_data))->mutex = mutex;
-  ((fli_unixsysinfo_t *) (DEVICE->sys_data))->attr = fliattr;
-  
-  DEVICE->io_data = io;
-  DEVICE->name = xstrdup(name);
+  DEVICE->name = fli_dev_strdup(dev, name);
   DEVICE->io_timeout = 60 * 1000; /* 1 min. */
 
   debug(FLIDEBUG_INFO, "Connected");
@@ -242,23 +447,28 @@ long unix_fli_disconnect(flidev_t dev)
 {
   int err = 0;
   fli_unixio_t *io;
-  fli_unixsysinfo_t *sys;
 
   CHKDEVICE(dev);
 
   if ((io = DEVICE->io_data) == NULL)
     return -EINVAL;
 
-  if ((sys = DEVICE->sys_data) == NULL)
+  if (DEVICE->sys_data == NULL)
     return -EINVAL;
 
-  err = pthread_mutex_destroy(&(sys->mutex));
-  err = pthread_mutexattr_destroy(&(sys->attr));
-
   switch (DEVICE->domain)
   {
   case FLIDOMAIN_USB:
-    err = unix_usb_disconnect(dev,io);
+    err = unix_fli_usb_disconnect(dev, io);
+    if (DEVICE->devinfo.buspath != NULL)
+    {
+      fli_dev_free(dev, DEVICE->devinfo.buspath);
+      DEVICE->devinfo.buspath = NULL;
+    }
+    break;
+
+  case FLIDOMAIN_SERIAL:
+    err = unix_serial_disconnect(dev, io);
     break;
 
   default:
@@ -269,18 +479,20 @@ long unix_fli_disconnect(flidev_t dev)
   if (err)
     err = -errno;
 
-  xfree(DEVICE->io_data);
+  fli_dev_free(dev, DEVICE->io_data);
   DEVICE->io_data = NULL;
 
-  if(DEVICE->sys_data != NULL)
-  {
-    xfree(DEVICE->sys_data);
-    DEVICE->sys_data = NULL;
-  }
+  unix_fli_sys_free(dev);
 
   DEVICE->fli_lock = NULL;
   DEVICE->fli_unlock = NULL;
   DEVICE->fli_io = NULL;
+  DEVICE->fli_io_batch = NULL;
+  DEVICE->fli_bulk = NULL;
+  DEVICE->fli_dev_mem_alloc = NULL;
+  DEVICE->fli_dev_mem_free = NULL;
+  DEVICE->fli_queue_depth = NULL;
+  DEVICE->bulk_max = 0;
   DEVICE->fli_open = NULL;
   DEVICE->fli_close = NULL;
   DEVICE->fli_command = NULL;
@@ -288,265 +500,71 @@ long unix_fli_disconnect(flidev_t dev)
   return err;
 }
 
-#if defined(_USE_PTHREAD_LOCK_)
-
 long unix_fli_lock(flidev_t dev)
 {
-  long r = -ENODEV;
   fli_unixsysinfo_t *sys;
-  pthread_mutex_t mutex;
+  int r;
 
   CHKDEVICE(dev);
 
   if ((sys = DEVICE->sys_data) == NULL)
   {
     debug(FLIDEBUG_WARN, "lock(): Mutex is NULL!");
-    return r;
+    return -ENODEV;
   }
 
-  mutex = sys->mutex;
-
-  r = pthread_mutex_lock(&mutex);
-  if(r != 0)
+  if ((r = pthread_mutex_lock(&sys->mutex)) != 0)
   {
     debug(FLIDEBUG_WARN, "Could not acquire mutex: %d", r);
-    r = -ENODEV;
+    return -ENODEV;
   }
 
-//  debug(FLIDEBUG_INFO, "Pthread Lock obtained");
-
-  return r;
+  return 0;
 }
 
 long unix_fli_unlock(flidev_t dev)
 {
-  int r = -ENODEV;
   fli_unixsysinfo_t *sys;
-  pthread_mutex_t mutex;
+  int r;
 
   CHKDEVICE(dev);
-  
-  sys = DEVICE->sys_data;
 
-  if (sys == NULL)
+  if ((sys = DEVICE->sys_data) == NULL)
   {
     debug(FLIDEBUG_WARN, "unlock(): Mutex is NULL!");
-    return r;
+    return -ENODEV;
   }
 
-  mutex = sys->mutex;
-
-  r = pthread_mutex_unlock(&mutex);
-  if( r != 0)
+  if ((r = pthread_mutex_unlock(&sys->mutex)) != 0)
   {
     debug(FLIDEBUG_WARN, "Could not release mutex: %d", r);
     return -ENODEV;
   }
 
-  return r;
+  return 0;
 }
 
 long unix_fli_trylock(flidev_t dev)
 {
-  long r = -ENODEV;
   fli_unixsysinfo_t *sys;
-  pthread_mutex_t mutex;
+  int r;
 
   CHKDEVICE(dev);
 
   if ((sys = DEVICE->sys_data) == NULL)
   {
     debug(FLIDEBUG_WARN, "trylock(): Mutex is NULL!");
-    return r;
-  }
-
-  mutex = sys->mutex;
-
-  r = pthread_mutex_trylock(&mutex);
-  if(r != 0)
-  {
-    debug(FLIDEBUG_WARN, "Could not acquire mutex with trylock: %d", r);
-    r = -ENODEV;
-  }
-
-  return r;
-}
-
-#elif defined(_USE_FLOCK_)
-
-long unix_fli_lock(flidev_t dev)
-{
-  fli_unixio_t *io = DEVICE->io_data;
-
-  if (io == NULL)
     return -ENODEV;
-
-  if (flock(io->fd, LOCK_EX) == -1)
-    return -errno;
-  else
-    return 0;
-}
-
-long unix_fli_unlock(flidev_t dev)
-{
-  fli_unixio_t *io = DEVICE->io_data;
-
-  if (io == NULL)
-    return -ENODEV;
-
-  if (flock(io->fd, LOCK_UN) == -1)
-    return -errno;
-  else
-    return 0;
-}
-
-long unix_fli_trylock(flidev_t dev)
-{
-  (void)dev;
-  return -ENODEV;
-}
-
-#else /* !defined(_USE_FLOCK_) */
-
-//#define PUBLIC_DIR "/var/spool/lock"
-#define PUBLIC_DIR "/tmp"
-
-long unix_fli_lock(flidev_t dev)
-{
-  int fd, err = 0, locked = 0, i;
-  char tmpf[] = PUBLIC_DIR "/temp.XXXXXX", lockf[PATH_MAX], name[PATH_MAX];
-  FILE *f;
-  unsigned int backoff = 10000;
-  pid_t pid;
-
-  if ((fd = mkstemp(tmpf)) == -1)
-    return -errno;
-
-  if ((f = fdopen(fd, "w")) == NULL)
-  {
-    err = -errno;
-    goto done;
-  }
-
-  fprintf(f, "%d\n", getpid());
-  fclose(f);
-
-  if (chmod(tmpf, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
-	    S_IROTH | S_IWOTH) == -1)
-  {
-    err = -errno;
-    goto done;
-  }
-
-  for (i = 0; DEVICE->name[i] != '\0' && i < PATH_MAX; i++)
-    name[i] = (DEVICE->name[i] == '/') ? '-' : DEVICE->name[i];
-
-  name[MIN(i, PATH_MAX - 1)] = '\0';
-
-  if (snprintf(lockf, PATH_MAX, PUBLIC_DIR "/libfli%s.lock",
-	       name) >= PATH_MAX)
-  {
-    err = -EOVERFLOW;
-    goto done;
-  }
-
-  do {
-    if (link(tmpf, lockf) == -1)
-    {
-      int r;
-
-      if (errno != EEXIST)
-      {
-	err = -errno;
-	goto done;
-      }
-
-      if ((f = fopen(lockf, "r")) == NULL)
-	continue;
-
-      r = fscanf(f, "%d\n", &pid);
-      fclose(f);
-      if (r != 1)
-	continue;
-
-      if (kill(pid, 0))
-      {
-	if (errno == ESRCH)
-	{
-	  debug(FLIDEBUG_WARN, "Removing stale lock file");
-	  unlink(lockf);
-	}
-
-	continue;
-      }
-      else
-      {
-	usleep(backoff);
-	if ((backoff <<= 2) == 0)
-	{
-	  err = -ETIMEDOUT;
-	  goto done;
-	}
-      }
-    }
-    else
-      locked = 1;
-  } while (!locked);
-
- done:
-
-  unlink(tmpf);
-
-  return err;
-}
-
-long unix_fli_unlock(flidev_t dev)
-{
-  char lockf[PATH_MAX], name[PATH_MAX];
-  FILE *f;
-  pid_t pid = -1;
-  int i;
-
-  for (i = 0; DEVICE->name[i] != '\0' && i < PATH_MAX; i++)
-    name[i] = (DEVICE->name[i] == '/') ? '-' : DEVICE->name[i];
-
-  name[MIN(i, PATH_MAX - 1)] = '\0';
-
-  if (snprintf(lockf, PATH_MAX, PUBLIC_DIR "/libfli%s.lock",
-	       name) >= PATH_MAX)
-    return -EOVERFLOW;
-
-  if ((f = fopen(lockf, "r")) == NULL)
-  {
-    debug(FLIDEBUG_WARN, "Trying to unlock `%s' when not locked",
-	  DEVICE->name);
-    return -errno;
   }
 
-  if (fscanf(f, "%d\n", &pid) != 1)
-    debug(FLIDEBUG_WARN, "Invalid lock file for `%s'", DEVICE->name);
-
-  fclose(f);
-
-  if (pid != -1 && pid != getpid())
-    debug(FLIDEBUG_WARN, "Forcing unlock of `%s' from process %d",
-	  DEVICE->name, pid);
-
-  unlink(lockf);
+  if ((r = pthread_mutex_trylock(&sys->mutex)) != 0)
+    return (r == EBUSY) ? -EBUSY : -ENODEV;
 
   return 0;
 }
 
-long unix_fli_trylock(flidev_t dev)
-{
-  (void)dev;
-  return -ENODEV;
-}
-
 #undef PUBLIC_DIR
 
-#endif /* defined(_USE_FLOCK_) */
-
 long unix_fli_list(flidomain_t domain, char ***names)
 {
   *names = NULL;
@@ -658,4 +676,98 @@ static long unix_fli_list_usb(flidomain_t domain, char ***names)
 static long unix_fli_list_serial(flidomain_t domain, char ***names)
 {
   return unix_fli_list_glob(SERIAL_GLOB, domain, names);
+}
+
+long unix_fli_hotplug_register(flihotplugcb_t cb, void *user)
+{
+#if defined(__LIBUSB__) && !defined(__USBFS__)
+  return unix_usb_hotplug_register(cb, user);
+#else
+  FLI_UNUSED(cb);
+  FLI_UNUSED(user);
+  return -ENOSYS;
+#endif
+}
+
+long unix_fli_hotplug_deregister(flihotplugcb_t cb, void *user)
+{
+#if defined(__LIBUSB__) && !defined(__USBFS__)
+  return unix_usb_hotplug_deregister(cb, user);
+#else
+  FLI_UNUSED(cb);
+  FLI_UNUSED(user);
+  return -ENOSYS;
+#endif
+}
+
+/* Serial ports that may have a device, found without opening any of
+ * them. Parallel ports are not supported, and USB is either enumerated
+ * natively or, returning -ENOSYS, through FLIList(). */
+long unix_fli_list_ports(flidomain_t domain, fli_devinfo_t *out, size_t cap,
+  size_t *n)
+{
+  size_t i;
+  glob_t g;
+  int r;
+
+  *n = 0;
+
+  switch (domain & 0x00ff)
+  {
+  case FLIDOMAIN_PARALLEL_PORT:
+    return -EINVAL;
+
+  case FLIDOMAIN_SERIAL:
+    break;
+
+  default:
+    return -ENOSYS;
+  }
+
+  if ((r = glob(SERIAL_GLOB, 0, NULL, &g)) != 0)
+  {
+#ifdef GLOB_NOMATCH
+    if (r == GLOB_NOMATCH)
+      return 0;
+#endif
+    return -EIO;
+  }
+
+  for (i = 0; i < g.gl_pathc; i++)
+  {
+    if (i < cap)
+    {
+      memset(&out[i], '\0', sizeof(out[i]));
+      out[i].domain = domain;
+      out[i].vid = -1;
+      out[i].pid = -1;
+      out[i].fwrev = -1;
+      out[i].hwrev = -1;
+      strncpy(out[i].filename, g.gl_pathv[i], sizeof(out[i].filename) - 1);
+    }
+    (*n)++;
+  }
+
+  globfree(&g);
+
+  return 0;
+}
+
+/* Only the libusb registry can describe devices without opening them,
+ * -ENOSYS makes the caller fall back on FLIList() */
+long unix_fli_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
+{
+#if defined(__LIBUSB__) && !defined(__USBFS__)
+  if ((domain & 0x00ff) == FLIDOMAIN_USB)
+    return unix_usb_enumerate(domain, serial, model, out, cap, n);
+#endif
+
+  FLI_UNUSED(domain);
+  FLI_UNUSED(serial);
+  FLI_UNUSED(model);
+  FLI_UNUSED(out);
+  FLI_UNUSED(cap);
+  *n = 0;
+  return -ENOSYS;
 }
\ No newline at end of file
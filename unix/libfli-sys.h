@@ -56,6 +56,8 @@
 typedef struct {
   int fd;
   void *han;
+  void *usbfs;			/* Set when opened through usbfs */
+  void *serial;			/* Set when opened as a serial port */
 } fli_unixio_t;
 
 typedef struct {
@@ -63,6 +65,7 @@ typedef struct {
   pthread_mutexattr_t attr;
   long locked;
   long OS;
+  int lockfd;			/* Session lock, -1 if not held */
 } fli_unixsysinfo_t;
 
 long unix_fli_connect(flidev_t dev, char *name, long domain);
@@ -71,6 +74,12 @@ long unix_fli_lock(flidev_t dev);
 long unix_fli_unlock(flidev_t dev);
 long unix_fli_trylock(flidev_t dev);
 long unix_fli_list(flidomain_t domain, char ***names);
+long unix_fli_hotplug_register(flihotplugcb_t cb, void *user);
+long unix_fli_hotplug_deregister(flihotplugcb_t cb, void *user);
+long unix_fli_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n);
+long unix_fli_list_ports(flidomain_t domain, fli_devinfo_t *out, size_t cap,
+  size_t *n);
 
 long mac_fli_list(flidomain_t domain, char ***names);
 long mac_fli_connect(flidev_t dev, char *name, long domain);
@@ -84,15 +93,21 @@ long mac_fli_trylock(flidev_t dev);
 #define __SYSNAME__ "Linux"
 #define __LIBFLI_MINOR__ 999.1
 #define USB_READ_SIZ_MAX (1024 * 64)
-#define _USE_PTHREAD_LOCK_
-//#define _USE_FLOCK_
 #define PARPORT_GLOB "/dev/ccd*"
+#if defined(__USBFS__)
+#define USB_GLOB "/dev/bus/usb/[0-9]*/[0-9]*"
+#else
 #define USB_GLOB "/dev/fliusb*"
+#endif
 #define SERIAL_GLOB "/dev/ttyS[0-9]*"
 
 #define fli_connect unix_fli_connect
 #define fli_disconnect unix_fli_disconnect
 #define fli_list unix_fli_list
+#define fli_hotplug_register unix_fli_hotplug_register
+#define fli_hotplug_deregister unix_fli_hotplug_deregister
+#define fli_enumerate unix_fli_enumerate
+#define fli_list_ports unix_fli_list_ports
 
 #elif defined(__FreeBSD__)
 
@@ -105,6 +120,10 @@ long mac_fli_trylock(flidev_t dev);
 #define fli_connect unix_fli_connect
 #define fli_disconnect unix_fli_disconnect
 #define fli_list unix_fli_list
+#define fli_hotplug_register unix_fli_hotplug_register
+#define fli_hotplug_deregister unix_fli_hotplug_deregister
+#define fli_enumerate unix_fli_enumerate
+#define fli_list_ports unix_fli_list_ports
 
 #elif defined (__NetBSD__)
 
@@ -117,6 +136,10 @@ long mac_fli_trylock(flidev_t dev);
 #define fli_connect unix_fli_connect
 #define fli_disconnect unix_fli_disconnect
 #define fli_list unix_fli_list
+#define fli_hotplug_register unix_fli_hotplug_register
+#define fli_hotplug_deregister unix_fli_hotplug_deregister
+#define fli_enumerate unix_fli_enumerate
+#define fli_list_ports unix_fli_list_ports
 
 #elif defined (__APPLE__)
 
@@ -130,10 +153,18 @@ long mac_fli_trylock(flidev_t dev);
 #define fli_connect unix_fli_connect
 #define fli_disconnect unix_fli_disconnect
 #define fli_list unix_fli_list
+#define fli_hotplug_register unix_fli_hotplug_register
+#define fli_hotplug_deregister unix_fli_hotplug_deregister
+#define fli_enumerate unix_fli_enumerate
+#define fli_list_ports unix_fli_list_ports
 #else
 #define fli_connect mac_fli_connect 
 #define fli_disconnect mac_fli_disconnect
 #define fli_list mac_fli_list
+#define fli_hotplug_register unix_fli_hotplug_register
+#define fli_hotplug_deregister unix_fli_hotplug_deregister
+#define fli_enumerate unix_fli_enumerate
+#define fli_list_ports unix_fli_list_ports
 #endif
 
 #define unix_fli_lock mac_fli_lock
@@ -63,20 +63,26 @@ long unix_usbio(flidev_t dev, void *buf, long *wlen, long *rlen)
 
   if (*wlen > 0)
   {
-    if ((err = unix_bulkwrite(dev, buf, wlen)))
+    /* The bulk routines accept short transfers for image reads, a
+     * command has to go out and come back whole */
+    if ((err = unix_bulkwrite(dev, buf, wlen)) || (*wlen != org_wlen))
     {
-      debug(FLIDEBUG_WARN, "Bulkwrite failed, wrote %d of %d bytes",
+      debug(FLIDEBUG_WARN, "Bulkwrite failed, wrote %ld of %ld bytes",
 	    *wlen, org_wlen);
+      if (err == 0)
+        err = -EIO;
       goto done;
     }
   }
 
   if (*rlen > 0)
   {
-    if ((err = unix_bulkread(dev, buf, rlen)))
+    if ((err = unix_bulkread(dev, buf, rlen)) || (*rlen != org_rlen))
     {
-      debug(FLIDEBUG_WARN, "Bulkread failed, read %d of %d bytes",
+      debug(FLIDEBUG_WARN, "Bulkread failed, read %ld of %ld bytes",
 	    *rlen, org_rlen);
+      if (err == 0)
+        err = -EIO;
       goto done;
     }
   }
@@ -44,7 +44,18 @@
 #ifndef _LIBFLI_USB_H_
 #define _LIBFLI_USB_H_
 
-#if defined(__linux__) && !defined(__LIBUSB__)
+#if defined(__linux__) && defined(__USBFS__)
+
+#define unix_bulkwrite  usbfs_bulkwrite
+#define unix_bulkread usbfs_bulkread
+#define unix_usb_connect  usbfs_usb_connect
+#define unix_usb_disconnect usbfs_usb_disconnect
+#define unix_bulktransfer usbfs_bulktransfer
+#define unix_usb_dev_mem_alloc usbfs_dev_mem_alloc
+#define unix_usb_dev_mem_free usbfs_dev_mem_free
+#define unix_usb_list unix_fli_list_glob
+
+#elif defined(__linux__) && !defined(__LIBUSB__)
 
 #define unix_bulkwrite  linux_bulkwrite
 #define unix_bulkread linux_bulkread
@@ -61,6 +72,11 @@
 #define unix_usb_disconnect	libusb_usb_disconnect
 #define unix_bulktransfer	libusb_bulktransfer
 #define unix_usb_list libusb_list
+#define unix_usb_hotplug_register libusb_fli_hotplug_register
+#define unix_usb_hotplug_deregister libusb_fli_hotplug_deregister
+#define unix_usb_enumerate libusb_fli_enumerate
+#define unix_usb_dev_mem_alloc libusb_fli_dev_mem_alloc
+#define unix_usb_dev_mem_free libusb_fli_dev_mem_free
 
 #elif defined(__FreeBSD__) || defined(__NetBSD__)
 
@@ -87,6 +103,11 @@
 #define unix_usb_disconnect	libusb_usb_disconnect
 #define unix_bulktransfer	libusb_bulktransfer
 #define unix_usb_list libusb_list
+#define unix_usb_hotplug_register libusb_fli_hotplug_register
+#define unix_usb_hotplug_deregister libusb_fli_hotplug_deregister
+#define unix_usb_enumerate libusb_fli_enumerate
+#define unix_usb_dev_mem_alloc libusb_fli_dev_mem_alloc
+#define unix_usb_dev_mem_free libusb_fli_dev_mem_free
 
 #else
 #error "Unknown system"
@@ -100,6 +121,23 @@ long unix_usb_disconnect(flidev_t dev, fli_unixio_t *io);
 long unix_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
 long unix_usb_list(char *pattern, flidomain_t domain,char ***names);
 
+#if defined(__LIBUSB__) && !defined(__USBFS__)
+long unix_usb_hotplug_register(flihotplugcb_t cb, void *user);
+long unix_usb_hotplug_deregister(flihotplugcb_t cb, void *user);
+long unix_usb_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n);
+#endif
+
+#if defined(unix_usb_dev_mem_alloc)
+void *unix_usb_dev_mem_alloc(flidev_t dev, size_t len);
+void unix_usb_dev_mem_free(flidev_t dev, void *buf, size_t len);
+#endif
+
+#if defined(__LIBUSB__)
+long libusb_fli_usbfs_path(char *name, char *path, size_t len);
+long libusb_fli_port_path(char *name, char *path, size_t len);
+#endif
+
 #if defined(__APPLE__) && !defined(__LIBUSB__)
 #define usb_bulktransfer mac_bulktransfer
 #else
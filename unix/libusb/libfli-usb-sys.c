@@ -43,6 +43,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <libusb-1.0/libusb.h>
 
 #include <errno.h>
@@ -51,10 +52,16 @@
 #include "libfli-sys.h"
 #include "libfli-mem.h"
 #include "libfli-usb.h"
+#include "libfli-trace.h"
 
 #define FLIUSB_MIN_TIMEOUT (5000)
 
 libusb_device_handle * libusb_fli_find_handle(struct libusb_context *usb_ctx, char *name);
+static long libusb_fli_registry_init(void);
+static void libusb_fli_registry_claim(flidev_t dev, libusb_device *usb_dev,
+  int claim);
+static int libusb_fli_registry_serial(libusb_device *usb_dev, char *serial,
+  size_t len);
 
 long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
 {
@@ -64,14 +71,8 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
   struct libusb_device_descriptor usbdesc;
   unsigned char strdesc[64];
 
-  r = libusb_init(NULL);
-  if(r < 0)
-  {
-    debug(FLIDEBUG_FAIL, "%s: Could not initialize LibUSB: %s",
-	  __PRETTY_FUNCTION__, libusb_error_name(r));
-
+  if (libusb_fli_registry_init() != 0)
     return -ENODEV;
-  }
 
 //  libusb_set_debug(NULL,LIBUSB_LOG_LEVEL_DEBUG); 
 
@@ -80,7 +81,7 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
 
   if (io->han == NULL)
   {
-    return -errno;
+    return -ENODEV;
   }
 
   debug(FLIDEBUG_INFO, "%s: Found Handle", __PRETTY_FUNCTION__);
@@ -119,10 +120,17 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
   DEVICE->devinfo.devid = usbdesc.idProduct;
   DEVICE->devinfo.fwrev = usbdesc.bcdDevice;
 
-  if (usbdesc.iSerialNumber != 0)
+  memset(strdesc, '\0', sizeof(strdesc));
+
+  if (libusb_fli_registry_serial(usb_dev, (char *) strdesc,
+    sizeof(strdesc) - 1) == 0)
   {
-    memset(strdesc, '\0', sizeof(strdesc));
+    DEVICE->devinfo.serial = fli_dev_strndup(dev, (const char *)strdesc, sizeof(strdesc));
 
+    debug(FLIDEBUG_INFO, "Serial Number: %s", strdesc);
+  }
+  else if (usbdesc.iSerialNumber != 0)
+  {
     if (libusb_get_string_descriptor_ascii(io->han, usbdesc.iSerialNumber,
       strdesc, sizeof(strdesc) - 1) < 0)
     {
@@ -131,7 +139,7 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
     }
     else
     {
-      DEVICE->devinfo.serial = xstrndup((const char *)strdesc, sizeof(strdesc));
+      DEVICE->devinfo.serial = fli_dev_strndup(dev, (const char *)strdesc, sizeof(strdesc));
   
       debug(FLIDEBUG_INFO, "Serial Number: %s", strdesc);
     }
@@ -169,6 +177,8 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
       return -ENODEV;
   }
 
+  libusb_fli_registry_claim(dev, usb_dev, 1);
+
 #ifdef CLEAR_HALT
   /* Clear the halt/stall condition for all endpoints in this configuration */
   {
@@ -209,32 +219,17 @@ long libusb_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
 long libusb_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
 {
   fli_unixio_t *io;
+  fli_trace_t *trace;
   unsigned int remaining;
+  uint64_t start = 0;
+  long org_len = *len;
   int r, err = 0;
 
-#define _DEBUG
-
-#ifdef _DEBUG
-  debug(FLIDEBUG_INFO, "%s: attempting %ld bytes %s",
-	__PRETTY_FUNCTION__, *len, (ep & LIBUSB_ENDPOINT_IN) ? "in" : "out");
-#endif
-
   io = DEVICE->io_data;
 
-#ifdef _DEBUG
-  if ((ep & 0xf0) == 0) {
-    char buffer[1024];
-    int i;
-
-    sprintf(buffer, "OUT %6ld: ", *len);
-    for (i = 0; i < ((*len > 16)?16:*len); i++) {
-      sprintf(buffer + strlen(buffer), "%02x ", ((unsigned char *) buf)[i]);
-    }
-
-    debug(FLIDEBUG_INFO, buffer);
-  }
-
-#endif /* _DEBUG */
+  trace = DEVICE->trace;
+  if (FLI_TRACE_ACTIVE(trace))
+    start = fli_trace_now();
 
   remaining = *len;
 
@@ -248,37 +243,27 @@ long libusb_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
      r = libusb_bulk_transfer(io->han, ep,
       (unsigned char *) (buf + *len - remaining), count, &bytes,
       (DEVICE->io_timeout < FLIUSB_MIN_TIMEOUT)?FLIUSB_MIN_TIMEOUT:DEVICE->io_timeout);
+    /* Data may have arrived before a timeout or error, count it so the
+     * caller can carry on from the right place */
+    remaining -= bytes;
+
     if( r != 0)
     {
       debug(FLIDEBUG_WARN, "LibUSB Error: %s", libusb_error_name(r));
+      err = (r == LIBUSB_ERROR_TIMEOUT)?-ETIMEDOUT:-EIO;
       break;
     }
 
-    remaining -= bytes;
     if (bytes < count)
       break;
   }
 
-  /* Set *len to the number of bytes actually transferred */
-  if (remaining)
-    err = -errno;
+  /* Set *len to the number of bytes actually transferred, a short read
+   * is not an error */
   *len -= remaining;
 
-#ifdef _DEBUG
-
-  if ((ep & 0xf0) != 0) {
-    char buffer[1024];
-    int i;
-
-    sprintf(buffer, " IN %6ld: ", *len);
-    for (i = 0; i < ((*len > 16)?16:*len); i++) {
-      sprintf(buffer + strlen(buffer), "%02x ", ((unsigned char *) buf)[i]);
-    }
-
-    debug(FLIDEBUG_INFO, buffer);
-  }
-
-#endif /* _DEBUG */
+  if (FLI_TRACE_ACTIVE(trace))
+    fli_trace_record(trace, ep, buf, org_len, *len, err, start);
 
   return err;
 }
@@ -334,22 +319,46 @@ long libusb_bulkread(flidev_t dev, void *buf, long *rlen)
 long libusb_usb_disconnect(flidev_t dev,  fli_unixio_t *io)
 {
   long err = 0;
-  FLI_UNUSED(dev);
 	
   debug(FLIDEBUG_INFO, "Disconnecting");
 
   if (io->han != NULL)
   {
+    libusb_fli_registry_claim(dev, libusb_get_device(io->han), -1);
 		libusb_release_interface(io->han, 0);
     libusb_close(io->han);
   }
 	io->han = NULL;
 
-  libusb_exit(NULL);
-	
   return err;
 }
 
+/* Buffers libusb can transfer into without a bounce copy, NULL when the
+ * library or the kernel can't provide them */
+void *libusb_fli_dev_mem_alloc(flidev_t dev, size_t len)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  fli_unixio_t *io = DEVICE->io_data;
+
+  if ((io == NULL) || (io->han == NULL))
+    return NULL;
+
+  return libusb_dev_mem_alloc(io->han, len);
+#else
+  return NULL;
+#endif
+}
+
+void libusb_fli_dev_mem_free(flidev_t dev, void *buf, size_t len)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  fli_unixio_t *io = DEVICE->io_data;
+
+  if ((io != NULL) && (io->han != NULL))
+    libusb_dev_mem_free(io->han, buf, len);
+#endif
+}
+
 int libusb_fli_get_serial(libusb_device *usb_dev, char *serial, size_t max_serial)
 {
   struct libusb_device_descriptor usb_desc;
@@ -465,161 +474,809 @@ int libusb_fli_create_name(libusb_device *usb_dev, char *name, size_t max_name)
   return len;  
 }
 
-long libusb_list(char *pattern, flidomain_t domain, char ***names)
+
+/* Device registry
+ *
+ * The registry holds one entry per FLI device on the bus and is kept
+ * current by libusb hotplug events, so listing and opening devices no
+ * longer walk (and open) every device on every hub.  The hotplug
+ * callback only records what can be read without opening the device;
+ * serial numbers and model names are read once, outside of the
+ * callback, the first time they are asked for and then cached until
+ * the device leaves.  Where libusb has no hotplug support the registry
+ * is brought up to date by a rescan (without device opens) instead.
+ */
+
+#define LIBUSB_FLI_REGISTRY_MAX (64)
+#define LIBUSB_FLI_HOTPLUG_QUEUE (32)
+#define LIBUSB_FLI_HOTPLUG_CALLBACKS (8)
+#define LIBUSB_FLI_SERIAL_INDEX (128) /* Power of two, > REGISTRY_MAX */
+#define LIBUSB_FLI_EVENT_TIMEOUT (250) /* msec */
+
+#define LIBUSB_FLI_HAVE_SERIAL (0x01)
+#define LIBUSB_FLI_HAVE_MODEL (0x02)
+#define LIBUSB_FLI_MODEL_FALLBACK (0x04) /* Product string, not from the device */
+
+typedef struct {
+  libusb_device *usb_dev;	/* Referenced for the lifetime of the entry */
+  unsigned short pid;
+  unsigned short bcd;
+  unsigned char bus;
+  unsigned char ports[7];
+  int numports;
+  int cached;			/* LIBUSB_FLI_HAVE_* */
+  int seen;			/* Used by rescans */
+  int claimed;			/* Open handles in this process */
+  long hwrev;			/* -1 until a handle has been closed */
+  char name[32];		/* FLI-<ports> connection name */
+  char serial[32];
+  char model[32];
+} libusb_fli_regent_t;
+
+typedef struct {
+  long event;
+  flidomain_t domain;
+  char name[32];
+} libusb_fli_hpevent_t;
+
+typedef struct {
+  flihotplugcb_t cb;
+  void *user;
+} libusb_fli_hpcb_t;
+
+static struct {
+  pthread_mutex_t mutex;
+  int status;			/* libusb_init() result */
+  int hotplug;			/* Kept current by hotplug events */
+  libusb_hotplug_callback_handle hphandle;
+  libusb_fli_regent_t ent[LIBUSB_FLI_REGISTRY_MAX];
+  int nent;
+  libusb_fli_hpevent_t queue[LIBUSB_FLI_HOTPLUG_QUEUE];
+  int qlen;
+  libusb_fli_hpcb_t cbs[LIBUSB_FLI_HOTPLUG_CALLBACKS];
+  unsigned char serial_index[LIBUSB_FLI_SERIAL_INDEX]; /* ent + 1, 0 empty */
+} registry = { PTHREAD_MUTEX_INITIALIZER, };
+
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static flidomain_t libusb_fli_pid_domain(unsigned short pid)
+{
+  switch (pid)
+  {
+  case FLIUSB_CAM_ID:
+  case FLIUSB_PROLINE_ID:
+    return FLIDOMAIN_USB | FLIDEVICE_CAMERA;
+
+  case FLIUSB_FOCUSER_ID:
+    return FLIDOMAIN_USB | FLIDEVICE_FOCUSER;
+
+  case FLIUSB_FILTER_ID:
+  case FLIUSB_CFW4_ID:
+    return FLIDOMAIN_USB | FLIDEVICE_FILTERWHEEL;
+
+  default:
+    return FLIDOMAIN_NONE;
+  }
+}
+
+/* Does a device with this product id belong to the requested domain? A
+ * domain without a device type matches every FLI device. */
+static int libusb_fli_domain_match(flidomain_t domain, unsigned short pid)
+{
+  flidomain_t type = domain & FLIDOMAIN_DEVICE_MASK;
+  flidomain_t devdomain = libusb_fli_pid_domain(pid);
+
+  if (devdomain == FLIDOMAIN_NONE)
+    return 0;
+
+  return (type == FLIDEVICE_NONE) ||
+    (type == (devdomain & FLIDOMAIN_DEVICE_MASK));
+}
+
+/* Registry lock must be held */
+static void libusb_fli_registry_queue(long event, libusb_fli_regent_t *ent)
+{
+  libusb_fli_hpevent_t *ev;
+  int i;
+
+  /* Nobody to tell */
+  for (i = 0; i < LIBUSB_FLI_HOTPLUG_CALLBACKS; i++)
+    if (registry.cbs[i].cb != NULL)
+      break;
+
+  if (i == LIBUSB_FLI_HOTPLUG_CALLBACKS)
+    return;
+
+  if (registry.qlen == LIBUSB_FLI_HOTPLUG_QUEUE)
+  {
+    debug(FLIDEBUG_WARN, "Hotplug event queue full, dropping event for %s",
+      ent->name);
+    return;
+  }
+
+  ev = &registry.queue[registry.qlen++];
+  ev->event = event;
+  ev->domain = libusb_fli_pid_domain(ent->pid);
+  memcpy(ev->name, ent->name, sizeof(ev->name));
+}
+
+/* Registry lock must be held */
+static libusb_fli_regent_t *libusb_fli_registry_find(libusb_device *usb_dev)
+{
+  int i;
+
+  for (i = 0; i < registry.nent; i++)
+    if (registry.ent[i].usb_dev == usb_dev)
+      return &registry.ent[i];
+
+  return NULL;
+}
+
+/* Same form as the kernel's device names, e.g. 1-2.4 */
+static void libusb_fli_bus_path(libusb_fli_regent_t *ent, char *path,
+  size_t len)
+{
+  size_t l;
+  int port;
+
+  l = snprintf(path, len, "%d", ent->bus);
+  for (port = 0; (port < ent->numports) && (l < len); port++)
+    l += snprintf(path + l, len - l, "%c%d", (port == 0)?'-':'.',
+      ent->ports[port]);
+}
+
+/* Serial number index
+ *
+ * Open addressing on a case folded hash of the serial number, so
+ * opening by serial resolves straight to the registry entry. Entries
+ * move when another is removed, the index is rebuilt then.
+ */
+
+static unsigned int libusb_fli_serial_hash(const char *serial)
+{
+  unsigned int h = 2166136261u;
+
+  for (; *serial != '\0'; serial++)
+    h = (h ^ (unsigned char) tolower((unsigned char) *serial)) * 16777619u;
+
+  return h & (LIBUSB_FLI_SERIAL_INDEX - 1);
+}
+
+/* Registry lock must be held */
+static void libusb_fli_serial_index_add(libusb_fli_regent_t *ent)
+{
+  unsigned int h;
+
+  if (ent->serial[0] == '\0')
+    return;
+
+  h = libusb_fli_serial_hash(ent->serial);
+  while (registry.serial_index[h] != 0)
+    h = (h + 1) & (LIBUSB_FLI_SERIAL_INDEX - 1);
+
+  registry.serial_index[h] = (ent - registry.ent) + 1;
+}
+
+/* Registry lock must be held */
+static void libusb_fli_serial_index_rebuild(void)
+{
+  int i;
+
+  memset(registry.serial_index, 0, sizeof(registry.serial_index));
+  for (i = 0; i < registry.nent; i++)
+    libusb_fli_serial_index_add(&registry.ent[i]);
+}
+
+/* Registry lock must be held */
+static libusb_fli_regent_t *libusb_fli_serial_index_find(const char *serial)
+{
+  unsigned int h;
+
+  if (serial[0] == '\0')
+    return NULL;
+
+  for (h = libusb_fli_serial_hash(serial); registry.serial_index[h] != 0;
+    h = (h + 1) & (LIBUSB_FLI_SERIAL_INDEX - 1))
+  {
+    libusb_fli_regent_t *ent = &registry.ent[registry.serial_index[h] - 1];
+
+    if (strcasecmp(ent->serial, serial) == 0)
+      return ent;
+  }
+
+  return NULL;
+}
+
+#if defined(__linux__)
+/* The kernel keeps the string descriptors it read when the device was
+ * enumerated, so the serial number can be had without opening (and
+ * disturbing) a device that may belong to another process. */
+static int libusb_fli_sysfs_serial(libusb_fli_regent_t *ent)
+{
+  char path[96], buspath[32];
+  FILE *f;
+  int r = -1;
+
+  libusb_fli_bus_path(ent, buspath, sizeof(buspath));
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/serial", buspath);
+
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+
+  if (fgets(ent->serial, sizeof(ent->serial), f) != NULL)
+  {
+    ent->serial[strcspn(ent->serial, "\r\n")] = '\0';
+    r = 0;
+  }
+  else
+  {
+    ent->serial[0] = '\0';
+  }
+
+  fclose(f);
+
+  return r;
+}
+#endif
+
+/* Registry lock must be held */
+static void libusb_fli_registry_add(libusb_device *usb_dev)
 {
-  FLI_UNUSED(pattern);
-  int r, i;
-  char **list;
-  libusb_device **usb_devs;
-  libusb_device *usb_dev;
   struct libusb_device_descriptor usb_desc;
-  int num_usb_devices, num_fli_devices=0;
+  libusb_fli_regent_t *ent;
+  int numports;
 
-  r = libusb_init(NULL);
-  if(r < 0)
+  if ((ent = libusb_fli_registry_find(usb_dev)) != NULL)
   {
-    debug(FLIDEBUG_FAIL, "%s: Could not initialize LibUSB: %s",
-	  __PRETTY_FUNCTION__, libusb_error_name(r));
-    libusb_exit(NULL);
-    return -ENODEV;
+    ent->seen = 1;
+    return;
   }
-	
+
+  if (libusb_get_device_descriptor(usb_dev, &usb_desc) != LIBUSB_SUCCESS)
+    return;
+
+  if ((usb_desc.idVendor != FLIUSB_VENDORID) ||
+    (libusb_fli_pid_domain(usb_desc.idProduct) == FLIDOMAIN_NONE))
+    return;
+
+  if (registry.nent == LIBUSB_FLI_REGISTRY_MAX)
+  {
+    debug(FLIDEBUG_WARN, "Device registry full, ignoring device.");
+    return;
+  }
+
+  ent = &registry.ent[registry.nent++];
+  memset(ent, '\0', sizeof(*ent));
+
+  ent->usb_dev = libusb_ref_device(usb_dev);
+  ent->pid = usb_desc.idProduct;
+  ent->bcd = usb_desc.bcdDevice;
+  ent->bus = libusb_get_bus_number(usb_dev);
+  numports = libusb_get_port_numbers(usb_dev, ent->ports, sizeof(ent->ports));
+  ent->numports = (numports < 0)?0:numports;
+  ent->seen = 1;
+  ent->hwrev = -1;
+  libusb_fli_create_name(usb_dev, ent->name, sizeof(ent->name) - 1);
+
+  if (usb_desc.iSerialNumber == 0)
+    ent->cached |= LIBUSB_FLI_HAVE_SERIAL;
+#if defined(__linux__)
+  else if (libusb_fli_sysfs_serial(ent) == 0)
+    ent->cached |= LIBUSB_FLI_HAVE_SERIAL;
+#endif
+
+  libusb_fli_serial_index_add(ent);
+
+  debug(FLIDEBUG_INFO, "Registry: added %s (pid 0x%04x)", ent->name, ent->pid);
+  libusb_fli_registry_queue(FLI_HOTPLUG_ARRIVED, ent);
+}
+
+/* Registry lock must be held */
+static void libusb_fli_registry_remove(libusb_fli_regent_t *ent)
+{
+  debug(FLIDEBUG_INFO, "Registry: removed %s", ent->name);
+  libusb_fli_registry_queue(FLI_HOTPLUG_LEFT, ent);
+
+  libusb_unref_device(ent->usb_dev);
+  registry.nent--;
+  if (ent != &registry.ent[registry.nent])
+    *ent = registry.ent[registry.nent];
+
+  libusb_fli_serial_index_rebuild();
+}
+
+/* Deliver queued events to the application, without holding the
+ * registry lock so callbacks are free to call back into the library */
+static void libusb_fli_registry_dispatch(void)
+{
+  libusb_fli_hpevent_t queue[LIBUSB_FLI_HOTPLUG_QUEUE];
+  libusb_fli_hpcb_t cbs[LIBUSB_FLI_HOTPLUG_CALLBACKS];
+  int qlen, i, j;
+
+  pthread_mutex_lock(&registry.mutex);
+  qlen = registry.qlen;
+  memcpy(queue, registry.queue, qlen * sizeof(queue[0]));
+  memcpy(cbs, registry.cbs, sizeof(cbs));
+  registry.qlen = 0;
+  pthread_mutex_unlock(&registry.mutex);
+
+  for (i = 0; i < qlen; i++)
+    for (j = 0; j < LIBUSB_FLI_HOTPLUG_CALLBACKS; j++)
+      if (cbs[j].cb != NULL)
+        cbs[j].cb(queue[i].domain, queue[i].name, queue[i].event, cbs[j].user);
+}
+
+static int LIBUSB_CALL libusb_fli_hotplug_event(libusb_context *ctx,
+  libusb_device *usb_dev, libusb_hotplug_event event, void *user)
+{
+  libusb_fli_regent_t *ent;
+  FLI_UNUSED(ctx);
+  FLI_UNUSED(user);
+
+  pthread_mutex_lock(&registry.mutex);
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+    libusb_fli_registry_add(usb_dev);
+  else if ((ent = libusb_fli_registry_find(usb_dev)) != NULL)
+    libusb_fli_registry_remove(ent);
+
+  pthread_mutex_unlock(&registry.mutex);
+
+  return 0;
+}
+
+static void *libusb_fli_event_thread(void *arg)
+{
+  FLI_UNUSED(arg);
+
+  for (;;)
+  {
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = LIBUSB_FLI_EVENT_TIMEOUT * 1000;
+    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    libusb_fli_registry_dispatch();
+  }
+
+  return NULL;
+}
+
+/* Bring the registry up to date without hotplug support. Only device
+ * descriptors are read, devices are not opened. */
+static void libusb_fli_registry_rescan(void)
+{
+  libusb_device **usb_devs;
+  ssize_t num_usb_devices;
+  int i;
+
   num_usb_devices = libusb_get_device_list(NULL, &usb_devs);
-  if(num_usb_devices < 0)
+  if (num_usb_devices < 0)
   {
     debug(FLIDEBUG_WARN, "LibUSB Get Device List Failed");
-    libusb_free_device_list(usb_devs, 1);
-    libusb_exit(NULL);
-    return -ENODEV;
+    return;
   }
 
-  list = xmalloc(sizeof(*list));
-  *list = NULL;
+  pthread_mutex_lock(&registry.mutex);
+
+  for (i = 0; i < registry.nent; i++)
+    registry.ent[i].seen = 0;
+
+  for (i = 0; usb_devs[i] != NULL; i++)
+    libusb_fli_registry_add(usb_devs[i]);
+
+  for (i = registry.nent - 1; i >= 0; i--)
+    if (registry.ent[i].seen == 0)
+      libusb_fli_registry_remove(&registry.ent[i]);
 
-  num_fli_devices = 0;
-  i = -1;
+  pthread_mutex_unlock(&registry.mutex);
 
-  while((usb_dev = usb_devs[++i]) != NULL)
+  libusb_free_device_list(usb_devs, 1);
+  libusb_fli_registry_dispatch();
+}
+
+static void libusb_fli_registry_start(void)
+{
+  pthread_t thread;
+  int r;
+
+  /* The registry holds a reference on the default context for the
+   * lifetime of the process */
+  if ((registry.status = libusb_init(NULL)) < 0)
   {
-    flidev_t dev;
-    char fli_usb_name[32];
-    char fli_serial_name[32];
-    char * fli_device_name = NULL;
-    char fli_model_name[32];
+    debug(FLIDEBUG_FAIL, "%s: Could not initialize LibUSB: %s",
+	  __PRETTY_FUNCTION__, libusb_error_name(registry.status));
+    return;
+  }
 
-    if(libusb_get_device_descriptor(usb_dev, &usb_desc) != LIBUSB_SUCCESS)
-    {
-      debug(FLIDEBUG_WARN, "USB Device Descriptor not obtained.");
-      continue;
-    }
-    
-    /* FLI device? */
-    if(usb_desc.idVendor != FLIUSB_VENDORID)
-      continue;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  {
+    debug(FLIDEBUG_INFO, "LibUSB has no hotplug support, rescanning on list.");
+    return;
+  }
 
-    /* Determine if device matches domain */
-    switch(domain & FLIDOMAIN_DEVICE_MASK)
-    {
-      case FLIDEVICE_CAMERA:
-        if (!((usb_desc.idProduct == FLIUSB_CAM_ID) ||
-          (usb_desc.idProduct == FLIUSB_PROLINE_ID)))
-        {
-          continue;
-        }
-        break;
+  r = libusb_hotplug_register_callback(NULL,
+    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+    LIBUSB_HOTPLUG_ENUMERATE, FLIUSB_VENDORID, LIBUSB_HOTPLUG_MATCH_ANY,
+    LIBUSB_HOTPLUG_MATCH_ANY, libusb_fli_hotplug_event, NULL,
+    &registry.hphandle);
+  if (r != LIBUSB_SUCCESS)
+  {
+    debug(FLIDEBUG_WARN, "%s: Could not register hotplug callback: %s",
+	  __PRETTY_FUNCTION__, libusb_error_name(r));
+    return;
+  }
 
-      case FLIDEVICE_FOCUSER:
-        if (usb_desc.idProduct != FLIUSB_FOCUSER_ID)
-        {
-          continue;
-        }
-        break;
+  if ((r = pthread_create(&thread, NULL, libusb_fli_event_thread, NULL)) != 0)
+  {
+    debug(FLIDEBUG_WARN, "%s: Could not start event thread: %s",
+	  __PRETTY_FUNCTION__, strerror(r));
+    libusb_hotplug_deregister_callback(NULL, registry.hphandle);
+    return;
+  }
 
-      case FLIDEVICE_FILTERWHEEL:
-        if (!((usb_desc.idProduct == FLIUSB_FILTER_ID) ||
-          (usb_desc.idProduct == FLIUSB_CFW4_ID)))
-        {
-          continue;
-        }
-        break;
+  pthread_detach(thread);
+  registry.hotplug = 1;
+}
+
+static long libusb_fli_registry_init(void)
+{
+  pthread_once(&registry_once, libusb_fli_registry_start);
+
+  if (registry.status < 0)
+    return -ENODEV;
+
+  if (!registry.hotplug)
+    libusb_fli_registry_rescan();
+
+  return 0;
+}
 
-      default:
-        continue;
+/* Read the serial number and/or model of every registered device in
+ * domain that does not have them cached yet. Devices are opened with
+ * the registry unlocked, since reading the model goes through
+ * FLIOpen(). */
+static void libusb_fli_registry_fill(flidomain_t domain, int want)
+{
+  for (;;)
+  {
+    libusb_fli_regent_t *ent;
+    libusb_device *usb_dev = NULL;
+    char name[32], serial[32], model[32];
+    unsigned short pid = 0;
+    int i, need = 0, claimed = 0, fallback = 0;
+
+    pthread_mutex_lock(&registry.mutex);
+    for (i = 0; i < registry.nent; i++)
+    {
+      ent = &registry.ent[i];
+      need = want & ~ent->cached;
+      if (need && libusb_fli_domain_match(domain, ent->pid))
+      {
+        usb_dev = libusb_ref_device(ent->usb_dev);
+        pid = ent->pid;
+        memcpy(name, ent->name, sizeof(name));
+        claimed = ent->claimed;
+        /* Whatever happens below, it is only attempted once */
+        ent->cached |= need;
         break;
+      }
     }
+    pthread_mutex_unlock(&registry.mutex);
+
+    if (usb_dev == NULL)
+      break;
 
-    memset(fli_usb_name, '\0', sizeof(fli_usb_name));
-    memset(fli_serial_name, '\0', sizeof(fli_serial_name));
-    memset(fli_model_name, '\0', sizeof(fli_model_name));
-    libusb_fli_create_name(usb_dev, fli_usb_name, sizeof(fli_usb_name) - 1);
-    libusb_fli_get_serial(usb_dev, fli_serial_name, sizeof(fli_serial_name) - 1);
+    memset(serial, '\0', sizeof(serial));
+    memset(model, '\0', sizeof(model));
 
-    if ((domain & FLIDEVICE_ENUMERATE_BY_SERIAL) &&
-      (fli_serial_name[0] != '\0'))
+    if (need & LIBUSB_FLI_HAVE_SERIAL)
+      libusb_fli_get_serial(usb_dev, serial, sizeof(serial) - 1);
+
+    if (need & LIBUSB_FLI_HAVE_MODEL)
     {
-      fli_device_name = fli_serial_name;
+      struct libusb_device_descriptor usb_desc;
+      libusb_device_handle *usb_han;
+      flidev_t dev;
+
+      /* FLIOpen is needed for a proper description (model) from the
+       * device. If the device is opened by another process and claimed,
+       * this will fail, so we will return the product string descriptor.
+       * The same goes for a device open here; closing it fills in the
+       * real model.
+       */
+      if ((claimed == 0) &&
+        (FLIOpen(&dev, name, libusb_fli_pid_domain(pid)) == 0))
+      {
+        if (DEVICE->devinfo.model != NULL)
+          strncpy(model, DEVICE->devinfo.model, sizeof(model) - 1);
+        FLIClose(dev);
+      }
+
+      if (model[0] == '\0')
+        fallback = 1;
+
+      if ((model[0] == '\0') &&
+        (libusb_get_device_descriptor(usb_dev, &usb_desc) == LIBUSB_SUCCESS) &&
+        (usb_desc.iProduct > 0) && (libusb_open(usb_dev, &usb_han) == 0))
+      {
+        libusb_get_string_descriptor_ascii(usb_han, usb_desc.iProduct,
+          (unsigned char *) model, sizeof(model) - 1);
+        libusb_close(usb_han);
+      }
+
+      if (model[0] == '\0')
+        strncpy(model, "Model unavailable", sizeof(model) - 1);
     }
-    else
+
+    pthread_mutex_lock(&registry.mutex);
+    if ((ent = libusb_fli_registry_find(usb_dev)) != NULL)
     {
-      fli_device_name = fli_usb_name;
+      if (need & LIBUSB_FLI_HAVE_SERIAL)
+      {
+        memcpy(ent->serial, serial, sizeof(ent->serial));
+        libusb_fli_serial_index_add(ent);
+      }
+      /* Unless a close got the real model in the meantime */
+      if ((need & LIBUSB_FLI_HAVE_MODEL) && (!fallback ||
+        (ent->model[0] == '\0') || (ent->cached & LIBUSB_FLI_MODEL_FALLBACK)))
+      {
+        memcpy(ent->model, model, sizeof(ent->model));
+        if (fallback)
+          ent->cached |= LIBUSB_FLI_MODEL_FALLBACK;
+        else
+          ent->cached &= ~LIBUSB_FLI_MODEL_FALLBACK;
+      }
     }
+    pthread_mutex_unlock(&registry.mutex);
 
-    debug(FLIDEBUG_INFO, "Device Name: '%s'", fli_device_name);
+    libusb_unref_device(usb_dev);
+  }
+}
+
+/* Returns a referenced device matching name by connection name or
+ * cached serial number, or NULL */
+static libusb_device *libusb_fli_registry_lookup(char *name)
+{
+  libusb_device *usb_dev = NULL;
+  int i;
 
-    /* FLIOpen is needed for a proper description (model) from the device. If the device is opened by
-     * another process and clamied, this will fail, so we will return the second string descriptor.
-     *
-     * Another option is to move libusb_clam_xxx to the IO functions, but since there doesn't seem to
-     * be a straightforward method to wait for a device to become available...
-     */
+  libusb_fli_regent_t *ent = NULL;
 
-    if (FLIOpen(&dev, fli_device_name, domain) == 0) /* Opened and should have model */
+  pthread_mutex_lock(&registry.mutex);
+  if (strncasecmp(name, "FLI-", 4) == 0)
+  {
+    for (i = 0; i < registry.nent; i++)
     {
-		if(DEVICE->devinfo.model == NULL)
-			DEVICE->devinfo.model = strdup("DEVICE->devinfo.model is NULL");
-	  strncpy(fli_model_name, DEVICE->devinfo.model, sizeof(fli_model_name) - 1);
-      FLIClose(dev);
+      if (strncasecmp(registry.ent[i].name, name,
+        sizeof(registry.ent[i].name)) == 0)
+      {
+        ent = &registry.ent[i];
+        break;
+      }
     }
-    else
+  }
+
+  if (ent == NULL)
+    ent = libusb_fli_serial_index_find(name);
+
+  if (ent != NULL)
+    usb_dev = libusb_ref_device(ent->usb_dev);
+  pthread_mutex_unlock(&registry.mutex);
+
+  return usb_dev;
+}
+
+/* Device node of a registry device, for opening it through usbfs */
+long libusb_fli_usbfs_path(char *name, char *path, size_t len)
+{
+  libusb_device *usb_dev;
+
+  if (libusb_fli_registry_init() != 0)
+    return -ENODEV;
+
+  if ((usb_dev = libusb_fli_registry_lookup(name)) == NULL)
+    return -ENODEV;
+
+  snprintf(path, len, "/dev/bus/usb/%03d/%03d",
+    libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+  libusb_unref_device(usb_dev);
+
+  return 0;
+}
+
+/* Physical port of the device opened as name, e.g. 1-2.4 */
+long libusb_fli_port_path(char *name, char *path, size_t len)
+{
+  libusb_device *usb_dev;
+  libusb_fli_regent_t *ent;
+  long r = -ENODEV;
+
+  if (libusb_fli_registry_init() != 0)
+    return -ENODEV;
+
+  if ((usb_dev = libusb_fli_registry_lookup(name)) == NULL)
+    return -ENODEV;
+
+  pthread_mutex_lock(&registry.mutex);
+  if ((ent = libusb_fli_registry_find(usb_dev)) != NULL)
+  {
+    libusb_fli_bus_path(ent, path, len);
+    r = 0;
+  }
+  pthread_mutex_unlock(&registry.mutex);
+  libusb_unref_device(usb_dev);
+
+  return r;
+}
+
+/* Copy the serial number of usb_dev if the registry has it */
+static int libusb_fli_registry_serial(libusb_device *usb_dev, char *serial,
+  size_t len)
+{
+  libusb_fli_regent_t *ent;
+  int r = -1;
+
+  pthread_mutex_lock(&registry.mutex);
+  if (((ent = libusb_fli_registry_find(usb_dev)) != NULL) &&
+    (ent->serial[0] != '\0'))
+  {
+    strncpy(serial, ent->serial, len);
+    r = 0;
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  return r;
+}
+
+/* Account for a handle being opened (claim > 0) or closed on usb_dev.
+ * On close whatever the device told us about itself is kept, so later
+ * enumerations can report it without opening the device again. */
+static void libusb_fli_registry_claim(flidev_t dev, libusb_device *usb_dev,
+  int claim)
+{
+  libusb_fli_regent_t *ent;
+
+  pthread_mutex_lock(&registry.mutex);
+  if ((ent = libusb_fli_registry_find(usb_dev)) != NULL)
+  {
+    ent->claimed += claim;
+    if (ent->claimed < 0)
+      ent->claimed = 0;
+
+    if (claim < 0)
     {
-      libusb_device_handle *usb_han;
+      if (DEVICE->devinfo.hwrev != 0)
+        ent->hwrev = DEVICE->devinfo.hwrev;
 
-      if( (libusb_open(usb_dev, &usb_han) == 0) && (usb_desc.iProduct > 0) )
+      if (!(ent->cached & LIBUSB_FLI_HAVE_SERIAL) &&
+        (DEVICE->devinfo.serial != NULL))
       {
-        libusb_get_string_descriptor_ascii(usb_han, usb_desc.iProduct,
-          (unsigned char *) fli_model_name, sizeof(fli_model_name) - 1);
-  
-        libusb_close(usb_han);
+        strncpy(ent->serial, DEVICE->devinfo.serial, sizeof(ent->serial) - 1);
+        ent->cached |= LIBUSB_FLI_HAVE_SERIAL;
+        libusb_fli_serial_index_add(ent);
       }
-      else
+
+      /* A product string read while the device was busy is replaced
+       * by what the device reported */
+      if ((!(ent->cached & LIBUSB_FLI_HAVE_MODEL) ||
+        (ent->cached & LIBUSB_FLI_MODEL_FALLBACK)) &&
+        (DEVICE->devinfo.model != NULL))
       {
-        strncpy(fli_model_name, "Model unavailable", sizeof(fli_model_name) - 1);
+        memset(ent->model, '\0', sizeof(ent->model));
+        strncpy(ent->model, DEVICE->devinfo.model, sizeof(ent->model) - 1);
+        ent->cached |= LIBUSB_FLI_HAVE_MODEL;
+        ent->cached &= ~LIBUSB_FLI_MODEL_FALLBACK;
       }
     }
+  }
+  pthread_mutex_unlock(&registry.mutex);
+}
+
+long libusb_fli_hotplug_register(flihotplugcb_t cb, void *user)
+{
+  long r;
+  int i;
+
+  if ((r = libusb_fli_registry_init()) != 0)
+    return r;
+
+  r = -ENOSPC;
+  pthread_mutex_lock(&registry.mutex);
+  for (i = 0; i < LIBUSB_FLI_HOTPLUG_CALLBACKS; i++)
+  {
+    if (registry.cbs[i].cb == NULL)
+    {
+      registry.cbs[i].cb = cb;
+      registry.cbs[i].user = user;
+      r = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  return r;
+}
+
+long libusb_fli_hotplug_deregister(flihotplugcb_t cb, void *user)
+{
+  long r = -ENOENT;
+  int i;
+
+  pthread_mutex_lock(&registry.mutex);
+  for (i = 0; i < LIBUSB_FLI_HOTPLUG_CALLBACKS; i++)
+  {
+    if ((registry.cbs[i].cb == cb) && (registry.cbs[i].user == user))
+    {
+      registry.cbs[i].cb = NULL;
+      registry.cbs[i].user = NULL;
+      r = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry.mutex);
+
+  return r;
+}
+
+long libusb_list(char *pattern, flidomain_t domain, char ***names)
+{
+  FLI_UNUSED(pattern);
+  long r;
+  int i, num_fli_devices = 0;
+  char **list;
+
+  if ((r = libusb_fli_registry_init()) != 0)
+    return r;
+
+  libusb_fli_registry_fill(domain,
+    LIBUSB_FLI_HAVE_SERIAL | LIBUSB_FLI_HAVE_MODEL);
+
+  pthread_mutex_lock(&registry.mutex);
+
+  list = xmalloc((registry.nent + 1) * sizeof(*list));
+  if (list == NULL)
+  {
+    pthread_mutex_unlock(&registry.mutex);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < registry.nent; i++)
+  {
+    libusb_fli_regent_t *ent = &registry.ent[i];
+    char *fli_device_name;
+
+    if (!libusb_fli_domain_match(domain, ent->pid))
+      continue;
+
+    if ((domain & FLIDEVICE_ENUMERATE_BY_SERIAL) && (ent->serial[0] != '\0'))
+      fli_device_name = ent->serial;
+    else
+      fli_device_name = ent->name;
+
+    debug(FLIDEBUG_INFO, "Device Name: '%s'", fli_device_name);
 
     /* Add it to the list */
     if ((list[num_fli_devices] = xmalloc(strlen(fli_device_name) +
-            strlen(fli_model_name) + 2)) == NULL)
+            strlen(ent->model) + 2)) == NULL)
     {
       int j;
-      
+
+      pthread_mutex_unlock(&registry.mutex);
+
       /* Free the list */
       for (j = 0; j < num_fli_devices; j++)
         xfree(list[j]);
       xfree(list);
 
-      libusb_exit(NULL);
       return -ENOMEM;
     }
-    else
-    {
-      sprintf(list[num_fli_devices], "%s;%s", fli_device_name, fli_model_name);
-      FLIClose(dev);
-      num_fli_devices++;
-    }
+
+    sprintf(list[num_fli_devices], "%s;%s", fli_device_name, ent->model);
+    num_fli_devices++;
   }
 
-  libusb_free_device_list(usb_devs, 1);
+  pthread_mutex_unlock(&registry.mutex);
 
   debug(FLIDEBUG_INFO, "Number of FLI Devices: %d", num_fli_devices);
 
@@ -628,75 +1285,105 @@ long libusb_list(char *pattern, flidomain_t domain, char ***names)
   list = xrealloc(list, num_fli_devices * sizeof(char *));
   *names = list;
 
-  libusb_exit(NULL);
   return 0;
 }
 
-libusb_device_handle * libusb_fli_find_handle(struct libusb_context *usb_ctx, char *name)
+long libusb_fli_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
 {
-  FLI_UNUSED(usb_ctx);
-  int r, i;
-  libusb_device **usb_devs;
-  libusb_device *usb_dev;
-  libusb_device_handle *usb_han;
-  struct libusb_device_descriptor usb_desc;
-  int num_usb_devices;
-  unsigned char serial[64];
+  long r;
+  int i, want = 0;
+  size_t found = 0;
 
-  num_usb_devices = libusb_get_device_list(NULL, &usb_devs);
-  if(num_usb_devices < 0)
-  {
-    debug(FLIDEBUG_FAIL, "LibUSB Get Device Failed with %s", libusb_error_name(num_usb_devices));
-    return NULL;
-  }
+  *n = 0;
+
+  if ((r = libusb_fli_registry_init()) != 0)
+    return r;
+
+  /* Filtering on a field we have not read yet costs one read per device,
+   * the result is cached */
+  if (serial != NULL)
+    want |= LIBUSB_FLI_HAVE_SERIAL;
+  if (model != NULL)
+    want |= LIBUSB_FLI_HAVE_MODEL;
+  if (want)
+    libusb_fli_registry_fill(domain, want);
 
-  for (i = 0; (usb_dev = usb_devs[i]) != NULL; i++)
+  pthread_mutex_lock(&registry.mutex);
+
+  for (i = 0; i < registry.nent; i++)
   {
-    char fli_usb_name[24];
+    libusb_fli_regent_t *ent = &registry.ent[i];
+    fli_devinfo_t info;
 
-    if(libusb_get_device_descriptor(usb_dev, &usb_desc) != LIBUSB_SUCCESS)
+    if (!libusb_fli_domain_match(domain, ent->pid))
       continue;
-      
-    if(usb_desc.idVendor == FLIUSB_VENDORID)
-    {
-      memset(serial, '\0', sizeof(serial));
-      memset(fli_usb_name, '\0', sizeof(fli_usb_name));
-      libusb_fli_create_name(usb_dev, fli_usb_name, sizeof(fli_usb_name) - 1);
 
-      /* May be a serial number as the name, so let's quickly read it */
-      if (usb_desc.iSerialNumber != 0)
-      {
-        r = libusb_open(usb_dev, &usb_han);
-        if(r == 0)
-        {
-          libusb_get_string_descriptor_ascii(usb_han, usb_desc.iSerialNumber,
-            serial, sizeof(serial) - 1);
+    memset(&info, '\0', sizeof(info));
+    info.domain = libusb_fli_pid_domain(ent->pid) |
+      (domain & FLIDOMAIN_OPTIONS_MASK);
+    info.vid = FLIUSB_VENDORID;
+    info.pid = ent->pid;
+    info.fwrev = ent->bcd;
+    info.hwrev = ent->hwrev;
+    info.flags = (ent->claimed > 0)?FLI_DEVINFO_CLAIMED:0;
 
-          libusb_close(usb_han);
-        }
-      }
+    memcpy(info.serial, ent->serial, sizeof(info.serial));
+    memcpy(info.model, ent->model, sizeof(info.model));
 
-      /* Is it the same as the one we are asking to open */
-      if( (strncasecmp(fli_usb_name, name, sizeof(fli_usb_name)) == 0) ||
-       (strncasecmp((char *) serial, name, sizeof(serial)) == 0 ))
-      {
-        r = libusb_open(usb_dev, &usb_han);
-        if(r == 0)
-        {
-          // Found device handle, cleanup and return
-          debug(FLIDEBUG_INFO, "Found Device Handle");
-          libusb_free_device_list(usb_devs, 1);
+    if ((domain & FLIDEVICE_ENUMERATE_BY_SERIAL) && (ent->serial[0] != '\0'))
+      memcpy(info.filename, ent->serial, sizeof(ent->serial));
+    else
+      memcpy(info.filename, ent->name, sizeof(ent->name));
 
-          return usb_han;
-        }
-        else
-        {
-          debug(FLIDEBUG_WARN, "Get USB Device Handle Failed");
-        }
-      }
-    }
+    libusb_fli_bus_path(ent, info.buspath, sizeof(info.buspath));
+
+    if (!fli_devinfo_match(&info, serial, model))
+      continue;
+
+    if (found < cap)
+      out[found] = info;
+    found++;
   }
 
-  libusb_free_device_list(usb_devs, 1);
-  return NULL;
+  pthread_mutex_unlock(&registry.mutex);
+
+  *n = found;
+
+  return 0;
+}
+
+libusb_device_handle * libusb_fli_find_handle(struct libusb_context *usb_ctx, char *name)
+{
+  FLI_UNUSED(usb_ctx);
+  libusb_device *usb_dev;
+  libusb_device_handle *usb_han = NULL;
+  int r;
+
+  /* May be a serial number as the name. Serial numbers normally come
+   * from sysfs when the device arrives; only where that is unavailable
+   * are the unknown ones read from the devices, once. */
+  if ((usb_dev = libusb_fli_registry_lookup(name)) == NULL)
+  {
+    libusb_fli_registry_fill(FLIDOMAIN_USB, LIBUSB_FLI_HAVE_SERIAL);
+    usb_dev = libusb_fli_registry_lookup(name);
+  }
+
+  if (usb_dev == NULL)
+    return NULL;
+
+  if ((r = libusb_open(usb_dev, &usb_han)) == 0)
+  {
+    debug(FLIDEBUG_INFO, "Found Device Handle");
+  }
+  else
+  {
+    debug(FLIDEBUG_WARN, "Get USB Device Handle Failed: %s",
+      libusb_error_name(r));
+    usb_han = NULL;
+  }
+
+  libusb_unref_device(usb_dev);
+
+  return usb_han;
 }
@@ -99,7 +99,7 @@ long unix_parportio_linux(flidev_t dev, void *buf, long *wlen, long *rlen)
   {
     if ((*wlen = write(io->fd, buf, *wlen)) != org_wlen)
     {
-      debug(FLIDEBUG_WARN, "write failed, only %d of %d bytes written",
+      debug(FLIDEBUG_WARN, "write failed, only %ld of %ld bytes written",
 	    *wlen, org_wlen);
       err = -errno;
       goto done;
@@ -110,7 +110,7 @@ long unix_parportio_linux(flidev_t dev, void *buf, long *wlen, long *rlen)
   {
     if ((*rlen = read(io->fd, buf, *rlen)) != org_rlen)
     {
-      debug(FLIDEBUG_WARN, "read failed, only %d of %d bytes read",
+      debug(FLIDEBUG_WARN, "read failed, only %ld of %ld bytes read",
 	    *rlen, org_rlen);
       err = -errno;
       goto done;
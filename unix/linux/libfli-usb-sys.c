@@ -68,6 +68,7 @@
 #include "libfli-mem.h"
 #include "libfli-usb.h"
 #include "fliusb_ioctl.h"
+#include "libfli-trace.h"
 
 long linux_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
 {
@@ -76,10 +77,7 @@ long linux_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
   int confg, r;
 
   if ((io->fd = open(name, O_RDWR)) == -1)
-  {
-    xfree(io);
     return -errno;
-  }
 
   if (ioctl(io->fd, FLIUSB_GET_DEVICE_DESCRIPTOR, &usbdesc) == -1)
   {
@@ -119,7 +117,7 @@ long linux_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
   }
   else
   {
-    DEVICE->devinfo.serial = xstrndup((char *) strdesc.buf, sizeof(strdesc.buf));
+    DEVICE->devinfo.serial = fli_dev_strndup(dev, (char *) strdesc.buf, sizeof(strdesc.buf));
   }
   
   confg = 0;
@@ -134,34 +132,18 @@ long linux_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
 long linux_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
 {
   fli_unixio_t *io;
+  fli_trace_t *trace;
   fliusb_bulktransfer_t bulkxfer;
   size_t remaining;
+  uint64_t start = 0;
+  long org_len = *len;
   int err = 0;
 
-#define _DEBUG
-
-#ifdef _DEBUG
-  debug(FLIDEBUG_INFO, "%s: attempting %ld bytes %s",
-	__PRETTY_FUNCTION__, *len, (ep & USB_DIR_IN) ? "in" : "out");
-#endif
-
   io = DEVICE->io_data;
 
-
-#ifdef _DEBUG
-  if ((ep & 0xf0) == 0) {
-    char buffer[1024];
-    int i;
-
-    sprintf(buffer, "OUT %6ld: ", *len);
-    for (i = 0; i < ((*len > 16)?16:*len); i++) {
-      sprintf(buffer + strlen(buffer), "%02x ", ((unsigned char *) buf)[i]);
-    }
-
-    debug(FLIDEBUG_INFO, buffer);
-  }
-
-#endif /* _DEBUG */
+  trace = DEVICE->trace;
+  if (FLI_TRACE_ACTIVE(trace))
+    start = fli_trace_now();
 
   remaining = *len;
   while (remaining)  /* read up to USB_READ_SIZ_MAX bytes at a time */
@@ -190,21 +172,8 @@ long linux_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
     err = -errno;
   *len -= remaining;
 
-#ifdef _DEBUG
-
-  if ((ep & 0xf0) != 0) {
-    char buffer[1024];
-    int i;
-
-    sprintf(buffer, " IN %6ld: ", *len);
-    for (i = 0; i < ((*len > 16)?16:*len); i++) {
-      sprintf(buffer + strlen(buffer), "%02x ", ((unsigned char *) buf)[i]);
-    }
-
-    debug(FLIDEBUG_INFO, buffer);
-  }
-
-#endif /* _DEBUG */
+  if (FLI_TRACE_ACTIVE(trace))
+    fli_trace_record(trace, ep, buf, org_len, *len, err, start);
 
   return err;
 }
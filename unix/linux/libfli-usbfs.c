@@ -0,0 +1,519 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#include "libfli-libfli.h"
+#include "libfli-debug.h"
+#include "libfli-sys.h"
+#include "libfli-mem.h"
+#include "libfli-trace.h"
+#include "libfli-usbfs.h"
+
+typedef struct {
+  unsigned int caps;		/* USBDEVFS_CAP_* */
+  int claimed;
+  long nurbs;			/* URBs kept in flight */
+  long urbsize;
+  struct usbdevfs_urb urb[FLI_USBFS_URBS_MAX];
+} fli_usbfs_t;
+
+/* Read a string descriptor, keeping the ASCII part of it */
+static int usbfs_string(int fd, int index, char *str, size_t len)
+{
+  struct usbdevfs_ctrltransfer ctrl;
+  unsigned char buf[255];
+  size_t j = 0;
+  int i, r;
+
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.bRequestType = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+  ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+  ctrl.wValue = (USB_DT_STRING << 8) | index;
+  ctrl.wIndex = 0x0409;
+  ctrl.wLength = sizeof(buf);
+  ctrl.timeout = 1000;
+  ctrl.data = buf;
+
+  if ((r = ioctl(fd, USBDEVFS_CONTROL, &ctrl)) < 2)
+    return -1;
+
+  r = MIN(r, buf[0]);
+  for (i = 2; (i + 1 < r) && (j + 1 < len); i += 2)
+    str[j++] = (buf[i + 1] == 0)?buf[i]:'?';
+  str[j] = '\0';
+
+  return 0;
+}
+
+long usbfs_usb_connect(flidev_t dev, fli_unixio_t *io, char *name)
+{
+  struct usb_device_descriptor usbdesc;
+  fli_usbfs_t *us;
+  unsigned int iface = 0;
+  char serial[64], *env;
+
+  /* Allocated first so a failed connect is undone by usbfs_usb_disconnect() */
+  if ((us = xcalloc(1, sizeof(fli_usbfs_t))) == NULL)
+    return -ENOMEM;
+  io->usbfs = us;
+
+  if ((io->fd = open(name, O_RDWR)) == -1)
+    return -errno;
+
+  /* usbfs hands out the device descriptor on read() */
+  if (read(io->fd, &usbdesc, USB_DT_DEVICE_SIZE) != USB_DT_DEVICE_SIZE)
+  {
+    debug(FLIDEBUG_FAIL, "%s: Could not read descriptor: %s",
+	  __PRETTY_FUNCTION__, strerror(errno));
+    return -EIO;
+  }
+
+  if (le16toh(usbdesc.idVendor) != FLIUSB_VENDORID)
+  {
+    debug(FLIDEBUG_INFO, "%s: Not a FLI device!", __PRETTY_FUNCTION__);
+    return -ENODEV;
+  }
+
+  switch (le16toh(usbdesc.idProduct))
+  {
+    /* These are valid product IDs */
+  case FLIUSB_CAM_ID:
+  case FLIUSB_FOCUSER_ID:
+  case FLIUSB_FILTER_ID:
+  case FLIUSB_PROLINE_ID:
+    break;
+
+  default:
+    /* Anything else is unknown */
+    return -ENODEV;
+  }
+
+  DEVICE->devinfo.devid = le16toh(usbdesc.idProduct);
+  DEVICE->devinfo.fwrev = le16toh(usbdesc.bcdDevice);
+
+  if (ioctl(io->fd, USBDEVFS_GET_CAPABILITIES, &us->caps) != 0)
+    us->caps = 0;
+
+  if (ioctl(io->fd, USBDEVFS_CLAIMINTERFACE, &iface) != 0)
+  {
+    struct usbdevfs_ioctl command;
+
+    if (errno != EBUSY)
+      return -errno;
+
+    /* Bound to a kernel driver, take it over */
+    command.ifno = 0;
+    command.ioctl_code = USBDEVFS_DISCONNECT;
+    command.data = NULL;
+    if ((ioctl(io->fd, USBDEVFS_IOCTL, &command) != 0) ||
+      (ioctl(io->fd, USBDEVFS_CLAIMINTERFACE, &iface) != 0))
+    {
+      debug(FLIDEBUG_FAIL, "%s: Could not claim interface: %s",
+	    __PRETTY_FUNCTION__, strerror(errno));
+      return -EBUSY;
+    }
+  }
+  us->claimed = 1;
+
+  if ((usbdesc.iSerialNumber != 0) &&
+    (usbfs_string(io->fd, usbdesc.iSerialNumber, serial, sizeof(serial)) == 0))
+    DEVICE->devinfo.serial = fli_dev_strdup(dev, serial);
+
+  us->nurbs = FLI_USBFS_URBS_DEFAULT;
+  if ((env = getenv("FLI_USBFS_URBS")) != NULL)
+    us->nurbs = strtol(env, NULL, 0);
+  if (us->nurbs < 1)
+    us->nurbs = 1;
+  if (us->nurbs > FLI_USBFS_URBS_MAX)
+    us->nurbs = FLI_USBFS_URBS_MAX;
+
+  us->urbsize = (us->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)?
+    USB_READ_SIZ_MAX:FLI_USBFS_URB_SIZE_LIMITED;
+
+  DEVICE->fli_io = usbfs_usbio;
+  DEVICE->fli_bulk = usbfs_bulktransfer;
+  DEVICE->fli_dev_mem_alloc = usbfs_dev_mem_alloc;
+  DEVICE->fli_dev_mem_free = usbfs_dev_mem_free;
+  DEVICE->fli_queue_depth = usbfs_queue_depth;
+
+  debug(FLIDEBUG_INFO, "%s: %s, caps 0x%02x, %ld URBs of %ld bytes",
+    __PRETTY_FUNCTION__, name, us->caps, us->nurbs, us->urbsize);
+
+  return 0;
+}
+
+long usbfs_usb_disconnect(flidev_t dev, fli_unixio_t *io)
+{
+  fli_usbfs_t *us = io->usbfs;
+  unsigned int iface = 0;
+  long err = 0;
+
+  debug(FLIDEBUG_INFO, "Disconnecting");
+
+  if (io->fd != (-1))
+  {
+    if ((us != NULL) && us->claimed)
+      ioctl(io->fd, USBDEVFS_RELEASEINTERFACE, &iface);
+    if (close(io->fd) != 0)
+      err = -errno;
+    io->fd = (-1);
+  }
+
+  if (us != NULL)
+    xfree(us);
+  io->usbfs = NULL;
+
+  return err;
+}
+
+static long usbfs_reap(int fd, long timeout, struct usbdevfs_urb **urb)
+{
+  struct pollfd pfd;
+  int r;
+
+  for (;;)
+  {
+    if (ioctl(fd, USBDEVFS_REAPURBNDELAY, urb) == 0)
+      return 0;
+    if (errno != EAGAIN)
+      return -errno;
+
+    /* usbfs signals completed URBs as writable */
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if ((r = poll(&pfd, 1, timeout)) == 0)
+      return -ETIMEDOUT;
+    if ((r < 0) && (errno != EINTR))
+      return -errno;
+  }
+}
+
+static void usbfs_discard(int fd, fli_usbfs_t *us, unsigned char *busy)
+{
+  long i;
+
+  for (i = 0; i < us->nurbs; i++)
+    if (busy[i])
+      ioctl(fd, USBDEVFS_DISCARDURB, &us->urb[i]);
+}
+
+/* Split the transfer into URBs and keep up to nurbs of them queued.
+ * URBs on one endpoint complete in order, so the data stays contiguous
+ * up to the first short or failed URB, after which the rest are
+ * discarded. Where the kernel supports bulk continuation it also stops
+ * the queued URBs from reading past a short packet. */
+long usbfs_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
+{
+  fli_unixio_t *io;
+  fli_usbfs_t *us;
+  fli_trace_t *trace;
+  struct usbdevfs_urb *urb;
+  unsigned char busy[FLI_USBFS_URBS_MAX];
+  long submitted = 0, done = 0, err = 0, org_len = *len, r;
+  long slot = 0, inflight = 0;
+  int stop = 0;
+  uint64_t start = 0;
+
+  io = DEVICE->io_data;
+  if ((io == NULL) || ((us = io->usbfs) == NULL))
+    return -ENODEV;
+
+  trace = DEVICE->trace;
+  if (FLI_TRACE_ACTIVE(trace))
+    start = fli_trace_now();
+
+  memset(busy, 0, sizeof(busy));
+
+  while ((inflight > 0) || (!stop && (submitted < org_len)))
+  {
+    /* Keep the queue full */
+    while (!stop && (inflight < us->nurbs) && (submitted < org_len))
+    {
+      while (busy[slot])
+        slot = (slot + 1) % us->nurbs;
+
+      urb = &us->urb[slot];
+      memset(urb, 0, sizeof(*urb));
+      urb->type = USBDEVFS_URB_TYPE_BULK;
+      urb->endpoint = ep;
+      urb->buffer = (char *) buf + submitted;
+      urb->buffer_length = MIN(us->urbsize, org_len - submitted);
+      if ((ep & USB_DIR_IN) && (submitted + urb->buffer_length < org_len))
+        urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+      if ((submitted > 0) && (us->caps & USBDEVFS_CAP_BULK_CONTINUATION))
+        urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+
+      if (ioctl(io->fd, USBDEVFS_SUBMITURB, urb) != 0)
+      {
+        err = -errno;
+        stop = 1;
+        usbfs_discard(io->fd, us, busy);
+        break;
+      }
+
+      busy[slot] = 1;
+      submitted += urb->buffer_length;
+      inflight++;
+    }
+
+    if (inflight == 0)
+      break;
+
+    if ((r = usbfs_reap(io->fd, DEVICE->io_timeout, &urb)) != 0)
+    {
+      if ((r == -ETIMEDOUT) && !stop)
+      {
+        /* Cancel and collect what is still queued */
+        err = r;
+        stop = 1;
+        usbfs_discard(io->fd, us, busy);
+        continue;
+      }
+
+      /* The queued URBs still point into buf and us->urb[], so they
+       * must be back from the kernel before we return */
+      debug(FLIDEBUG_FAIL, "%s: Waiting for %ld URBs: %s", __PRETTY_FUNCTION__,
+        inflight, strerror(-r));
+      if (err == 0)
+        err = r;
+      usbfs_discard(io->fd, us, busy);
+      while (inflight > 0)
+      {
+        if (ioctl(io->fd, USBDEVFS_REAPURB, &urb) != 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* Device gone, usbfs has dropped them */
+          break;
+        }
+        busy[urb - us->urb] = 0;
+        inflight--;
+      }
+      break;
+    }
+
+    busy[urb - us->urb] = 0;
+    inflight--;
+
+    /* A cancelled URB may still have received data, keep it when it
+     * carries on from what we have */
+    if (stop)
+    {
+      if (((char *) urb->buffer == (char *) buf + done) &&
+        (urb->actual_length > 0))
+        done += urb->actual_length;
+      continue;
+    }
+
+    if ((urb->status == 0) || (urb->status == -EREMOTEIO))
+    {
+      done += urb->actual_length;
+      if (urb->actual_length < urb->buffer_length)
+      {
+        stop = 1;
+        usbfs_discard(io->fd, us, busy);
+      }
+    }
+    else
+    {
+      err = urb->status;
+      stop = 1;
+      usbfs_discard(io->fd, us, busy);
+    }
+  }
+
+  *len = done;
+
+  if (FLI_TRACE_ACTIVE(trace))
+    fli_trace_record(trace, ep, buf, org_len, *len, err, start);
+
+  return err;
+}
+
+static int usbfs_endpoint(flidev_t dev)
+{
+  switch (DEVICE->devinfo.devid)
+  {
+  case FLIUSB_CAM_ID:
+  case FLIUSB_FOCUSER_ID:
+  case FLIUSB_FILTER_ID:
+    return 0x02;
+
+  case FLIUSB_PROLINE_ID:
+    return 0x01;
+
+  default:
+    debug(FLIDEBUG_FAIL, "Unknown device type.");
+    return -EINVAL;
+  }
+}
+
+long usbfs_bulkwrite(flidev_t dev, void *buf, long *wlen)
+{
+  int ep;
+
+  if ((ep = usbfs_endpoint(dev)) < 0)
+    return ep;
+
+  return usbfs_bulktransfer(dev, ep | USB_DIR_OUT, buf, wlen);
+}
+
+long usbfs_bulkread(flidev_t dev, void *buf, long *rlen)
+{
+  int ep;
+
+  if ((ep = usbfs_endpoint(dev)) < 0)
+    return ep;
+
+  return usbfs_bulktransfer(dev, ep | USB_DIR_IN, buf, rlen);
+}
+
+long usbfs_usbio(flidev_t dev, void *buf, long *wlen, long *rlen)
+{
+  long err = 0, r, org_wlen = *wlen, org_rlen = *rlen;
+
+  if ((err = unix_fli_lock(dev)))
+  {
+    debug(FLIDEBUG_WARN, "Lock failed");
+    return err;
+  }
+
+  /* Short transfers are only acceptable to image reads */
+  if (*wlen > 0)
+  {
+    err = usbfs_bulkwrite(dev, buf, wlen);
+    if ((err == 0) && (*wlen != org_wlen))
+      err = -EIO;
+  }
+
+  if ((err == 0) && (*rlen > 0))
+  {
+    err = usbfs_bulkread(dev, buf, rlen);
+    if ((err == 0) && (*rlen != org_rlen))
+      err = -EIO;
+  }
+
+  if (err != 0)
+    debug(FLIDEBUG_WARN, "%s: wrote %ld of %ld, read %ld of %ld bytes",
+      __PRETTY_FUNCTION__, *wlen, org_wlen, *rlen, org_rlen);
+
+  if ((r = unix_fli_unlock(dev)))
+    debug(FLIDEBUG_WARN, "Unlock failed");
+  if (err == 0)
+    err = r;
+
+  return err;
+}
+
+/* Transfer memory the kernel can use in place, NULL where usbfs can't
+ * provide it (before Linux 4.6) */
+void *usbfs_dev_mem_alloc(flidev_t dev, size_t len)
+{
+  fli_unixio_t *io = DEVICE->io_data;
+  fli_usbfs_t *us;
+  void *addr;
+
+  if ((io == NULL) || ((us = io->usbfs) == NULL))
+    return NULL;
+
+#ifdef USBDEVFS_CAP_MMAP
+  if ((us->caps & USBDEVFS_CAP_MMAP) == 0)
+    return NULL;
+
+  addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, io->fd, 0);
+  if (addr == MAP_FAILED)
+  {
+    debug(FLIDEBUG_WARN, "%s: mmap of %zu bytes failed: %s",
+      __PRETTY_FUNCTION__, len, strerror(errno));
+    return NULL;
+  }
+
+  return addr;
+#else
+  FLI_UNUSED(us);
+  FLI_UNUSED(addr);
+  return NULL;
+#endif
+}
+
+void usbfs_dev_mem_free(flidev_t dev, void *addr, size_t len)
+{
+  FLI_UNUSED(dev);
+
+  if (addr != NULL)
+    munmap(addr, len);
+}
+
+long usbfs_queue_depth(flidev_t dev, long depth)
+{
+  fli_unixio_t *io = DEVICE->io_data;
+  fli_usbfs_t *us;
+
+  if ((io == NULL) || ((us = io->usbfs) == NULL))
+    return 0;
+
+  if (depth > 0)
+    us->nurbs = MIN(depth, FLI_USBFS_URBS_MAX);
+
+  return us->nurbs;
+}
+
+#endif /* defined(__linux__) */
@@ -0,0 +1,77 @@
+/*
+
+  Copyright (c) 2002 Finger Lakes Instrumentation (FLI), L.L.C.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+        Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+        Redistributions in binary form must reproduce the above
+        copyright notice, this list of conditions and the following
+        disclaimer in the documentation and/or other materials
+        provided with the distribution.
+
+        Neither the name of Finger Lakes Instrumentation (FLI), LLC
+        nor the names of its contributors may be used to endorse or
+        promote products derived from this software without specific
+        prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+  ======================================================================
+
+  Finger Lakes Instrumentation, L.L.C. (FLI)
+  web: http://www.fli-cam.com
+  email: support@fli-cam.com
+
+*/
+
+
+#ifndef _LIBFLI_USBFS_H_
+#define _LIBFLI_USBFS_H_
+
+/* usbfs backend
+ *
+ * Talks to the device node under /dev/bus/usb directly, without the
+ * fliusb kernel module or libusb. Bulk transfers are split into URBs
+ * of which several are kept in flight, and transfer memory can be
+ * mmap()ed from usbfs so the kernel uses it in place instead of
+ * copying through a bounce buffer.
+ *
+ * The backend is used for names under FLI_USBFS_PREFIX, for every
+ * name when the environment has FLI_USB_BACKEND=usbfs, and as the
+ * only USB backend when built with -D__USBFS__. FLI_USBFS_URBS sets
+ * the number of URBs in flight.
+ */
+
+#define FLI_USBFS_PREFIX "/dev/bus/usb/"
+#define FLI_USBFS_URBS_DEFAULT (4)
+#define FLI_USBFS_URBS_MAX (16)
+#define FLI_USBFS_URB_SIZE_LIMITED (16 * 1024) /* Kernels before 3.3 */
+
+long usbfs_usb_connect(flidev_t dev, fli_unixio_t *io, char *name);
+long usbfs_usb_disconnect(flidev_t dev, fli_unixio_t *io);
+long usbfs_bulktransfer(flidev_t dev, int ep, void *buf, long *len);
+long usbfs_bulkwrite(flidev_t dev, void *buf, long *wlen);
+long usbfs_bulkread(flidev_t dev, void *buf, long *rlen);
+long usbfs_usbio(flidev_t dev, void *buf, long *wlen, long *rlen);
+void *usbfs_dev_mem_alloc(flidev_t dev, size_t len);
+void usbfs_dev_mem_free(flidev_t dev, void *addr, size_t len);
+long usbfs_queue_depth(flidev_t dev, long depth);
+
+#endif /* _LIBFLI_USBFS_H_ */
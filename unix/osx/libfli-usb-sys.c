@@ -205,6 +205,7 @@ long mac_fli_connect(flidev_t dev, char *name, long domain)
     /* Lock functions should be set before any other functions used */
     DEVICE->fli_lock = mac_fli_lock;
     DEVICE->fli_unlock = mac_fli_unlock;
+    DEVICE->fli_trylock = mac_fli_trylock;
     
     DEVICE->domain = domain & 0x00ff;
     DEVICE->devinfo.type = domain & 0xff00;
@@ -231,6 +232,7 @@ long mac_fli_connect(flidev_t dev, char *name, long domain)
     }
     
     DEVICE->fli_io = unix_usbio;
+    DEVICE->fli_bulk = mac_bulktransfer;
 
     switch(DEVICE->devinfo.type)
     {
@@ -313,6 +315,12 @@ long mac_fli_disconnect(flidev_t dev)
         }
     }
     
+    if(DEVICE->sys_data != NULL)
+    {
+        pthread_mutex_destroy(&DEVICE_DATA->mutex);
+        pthread_mutexattr_destroy(&DEVICE_DATA->attr);
+    }
+    
     free(DEVICE->io_data);
     free(DEVICE->sys_data);
     
@@ -321,7 +329,9 @@ long mac_fli_disconnect(flidev_t dev)
     
     DEVICE->fli_lock = NULL;
     DEVICE->fli_unlock = NULL;
+    DEVICE->fli_trylock = NULL;
     DEVICE->fli_io = NULL;
+    DEVICE->fli_bulk = NULL;
     DEVICE->fli_open = NULL;
     DEVICE->fli_close = NULL;
     DEVICE->fli_command = NULL;
@@ -627,7 +637,28 @@ IOReturn mac_usb_find_interfaces(flidev_t dev, IOUSBDeviceInterface182 **device)
             return kr;
         }
         
-        mac_device_info *deviceInfo = (mac_device_info*) malloc(sizeof(mac_device_info));
+        mac_device_info *deviceInfo = (mac_device_info*) calloc(1, sizeof(mac_device_info));
+        if(deviceInfo == NULL)
+        {
+            (*interface)->USBInterfaceClose(interface);
+            (*interface)->Release(interface);
+            return kIOReturnNoMemory;
+        }
+        
+        // Recursive, so that FLILockDevice() can be held around commands
+        // which take the lock again for every transaction.
+        pthread_mutexattr_init(&deviceInfo->attr);
+        pthread_mutexattr_settype(&deviceInfo->attr, PTHREAD_MUTEX_RECURSIVE);
+        if(pthread_mutex_init(&deviceInfo->mutex, &deviceInfo->attr) != 0)
+        {
+            debug(FLIDEBUG_FAIL, "mac_usb_find_interfaces: Unable to create device mutex");
+            pthread_mutexattr_destroy(&deviceInfo->attr);
+            free(deviceInfo);
+            (*interface)->USBInterfaceClose(interface);
+            (*interface)->Release(interface);
+            return kIOReturnNoResources;
+        }
+        
         DEVICE->sys_data = deviceInfo;
         
         DEVICE_DATA->interface = interface;
@@ -878,18 +909,34 @@ ssize_t mac_usb_pipewrite(flidev_t dev, void *buf, size_t size, unsigned pipe, u
 //==========================================================================
 long mac_fli_lock(flidev_t dev)
 {
+    fli_unixio_t *io;
+    int r;
+    
+    CHKDEVICE(dev);
     
-    fli_unixio_t *io = DEVICE->io_data;
+    if(((io = DEVICE->io_data) == NULL) || (DEVICE->sys_data == NULL))
+    {
+        debug(FLIDEBUG_WARN, "mac_fli_lock: Mutex is NULL!");
+        return -ENODEV;
+    }
     
-    if(io == NULL)
+    if((r = pthread_mutex_lock(&DEVICE_DATA->mutex)) != 0)
     {
+        debug(FLIDEBUG_WARN, "mac_fli_lock: Could not acquire mutex: %d", r);
         return -ENODEV;
     }
     
-    if(!flock(io->fd, LOCK_EX))
+    // Only the outermost holder takes the file lock
+    if(DEVICE_DATA->locked == 0)
     {
-        return -errno;
+        if(flock(io->fd, LOCK_EX) == -1)
+        {
+            r = errno;
+            pthread_mutex_unlock(&DEVICE_DATA->mutex);
+            return -r;
+        }
     }
+    DEVICE_DATA->locked++;
     
     return 0;
 }
@@ -903,18 +950,40 @@ long mac_fli_lock(flidev_t dev)
 //==========================================================================
 long mac_fli_unlock(flidev_t dev)
 {
-    fli_unixio_t *io = DEVICE->io_data;
-    if(io == NULL)
+    fli_unixio_t *io;
+    long err = 0;
+    int r;
+    
+    CHKDEVICE(dev);
+    
+    if(((io = DEVICE->io_data) == NULL) || (DEVICE->sys_data == NULL))
     {
+        debug(FLIDEBUG_WARN, "mac_fli_unlock: Mutex is NULL!");
         return -ENODEV;
     }
     
-    if(!flock(io->fd, LOCK_UN))
+    if(DEVICE_DATA->locked <= 0)
     {
-        return -errno;
+        debug(FLIDEBUG_WARN, "mac_fli_unlock: Device is not locked");
+        return -EPERM;
     }
     
-    return 0;
+    // The file lock goes with the last unlock
+    if(--DEVICE_DATA->locked == 0)
+    {
+        if(flock(io->fd, LOCK_UN) == -1)
+        {
+            err = -errno;
+        }
+    }
+    
+    if((r = pthread_mutex_unlock(&DEVICE_DATA->mutex)) != 0)
+    {
+        debug(FLIDEBUG_WARN, "mac_fli_unlock: Could not release mutex: %d", r);
+        return -ENODEV;
+    }
+    
+    return err;
 }
 //-------------------------------------------------------------------------
 
@@ -925,16 +994,32 @@ long mac_fli_unlock(flidev_t dev)
 //==========================================================================
 long mac_fli_trylock(flidev_t dev)
 {
-    fli_unixio_t *io = DEVICE->io_data;
-    if(io == NULL)
+    fli_unixio_t *io;
+    int r;
+    
+    CHKDEVICE(dev);
+    
+    if(((io = DEVICE->io_data) == NULL) || (DEVICE->sys_data == NULL))
     {
+        debug(FLIDEBUG_WARN, "mac_fli_trylock: Mutex is NULL!");
         return -ENODEV;
     }
     
-    if(!flock(io->fd, LOCK_EX | LOCK_NB))
+    if((r = pthread_mutex_trylock(&DEVICE_DATA->mutex)) != 0)
+    {
+        return (r == EBUSY) ? -EBUSY : -ENODEV;
+    }
+    
+    if(DEVICE_DATA->locked == 0)
     {
-        return -errno;
+        if(flock(io->fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            r = errno;
+            pthread_mutex_unlock(&DEVICE_DATA->mutex);
+            return (r == EWOULDBLOCK) ? -EBUSY : -r;
+        }
     }
+    DEVICE_DATA->locked++;
     
     return 0;
 }
@@ -61,6 +61,7 @@
 #include <signal.h>
 #include <stdlib.h> 
 #include <glob.h>
+#include <pthread.h>
 
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOMessage.h>
@@ -154,7 +155,12 @@ typedef struct _mac_device_info
     UInt8 interfaceNumEndpoints;
     unsigned int epWrite, epRead, epReadBulk;
     
-    
+    // flock() neither nests nor excludes threads of this process, so the
+    // device lock is a recursive mutex; the file lock is only taken by the
+    // outermost holder and dropped by its last unlock.
+    pthread_mutex_t mutex;
+    pthread_mutexattr_t attr;
+    long locked;
 } mac_device_info;
 
 #define DEVICE_DATA ((mac_device_info*)DEVICE->sys_data)
@@ -6,11 +6,13 @@
 #include "../libfli-libfli.h"
 #include "../libfli-debug.h"
 #include "../libfli-mem.h"
+#include "../libfli-log.h"
 
 #define MAX_DEBUG_STRING (1024)
 
 LARGE_INTEGER dlltime;
 static int _level = 0;
+volatile int fli_debug_levels = 0;
 static int _forced = 0;
 static int _debugstring = 0;
 static char *_debugfile = NULL;
@@ -97,10 +99,19 @@ void __cdecl FLIDebug(int level, char *format, ...)
 	}
 }
 
-void debug(int level, char *format, ...)
+void fli_debug(int level, char *format, ...)
 {
 	char buffer[MAX_DEBUG_STRING];
 	int ret;
+
+	if (fli_log_active() && (level & _level))
+	{
+		va_list ap;
+		va_start(ap, format);
+		fli_log_vrecord(level, format, ap);
+		va_end(ap);
+		return;
+	}
 	
 	if( ((_debugstring != 0) || (_debugfile != NULL )) && (level & _level) )
 	{
@@ -225,6 +236,7 @@ void setdebuglevel(char *host, long level)
 	debug(FLIDEBUG_INFO, "Changing debug level to %d.", level);
 
 	_level = level;
+	fli_debug_levels = level;
 	_debugstring = (level & 0x80000000)?1:0;
 
 	if (level == 0)
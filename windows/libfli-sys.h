@@ -84,5 +84,11 @@ long fli_disconnect(flidev_t dev);
 long fli_lock(flidev_t dev);
 long fli_unlock(flidev_t dev);
 long fli_list(flidomain_t domain, char ***names);
+long fli_hotplug_register(flihotplugcb_t cb, void *user);
+long fli_hotplug_deregister(flihotplugcb_t cb, void *user);
+long fli_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n);
+long fli_list_ports(flidomain_t domain, fli_devinfo_t *out, size_t cap,
+  size_t *n);
 
 #endif /* _LIBFLI_SYSDEP_H */
@@ -119,7 +119,7 @@ long usb_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
 			snprintf(cbuf, 10, "%02x ", ((unsigned char *) buf)[i]);
 			strcat(dbuf, cbuf);
 		}
-		debug(FLIDEBUG_INFO, dbuf);
+		debug(FLIDEBUG_INFO, "%s", dbuf);
 	}
 
 	QueryPerformanceCounter(&btime);
@@ -279,7 +279,7 @@ long usb_bulktransfer(flidev_t dev, int ep, void *buf, long *len)
 			snprintf(cbuf, 10, "%02x ", ((unsigned char *) buf)[i]);
 			strcat(dbuf, cbuf);
 		}
-		debug(FLIDEBUG_INFO, dbuf);
+		debug(FLIDEBUG_INFO, "%s", dbuf);
 	}
 
 	dtime = ((double) etime.QuadPart - (double) btime.QuadPart ) / (double) freq.QuadPart;
@@ -557,6 +557,7 @@ long fli_connect(flidev_t dev, char *name, long domain)
 			debug(FLIDEBUG_INFO, "    id: 0x%04x", DEVICE->devinfo.devid);
 			debug(FLIDEBUG_INFO, " fwrev: 0x%04x", DEVICE->devinfo.fwrev);
 			DEVICE->fli_io = usbio;
+			DEVICE->fli_bulk = usb_bulktransfer;
     }
 		break;
 
@@ -704,6 +705,7 @@ long fli_disconnect(flidev_t dev)
   DEVICE->fli_lock = NULL;
   DEVICE->fli_unlock = NULL;
   DEVICE->fli_io = NULL;
+  DEVICE->fli_bulk = NULL;
   DEVICE->fli_open = NULL;
   DEVICE->fli_close = NULL;
   DEVICE->fli_command = NULL;
@@ -1367,5 +1369,103 @@ static long fli_list_parport(flidomain_t domain, char ***names)
 	return -EINVAL;
 }
 
+/* The Windows drivers do not report device arrival to the library */
+long fli_hotplug_register(flihotplugcb_t cb, void *user)
+{
+	FLI_UNUSED(cb);
+	FLI_UNUSED(user);
+	return -ENOSYS;
+}
+
+long fli_hotplug_deregister(flihotplugcb_t cb, void *user)
+{
+	FLI_UNUSED(cb);
+	FLI_UNUSED(user);
+	return -ENOSYS;
+}
+
+/* Enumeration is built from fli_list_ports() or fli_list() by the caller */
+long fli_enumerate(flidomain_t domain, char *serial, char *model,
+  fli_devinfo_t *out, size_t cap, size_t *n)
+{
+	FLI_UNUSED(domain);
+	FLI_UNUSED(serial);
+	FLI_UNUSED(model);
+	FLI_UNUSED(out);
+	FLI_UNUSED(cap);
+	*n = 0;
+	return -ENOSYS;
+}
+
+/* The names fli_list_tree() tries, without opening them */
+static long fli_list_tree_ports(const char *root, flidomain_t domain,
+	fli_devinfo_t *out, size_t cap, size_t *n)
+{
+	char prefix[NAME_LEN_MAX];
+	int cnt, index = 0, device;
+
+	while (root[index] != '\0')
+	{
+		cnt = 0;
+		while ((root[index] != '\0') &&
+					 (root[index] != ',') &&
+					 (cnt < NAME_LEN_MAX - 1))
+		{
+			prefix[cnt] = root[index];
+			cnt++;
+			index++;
+		}
+		prefix[cnt] = '\0';
+		if (root[index] != '\0')
+			index++;
+
+		for (device = 0; device < MAX_SEARCH; device++)
+		{
+			if (*n < cap)
+			{
+				memset(&out[*n], '\0', sizeof(out[*n]));
+				out[*n].domain = domain;
+				out[*n].vid = -1;
+				out[*n].pid = -1;
+				out[*n].fwrev = -1;
+				out[*n].hwrev = -1;
+				if (snprintf(out[*n].filename, sizeof(out[*n].filename), "%s%d",
+					prefix, device) >= (int) sizeof(out[*n].filename))
+					return -EOVERFLOW;
+			}
+			(*n)++;
+		}
+	}
+
+	return 0;
+}
+
+/* Serial and parallel ports that may have a device, found without
+ * opening any of them. USB, with -ENOSYS, is listed through fli_list(). */
+long fli_list_ports(flidomain_t domain, fli_devinfo_t *out, size_t cap,
+  size_t *n)
+{
+	*n = 0;
+
+	switch (domain & 0x00ff)
+	{
+		case FLIDOMAIN_PARALLEL_PORT:
+			if ((domain & 0xff00) != FLIDEVICE_CAMERA)
+				return -EINVAL;
+			return fli_list_tree_ports("ccdpar", domain, out, cap, n);
+
+		case FLIDOMAIN_SERIAL:
+		case FLIDOMAIN_SERIAL_1200:
+		case FLIDOMAIN_SERIAL_19200:
+			if (((domain & 0xff00) != FLIDEVICE_FOCUSER) &&
+				((domain & 0xff00) != FLIDEVICE_FILTERWHEEL))
+				return -EINVAL;
+			return fli_list_tree_ports("\\\\?\\COM", domain, out, cap, n);
+
+		default:
+			return -ENOSYS;
+	}
+}
+
 #undef NAME_LEN_MAX
 